@@ -1,6 +1,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include "array.h"
+#include "probes.h"
+
+struct array_stats array_stats;
+
+#define ARRAY_STAT(field, n) __atomic_add_fetch(&array_stats.field, (n), __ATOMIC_RELAXED)
 
 array_t *array_new() {
 	array_t *res = calloc(sizeof(array_t), 1);
@@ -14,11 +19,15 @@ static void array_free_node(array_t *array, struct array_node *node) {
 				array_free_node(array, node->nodes[i]);
 		}
 		free(node->nodes);
+		ARRAY_STAT(tables, -1);
 	}
 	if (node->has_value) {
 		free(node->value_key);
+		ARRAY_STAT(values, -1);
+		ARRAY_STAT(key_bytes, -(uint64_t)node->value_keylen);
 	}
 	free(node);
+	ARRAY_STAT(nodes, -1);
 }
 
 void array_optimize(array_t *array) {
@@ -55,6 +64,7 @@ bool array_insert(array_t *array, int keylen, const uint8_t *key, void *value, b
 	if (array->root == NULL) {
 		// ok, create a root node
 		array->root = calloc(sizeof(struct array_node), 1);
+		ARRAY_STAT(nodes, 1);
 	}
 	node = array->root;
 	while(1) {
@@ -71,6 +81,7 @@ bool array_insert(array_t *array, int keylen, const uint8_t *key, void *value, b
 			}
 			// create new child node
 			node->nodes[key[pos]] = calloc(sizeof(struct array_node), 1);
+			ARRAY_STAT(nodes, 1);
 			node->children++;
 			parent = node;
 			node = node->nodes[key[pos]];
@@ -93,6 +104,8 @@ bool array_insert(array_t *array, int keylen, const uint8_t *key, void *value, b
 		// create intermediate node and move the current node lower
 		struct array_node *newnode = calloc(sizeof(struct array_node), 1);
 		newnode->nodes = calloc(sizeof(void*), 256);
+		ARRAY_STAT(nodes, 1);
+		ARRAY_STAT(tables, 1);
 		newnode->nodes[node->value_key[pos]] = node;
 		newnode->children = 1;
 		node->parent = newnode;
@@ -114,13 +127,17 @@ bool array_insert(array_t *array, int keylen, const uint8_t *key, void *value, b
 	node->value_key = malloc(keylen);
 	node->value_is_type = is_type;
 	memcpy(node->value_key, key, keylen);
+	ARRAY_STAT(values, 1);
+	ARRAY_STAT(key_bytes, keylen);
 	array->count++;
+	cc_probe(array_insert, array, keylen, array->count);
 	return true;
 }
 
 struct array_node *array_get_node(array_t *array, int keylen, const uint8_t *key) {
 	struct array_node *node = array->root;
 	int pos = 0;
+	if (node == NULL) return NULL; // empty array
 	while(pos < keylen) {
 		if ((node->nodes != NULL) && (node->nodes[key[pos]] != NULL)) {
 			node = node->nodes[key[pos]];
@@ -158,13 +175,17 @@ bool array_remove(array_t *array, int keylen, const uint8_t *key) {
 	if (!node->has_value) return false;
 
 	free(node->value_key);
+	ARRAY_STAT(values, -1);
+	ARRAY_STAT(key_bytes, -(uint64_t)node->value_keylen);
 	node->has_value = false;
 	array->count--;
+	cc_probe(array_remove, array, node->value_keylen, array->count);
 
 	while ((node->children == 0) && (!node->has_value)) {
 		if (node->parent == NULL) { // root node
 			// this array is now empty!
 			free(node);
+			ARRAY_STAT(nodes, -1);
 			array->root = NULL;
 			return true;
 		}
@@ -173,9 +194,11 @@ bool array_remove(array_t *array, int keylen, const uint8_t *key) {
 		parent->nodes[node->node_key] = NULL;
 		parent->children--;
 		free(node);
+		ARRAY_STAT(nodes, -1);
 		node = parent;
 		if (node->children == 0) {
 			free(node->nodes);
+			ARRAY_STAT(tables, -1);
 			node->nodes = NULL;
 		}
 	}
@@ -190,13 +213,17 @@ bool array_remove_iterator(array_iterator_t *iterator) {
 	if (!node->has_value) return false;
 
 	free(node->value_key);
+	ARRAY_STAT(values, -1);
+	ARRAY_STAT(key_bytes, -(uint64_t)node->value_keylen);
 	node->has_value = false;
 	array->count--;
+	cc_probe(array_remove, array, node->value_keylen, array->count);
 
 	while ((node->children == 0) && (!node->has_value)) {
 		if (node->parent == NULL) { // root node
 			// this array is now empty!
 			free(node);
+			ARRAY_STAT(nodes, -1);
 			array->root = NULL;
 			return true;
 		}
@@ -205,9 +232,11 @@ bool array_remove_iterator(array_iterator_t *iterator) {
 		parent->nodes[node->node_key] = NULL;
 		parent->children--;
 		free(node);
+		ARRAY_STAT(nodes, -1);
 		node = parent;
 		if (node->children == 0) {
 			free(node->nodes);
+			ARRAY_STAT(tables, -1);
 			node->nodes = NULL;
 		}
 	}
@@ -223,13 +252,17 @@ void *array_take(array_t *array, int keylen, const uint8_t *key) {
 	void *res = node->value;
 
 	free(node->value_key);
+	ARRAY_STAT(values, -1);
+	ARRAY_STAT(key_bytes, -(uint64_t)node->value_keylen);
 	node->has_value = false;
 	array->count--;
+	cc_probe(array_remove, array, node->value_keylen, array->count);
 
 	while ((node->children == 0) && (!node->has_value)) {
 		if (node->parent == NULL) { // root node
 			// this array is now empty!
 			free(node);
+			ARRAY_STAT(nodes, -1);
 			array->root = NULL;
 			return res;
 		}
@@ -238,9 +271,11 @@ void *array_take(array_t *array, int keylen, const uint8_t *key) {
 		parent->nodes[node->node_key] = NULL;
 		parent->children--;
 		free(node);
+		ARRAY_STAT(nodes, -1);
 		node = parent;
 		if (node->children == 0) {
 			free(node->nodes);
+			ARRAY_STAT(tables, -1);
 			node->nodes = NULL;
 		}
 	}
@@ -33,6 +33,16 @@ struct array_node {
 	struct array_node **nodes;
 };
 
+// allocations of all arrays together, the ssl reload thread builds some too
+struct array_stats {
+	uint64_t values;
+	uint64_t nodes;
+	uint64_t tables; // 256 child pointers each
+	uint64_t key_bytes;
+};
+
+extern struct array_stats array_stats;
+
 // Basic functions
 array_t *array_new();
 void array_free(array_t *);
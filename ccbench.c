@@ -0,0 +1,714 @@
+#define _GNU_SOURCE // sendmmsg()
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "ssl.h"
+#include "network.h"
+#include "cfg_files.h"
+
+/* ccbench : benchmarks for the choices the daemon makes
+ *   ccbench [duration_ms]                       AEAD throughput, and the
+ *                                               priority ssl_priority = auto picks
+ *   ccbench handshake cert key [duration_ms]    server handshakes per second on
+ *                                               one core, certificate vs PSK
+ *   ccbench batch [packet_size] [duration_ms]   data channel packets per second
+ *                                               by batch size, sealed only and
+ *                                               sealed + sent over loopback
+ *   ccbench config [lines]                      config parse and reload time by
+ *                                               file size (a few MB), should grow
+ *                                               linearly, then from the snapshot
+ *   ccbench metrics [duration_ms]               64 byte records through a TLS
+ *                                               session pair, with and without
+ *                                               what the metrics cost per event,
+ *                                               then with network_event_timing
+ *   ccbench packet [duration_ms]                packet buffers against malloc(),
+ *                                               freed by the same thread or
+ *                                               handed to another one
+ *   ccbench egress [duration_ms]                small packet latency through the
+ *                                               egress scheduler while a bulk
+ *                                               flow saturates a shaped link,
+ *                                               on a simulated clock */
+
+// one direction of an in-memory connection
+struct bench_pipe {
+	uint8_t buf[65536];
+	size_t len;
+};
+
+struct bench_end {
+	gnutls_session_t session;
+	struct bench_pipe *in, *out;
+};
+
+static ssize_t bench_push(gnutls_transport_ptr_t ptr, const void *buf, size_t size) {
+	struct bench_end *end = ptr;
+	if (end->out->len + size > sizeof(end->out->buf)) {
+		gnutls_transport_set_errno(end->session, EAGAIN);
+		return -1;
+	}
+	memcpy(end->out->buf + end->out->len, buf, size);
+	end->out->len += size;
+	return size;
+}
+
+static ssize_t bench_pull(gnutls_transport_ptr_t ptr, void *buf, size_t size) {
+	struct bench_end *end = ptr;
+	if (end->in->len == 0) {
+		gnutls_transport_set_errno(end->session, EAGAIN);
+		return -1;
+	}
+	if (size > end->in->len) size = end->in->len;
+	memcpy(buf, end->in->buf, size);
+	memmove(end->in->buf, end->in->buf + size, end->in->len - size);
+	end->in->len -= size;
+	return size;
+}
+
+static uint8_t bench_psk[32];
+
+static int bench_psk_callback(gnutls_session_t session, const gnutls_datum_t *username, gnutls_datum_t *key) {
+	key->data = gnutls_malloc(sizeof(bench_psk));
+	memcpy(key->data, bench_psk, sizeof(bench_psk));
+	key->size = sizeof(bench_psk);
+	return 0;
+}
+
+static double bench_clock(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_end_init(struct bench_end *end, unsigned int flags, const char *priority, struct bench_pipe *in, struct bench_pipe *out) {
+	end->in = in;
+	end->out = out;
+	gnutls_init(&end->session, flags | GNUTLS_NONBLOCK);
+	gnutls_priority_set_direct(end->session, priority, NULL);
+	gnutls_transport_set_ptr(end->session, end);
+	gnutls_transport_set_push_function(end->session, bench_push);
+	gnutls_transport_set_pull_function(end->session, bench_pull);
+}
+
+/* bench_handshakes : run full handshakes for duration_ms, return the rate one
+ * core achieves on the server side (only server CPU time is counted) */
+static double bench_handshakes(gnutls_certificate_credentials_t server_x509, gnutls_certificate_credentials_t client_x509,
+		gnutls_psk_server_credentials_t server_psk, gnutls_psk_client_credentials_t client_psk, int duration_ms) {
+	static struct bench_pipe c2s, s2c;
+	double server_cpu = 0, start = bench_clock(CLOCK_MONOTONIC);
+	int count = 0;
+
+	while((bench_clock(CLOCK_MONOTONIC) - start) * 1000 < duration_ms) {
+		struct bench_end server, client;
+		bool server_done = false, client_done = false;
+
+		c2s.len = s2c.len = 0;
+		bench_end_init(&server, GNUTLS_SERVER, server_psk ? "NORMAL:+ECDHE-PSK" : "NORMAL", &c2s, &s2c);
+		bench_end_init(&client, GNUTLS_CLIENT, client_psk ? "NORMAL:-KX-ALL:+ECDHE-PSK" : "NORMAL", &s2c, &c2s);
+		if (server_psk) {
+			gnutls_credentials_set(server.session, GNUTLS_CRD_PSK, server_psk);
+			gnutls_credentials_set(client.session, GNUTLS_CRD_PSK, client_psk);
+		} else {
+			gnutls_credentials_set(server.session, GNUTLS_CRD_CERTIFICATE, server_x509);
+			gnutls_certificate_server_set_request(server.session, GNUTLS_CERT_REQUEST);
+			gnutls_credentials_set(client.session, GNUTLS_CRD_CERTIFICATE, client_x509);
+		}
+
+		while(!server_done || !client_done) {
+			int ret;
+			if (!client_done) {
+				ret = gnutls_handshake(client.session);
+				if (ret == 0) client_done = true;
+				else if (gnutls_error_is_fatal(ret)) {
+					fprintf(stderr, "client handshake: %s\n", gnutls_strerror(ret));
+					return -1;
+				}
+			}
+			if (!server_done) {
+				double t = bench_clock(CLOCK_THREAD_CPUTIME_ID);
+				ret = gnutls_handshake(server.session);
+				server_cpu += bench_clock(CLOCK_THREAD_CPUTIME_ID) - t;
+				if (ret == 0) server_done = true;
+				else if (gnutls_error_is_fatal(ret)) {
+					fprintf(stderr, "server handshake: %s\n", gnutls_strerror(ret));
+					return -1;
+				}
+			}
+		}
+
+		gnutls_deinit(server.session);
+		gnutls_deinit(client.session);
+		count++;
+	}
+
+	return count / server_cpu;
+}
+
+static int bench_handshake_main(const char *cert, const char *key, int duration) {
+	gnutls_certificate_credentials_t server_x509, client_x509;
+	gnutls_psk_server_credentials_t server_psk;
+	gnutls_psk_client_credentials_t client_psk;
+	gnutls_datum_t psk = { bench_psk, sizeof(bench_psk) };
+
+	gnutls_certificate_allocate_credentials(&server_x509);
+	gnutls_certificate_allocate_credentials(&client_x509);
+	// the same keypair on both ends, what matters is the signature work
+	if ((gnutls_certificate_set_x509_key_file(server_x509, cert, key, GNUTLS_X509_FMT_PEM) < 0) ||
+			(gnutls_certificate_set_x509_key_file(client_x509, cert, key, GNUTLS_X509_FMT_PEM) < 0)) {
+		fprintf(stderr, "Can't load keypair %s / %s\n", cert, key);
+		return 1;
+	}
+
+	gnutls_rnd(GNUTLS_RND_KEY, bench_psk, sizeof(bench_psk));
+	gnutls_psk_allocate_server_credentials(&server_psk);
+	gnutls_psk_set_server_credentials_function2(server_psk, bench_psk_callback);
+	gnutls_psk_allocate_client_credentials(&client_psk);
+	gnutls_psk_set_client_credentials(client_psk, "bench", &psk, GNUTLS_PSK_KEY_RAW);
+
+	double x509_rate = bench_handshakes(server_x509, client_x509, NULL, NULL, duration);
+	double psk_rate = bench_handshakes(NULL, NULL, server_psk, client_psk, duration);
+	if ((x509_rate < 0) || (psk_rate < 0)) return 1;
+
+	printf("%-24s %12s\n", "server handshakes/s", "one core");
+	printf("%-24s %12.0f\n", "certificate", x509_rate);
+	printf("%-24s %12.0f\n", "ecdhe-psk", psk_rate);
+
+	gnutls_certificate_free_credentials(server_x509);
+	gnutls_certificate_free_credentials(client_x509);
+	gnutls_psk_free_server_credentials(server_psk);
+	gnutls_psk_free_client_credentials(client_psk);
+	return 0;
+}
+
+/* bench_batch : seal count packets at a time for duration_ms, and send them
+ * to fd if it is not -1 (sendto for single packets, sendmmsg for batches).
+ * Returns packets per second. */
+static double bench_batch(struct ssl_data_channel *ch, int count, size_t size, int fd, struct sockaddr_in *to, int duration_ms) {
+	static uint8_t bufs[64][2048 + SSL_DATA_OVERHEAD];
+	struct ssl_data_packet pkts[64];
+	struct mmsghdr msgs[64];
+	struct iovec iovs[64];
+	double start = bench_clock(CLOCK_MONOTONIC), elapsed;
+	uint64_t packets = 0;
+
+	do {
+		for(int i = 0; i < count; i++) {
+			memset(bufs[i] + SSL_DATA_HEADER_SIZE, 0x5a, size);
+			pkts[i] = (struct ssl_data_packet){ ch, bufs[i], size, false };
+		}
+		if (count == 1) {
+			ssl_data_seal(ch, bufs[0] + SSL_DATA_HEADER_SIZE, size, bufs[0]);
+			if (fd != -1) sendto(fd, bufs[0], size + SSL_DATA_OVERHEAD, 0, (struct sockaddr *)to, sizeof(*to));
+		} else {
+			ssl_data_seal_batch(pkts, count);
+			if (fd != -1) {
+				for(int i = 0; i < count; i++) {
+					iovs[i] = (struct iovec){ bufs[i], pkts[i].len };
+					msgs[i].msg_hdr = (struct msghdr){ .msg_name = to, .msg_namelen = sizeof(*to), .msg_iov = &iovs[i], .msg_iovlen = 1 };
+				}
+				sendmmsg(fd, msgs, count, 0);
+			}
+		}
+		packets += count;
+		elapsed = bench_clock(CLOCK_MONOTONIC) - start;
+	} while (elapsed * 1000 < duration_ms);
+
+	return packets / elapsed;
+}
+
+static int bench_batch_main(size_t size, int duration) {
+	int batches[] = { 1, 4, 16, 64 };
+	uint8_t key[32], iv[12], id[SSL_DATA_ID_SIZE];
+	struct sockaddr_in to = { .sin_family = AF_INET };
+
+	if ((size == 0) || (size > 2048)) {
+		fprintf(stderr, "packet size must be 1-2048\n");
+		return 1;
+	}
+
+	// a socket nobody reads: the kernel drops what doesn't fit, like real loss
+	int sink = socket(AF_INET, SOCK_DGRAM, 0);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	socklen_t to_len = sizeof(to);
+	inet_pton(AF_INET, "127.0.0.1", &to.sin_addr);
+	if ((sink == -1) || (fd == -1) || (bind(sink, (struct sockaddr *)&to, sizeof(to)) == -1) ||
+			(getsockname(sink, (struct sockaddr *)&to, &to_len) == -1)) {
+		perror("loopback socket");
+		return 1;
+	}
+
+	gnutls_rnd(GNUTLS_RND_KEY, key, sizeof(key));
+	gnutls_rnd(GNUTLS_RND_NONCE, iv, sizeof(iv));
+	gnutls_rnd(GNUTLS_RND_NONCE, id, sizeof(id));
+
+	printf("%zu byte packets, packets/s\n", size);
+	printf("%-20s %8s %12s %12s\n", "AEAD", "batch", "seal", "seal+send");
+	gnutls_cipher_algorithm_t ciphers[] = { GNUTLS_CIPHER_AES_128_GCM, GNUTLS_CIPHER_AES_256_GCM, GNUTLS_CIPHER_CHACHA20_POLY1305 };
+	for(int c = 0; c < 3; c++) {
+		struct ssl_data_channel ch;
+		memset(&ch, 0, sizeof(ch));
+		if (!ssl_data_keys(&ch, ciphers[c], id, key, iv, key, iv)) continue;
+		for(int b = 0; b < 4; b++) {
+			double seal = bench_batch(&ch, batches[b], size, -1, NULL, duration);
+			double send = bench_batch(&ch, batches[b], size, fd, &to, duration);
+			printf("%-20s %8d %12.0f %12.0f\n", gnutls_cipher_get_name(ciphers[c]), batches[b], seal, send);
+		}
+		ssl_data_free(&ch);
+	}
+	close(fd);
+	close(sink);
+	return 0;
+}
+
+/* a config with half unique names, half values of one array, plus an import.
+ * Lines look like hand written ones: comments, padding, quotes and escapes. */
+static bool bench_config_write(const char *path, const char *import, int lines, long *size) {
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) return false;
+	fprintf(fp, "bench_port = 1234\nimport = %s\narray = route\n", import);
+	for(int i = 0; i < lines / 2; i++) {
+		if (i % 16 == 0) fprintf(fp, "// peers %d to %d, one per line, the name is the key\n", i, i + 15);
+		fprintf(fp, "Peer %d    =   \"host-%d.example.net\\x3a443\"   \t; 10.%d.%d.%d\n", i, i, (i >> 16) & 255, (i >> 8) & 255, i & 255);
+	}
+	for(int i = 0; i < lines / 2; i++)
+		fprintf(fp, "route = 172.16.%d.%d/32   via   '10.0.0.1'   metric %d\n", (i >> 8) & 255, i & 255, i % 100);
+	*size = ftell(fp);
+	return fclose(fp) == 0;
+}
+
+static int bench_config_main(int lines) {
+	static int port;
+	static char cache[5][32]; // config_add_cache() keeps the name
+	char path[] = "/tmp/ccbench-XXXXXX", import[] = "/tmp/ccbench-XXXXXX";
+	int fd = mkstemp(path), fd2 = mkstemp(import);
+
+	if ((fd == -1) || (fd2 == -1)) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	close(fd2);
+	FILE *fp = fopen(import, "w");
+	fprintf(fp, "bench_name = imported\n");
+	fclose(fp);
+
+	printf("%10s %10s %12s %12s %12s %10s %12s\n", "lines", "MB", "parse ms", "reload ms", "ns/line", "MB/s", "cached ms");
+	// one config id per size, there is no way to drop one
+	for(int id = 1; id <= 4; id++) {
+		int n = lines >> (4 - id);
+		long size;
+		if (!bench_config_write(path, import, n, &size)) {
+			perror(path);
+			return 1;
+		}
+		config_add(path, id);
+		config_add_var(id, "bench_port", &port, CONF_VAR_INT, 1, 65535, true);
+
+		double start = bench_clock(CLOCK_MONOTONIC);
+		if (!config_parse(id)) {
+			fprintf(stderr, "Failed to parse %s\n", path);
+			return 1;
+		}
+		double parsed = bench_clock(CLOCK_MONOTONIC);
+		if (!config_reload(id)) {
+			fprintf(stderr, "Failed to reload %s\n", path);
+			return 1;
+		}
+		double reloaded = bench_clock(CLOCK_MONOTONIC);
+
+		// once to write the snapshot, then from it twice: the first one still
+		// drops the indexed entries of a parse, the second what a snapshot left
+		snprintf(cache[id], sizeof(cache[id]), "%s.cache", path);
+		config_add_cache(id, cache[id]);
+		if (!config_reload(id) || !config_reload(id)) {
+			fprintf(stderr, "Failed to reload %s\n", path);
+			return 1;
+		}
+		double cached = bench_clock(CLOCK_MONOTONIC);
+		if (!config_reload(id)) {
+			fprintf(stderr, "Failed to reload %s from the snapshot\n", path);
+			return 1;
+		}
+		cached = bench_clock(CLOCK_MONOTONIC) - cached;
+		unlink(cache[id]);
+		if ((config_get_entry(id, "route", n / 2 - 1) == NULL) || (config_get_entry(id, "peer_0", 0) == NULL)) {
+			fprintf(stderr, "Entries missing after parsing %d lines\n", n);
+			return 1;
+		}
+		printf("%10d %10.1f %12.1f %12.1f %12.0f %10.0f %12.1f\n", n, size / 1e6, (parsed - start) * 1000, (reloaded - parsed) * 1000,
+			(reloaded - parsed) * 1e9 / n, size / 1e6 / (reloaded - parsed), cached * 1000);
+	}
+	unlink(path);
+	unlink(import);
+	return 0;
+}
+
+static int bench_aead_main(int duration) {
+	struct ssl_bench_result results[8];
+	char priority[512];
+	size_t sizes[] = { 64, 1400, 16384 };
+
+	printf("%-20s %12s %12s %12s\n", "AEAD (MB/s)", "64", "1400", "16384");
+	int count = 0;
+	double mbps[8][3];
+	for(int s = 0; s < 3; s++) {
+		count = ssl_bench_aead(results, 8, duration, sizes[s]);
+		for(int i = 0; i < count; i++) mbps[i][s] = results[i].mbps;
+	}
+	for(int i = 0; i < count; i++)
+		printf("%-20s %12.1f %12.1f %12.1f\n", gnutls_cipher_get_name(results[i].cipher), mbps[i][0], mbps[i][1], mbps[i][2]);
+
+	// the daemon orders by 16k records, which is what results holds now
+	if (!ssl_bench_priority(priority, sizeof(priority), results, count)) {
+		fprintf(stderr, "Failed to build priority string\n");
+		return 1;
+	}
+	printf("\nssl_priority = %s\n", priority);
+	return 0;
+}
+
+// what one loop iteration pays for the metrics, with its own copies of the counters
+struct bench_metrics {
+	struct network_stats network;
+	struct ssl_session_stats ssl_session;
+	struct ssl_record_stats ssl_record;
+} __attribute__((aligned(64)));
+
+static struct bench_metrics bench_counters, bench_slot;
+
+static uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* bench_records : send count 64 byte records from client to server, one per
+ * simulated wakeup, with mode's share of the metrics. Returns the thread CPU
+ * time it took. BENCH_TIMED is network_event_timing = 1. */
+enum { BENCH_BARE, BENCH_COUNTERS, BENCH_TIMED };
+
+static double bench_records(struct bench_end *client, struct bench_end *server, int mode, int count) {
+	static uint64_t loop_clock, event_start, events, event_ns, event_ns_max, last_event, rx_bytes; // per connection
+	static unsigned int iterations;
+	uint8_t buf[64], in[16384];
+	double start = bench_clock(CLOCK_THREAD_CPUTIME_ID);
+
+	memset(buf, 0x5a, sizeof(buf));
+	for(int i = 0; i < count; i++) {
+		gnutls_record_send(client->session, buf, sizeof(buf));
+		// network_sleep() reads the clock at wakeup either way, for the loop profile
+		loop_clock = bench_now();
+		// network_event_begin()
+		if (mode == BENCH_TIMED) event_start = bench_now();
+		ssize_t len = gnutls_record_recv(server->session, in, sizeof(in));
+		if (mode == BENCH_BARE) continue;
+		bench_counters.network.wakeups++;
+		metrics_observe(&bench_counters.network.events, 1);
+		// network_read()
+		bench_counters.network.read_bytes += len;
+		rx_bytes += len;
+		// network_event_done()
+		events++;
+		if (mode == BENCH_TIMED) {
+			uint64_t now = bench_now();
+			event_ns += now - event_start;
+			if (now - event_start > event_ns_max) event_ns_max = now - event_start;
+			last_event = now;
+		} else {
+			last_event = loop_clock;
+		}
+		// ssl_write(), ssl_flush()
+		bench_counters.ssl_record.records++;
+		// core_stats_publish()
+		if (++iterations % 16 == 0) bench_slot = bench_counters;
+	}
+	if ((mode != BENCH_BARE) && ((last_event < loop_clock) || (events == 0))) fprintf(stderr, "clock went back\n");
+	return bench_clock(CLOCK_THREAD_CPUTIME_ID) - start;
+}
+
+static int bench_metrics_main(int duration) {
+	static struct bench_pipe c2s, s2c;
+	gnutls_psk_server_credentials_t server_psk;
+	gnutls_psk_client_credentials_t client_psk;
+	gnutls_datum_t psk = { bench_psk, sizeof(bench_psk) };
+	struct bench_end server, client;
+	int ret = 0;
+
+	gnutls_rnd(GNUTLS_RND_KEY, bench_psk, sizeof(bench_psk));
+	gnutls_psk_allocate_server_credentials(&server_psk);
+	gnutls_psk_set_server_credentials_function2(server_psk, bench_psk_callback);
+	gnutls_psk_allocate_client_credentials(&client_psk);
+	gnutls_psk_set_client_credentials(client_psk, "bench", &psk, GNUTLS_PSK_KEY_RAW);
+
+	bench_end_init(&server, GNUTLS_SERVER, "NORMAL:+ECDHE-PSK", &c2s, &s2c);
+	bench_end_init(&client, GNUTLS_CLIENT, "NORMAL:-KX-ALL:+ECDHE-PSK", &s2c, &c2s);
+	gnutls_credentials_set(server.session, GNUTLS_CRD_PSK, server_psk);
+	gnutls_credentials_set(client.session, GNUTLS_CRD_PSK, client_psk);
+	for(bool server_done = false, client_done = false; !server_done || !client_done; ) {
+		if (!client_done && ((ret = gnutls_handshake(client.session)) == 0)) client_done = true;
+		if ((ret < 0) && gnutls_error_is_fatal(ret)) break;
+		if (!server_done && ((ret = gnutls_handshake(server.session)) == 0)) server_done = true;
+		if ((ret < 0) && gnutls_error_is_fatal(ret)) break;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "handshake: %s\n", gnutls_strerror(ret));
+		return 1;
+	}
+
+	/* alternate small batches so all modes see the same machine, and count CPU
+	 * time only: what a scheduler does to one run, it does to the others */
+	double cpu[3] = { 0, 0, 0 }, start = bench_clock(CLOCK_MONOTONIC);
+	uint64_t records = 0;
+	while((bench_clock(CLOCK_MONOTONIC) - start) * 1000 < duration) {
+		for(int mode = BENCH_BARE; mode <= BENCH_TIMED; mode++)
+			cpu[mode] += bench_records(&client, &server, mode, 256);
+		records += 256;
+	}
+	printf("64 byte records, one per wakeup\n");
+	printf("%-28s %12s %10s\n", "", "records/s", "overhead");
+	printf("%-28s %12.0f\n", "no metrics", records / cpu[BENCH_BARE]);
+	printf("%-28s %12.0f %9.2f%%\n", "counters (default)", records / cpu[BENCH_COUNTERS], (cpu[BENCH_COUNTERS] / cpu[BENCH_BARE] - 1) * 100);
+	printf("%-28s %12.0f %9.2f%%\n", "+ network_event_timing", records / cpu[BENCH_TIMED], (cpu[BENCH_TIMED] / cpu[BENCH_BARE] - 1) * 100);
+
+	gnutls_deinit(server.session);
+	gnutls_deinit(client.session);
+	gnutls_psk_free_server_credentials(server_psk);
+	gnutls_psk_free_client_credentials(client_psk);
+	return 0;
+}
+
+/* packets go from one thread to the next through a ring, as received
+ * packets would from the network thread to a tunnel writer */
+#define BENCH_RING 1024
+
+struct bench_ring {
+	void *slots[BENCH_RING];
+	uint64_t head, tail; // written by the producer, the consumer
+	bool pool;
+};
+
+static void bench_buf_free(void *buf, bool pool) {
+	if (pool) packet_unref(buf);
+	else free(buf);
+}
+
+static void *bench_buf_alloc(bool pool) {
+	if (!pool) {
+		void *buf = malloc(PACKET_SIZE);
+		memset(buf, 0, 64); // a header gets written anyway
+		return buf;
+	}
+	struct packet *pkt = packet_alloc();
+	memset(packet_put(pkt, 64), 0, 64);
+	return pkt;
+}
+
+static void *bench_ring_consumer(void *arg) {
+	struct bench_ring *ring = arg;
+	while(1) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail == head) {
+			sched_yield();
+			continue;
+		}
+		for(; ring->tail < head; ring->tail++) {
+			void *buf = ring->slots[ring->tail % BENCH_RING];
+			if (buf == NULL) return NULL;
+			bench_buf_free(buf, ring->pool);
+		}
+		__atomic_store_n(&ring->tail, ring->tail, __ATOMIC_RELEASE);
+	}
+}
+
+// ns per buffer, alloc and free in bursts of batch on one thread
+static double bench_packet_local(bool pool, int batch, int duration_ms) {
+	void *bufs[64];
+	uint64_t count = 0;
+	double start = bench_clock(CLOCK_THREAD_CPUTIME_ID), elapsed;
+
+	do {
+		for(int r = 0; r < 1024; r++) {
+			for(int i = 0; i < batch; i++) bufs[i] = bench_buf_alloc(pool);
+			for(int i = 0; i < batch; i++) bench_buf_free(bufs[i], pool);
+		}
+		count += 1024 * batch;
+		elapsed = bench_clock(CLOCK_THREAD_CPUTIME_ID) - start;
+	} while(elapsed * 1000 < duration_ms);
+	return elapsed * 1e9 / count;
+}
+
+// ns per buffer, allocated here and freed by another thread, CPU time of both
+static double bench_packet_remote(bool pool, int duration_ms) {
+	static struct bench_ring ring;
+	pthread_t thread;
+	uint64_t count = 0;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.pool = pool;
+	double start = bench_clock(CLOCK_PROCESS_CPUTIME_ID), wall = bench_clock(CLOCK_MONOTONIC);
+	pthread_create(&thread, NULL, bench_ring_consumer, &ring);
+	do {
+		for(int i = 0; i < 1024; i++) {
+			while(ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) >= BENCH_RING) sched_yield();
+			ring.slots[ring.head % BENCH_RING] = bench_buf_alloc(pool);
+			__atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+		}
+		count += 1024;
+	} while((bench_clock(CLOCK_MONOTONIC) - wall) * 1000 < duration_ms);
+	while(ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) >= BENCH_RING) sched_yield();
+	ring.slots[ring.head % BENCH_RING] = NULL;
+	__atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	return (bench_clock(CLOCK_PROCESS_CPUTIME_ID) - start) * 1e9 / count;
+}
+
+static int bench_packet_main(int duration) {
+	struct packet_gauges gauges;
+	int batches[] = { 1, 64 };
+
+	// map the chunks before timing anything
+	bench_packet_local(true, 64, 1);
+	packet_gauges(&gauges);
+	printf("%d byte buffers, ns per alloc + free (%.0f MB mapped, %.0f MB on reserved huge pages)\n",
+		PACKET_SIZE, gauges.bytes / 1e6, gauges.huge_bytes / 1e6);
+	printf("%-28s %12s %12s\n", "", "malloc", "packet");
+	for(int b = 0; b < 2; b++) {
+		char name[32];
+		snprintf(name, sizeof(name), "same thread, batch %d", batches[b]);
+		printf("%-28s %12.1f %12.1f\n", name, bench_packet_local(false, batches[b], duration), bench_packet_local(true, batches[b], duration));
+	}
+	printf("%-28s %12.1f %12.1f\n", "freed by another thread", bench_packet_remote(false, duration), bench_packet_remote(true, duration));
+	return 0;
+}
+
+/* the egress scheduler on a simulated clock: every tick, the peers queue what
+ * they offered since the last one and the loop sends what the scheduler lets
+ * go. A bulk peer offers twice what the link carries, a few interactive peers
+ * a small packet every 10 ms each. */
+#define BENCH_EGRESS_LINK 10000 // kB/s
+#define BENCH_EGRESS_TICK 100000 // ns
+#define BENCH_EGRESS_PEERS 4
+#define BENCH_EGRESS_BULK 1400 // payload bytes
+#define BENCH_EGRESS_SMALL 100
+
+enum { BENCH_EGRESS_IDLE, BENCH_EGRESS_FIFO, BENCH_EGRESS_DRR, BENCH_EGRESS_CONTROL, BENCH_EGRESS_LIMITED };
+
+static uint64_t bench_egress_clock; // ns, goes on across runs like the loop's
+
+static void bench_egress_offer(struct network_connection *net, size_t len, bool control) {
+	struct packet *pkt = packet_alloc();
+	memset(packet_put(pkt, len), 0, len);
+	memcpy(packet_data(pkt), &bench_egress_clock, sizeof(bench_egress_clock));
+	network_egress_queue(net, pkt, control);
+}
+
+static void bench_egress_run(const char *name, int mode, int duration_ms) {
+	static struct network_connection bulk, small[BENCH_EGRESS_PEERS];
+	struct network_connection *nets[64];
+	struct packet *pkts[64];
+	struct metrics_hdr latency_us;
+	uint64_t offered = 0, bulk_bytes = 0, start = bench_egress_clock;
+	uint64_t dropped = network_egress_stats.queue_full, count = 0;
+	uint64_t bulk_rate = (mode == BENCH_EGRESS_IDLE) ? 0 : 2 * BENCH_EGRESS_LINK * 1000ULL; // bytes/s
+	double cpu = bench_clock(CLOCK_THREAD_CPUTIME_ID);
+
+	memset(&latency_us, 0, sizeof(latency_us));
+	network_egress_limit(&bulk, (mode == BENCH_EGRESS_LIMITED) ? BENCH_EGRESS_LINK * 1000ULL / 2 : 0);
+	for(uint64_t tick = 0; tick < (uint64_t)duration_ms * 1000000 / BENCH_EGRESS_TICK; tick++) {
+		bench_egress_clock += BENCH_EGRESS_TICK;
+		for(offered += bulk_rate * BENCH_EGRESS_TICK / 1000000000; offered >= BENCH_EGRESS_BULK; offered -= BENCH_EGRESS_BULK)
+			bench_egress_offer(&bulk, BENCH_EGRESS_BULK, false);
+		// each interactive peer on its own phase of the 10 ms
+		for(int i = 0; i < BENCH_EGRESS_PEERS; i++) {
+			if ((tick + i * 25) % 100 != 0) continue;
+			bench_egress_offer((mode == BENCH_EGRESS_FIFO) ? &bulk : &small[i], BENCH_EGRESS_SMALL, mode == BENCH_EGRESS_CONTROL);
+		}
+
+		int n;
+		while((n = network_egress_dequeue(nets, pkts, 64, bench_egress_clock)) > 0) {
+			for(int i = 0; i < n; i++) {
+				uint64_t queued;
+				memcpy(&queued, packet_data(pkts[i]), sizeof(queued));
+				if (pkts[i]->len == BENCH_EGRESS_SMALL) metrics_hdr_record(&latency_us, (bench_egress_clock - queued) / 1000);
+				else bulk_bytes += pkts[i]->len;
+				packet_unref(pkts[i]);
+			}
+			count += n;
+		}
+	}
+	cpu = bench_clock(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	network_egress_free(&bulk);
+	for(int i = 0; i < BENCH_EGRESS_PEERS; i++) network_egress_free(&small[i]);
+
+	double seconds = (bench_egress_clock - start) / 1e9;
+	printf("%-26s %8llu %8llu %8llu %10.2f %10.0f %8.0f\n", name,
+		(unsigned long long)metrics_hdr_percentile(&latency_us, 50), (unsigned long long)metrics_hdr_percentile(&latency_us, 99),
+		(unsigned long long)latency_us.max, bulk_bytes / seconds / 1e6, (network_egress_stats.queue_full - dropped) / seconds,
+		count ? cpu * 1e9 / count : 0);
+}
+
+static int bench_egress_main(int duration) {
+	char link[16];
+
+	// variables belong to a config file, this one is never parsed
+	config_add("/dev/null", CONFIG_CORE);
+	network_egress_config_init();
+	snprintf(link, sizeof(link), "%d", BENCH_EGRESS_LINK);
+	if (config_set_value(CONFIG_CORE, "network_egress_link", link) != 0) {
+		fprintf(stderr, "Failed to set network_egress_link\n");
+		return 1;
+	}
+	printf("link shaped to %d kB/s, bulk peer offering twice that in %d byte packets,\n", BENCH_EGRESS_LINK, BENCH_EGRESS_BULK);
+	printf("%d peers sending %d bytes every 10 ms, %d ms simulated in %d us ticks\n",
+		BENCH_EGRESS_PEERS, BENCH_EGRESS_SMALL, duration, BENCH_EGRESS_TICK / 1000);
+	printf("%-26s %8s %8s %8s %10s %10s %8s\n", "small packet latency (us)", "p50", "p99", "max", "bulk MB/s", "drops/s", "ns/pkt");
+	bench_egress_run("no bulk flow", BENCH_EGRESS_IDLE, duration);
+	bench_egress_run("bulk, one shared queue", BENCH_EGRESS_FIFO, duration);
+	bench_egress_run("bulk, per-peer DRR", BENCH_EGRESS_DRR, duration);
+	bench_egress_run("bulk, small as control", BENCH_EGRESS_CONTROL, duration);
+	bench_egress_run("bulk limited to half", BENCH_EGRESS_LIMITED, duration);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int ret;
+
+	if (gnutls_global_init() != GNUTLS_E_SUCCESS) {
+		fprintf(stderr, "Failed to initialize GnuTLS\n");
+		return 1;
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "handshake") == 0)) {
+		if (argc < 4) {
+			fprintf(stderr, "Usage: %s handshake cert key [duration_ms]\n", argv[0]);
+			return 1;
+		}
+		ret = bench_handshake_main(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 1000);
+	} else if ((argc > 1) && (strcmp(argv[1], "config") == 0)) {
+		ret = bench_config_main(argc > 2 ? atoi(argv[2]) : 100000);
+	} else if ((argc > 1) && (strcmp(argv[1], "batch") == 0)) {
+		ret = bench_batch_main(argc > 2 ? atoi(argv[2]) : 1400, argc > 3 ? atoi(argv[3]) : 300);
+	} else if ((argc > 1) && (strcmp(argv[1], "metrics") == 0)) {
+		ret = bench_metrics_main(argc > 2 ? atoi(argv[2]) : 2000);
+	} else if ((argc > 1) && (strcmp(argv[1], "packet") == 0)) {
+		ret = bench_packet_main(argc > 2 ? atoi(argv[2]) : 500);
+	} else if ((argc > 1) && (strcmp(argv[1], "egress") == 0)) {
+		ret = bench_egress_main(argc > 2 ? atoi(argv[2]) : 2000);
+	} else {
+		ret = bench_aead_main(argc > 1 ? atoi(argv[1]) : 200);
+	}
+
+	gnutls_global_deinit();
+	return ret;
+}
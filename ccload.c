@@ -0,0 +1,858 @@
+#define _GNU_SOURCE // sendmmsg(), SO_PEERCRED
+#include <gnutls/gnutls.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <gnutls/dtls.h>
+
+#include "log.h"
+#include "ssl.h"
+#include "network.h"
+#include "array.h"
+
+/* ccload : load generator for a cloudconnector on this machine. Its
+ * connections are handler fds on the daemon's own event loop (network.c).
+ *   ccload [options]
+ *   -s ip:port     daemon (127.0.0.1:65534)
+ *   -c cert -k key client certificate, as signed by ssl/ca/make_cert_csr.sh
+ *                  (ssl/ssl.crt ssl/ssl.key)
+ *   -p id:hexkey   PSK identity and key, for a daemon with ssl_psk_file
+ *   -o priority    GnuTLS priorities (NORMAL, NORMAL:-KX-ALL:+ECDHE-PSK with -p)
+ *   -n conns       connections to hold open (1000)
+ *   -r rate        new connections per second, 0 for no limit (1000)
+ *   -l ms          connection lifetime, then it is replaced (0: until the end)
+ *   -t s           handshake timeout (10)
+ *   -T transport   tls, dtls (on the daemon's UDP port) or data (TLS, then
+ *                  messages go over the data channel) (tls)
+ *   -m bytes       message size, 0 for none (0)
+ *   -i ms          each connection sends a message this often (1000)
+ *   -e ip          messages are ICMP echo requests to this tunnel address,
+ *                  of -m bytes (64), and replies are timed
+ *   -u pps         data channel packets per second over all connections, for
+ *                  a daemon with ssl_data_channel = 1 (0)
+ *   -U bytes       data channel packet size, 20-2048 (1200)
+ *   -b count       source addresses from 127.0.0.1 up, each gets its own
+ *                  range of ports (one per 20000 connections), for a daemon
+ *                  on 127.x.y.z: elsewhere the kernel picks the source
+ *   -d s           duration (10)
+ *   -a path        daemon admin socket: its counters and RSS go in the report
+ * Prints a line every second and a summary at the end, or on ^C. Handshake
+ * latencies run from connect() to the end of the handshake.
+ *
+ * Whatever goes through the tunnel is IPv4, each connection has an address
+ * of its own in it. With -e that is the one after the echo address for the
+ * first connection, then the next ones (so -n is at most the size of the
+ * daemon's tunnel_address network); the daemon's kernel answers and the round
+ * trip of each echo is measured. Otherwise messages and data channel packets
+ * are cut into packets of protocol 253 (RFC 3692) from 198.18.0.0/15 to
+ * 192.0.2.1, which go nowhere: they can only be counted, on both ends.
+ *
+ * For latency under loss, run the daemon on 0.0.0.0 behind ccnetem and point
+ * -s at the other side of it, 10.77.0.1 by default. */
+
+#define LOAD_TICK_NS 1000000 // pacing timer
+#define LOAD_CONNECT_BURST 256 // connect() calls per tick without -r
+#define LOAD_QUEUE_MAX 262144 // skip a message while this much is still queued
+#define LOAD_UDP_BATCH 64
+#define LOAD_UDP_MAX 2048
+#define LOAD_PORTS 20000 // usable ports per source address, with the default ip_local_port_range
+#define LOAD_IP_MAX 1400 // messages are cut into IP packets of this size at most
+#define LOAD_ECHO_MIN 36 // IPv4, ICMP header, send time
+#define LOAD_PROTO_TEST 253
+
+enum load_transport {
+	LOAD_TLS = 0,
+	LOAD_DTLS,
+	LOAD_DATA,
+};
+
+enum load_end {
+	LOAD_END_ERROR = 0, // failed, or closed by the daemon
+	LOAD_END_TIMEOUT,
+	LOAD_END_LIFETIME,
+};
+
+struct load_conn {
+	struct network_connection *net;
+	gnutls_session_t session;
+	struct ssl_data_channel *data; // with -u or -T data
+	uint64_t started; // connect(), network_now()
+	uint64_t established; // 0 during the handshake
+	uint64_t retransmit; // DTLS handshake: when to resend the last flight
+	uint32_t src; // its address in the tunnel, network order
+	uint16_t slot, echo_seq;
+	uint8_t *rx; // TLS: an IP packet cut between two records
+	size_t rx_len;
+	enum load_end end;
+	struct load_conn *prev, *next; // in handshaking or established, oldest first
+};
+
+struct load_list {
+	struct load_conn *head, *tail;
+	int count;
+};
+
+struct load_counters {
+	uint64_t connects, connect_errors;
+	uint64_t handshakes, failed, timeouts;
+	uint64_t dropped; // closed by the daemon once established
+	uint64_t messages, message_bytes, message_skipped;
+	uint64_t udp_packets, udp_dropped;
+	uint64_t echoes, replies, bad_replies;
+};
+
+// the daemon, from its admin socket
+struct load_server {
+	pid_t pid;
+	uint64_t rss; // bytes
+	uint64_t peers, handshakes, read_bytes, udp_packets;
+	uint64_t tunnel_bytes; // what made it into the tunnel
+};
+
+static struct sockaddr_in server = { .sin_family = AF_INET };
+static char *cert_file = "ssl/ssl.crt", *key_file = "ssl/ssl.key";
+static char *psk = NULL, *priority = NULL, *admin_path = NULL;
+static int target = 1000, rate = 1000, lifetime = 0, timeout = 10;
+static int message_size = 0, message_interval = 1000;
+static int udp_rate = 0, udp_size = 1200;
+static int sources = 0, duration = 10;
+static enum load_transport transport = LOAD_TLS;
+static struct in_addr echo_addr;
+static bool echo = false;
+
+static gnutls_certificate_credentials_t x509_cred;
+static gnutls_psk_client_credentials_t psk_cred;
+static gnutls_priority_t prio;
+
+static array_t *conns; // fd => struct load_conn
+static array_t *channels; // data channel id => struct load_conn
+static struct load_list handshaking, established;
+static struct load_conn *send_next, *udp_next; // round robin over established
+static uint64_t source_next, slot_next;
+static int udp_fd = -1;
+static uint8_t *message;
+
+static struct load_counters total, last;
+static struct metrics_hdr latency, latency_second; // handshakes, us
+static struct metrics_hdr rtt, rtt_second; // echoes, us
+static double connect_credit, message_credit, udp_credit;
+static volatile sig_atomic_t stop;
+
+// ssl_data.c reads it, ccload is never pre-forked
+int core_worker = -1;
+
+static void load_list_add(struct load_list *list, struct load_conn *conn) {
+	conn->prev = list->tail;
+	conn->next = NULL;
+	if (list->tail) list->tail->next = conn; else list->head = conn;
+	list->tail = conn;
+	list->count++;
+}
+
+static void load_list_remove(struct load_list *list, struct load_conn *conn) {
+	if (conn->prev) conn->prev->next = conn->next; else list->head = conn->next;
+	if (conn->next) conn->next->prev = conn->prev; else list->tail = conn->prev;
+	list->count--;
+}
+
+static ssize_t load_push(gnutls_transport_ptr_t ptr, const void *buf, size_t size) {
+	return network_write(ptr, buf, size);
+}
+
+static ssize_t load_pull(gnutls_transport_ptr_t ptr, void *buf, size_t size) {
+	return network_read(ptr, buf, size);
+}
+
+// DTLS: the socket is the connection's own, connected to the daemon
+static ssize_t load_dgram_pull(gnutls_transport_ptr_t ptr, void *buf, size_t size) {
+	struct network_connection *net = ptr;
+	return recv(net->fd, buf, size, 0);
+}
+
+static int load_dgram_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+	struct network_connection *net = ptr;
+	struct pollfd pfd = { net->fd, POLLIN, 0 };
+	// never blocks, the loop calls back when a datagram arrives
+	return poll(&pfd, 1, 0);
+}
+
+static uint16_t load_checksum(const uint8_t *buf, size_t len) {
+	uint32_t sum = 0;
+
+	for(size_t i = 0; i + 1 < len; i += 2) sum += (buf[i] << 8) | buf[i + 1];
+	if (len & 1) sum += buf[len - 1] << 8;
+	while(sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static void load_ip_header(uint8_t *buf, size_t len, uint8_t proto, uint32_t src, uint32_t dst) {
+	memset(buf, 0, 20);
+	buf[0] = 0x45;
+	buf[2] = len >> 8;
+	buf[3] = len;
+	buf[6] = 0x40; // don't fragment
+	buf[8] = 64;
+	buf[9] = proto;
+	memcpy(buf + 12, &src, 4);
+	memcpy(buf + 16, &dst, 4);
+	uint16_t sum = load_checksum(buf, 20);
+	buf[10] = sum >> 8;
+	buf[11] = sum;
+}
+
+// an echo request, the send time in its payload
+static void load_echo_request(struct load_conn *conn, uint8_t *buf, size_t len) {
+	uint64_t now = network_now();
+
+	load_ip_header(buf, len, IPPROTO_ICMP, conn->src, echo_addr.s_addr);
+	uint8_t *icmp = buf + 20;
+	memset(icmp, 0, len - 20);
+	icmp[0] = 8;
+	icmp[4] = conn->slot >> 8;
+	icmp[5] = conn->slot;
+	icmp[6] = conn->echo_seq >> 8;
+	icmp[7] = conn->echo_seq++;
+	memcpy(icmp + 8, &now, sizeof(now));
+	uint16_t sum = load_checksum(icmp, len - 20);
+	icmp[2] = sum >> 8;
+	icmp[3] = sum;
+}
+
+// a whole IP packet from the tunnel
+static void load_tunnel_input(const uint8_t *buf, size_t len) {
+	uint64_t sent;
+
+	if ((len < LOAD_ECHO_MIN) || (buf[0] != 0x45) || (buf[9] != IPPROTO_ICMP) || (buf[20] != 0)) {
+		total.bad_replies++;
+		return;
+	}
+	memcpy(&sent, buf + 28, sizeof(sent));
+	uint64_t us = (network_now() - sent) / 1000;
+	metrics_hdr_record(&rtt, us);
+	metrics_hdr_record(&rtt_second, us);
+	total.replies++;
+}
+
+// TLS: IP packets back to back, cut anywhere, false if the stream isn't that
+static bool load_stream_input(struct load_conn *conn, const uint8_t *buf, size_t len) {
+	if ((conn->rx == NULL) && ((conn->rx = malloc(LOAD_UDP_MAX)) == NULL)) return false;
+	while(len > 0) {
+		// the header first, for the length
+		size_t want = 4;
+		if (conn->rx_len >= 4) {
+			want = (conn->rx[2] << 8) | conn->rx[3];
+			if ((want < 20) || (want > LOAD_UDP_MAX)) return false;
+		}
+		size_t n = want - conn->rx_len;
+		if (n > len) n = len;
+		memcpy(conn->rx + conn->rx_len, buf, n);
+		conn->rx_len += n;
+		buf += n;
+		len -= n;
+		if ((want > 4) && (conn->rx_len == want)) {
+			load_tunnel_input(conn->rx, conn->rx_len);
+			conn->rx_len = 0;
+		}
+	}
+	return true;
+}
+
+// network_close() ends every connection, whoever decided it
+static void load_closed(struct network_connection *net) {
+	struct load_conn *conn = array_get_int(conns, net->fd);
+
+	if (conn == NULL) return;
+	array_remove_int(conns, net->fd);
+	if (conn->established) {
+		if (send_next == conn) send_next = conn->next;
+		if (udp_next == conn) udp_next = conn->next;
+		load_list_remove(&established, conn);
+		if (conn->end == LOAD_END_ERROR) total.dropped++;
+	} else {
+		load_list_remove(&handshaking, conn);
+		if (conn->end == LOAD_END_TIMEOUT) total.timeouts++; else total.failed++;
+	}
+	if (conn->data) {
+		if (channels) array_remove(channels, SSL_DATA_ID_SIZE, conn->data->id);
+		ssl_data_free(conn->data);
+		free(conn->data);
+	}
+	gnutls_deinit(conn->session);
+	free(conn->rx);
+	free(conn);
+}
+
+static bool load_handshake(struct load_conn *conn) {
+	int ret = gnutls_handshake(conn->session);
+	if ((ret == GNUTLS_E_AGAIN) || (ret == GNUTLS_E_INTERRUPTED)) {
+		if (transport == LOAD_DTLS) conn->retransmit = network_now() + (uint64_t)gnutls_dtls_get_timeout(conn->session) * 1000000;
+		return true;
+	}
+	if (ret < 0) return !gnutls_error_is_fatal(ret);
+
+	uint64_t now = network_now();
+	conn->established = now;
+	metrics_hdr_record(&latency, (now - conn->started) / 1000);
+	metrics_hdr_record(&latency_second, (now - conn->started) / 1000);
+	total.handshakes++;
+	load_list_remove(&handshaking, conn);
+	load_list_add(&established, conn);
+
+	if ((udp_rate > 0) || (transport == LOAD_DATA)) {
+		conn->data = calloc(sizeof(struct ssl_data_channel), 1);
+		if (ssl_data_derive(conn->data, conn->session, false)) {
+			array_insert(channels, SSL_DATA_ID_SIZE, conn->data->id, conn, false);
+		} else {
+			free(conn->data);
+			conn->data = NULL;
+		}
+	}
+	return true;
+}
+
+// tunnel packets, one per DTLS record or spread over TLS ones
+static void load_event(struct network_connection *net) {
+	struct load_conn *conn = array_get_int(conns, net->fd);
+	uint8_t buf[16384];
+
+	if (conn == NULL) return;
+	if (!conn->established) {
+		if (!load_handshake(conn)) {
+			network_close(net);
+			return;
+		}
+		if (!conn->established) return;
+	}
+	while(1) {
+		int ret = gnutls_record_recv(conn->session, buf, sizeof(buf));
+		if ((ret == GNUTLS_E_AGAIN) || (ret == GNUTLS_E_INTERRUPTED)) return;
+		if ((ret == 0) || ((ret < 0) && gnutls_error_is_fatal(ret))) {
+			network_close(net);
+			return;
+		}
+		if (ret < 0) continue;
+		if (transport == LOAD_DTLS) {
+			load_tunnel_input(buf, ret);
+		} else if (!load_stream_input(conn, buf, ret)) {
+			network_close(net);
+			return;
+		}
+	}
+}
+
+// data channel datagrams back from the daemon, once it knows where we are
+static void load_udp_read(struct network_connection *net) {
+	uint8_t buf[LOAD_UDP_MAX + SSL_DATA_OVERHEAD];
+
+	while(1) {
+		ssize_t len = recv(net->fd, buf, sizeof(buf), 0);
+		if (len < 0) return;
+		if ((len < SSL_DATA_HEADER_SIZE) || (buf[0] != SSL_DATA_MAGIC)) continue;
+		struct load_conn *conn = array_get(channels, SSL_DATA_ID_SIZE, buf + 1);
+		if (conn == NULL) continue;
+		ssize_t plain_len = ssl_data_open(conn->data, buf, len);
+		if (plain_len >= 0) load_tunnel_input(buf + SSL_DATA_HEADER_SIZE, plain_len);
+	}
+}
+
+static void load_timer(struct network_connection *net) {
+	uint64_t expirations;
+	while(read(net->fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+}
+
+static bool load_connect() {
+	struct sockaddr_in source = { .sin_family = AF_INET };
+	int ok = 1;
+
+	// each source address has its own ports, the kernel picks one at connect()
+	source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + source_next++ % sources);
+	total.connects++;
+	int fd = socket(AF_INET, (transport == LOAD_DTLS ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		total.connect_errors++;
+		return false;
+	}
+	if (transport != LOAD_DTLS) {
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &ok, sizeof(ok));
+		// messages are flushed once per loop iteration already, like the daemon does
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &ok, sizeof(ok));
+	}
+	bool loopback = (ntohl(server.sin_addr.s_addr) >> 24) == 127;
+	if ((loopback && (bind(fd, (struct sockaddr *)&source, sizeof(source)) == -1)) ||
+			((connect(fd, (struct sockaddr *)&server, sizeof(server)) == -1) && (errno != EINPROGRESS))) {
+		total.connect_errors++;
+		close(fd);
+		return false;
+	}
+
+	struct network_connection *net = network_register_fd(fd, load_event);
+	if (net == NULL) {
+		total.connect_errors++;
+		close(fd);
+		return false;
+	}
+	// DTLS sends its datagrams right away, TCP buffers until the socket is writable
+	net->stream = (transport != LOAD_DTLS);
+	net->closed = load_closed;
+
+	struct load_conn *conn = calloc(sizeof(struct load_conn), 1);
+	conn->net = net;
+	conn->started = network_now();
+	// each connection its own address in the tunnel, a slot stays with one connection at a time
+	conn->slot = slot_next++ % target;
+	conn->src = echo ? htonl(ntohl(echo_addr.s_addr) + 1 + conn->slot) : htonl(0xc6120000 + conn->slot);
+	gnutls_init(&conn->session, GNUTLS_CLIENT | GNUTLS_NONBLOCK | (transport == LOAD_DTLS ? GNUTLS_DATAGRAM : 0));
+	gnutls_priority_set(conn->session, prio);
+	if (x509_cred) gnutls_credentials_set(conn->session, GNUTLS_CRD_CERTIFICATE, x509_cred);
+	if (psk_cred) gnutls_credentials_set(conn->session, GNUTLS_CRD_PSK, psk_cred);
+	gnutls_transport_set_ptr(conn->session, net);
+	gnutls_transport_set_push_function(conn->session, load_push);
+	if (transport == LOAD_DTLS) {
+		gnutls_transport_set_pull_function(conn->session, load_dgram_pull);
+		gnutls_transport_set_pull_timeout_function(conn->session, load_dgram_pull_timeout);
+		gnutls_dtls_set_timeouts(conn->session, 1000, timeout * 1000);
+	} else {
+		gnutls_transport_set_pull_function(conn->session, load_pull);
+	}
+	array_insert_int(conns, fd, conn);
+	load_list_add(&handshaking, conn);
+
+	// ClientHello waits in the write buffer until the socket is connected
+	if (!load_handshake(conn)) network_close(net);
+	return true;
+}
+
+/* a message is cut into IP packets: one echo request with -e, protocol 253
+ * packets of LOAD_IP_MAX bytes or less otherwise */
+static void load_message(struct load_conn *conn) {
+	if (conn->net->write_buf_pos > LOAD_QUEUE_MAX) {
+		total.message_skipped++;
+		return;
+	}
+	if (echo) {
+		load_echo_request(conn, message, message_size);
+		total.echoes++;
+	} else {
+		for(int pos = 0; pos < message_size; pos += LOAD_IP_MAX) {
+			int len = (message_size - pos > LOAD_IP_MAX) ? LOAD_IP_MAX : message_size - pos;
+			load_ip_header(message + pos, len, LOAD_PROTO_TEST, conn->src, htonl(0xc0000201));
+		}
+	}
+
+	// the data channel takes one IP packet per datagram
+	if ((transport == LOAD_DATA) && (conn->data != NULL)) {
+		static uint8_t out[LOAD_IP_MAX + SSL_DATA_OVERHEAD];
+		for(int pos = 0; pos < message_size; pos += LOAD_IP_MAX) {
+			int len = (message_size - pos > LOAD_IP_MAX) ? LOAD_IP_MAX : message_size - pos;
+			size_t out_len = ssl_data_seal(conn->data, message + pos, len, out);
+			if ((out_len == 0) || (send(udp_fd, out, out_len, 0) == -1)) total.udp_dropped++;
+			else total.udp_packets++;
+		}
+	} else {
+		// TLS cuts it into records, DTLS sends each packet as one
+		for(int sent = 0; sent < message_size; ) {
+			int len = message_size - sent;
+			if ((transport == LOAD_DTLS) && (len > LOAD_IP_MAX)) len = LOAD_IP_MAX;
+			ssize_t ret = gnutls_record_send(conn->session, message + sent, len);
+			if ((ret == GNUTLS_E_AGAIN) && (transport == LOAD_DTLS)) {
+				ret = len; // socket full, that packet is lost
+			} else if (ret < 0) {
+				network_close(conn->net);
+				return;
+			}
+			sent += ret;
+		}
+	}
+	total.messages++;
+	total.message_bytes += message_size;
+}
+
+// one sendmmsg() for up to LOAD_UDP_BATCH packets, each on the next channel
+static int load_udp_batch(int count) {
+	static uint8_t bufs[LOAD_UDP_BATCH][LOAD_UDP_MAX + SSL_DATA_OVERHEAD];
+	struct ssl_data_packet pkts[LOAD_UDP_BATCH];
+	struct mmsghdr msgs[LOAD_UDP_BATCH];
+	struct iovec iovs[LOAD_UDP_BATCH];
+	int n = 0;
+
+	for(int tries = established.count; (n < count) && (tries > 0); tries--) {
+		struct load_conn *conn = udp_next ? udp_next : established.head;
+		udp_next = conn->next;
+		if (conn->data == NULL) continue;
+		load_ip_header(bufs[n] + SSL_DATA_HEADER_SIZE, udp_size, LOAD_PROTO_TEST, conn->src, htonl(0xc0000201));
+		pkts[n] = (struct ssl_data_packet){ conn->data, bufs[n], udp_size, false };
+		n++;
+	}
+	ssl_data_seal_batch(pkts, n);
+
+	int m = 0;
+	for(int i = 0; i < n; i++) {
+		if (!pkts[i].ok) continue;
+		iovs[m] = (struct iovec){ pkts[i].buf, pkts[i].len };
+		msgs[m].msg_hdr = (struct msghdr){ .msg_iov = &iovs[m], .msg_iovlen = 1 };
+		m++;
+	}
+	int done = (m > 0) ? sendmmsg(udp_fd, msgs, m, 0) : 0;
+	if (done < 0) done = 0;
+	total.udp_packets += done;
+	total.udp_dropped += m - done;
+	return n;
+}
+
+/* load_tick : after each loop iteration, age out connections and spend the
+ * credits each workload earned since the last one */
+static void load_tick(uint64_t now, uint64_t elapsed_ns) {
+	double elapsed = elapsed_ns / 1e9;
+
+	while(handshaking.head && (now - handshaking.head->started >= (uint64_t)timeout * 1000000000)) {
+		handshaking.head->end = LOAD_END_TIMEOUT;
+		network_close(handshaking.head->net);
+	}
+	// a lost DTLS flight is only sent again when we ask
+	for(struct load_conn *conn = handshaking.head, *next; conn != NULL; conn = next) {
+		next = conn->next;
+		if ((transport != LOAD_DTLS) || (now < conn->retransmit)) continue;
+		if (!load_handshake(conn)) network_close(conn->net);
+	}
+	while(lifetime && established.head && (now - established.head->established >= (uint64_t)lifetime * 1000000)) {
+		established.head->end = LOAD_END_LIFETIME;
+		network_close(established.head->net);
+	}
+
+	int missing = target - handshaking.count - established.count;
+	if (rate > 0) {
+		// no catching up after a stall beyond 100ms worth
+		connect_credit += rate * elapsed;
+		if (connect_credit > rate / 10.0 + 1) connect_credit = rate / 10.0 + 1;
+		if (missing > (int)connect_credit) missing = connect_credit;
+	} else if (missing > LOAD_CONNECT_BURST) {
+		missing = LOAD_CONNECT_BURST;
+	}
+	for(int i = 0; i < missing; i++) {
+		if (rate > 0) connect_credit--;
+		if (!load_connect()) break;
+	}
+
+	if ((message_size > 0) && (established.count > 0)) {
+		message_credit += established.count * elapsed * 1000 / message_interval;
+		if (message_credit > established.count) message_credit = established.count;
+		for(; message_credit >= 1 && established.count > 0; message_credit--) {
+			struct load_conn *conn = send_next ? send_next : established.head;
+			send_next = conn->next;
+			load_message(conn);
+		}
+	} else {
+		message_credit = 0;
+	}
+
+	if ((udp_rate > 0) && (established.count > 0)) {
+		udp_credit += udp_rate * elapsed;
+		if (udp_credit > udp_rate / 10.0 + 1) udp_credit = udp_rate / 10.0 + 1;
+		while(udp_credit >= 1) {
+			int count = (udp_credit > LOAD_UDP_BATCH) ? LOAD_UDP_BATCH : udp_credit;
+			int sent = load_udp_batch(count);
+			if (sent == 0) break;
+			udp_credit -= sent;
+		}
+	}
+}
+
+// value of a metric line, name including its labels
+static uint64_t load_metric(const char *text, const char *name) {
+	size_t len = strlen(name);
+	for(const char *line = text; line != NULL; line = strchr(line, '\n')) {
+		if (*line == '\n') line++;
+		if ((strncmp(line, name, len) == 0) && (line[len] == ' ')) return strtoull(line + len + 1, NULL, 10);
+	}
+	return 0;
+}
+
+/* load_server : read the daemon's counters from its admin socket, and its RSS
+ * from /proc, the pid comes with the socket. Blocks, only used at both ends
+ * of the run. */
+static bool load_server(struct load_server *res) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	char *text = NULL, line[256];
+	size_t size = 0, len = 0;
+
+	if (admin_path == NULL) return false;
+	memset(res, 0, sizeof(*res));
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", admin_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((fd == -1) || (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+			(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) ||
+			(write(fd, "metrics\n", 8) != 8)) {
+		perror(admin_path);
+		if (fd != -1) close(fd);
+		return false;
+	}
+	shutdown(fd, SHUT_WR);
+	while(1) {
+		if (len + 4096 + 1 > size) {
+			size = size ? size * 2 : 65536;
+			text = realloc(text, size);
+		}
+		ssize_t ret = read(fd, text + len, size - len - 1);
+		if (ret <= 0) break;
+		len += ret;
+	}
+	close(fd);
+	text[len] = 0;
+
+	res->pid = cred.pid;
+	res->peers = load_metric(text, "cloudconnector_peers{proto=\"tcp\"}");
+	res->handshakes = load_metric(text, "cloudconnector_handshakes_total{result=\"ok\"}");
+	res->read_bytes = load_metric(text, "cloudconnector_read_bytes_total");
+	res->udp_packets = load_metric(text, "cloudconnector_data_packets_total{dir=\"rx\"}");
+	res->tunnel_bytes = load_metric(text, "cloudconnector_tunnel_bytes_total{dir=\"in\"}");
+	free(text);
+
+	snprintf(line, sizeof(line), "/proc/%d/status", (int)cred.pid);
+	FILE *f = fopen(line, "r");
+	if (f == NULL) return true;
+	while(fgets(line, sizeof(line), f) != NULL) {
+		unsigned long long kb;
+		if (sscanf(line, "VmRSS: %llu kB", &kb) == 1) res->rss = kb * 1024;
+	}
+	fclose(f);
+	return true;
+}
+
+static void load_report_second(int second, double elapsed) {
+	printf("%4ds  conns %6d (+%d)  handshakes %7.0f/s  failed %llu  p50 %6.2fms p99 %6.2fms  tx %7.2f MB/s  udp %7.0f pps",
+		second, established.count, handshaking.count, (total.handshakes - last.handshakes) / elapsed,
+		(unsigned long long)(total.failed + total.timeouts + total.connect_errors),
+		metrics_hdr_percentile(&latency_second, 50) / 1000.0, metrics_hdr_percentile(&latency_second, 99) / 1000.0,
+		(total.message_bytes - last.message_bytes) / elapsed / 1e6, (total.udp_packets - last.udp_packets) / elapsed);
+	if (echo)
+		printf("  echo %llu/%llu p50 %6.2fms p99 %6.2fms", (unsigned long long)(total.replies - last.replies),
+			(unsigned long long)(total.echoes - last.echoes),
+			metrics_hdr_percentile(&rtt_second, 50) / 1000.0, metrics_hdr_percentile(&rtt_second, 99) / 1000.0);
+	printf("\n");
+	fflush(stdout);
+	last = total;
+	memset(&latency_second, 0, sizeof(latency_second));
+	memset(&rtt_second, 0, sizeof(rtt_second));
+}
+
+static void load_report(double elapsed, struct load_server *before, struct load_server *after) {
+	printf("\nover %.1fs, %d connections established, %d handshaking\n", elapsed, established.count, handshaking.count);
+	printf("handshakes  %llu ok (%.0f/s), %llu failed, %llu timed out, %llu connect errors, %llu dropped after\n",
+		(unsigned long long)total.handshakes, total.handshakes / elapsed, (unsigned long long)total.failed,
+		(unsigned long long)total.timeouts, (unsigned long long)total.connect_errors, (unsigned long long)total.dropped);
+	printf("latency     p50 %.2fms p99 %.2fms p99.9 %.2fms max %.2fms\n",
+		metrics_hdr_percentile(&latency, 50) / 1000.0, metrics_hdr_percentile(&latency, 99) / 1000.0,
+		metrics_hdr_percentile(&latency, 99.9) / 1000.0, latency.max / 1000.0);
+	if (message_size > 0)
+		printf("messages    %llu of %d bytes, %.0f/s, %.2f MB/s, %llu skipped (queue full)\n",
+			(unsigned long long)total.messages, message_size, total.messages / elapsed,
+			total.message_bytes / elapsed / 1e6, (unsigned long long)total.message_skipped);
+	if (echo)
+		printf("echo        %llu sent, %llu replies (%.2f%% lost, the last ones may still be on their way), %llu bad\n"
+			"echo rtt    p50 %.2fms p90 %.2fms p99 %.2fms p99.9 %.2fms max %.2fms\n",
+			(unsigned long long)total.echoes, (unsigned long long)total.replies,
+			total.echoes ? 100.0 * (total.echoes - total.replies) / total.echoes : 0, (unsigned long long)total.bad_replies,
+			metrics_hdr_percentile(&rtt, 50) / 1000.0, metrics_hdr_percentile(&rtt, 90) / 1000.0,
+			metrics_hdr_percentile(&rtt, 99) / 1000.0, metrics_hdr_percentile(&rtt, 99.9) / 1000.0, rtt.max / 1000.0);
+	if (udp_rate > 0)
+		printf("udp         %llu packets of %d bytes, %.0f pps, %llu dropped (socket full)\n",
+			(unsigned long long)total.udp_packets, udp_size, total.udp_packets / elapsed, (unsigned long long)total.udp_dropped);
+	if (after == NULL) return;
+
+	printf("server      pid %d, %llu tcp peers, RSS %.1f MB", (int)after->pid, (unsigned long long)after->peers, after->rss / 1e6);
+	if ((before != NULL) && (after->peers > before->peers))
+		printf(" (+%.1f KB per peer)", ((double)after->rss - before->rss) / (after->peers - before->peers) / 1024);
+	printf("\n");
+	if (before == NULL) return;
+	printf("server in   %llu handshakes, %.2f MB/s read, %.0f udp pps, %.2f MB/s into the tunnel\n",
+		(unsigned long long)(after->handshakes - before->handshakes), (after->read_bytes - before->read_bytes) / elapsed / 1e6,
+		(after->udp_packets - before->udp_packets) / elapsed, (after->tunnel_bytes - before->tunnel_bytes) / elapsed / 1e6);
+}
+
+static bool load_credentials() {
+	char priorities[1100];
+
+	if (psk != NULL) {
+		char *key = strchr(psk, ':');
+		if (key == NULL) {
+			fprintf(stderr, "-p wants identity:hexkey\n");
+			return false;
+		}
+		*key++ = 0;
+		gnutls_datum_t datum = { (unsigned char *)key, strlen(key) };
+		gnutls_psk_allocate_client_credentials(&psk_cred);
+		if (gnutls_psk_set_client_credentials(psk_cred, psk, &datum, GNUTLS_PSK_KEY_HEX) < 0) {
+			fprintf(stderr, "Bad PSK key\n");
+			return false;
+		}
+	}
+	if (cert_file != NULL) {
+		gnutls_certificate_allocate_credentials(&x509_cred);
+		if (gnutls_certificate_set_x509_key_file(x509_cred, cert_file, key_file, GNUTLS_X509_FMT_PEM) < 0) {
+			fprintf(stderr, "Can't load keypair %s %s\n", cert_file, key_file);
+			return false;
+		}
+	}
+	snprintf(priorities, sizeof(priorities), "%s", priority ? priority : psk ? "NORMAL:-KX-ALL:+ECDHE-PSK" : "NORMAL");
+	if (gnutls_priority_init(&prio, priorities, NULL) < 0) {
+		fprintf(stderr, "Bad priority string %s\n", priorities);
+		return false;
+	}
+	return true;
+}
+
+// every connection is an fd, take what the hard limit allows
+static void load_fd_limit() {
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) return;
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	if ((rlim_t)target + 32 > limit.rlim_cur) {
+		fprintf(stderr, "Warning: %d connections need more fds than the %llu allowed, holding %llu\n",
+			target, (unsigned long long)limit.rlim_cur, (unsigned long long)limit.rlim_cur - 32);
+		target = limit.rlim_cur - 32;
+	}
+}
+
+static void load_stop(int sig) {
+	stop = 1;
+}
+
+static void load_usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-s ip:port] [-c cert -k key] [-p id:hexkey] [-o priority] [-n conns] [-r rate]\n"
+		"\t[-l lifetime_ms] [-t timeout_s] [-T tls|dtls|data] [-m bytes] [-i interval_ms] [-e echo_ip]\n"
+		"\t[-u pps] [-U bytes] [-b sources] [-d duration_s] [-a admin_socket]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	char *addr = "127.0.0.1:65534", *echo_ip = NULL, *transport_name = "tls";
+	bool cert_given = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "s:c:k:p:o:n:r:l:t:T:m:i:e:u:U:b:d:a:")) != -1) {
+		switch(opt) {
+			case 's': addr = optarg; break;
+			case 'c': cert_file = optarg; cert_given = true; break;
+			case 'k': key_file = optarg; break;
+			case 'p': psk = optarg; break;
+			case 'o': priority = optarg; break;
+			case 'n': target = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'l': lifetime = atoi(optarg); break;
+			case 't': timeout = atoi(optarg); break;
+			case 'T': transport_name = optarg; break;
+			case 'm': message_size = atoi(optarg); break;
+			case 'i': message_interval = atoi(optarg); break;
+			case 'e': echo_ip = optarg; break;
+			case 'u': udp_rate = atoi(optarg); break;
+			case 'U': udp_size = atoi(optarg); break;
+			case 'b': sources = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'a': admin_path = optarg; break;
+			default:
+				load_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	char *port = strrchr(addr, ':');
+	if (port != NULL) *port++ = 0;
+	server.sin_port = htons(port ? atoi(port) : 65534);
+	if (strcmp(transport_name, "dtls") == 0) transport = LOAD_DTLS;
+	else if (strcmp(transport_name, "data") == 0) transport = LOAD_DATA;
+	else if (strcmp(transport_name, "tls") != 0) transport_name = NULL;
+	if (echo_ip != NULL) {
+		echo = (inet_pton(AF_INET, echo_ip, &echo_addr) == 1);
+		if (message_size == 0) message_size = 64;
+	}
+	if ((inet_pton(AF_INET, addr, &server.sin_addr) != 1) || (target < 1) || (target > 65535) || (rate < 0) || (lifetime < 0) ||
+			(timeout < 1) || (transport_name == NULL) || (message_size < 0) || (message_interval < 1) ||
+			((echo_ip != NULL) && (!echo || (message_size < LOAD_ECHO_MIN) || (message_size > LOAD_IP_MAX))) ||
+			((message_size % LOAD_IP_MAX != 0) && (message_size % LOAD_IP_MAX < 20)) ||
+			(udp_rate < 0) || (udp_size < 20) || (udp_size > LOAD_UDP_MAX) || ((udp_rate > 0) && (transport == LOAD_DTLS)) ||
+			(sources < 0) || (duration < 1)) {
+		load_usage(argv[0]);
+		return 1;
+	}
+	// with a PSK, a certificate only if asked for
+	if (psk && !cert_given) cert_file = NULL;
+	if (sources == 0) sources = target / LOAD_PORTS + 1;
+
+	if (gnutls_global_init() != GNUTLS_E_SUCCESS) {
+		fprintf(stderr, "Failed to initialize GnuTLS\n");
+		return 1;
+	}
+	if (!load_credentials()) return 1;
+	load_fd_limit();
+	if (message_size > 0) message = calloc(message_size, 1);
+
+	conns = array_new();
+	channels = array_new();
+	if (!network_loop_init()) return 1;
+
+	if ((udp_rate > 0) || (transport == LOAD_DATA)) {
+		udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if ((udp_fd == -1) || (connect(udp_fd, (struct sockaddr *)&server, sizeof(server)) == -1) ||
+				(network_register_fd(udp_fd, load_udp_read) == NULL)) {
+			perror("udp socket");
+			return 1;
+		}
+	}
+
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct itimerspec tick = { { 0, LOAD_TICK_NS }, { 0, LOAD_TICK_NS } };
+	if ((timer == -1) || (timerfd_settime(timer, 0, &tick, NULL) == -1) || (network_register_fd(timer, load_timer) == NULL)) {
+		perror("timerfd");
+		return 1;
+	}
+
+	struct load_server before, after;
+	bool have_before = load_server(&before);
+
+	signal(SIGINT, load_stop);
+	signal(SIGTERM, load_stop);
+	signal(SIGPIPE, SIG_IGN);
+	printf("%d %s connections to %s:%d at %d/s from %d source addresses, for %ds\n", target, transport_name, addr,
+		ntohs(server.sin_port), rate, sources, duration);
+
+	uint64_t start = network_now(), prev = start, second_start = start;
+	int second = 0;
+	while(!stop) {
+		network_sleep();
+		uint64_t now = network_now();
+		load_tick(now, now - prev);
+		prev = now;
+		if (now - second_start >= 1000000000) {
+			load_report_second(++second, (now - second_start) / 1e9);
+			second_start = now;
+		}
+		if (now - start >= (uint64_t)duration * 1000000000) break;
+	}
+	// no FIN on UDP: without a close_notify the daemon holds DTLS peers (and their tunnel addresses) until they time out
+	if (transport == LOAD_DTLS)
+		for(struct load_conn *conn = established.head; conn != NULL; conn = conn->next) gnutls_bye(conn->session, GNUTLS_SHUT_WR);
+
+	bool have_after = load_server(&after);
+	load_report((network_now() - start) / 1e9, have_before ? &before : NULL, have_after ? &after : NULL);
+	return 0;
+}
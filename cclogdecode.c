@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "log.h"
+
+/* cclogdecode : render a log_trace_file as text, oldest record first, in the
+ * same format as the text log.
+ *   cclogdecode trace_file */
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static const char *file_string(const void *map, size_t size, uint32_t offset) {
+	if (offset >= size) return "?";
+	if (memchr(map + offset, 0, size - offset) == NULL) return "?";
+	return map + offset;
+}
+
+// render one record, arguments are read back the way log_trace_call() stored them
+static void decode_record(const char *format, const struct log_trace_record *record, char *out, size_t size) {
+	const uint8_t *p = record->data, *end = record->data + (record->len < sizeof(record->data) ? record->len : sizeof(record->data));
+	size_t len = 0;
+
+	while((*format != 0) && (len + 1 < size)) {
+		if (*format != '%') {
+			out[len++] = *format++;
+			continue;
+		}
+
+		int cls;
+		const char *next = log_format_spec(format, &cls);
+		char spec[32];
+		int spec_len = next - format;
+		if ((cls < 0) || (spec_len >= (int)sizeof(spec))) break; // can't happen for a traced site
+		memcpy(spec, format, spec_len);
+		spec[spec_len] = 0;
+		format = next;
+
+		if (cls == 0) {
+			out[len++] = '%';
+			continue;
+		}
+
+		uint64_t value = 0;
+		double d;
+		char str[256];
+		int res;
+		if (cls == LOG_ARG_STR) {
+			int n = (p < end) ? *p++ : 0;
+			if (p + n > end) n = end - p;
+			memcpy(str, p, n);
+			str[n] = 0;
+			p += n;
+		} else if (p + 8 <= end) {
+			memcpy(&value, p, 8);
+			p += 8;
+		}
+
+		switch(cls) {
+			case LOG_ARG_INT: res = snprintf(out + len, size - len, spec, (int)value); break;
+			case LOG_ARG_LONG: res = snprintf(out + len, size - len, spec, (long)value); break;
+			case LOG_ARG_PTR: res = snprintf(out + len, size - len, spec, (void *)(uintptr_t)value); break;
+			case LOG_ARG_DOUBLE:
+				memcpy(&d, &value, sizeof(d));
+				res = snprintf(out + len, size - len, spec, d);
+				break;
+			default: res = snprintf(out + len, size - len, spec, str); break;
+		}
+		if (res < 0) break;
+		len += res;
+		if (len >= size) len = size - 1;
+	}
+	out[len] = 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct stat st;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s trace_file\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if ((fd == -1) || (fstat(fd, &st) == -1)) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	size_t size = st.st_size;
+	const void *map = (size >= sizeof(struct log_trace_header)) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: can't map trace file\n", argv[1]);
+		return 1;
+	}
+
+	const struct log_trace_header *header = map;
+	if ((memcmp(header->magic, LOG_TRACE_MAGIC, sizeof(header->magic)) != 0) ||
+	    (header->record_size != LOG_TRACE_RECORD_SIZE) || (header->records == 0) ||
+	    ((uint64_t)header->sites_offset + (uint64_t)header->sites * sizeof(struct log_trace_site) > size) ||
+	    ((uint64_t)header->ring_offset + (uint64_t)header->records * LOG_TRACE_RECORD_SIZE > size)) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		return 1;
+	}
+	const struct log_trace_site *sites = map + header->sites_offset;
+	const struct log_trace_record *ring = map + header->ring_offset;
+
+	// the daemon may still be writing, slots that don't hold the expected record are skipped
+	uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	uint64_t seq = (head > header->records) ? head - header->records : 0;
+	for(; seq < head; seq++) {
+		const struct log_trace_record *slot = &ring[seq % header->records];
+		struct log_trace_record copy;
+		const struct log_trace_record *record = &copy;
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1) continue;
+		memcpy(&copy, slot, sizeof(copy));
+		// rewritten while we copied it: its seq went to 0 first
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1) continue;
+		if (record->site >= header->sites) continue;
+
+		const struct log_trace_site *site = &sites[record->site];
+		char text[1024], date[32];
+		struct tm tm;
+		time_t sec = record->ts / 1000000000;
+
+		decode_record(file_string(map, size, site->format), record, text, sizeof(text));
+		localtime_r(&sec, &tm);
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+		printf("%s.%06ld %-5s %s\n", date, (long)(record->ts % 1000000000) / 1000,
+			site->level < 4 ? level_names[site->level] : "?", text);
+	}
+	return 0;
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+
+/* ccnetem : packet loss and delay on a loopback path, for benchmarks where
+ * the netem qdisc isn't there (containers without sch_netem).
+ *   ccnetem [options]
+ *   -a ip          address of the device, its second byte even (10.76.0.1)
+ *   -n name        TUN device (ccnetem0)
+ *   -l percent     packets dropped, each way (0)
+ *   -d ms          delay added each way (0)
+ *   -q packets     delayed packets held at most, more wait in the device (4096)
+ * The device gets the address as a /15: the other half of it, the second byte
+ * odd (10.77.x.y), is only reachable through the device. Every packet read is
+ * mirrored back to the kernel with the second byte of both addresses flipped,
+ * so 10.76.0.1 -> 10.77.0.1 arrives as 10.77.0.1 -> 10.76.0.1. A daemon bound
+ * to 0.0.0.0 (or the device address) sees clients connecting to 10.77.0.1 as
+ * coming from there, and both directions go through the loss and the delay.
+ * Swapping a bit between source and destination leaves every checksum right.
+ * Prints what it did every second. */
+
+#define NETEM_MTU 1500
+#define NETEM_PACKET_MAX 2048
+
+struct netem_packet {
+	uint64_t due; // ns, CLOCK_MONOTONIC
+	size_t len;
+	uint8_t data[NETEM_PACKET_MAX];
+};
+
+static char *device_name = "ccnetem0";
+static struct in_addr address;
+static double loss = 0;
+static int delay = 0, queue_max = 4096;
+
+static struct netem_packet *queue; // ring, in due order since the delay is the same for all
+static int queue_head, queue_count;
+static uint64_t passed, lost, queue_full, ignored;
+static volatile sig_atomic_t stop;
+
+static uint64_t netem_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 10.76.x.y <-> 10.77.x.y for both addresses, false for anything else
+static bool netem_mirror(uint8_t *pkt, size_t len) {
+	uint8_t b = ((uint8_t *)&address)[1];
+
+	if ((len < 20) || ((pkt[0] >> 4) != 4)) return false;
+	uint8_t *src = pkt + 12, *dst = pkt + 16;
+	if ((src[0] != dst[0]) || ((src[1] & ~1) != b) || ((dst[1] & ~1) != b) || (src[1] == dst[1])) return false;
+	src[1] ^= 1;
+	dst[1] ^= 1;
+	return true;
+}
+
+static void netem_write(int fd, const uint8_t *pkt, size_t len) {
+	if (write(fd, pkt, len) == (ssize_t)len) passed++;
+	else queue_full++;
+}
+
+static void netem_read(int fd) {
+	while(queue_count < queue_max) {
+		struct netem_packet *p = &queue[(queue_head + queue_count) % queue_max];
+		ssize_t len = read(fd, p->data, sizeof(p->data));
+		if (len <= 0) return;
+		if (!netem_mirror(p->data, len)) {
+			ignored++;
+			continue;
+		}
+		if (random() < loss / 100 * RAND_MAX) {
+			lost++;
+			continue;
+		}
+		if (delay == 0) {
+			netem_write(fd, p->data, len);
+			continue;
+		}
+		p->len = len;
+		p->due = netem_now() + (uint64_t)delay * 1000000;
+		queue_count++;
+	}
+	// the delay line is full, the rest waits in the device's own queue, or is dropped by it
+}
+
+// what is due goes out, returns the poll() timeout until the next one
+static int netem_release(int fd) {
+	uint64_t now = netem_now();
+
+	while(queue_count > 0) {
+		struct netem_packet *p = &queue[queue_head];
+		if (p->due > now) return (p->due - now + 999999) / 1000000;
+		netem_write(fd, p->data, p->len);
+		queue_head = (queue_head + 1) % queue_max;
+		queue_count--;
+	}
+	return 1000;
+}
+
+static bool netem_device(int *tun) {
+	struct ifreq ifr;
+
+	int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		perror("/dev/net/tun");
+		return false;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", device_name);
+	if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+		perror(device_name);
+		close(fd);
+		return false;
+	}
+
+	int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
+	bool ok = (s != -1);
+	ifr.ifr_mtu = NETEM_MTU;
+	if (ok) ok = ioctl(s, SIOCSIFMTU, &ifr) != -1;
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr = address;
+	if (ok) ok = ioctl(s, SIOCSIFADDR, &ifr) != -1;
+	sin->sin_addr.s_addr = htonl(0xfffe0000);
+	if (ok) ok = ioctl(s, SIOCSIFNETMASK, &ifr) != -1;
+	if (ok) ok = ioctl(s, SIOCGIFFLAGS, &ifr) != -1;
+	ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+	if (ok) ok = ioctl(s, SIOCSIFFLAGS, &ifr) != -1;
+	if (!ok) perror(device_name);
+	if (s != -1) close(s);
+	if (!ok) {
+		close(fd);
+		return false;
+	}
+	*tun = fd;
+	return true;
+}
+
+static void netem_stop(int sig) {
+	stop = 1;
+}
+
+static void netem_usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-a ip] [-n device] [-l loss_percent] [-d delay_ms] [-q packets]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	char *addr = "10.76.0.1";
+	int opt, fd;
+
+	while((opt = getopt(argc, argv, "a:n:l:d:q:")) != -1) {
+		switch(opt) {
+			case 'a': addr = optarg; break;
+			case 'n': device_name = optarg; break;
+			case 'l': loss = atof(optarg); break;
+			case 'd': delay = atoi(optarg); break;
+			case 'q': queue_max = atoi(optarg); break;
+			default:
+				netem_usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((inet_pton(AF_INET, addr, &address) != 1) || (((uint8_t *)&address)[1] & 1) ||
+			(loss < 0) || (loss > 100) || (delay < 0) || (queue_max < 1)) {
+		netem_usage(argv[0]);
+		return 1;
+	}
+	queue = calloc(queue_max, sizeof(struct netem_packet));
+	if ((queue == NULL) || !netem_device(&fd)) return 1;
+
+	uint8_t *a = (uint8_t *)&address;
+	printf("%s: %s/15, %d.%d.x.y through it, %.2f%% loss and %dms delay each way\n",
+		device_name, addr, a[0], a[1] | 1, loss, delay);
+	fflush(stdout);
+	srandom(netem_now());
+	signal(SIGINT, netem_stop);
+	signal(SIGTERM, netem_stop);
+
+	uint64_t last = netem_now(), last_passed = 0, last_lost = 0;
+	while(!stop) {
+		struct pollfd pfd = { fd, queue_count < queue_max ? POLLIN : 0, 0 };
+		int timeout = netem_release(fd);
+		if ((poll(&pfd, 1, timeout) == -1) && (errno != EINTR)) {
+			perror("poll");
+			return 1;
+		}
+		if (pfd.revents & POLLIN) netem_read(fd);
+		netem_release(fd);
+
+		uint64_t now = netem_now();
+		if (now - last < 1000000000) continue;
+		if (passed != last_passed || lost != last_lost) {
+			printf("passed %llu (+%llu)  lost %llu (+%llu)  queue full %llu  ignored %llu\n",
+				(unsigned long long)passed, (unsigned long long)(passed - last_passed),
+				(unsigned long long)lost, (unsigned long long)(lost - last_lost),
+				(unsigned long long)queue_full, (unsigned long long)ignored);
+			fflush(stdout);
+		}
+		last = now;
+		last_passed = passed;
+		last_lost = lost;
+	}
+	return 0;
+}
@@ -0,0 +1,855 @@
+#include <gnutls/gnutls.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ssl.h"
+#include "network.h"
+#include "cfg_files.h"
+#include "tunnel.h"
+
+/* cctest : checks for what the daemon relies on, run by make check
+ *   cctest [name...]    the named checks, or all of them
+ *   cctest egress       one packet queued for two peers comes out once for
+ *                       each, in order with the rest of their queues
+ *   cctest roam         a data channel peer moves from 127.0.0.1 to
+ *                       127.0.0.2 and replies follow it, forged, replayed and
+ *                       delayed datagrams from 127.0.0.3 don't move it
+ *   cctest config       a config file full of quotes, escapes, hex codes,
+ *                       comments, an import and long lines parses to what
+ *                       the line by line rules of the old parser gave
+ *   cctest config_index registered, repeated, array and required variables
+ *                       are found by name, a required one may come from an
+ *                       import, one missing fails the parse and a reload
+ *   cctest config_cache a reload from the snapshot gives what the parse did,
+ *                       a changed import, other registered variables or a
+ *                       damaged snapshot make it parse again
+ *   cctest tunnel       through a TUN device (cctest0, 10.98.0.0/24, needs
+ *                       root, skipped without): peers only send from their
+ *                       tunnel_peers_file prefixes, control packets (small,
+ *                       ICMP, TCP without payload) overtake bulk ones
+ * Prints a line per check, exits 1 if any failed. */
+
+#define TEST_FAIL(...) do { printf("FAIL %s: ", test_name); printf(__VA_ARGS__); printf("\n"); return false; } while(0)
+#define TEST_SKIP(...) do { printf("skip %s: ", test_name); printf(__VA_ARGS__); printf("\n"); test_skipped = true; return true; } while(0)
+
+static const char *test_name;
+static bool test_skipped;
+
+// ssl_data.c and tunnel.c read it, cctest is never pre-forked
+int core_worker = -1;
+
+static struct packet *test_packet(uint8_t tag) {
+	struct packet *pkt = packet_alloc();
+	if (pkt != NULL) memset(packet_put(pkt, 100), tag, 100);
+	return pkt;
+}
+
+/* a forwarded packet can be queued for more than one peer, each queue holds
+ * its own reference: neither may see the other's packets */
+static bool test_egress() {
+	static struct network_connection a, b;
+	struct network_connection *nets[16];
+	struct packet *pkts[16];
+	struct packet *shared = test_packet(1), *only_a = test_packet(2), *only_b = test_packet(3);
+
+	if ((shared == NULL) || (only_a == NULL) || (only_b == NULL)) TEST_FAIL("no packet buffers");
+	network_egress_queue(&a, packet_ref(shared), false);
+	network_egress_queue(&b, shared, false);
+	network_egress_queue(&a, only_a, false);
+	network_egress_queue(&b, only_b, false);
+
+	int n = network_egress_dequeue(nets, pkts, 16, 0);
+	int seen_a = 0, seen_b = 0;
+	for(int i = 0; i < n; i++) {
+		uint8_t tag = packet_data(pkts[i])[0];
+		if (nets[i] == &a) {
+			// round robin between the peers, each one's own order kept
+			if (tag != (seen_a ? 2 : 1)) TEST_FAIL("peer a got packet %d as its #%d", tag, seen_a + 1);
+			seen_a++;
+		} else if (nets[i] == &b) {
+			if (tag != (seen_b ? 3 : 1)) TEST_FAIL("peer b got packet %d as its #%d", tag, seen_b + 1);
+			seen_b++;
+		} else {
+			TEST_FAIL("packet for a peer that queued nothing");
+		}
+		packet_unref(pkts[i]);
+	}
+	if ((seen_a != 2) || (seen_b != 2)) TEST_FAIL("%d packets out for a, %d for b, expected 2 each", seen_a, seen_b);
+	if (network_egress_dequeue(nets, pkts, 16, 0) != 0) TEST_FAIL("queues not empty once drained");
+
+	// a queue that grows while it wraps around keeps its order
+	for(int in = 0, out = 0; out < 200; ) {
+		for(int i = 0; (i < 5) && (in < 200); i++, in++) network_egress_queue(&a, test_packet(in), false);
+		n = network_egress_dequeue(nets, pkts, 3, 0);
+		if (n == 0) TEST_FAIL("stuck after %d of 200 packets", out);
+		for(int i = 0; i < n; i++, out++) {
+			if (packet_data(pkts[i])[0] != out) TEST_FAIL("packet %d out as #%d", packet_data(pkts[i])[0], out);
+			packet_unref(pkts[i]);
+		}
+	}
+	network_egress_free(&a);
+	network_egress_free(&b);
+	return true;
+}
+
+// one direction of an in-memory TLS connection
+struct test_pipe {
+	uint8_t buf[65536];
+	size_t len;
+};
+
+struct test_end {
+	gnutls_session_t session;
+	struct test_pipe *in, *out;
+};
+
+static ssize_t test_push(gnutls_transport_ptr_t ptr, const void *buf, size_t size) {
+	struct test_end *end = ptr;
+	if (end->out->len + size > sizeof(end->out->buf)) {
+		gnutls_transport_set_errno(end->session, EAGAIN);
+		return -1;
+	}
+	memcpy(end->out->buf + end->out->len, buf, size);
+	end->out->len += size;
+	return size;
+}
+
+static ssize_t test_pull(gnutls_transport_ptr_t ptr, void *buf, size_t size) {
+	struct test_end *end = ptr;
+	if (end->in->len == 0) {
+		gnutls_transport_set_errno(end->session, EAGAIN);
+		return -1;
+	}
+	if (size > end->in->len) size = end->in->len;
+	memcpy(buf, end->in->buf, size);
+	memmove(end->in->buf, end->in->buf + size, end->in->len - size);
+	end->in->len -= size;
+	return size;
+}
+
+static int test_psk_callback(gnutls_session_t session, const char *username, gnutls_datum_t *key) {
+	key->data = gnutls_calloc(32, 1);
+	key->size = 32;
+	return 0;
+}
+
+// a PSK handshake between two sessions in memory, the data channel keys come from it
+static bool test_tls_pair(struct test_end *server, struct test_end *client) {
+	static struct test_pipe c2s, s2c;
+	static gnutls_psk_server_credentials_t server_psk;
+	static gnutls_psk_client_credentials_t client_psk;
+	uint8_t zero[32] = { 0 };
+	gnutls_datum_t key = { zero, sizeof(zero) };
+
+	gnutls_psk_allocate_server_credentials(&server_psk);
+	gnutls_psk_set_server_credentials_function(server_psk, test_psk_callback);
+	gnutls_psk_allocate_client_credentials(&client_psk);
+	gnutls_psk_set_client_credentials(client_psk, "cctest", &key, GNUTLS_PSK_KEY_RAW);
+
+	struct test_end *ends[2] = { server, client };
+	for(int i = 0; i < 2; i++) {
+		struct test_end *end = ends[i];
+		end->in = i ? &s2c : &c2s;
+		end->out = i ? &c2s : &s2c;
+		gnutls_init(&end->session, (i ? GNUTLS_CLIENT : GNUTLS_SERVER) | GNUTLS_NONBLOCK);
+		gnutls_priority_set_direct(end->session, "NORMAL:-KX-ALL:+ECDHE-PSK", NULL);
+		if (i) gnutls_credentials_set(end->session, GNUTLS_CRD_PSK, client_psk);
+		else gnutls_credentials_set(end->session, GNUTLS_CRD_PSK, server_psk);
+		gnutls_transport_set_ptr(end->session, end);
+		gnutls_transport_set_push_function(end->session, test_push);
+		gnutls_transport_set_pull_function(end->session, test_pull);
+	}
+
+	bool server_done = false, client_done = false;
+	for(int rounds = 0; (rounds < 100) && (!server_done || !client_done); rounds++) {
+		int ret;
+		if (!client_done) {
+			ret = gnutls_handshake(client->session);
+			if (ret == 0) client_done = true;
+			else if (gnutls_error_is_fatal(ret)) return false;
+		}
+		if (!server_done) {
+			ret = gnutls_handshake(server->session);
+			if (ret == 0) server_done = true;
+			else if (gnutls_error_is_fatal(ret)) return false;
+		}
+	}
+	return server_done && client_done;
+}
+
+static int test_udp_socket(const char *ip, int port) {
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	struct timeval tv = { 1, 0 };
+
+	inet_pton(AF_INET, ip, &addr.sin_addr);
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// the daemon's side: the next datagram on the endpoint, as network_udp_read() hands it over
+static bool test_endpoint_input(struct network_connection *endpoint) {
+	uint8_t buf[2048];
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+
+	ssize_t len = recvfrom(endpoint->fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addr_len);
+	if (len <= 0) return false;
+	return ssl_data_input(endpoint, (struct sockaddr *)&addr, addr_len, buf, len, NULL);
+}
+
+// a reply from the daemon's side, true if it reached fd and not the others
+static bool test_reply_at(struct network_connection *net, int fd, int *fds, int count) {
+	uint8_t buf[2048];
+
+	if (!ssl_data_send(net, "reply", 5)) return false;
+	for(int i = 0; i < count; i++) {
+		ssize_t len = recv(fds[i], buf, sizeof(buf), (fds[i] == fd) ? 0 : MSG_DONTWAIT);
+		if ((fds[i] == fd) != (len > 0)) return false;
+	}
+	return true;
+}
+
+/* the channel id finds the peer whatever its address: the first datagram
+ * that authenticates and is the newest so far moves it, nothing else does */
+static bool test_roam() {
+	static struct network_connection net, endpoint;
+	static struct ssl_context ctx;
+	struct ssl_data_channel client;
+	struct test_end server_end, client_end;
+	struct sockaddr_in to = { .sin_family = AF_INET };
+	uint8_t sealed[4][64];
+	size_t sealed_len[4];
+	socklen_t to_len = sizeof(to);
+
+	if (config_set_value(CONFIG_CORE, "ssl_data_channel", "1") != 0) TEST_FAIL("can't set ssl_data_channel");
+	if (!test_tls_pair(&server_end, &client_end)) TEST_FAIL("TLS handshake failed");
+	ctx.session = server_end.session;
+	net.ssl_ctx = &ctx;
+	if (!ssl_data_setup(&net) || (ctx.data == NULL)) TEST_FAIL("no data channel on the server side");
+	if (!ssl_data_derive(&client, client_end.session, false)) TEST_FAIL("no data channel on the client side");
+
+	endpoint.fd = test_udp_socket("127.0.0.1", 0);
+	int fds[3] = { test_udp_socket("127.0.0.1", 0), test_udp_socket("127.0.0.2", 0), test_udp_socket("127.0.0.3", 0) };
+	if ((endpoint.fd == -1) || (fds[0] == -1) || (fds[1] == -1) || (fds[2] == -1)) TEST_FAIL("can't bind 127.0.0.1-3: %s", strerror(errno));
+	getsockname(endpoint.fd, (struct sockaddr *)&to, &to_len);
+	for(int i = 0; i < 4; i++) sealed_len[i] = ssl_data_seal(&client, "ping", 4, sealed[i]);
+
+	// up from .1, replies go there
+	sendto(fds[0], sealed[0], sealed_len[0], 0, (struct sockaddr *)&to, to_len);
+	if (!test_endpoint_input(&endpoint) || (ctx.data->endpoint == NULL)) TEST_FAIL("first datagram didn't open the channel");
+	if (!test_reply_at(&net, fds[0], fds, 3)) TEST_FAIL("reply didn't reach 127.0.0.1 alone");
+
+	// the next one from .2: replies follow, no handshake
+	uint64_t roams = ssl_data_stats.roams;
+	sendto(fds[1], sealed[1], sealed_len[1], 0, (struct sockaddr *)&to, to_len);
+	test_endpoint_input(&endpoint);
+	if (ssl_data_stats.roams != roams + 1) TEST_FAIL("peer didn't move to 127.0.0.2");
+	if (!test_reply_at(&net, fds[1], fds, 3)) TEST_FAIL("reply didn't follow to 127.0.0.2");
+
+	uint64_t bad = ssl_data_stats.rx_bad, replayed = ssl_data_stats.rx_replayed;
+	// forged: the channel id and a new counter, but not the key
+	uint8_t forged[64];
+	memcpy(forged, sealed[3], sealed_len[3]);
+	forged[sealed_len[3] - 1] ^= 1;
+	sendto(fds[2], forged, sealed_len[3], 0, (struct sockaddr *)&to, to_len);
+	test_endpoint_input(&endpoint);
+	// replayed: an authentic datagram, seen before
+	sendto(fds[2], sealed[1], sealed_len[1], 0, (struct sockaddr *)&to, to_len);
+	test_endpoint_input(&endpoint);
+	if ((ssl_data_stats.rx_bad != bad + 1) || (ssl_data_stats.rx_replayed != replayed + 1)) TEST_FAIL("forged or replayed datagram not dropped as such");
+	if (ssl_data_stats.roams != roams + 1) TEST_FAIL("a forged or replayed datagram moved the peer");
+	if (!test_reply_at(&net, fds[1], fds, 3)) TEST_FAIL("reply went elsewhere after a forged or replayed datagram");
+
+	// delayed: authentic and never seen, but older than the newest
+	sendto(fds[1], sealed[3], sealed_len[3], 0, (struct sockaddr *)&to, to_len);
+	test_endpoint_input(&endpoint);
+	sendto(fds[2], sealed[2], sealed_len[2], 0, (struct sockaddr *)&to, to_len);
+	test_endpoint_input(&endpoint);
+	if (ssl_data_stats.roams != roams + 1) TEST_FAIL("a delayed datagram dragged the peer back");
+	if (!test_reply_at(&net, fds[1], fds, 3)) TEST_FAIL("reply went elsewhere after a delayed datagram");
+	if (ssl_data_stats.rx_packets != 4) TEST_FAIL("%llu datagrams accepted, expected 4", (unsigned long long)ssl_data_stats.rx_packets);
+
+	ssl_data_close(&ctx);
+	ssl_data_free(&client);
+	for(int i = 0; i < 3; i++) close(fds[i]);
+	close(endpoint.fd);
+	return true;
+}
+
+/* the config parser before it tokenized the mapped file in one pass, the
+ * reference for what each line gives. Lines are taken whole here, it cut
+ * them at 1024 bytes. */
+#define TEST_LINE_MAX 16384
+
+static void test_old_clean_name(char *str) {
+	int i,j;
+	char start=1;
+	for (i=0; i<TEST_LINE_MAX && str[i]; i++) {
+		if (start && str[i]==32) {
+			str[i]=1;
+		} else {
+			start=0;
+		}
+		if (str[i]<32) {
+			for (j=i;j<TEST_LINE_MAX && str[j];j++) str[j]=str[j+1];
+			i--;
+			continue;
+		} else if(str[i]==32) {
+			str[i]='_';
+			continue;
+		}
+		if ( (str[i]>='A') && (str[i]<='Z')) str[i]=str[i]+32;
+	}
+	for(i--; i>0; i--) {
+		if(str[i]!='_') break;
+		str[i]=0;
+	}
+}
+
+static void test_old_clean_value(char *str) {
+	int i=0,j=0;
+	int inquote=0,quoteisdouble=0,wasinquote=0;
+	int lastwasspace=1;
+
+	for(i=0;i<TEST_LINE_MAX && str[i];i++) {
+		if (str[i]<32) str[i]=32;
+		if (lastwasspace && str[i]==32) {
+			for(j=i;j<TEST_LINE_MAX && str[j];j++) str[j]=str[j+1];
+			i--;
+			continue;
+		}
+		lastwasspace=(str[i]==32 && !inquote);
+		wasinquote=inquote;
+		if ((str[i]==34) || (str[i]==39)) {
+			if (!inquote || (quoteisdouble && str[i]==34) || (!quoteisdouble && str[i]==39)) {
+				inquote=1-inquote;
+				if (inquote) {
+					quoteisdouble=(str[i]==34);
+				} else {
+					lastwasspace=1;
+				}
+				for(j=i;j<TEST_LINE_MAX && str[j];j++) str[j]=str[j+1];
+				i--;
+				continue;
+			}
+		}
+		if (inquote && str[i]==92) {
+			if (quoteisdouble) {
+				if (str[i+1]=='a') str[i+1]=7;
+				if (str[i+1]=='b') str[i+1]=8;
+				if (str[i+1]=='t') str[i+1]=9;
+				if (str[i+1]=='n') str[i+1]=10;
+				if (str[i+1]=='v') str[i+1]=11;
+				if (str[i+1]=='f') str[i+1]=12;
+				if (str[i+1]=='r') str[i+1]=13;
+			}
+			if ( ((str[i+1]>=7) && (str[i+1]<=13)) || str[i+1]==92 || str[i+1]==34 || str[i+1]==39) {
+				for(j=i;j<TEST_LINE_MAX && str[j];j++) str[j]=str[j+1];
+				continue;
+			}
+			if (!quoteisdouble) continue;
+			if (str[i+1]=='x') {
+				/* Hexadecimal code */
+				if ( (str[i+2]>=48) && (str[i+2]<=57)) {
+					j=str[i+2]-48;
+				} else if ( (str[i+2]>=97) && (str[i+2]<=102)) {
+					j=str[i+2]-87;
+				} else if ( (str[i+2]>=65) && (str[i+2]<=70)) {
+					j=str[i+2]-55;
+				} else continue;
+				j=j*16;
+				if ((str[i+3]>=48) && (str[i+3]<=57)) {
+					j=j+(str[i+3]-48);
+				} else if ( (str[i+3]>=97) && (str[i+3]<=102)) {
+					j=j+(str[i+3]-87);
+				} else if ( (str[i+3]>=65) && (str[i+3]<=70)) {
+					j=j+(str[i+3]-55);
+				} else continue;
+				str[i]=j;
+				for(j=i+1;j<TEST_LINE_MAX && str[j];j++) str[j]=str[j+3];
+			}
+		}
+	}
+	if (!wasinquote && lastwasspace) for(i--;i>0;i--) {
+		if (str[i]!=' ') break;
+		str[i]=0;
+	}
+}
+
+// false for comments and lines without a value
+static bool test_old_parse_line(const char *line, char *w1, char *w2) {
+	int i=0,j=0;
+
+	if ((line[0]=='/') && (line[1]=='/')) return false;
+	if (line[0]==';') return false;
+	w1[0]=0;
+	w2[0]=0;
+	for(i=0;i<TEST_LINE_MAX;i++) {
+		if (!line[i]) break;
+		if (!j) {
+			if ((line[i]==34) || (line[i]==39)) {
+				w1[i]=0;
+				j=i;
+				i--;
+			} else if ((line[i]!=':') && (line[i]!='=')) {
+				w1[i]=line[i];
+			} else {
+				w1[i]=0;
+				j=i+1;
+			}
+		} else {
+			w2[i-j]=line[i];
+		}
+	}
+	if (!j) return false;
+	w2[i-j]=0;
+	test_old_clean_name(w1);
+	test_old_clean_value(w2);
+	return true;
+}
+
+struct test_config_entry {
+	char name[TEST_LINE_MAX], value[TEST_LINE_MAX];
+};
+
+// what the old parser gave for a file and its imports, in order
+static int test_old_parse_file(const char *filename, struct test_config_entry *out, int max) {
+	static char line[TEST_LINE_MAX];
+	int count = 0;
+	FILE *fp = fopen(filename, "r");
+
+	if (fp == NULL) return 0;
+	while((count < max) && fgets(line, sizeof(line), fp)) {
+		struct test_config_entry *entry = &out[count];
+		if (!test_old_parse_line(line, entry->name, entry->value)) continue;
+		if (strcmp(entry->name, "import") == 0) {
+			char *imported = strdup(entry->value);
+			count += test_old_parse_file(imported, out + count, max - count);
+			free(imported);
+			continue;
+		}
+		count++;
+	}
+	fclose(fp);
+	return count;
+}
+
+static bool test_write_file(char *path, const char **lines, int count) {
+	int fd = mkstemp(path);
+	if (fd == -1) return false;
+	FILE *fp = fdopen(fd, "w");
+	for(int i = 0; i < count; i++) fprintf(fp, "%s\n", lines[i]);
+	return fclose(fp) == 0;
+}
+
+/* every line as the old rules read it: the name index merges names seen
+ * twice, so each line of the fixture has a name of its own */
+static bool test_config() {
+	static char main_file[] = "/tmp/cctest.conf.XXXXXX", imported_file[] = "/tmp/cctest.import.XXXXXX";
+	static char import_line[64], long_line[6000], long_name[3000];
+	static struct test_config_entry expected[64];
+	const char *imported[] = {
+		"imported = from the other file",
+		"Imported Tab\t:\t\"a\\tb\"  ",
+	};
+	const char *lines[] = {
+		"# no comment syntax: a variable named #_no_comment_syntax",
+		"// comment",
+		"; comment",
+		"",
+		"no value on this line",
+		"plain = value",
+		"   Spaced   Out  Name   =    spaced    out    value    ",
+		"TABS\tand\tCTRL\x01:\tvalue\twith\ttabs\t\r",
+		"dq = \"  kept  as  is  \"",
+		"sq = '  single  \\n  quotes  '",
+		"mixed = a \"b  c\" 'd  e'   f  ",
+		"escapes = \"\\a\\b\\t\\n\\v\\f\\r\\\\\\\"\\'\\z\"",
+		"sq_escapes = '\\\\ \\' \\\" \\n \\x41'",
+		"hex = \"\\x41\\x62\\x7E\\x7e\\xzz\\x4\\x4g\"",
+		"hex_nul = \"abc\\x00def\"",
+		"hex_end = \"\\x4",
+		"escape_end = \"abc\\",
+		"quote\"starts the value\" after",
+		"quote_single'starts too'",
+		"colon: a=b:c",
+		"equals = a:b=c",
+		"open_quote = \"never   closed   ",
+		"open_single = it's",
+		"utf8 = caf\xc3\xa9 \xe2\x82\xac 8 bit",
+		"utf8_name_\xc3\xa9 = x",
+		"empty =",
+		"spaces_only =     ",
+		"trailing__ = x",
+		"__ = underscores only",
+		"quoted_spaces = \"   \"",
+		import_line,
+		long_line,
+		long_name,
+		"last = no newline after the import",
+	};
+	int count = sizeof(lines) / sizeof(lines[0]);
+	char *p = long_line;
+
+	// thousands of bytes of the above, quoted, escaped and not
+	p += sprintf(p, "long = ");
+	while(p - long_line < (int)sizeof(long_line) - 64) p += sprintf(p, "ab  \"c  \\x41\\t\" 'd  \\' e'  \t");
+	p = long_name;
+	while(p - long_name < (int)sizeof(long_name) - 32) p += sprintf(p, "Long Name ");
+	sprintf(p, "= long name's value");
+
+	if (!test_write_file(imported_file, imported, 2)) TEST_FAIL("can't write %s: %s", imported_file, strerror(errno));
+	snprintf(import_line, sizeof(import_line), "import = %s", imported_file);
+	bool ok = test_write_file(main_file, lines, count);
+	int expected_count = ok ? test_old_parse_file(main_file, expected, 64) : 0;
+	ok = ok && (config_add(main_file, 1) == 0) && config_parse(1);
+	unlink(main_file);
+	unlink(imported_file);
+	if (!ok) TEST_FAIL("fixture didn't parse");
+
+	struct conf_entry *entry = config_file[1].first;
+	for(int i = 0; i < expected_count; i++, entry = entry->next) {
+		if (entry == NULL) TEST_FAIL("%d entries, the old rules give %d", i, expected_count);
+		if (strcmp(entry->param_name, expected[i].name) != 0) TEST_FAIL("entry %d named \"%s\", expected \"%s\"", i + 1, entry->param_name, expected[i].name);
+		if (strcmp(entry->save_pointer, expected[i].value) != 0) TEST_FAIL("%s is \"%s\", expected \"%s\"", entry->param_name, (char *)entry->save_pointer, expected[i].value);
+	}
+	if (entry != NULL) TEST_FAIL("more entries than the old rules give (%d)", expected_count);
+	if (expected_count < 20) TEST_FAIL("only %d entries, the fixture lost lines", expected_count);
+	return true;
+}
+
+static bool test_rewrite_file(const char *path, const char **lines, int count) {
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) return false;
+	for(int i = 0; i < count; i++) fprintf(fp, "%s\n", lines[i]);
+	return fclose(fp) == 0;
+}
+
+/* the name index and the required bitmap: 64 required variables, the last
+ * bit only set by an import, names seen more than once */
+static bool test_config_index() {
+	static char main_file[] = "/tmp/cctest.conf.XXXXXX", imported_file[] = "/tmp/cctest.import.XXXXXX";
+	static char names[CONF_MAX_REQUIRED][8], values[CONF_MAX_REQUIRED][16], import_line[64];
+	static int required[CONF_MAX_REQUIRED], dup;
+	static char *opt;
+	const char *lines[CONF_MAX_REQUIRED + 16];
+	const char *imported[] = { "R63 = 63" };
+	char buf[64];
+	int count = 0;
+
+	int fd = mkstemp(main_file);
+	if (fd != -1) close(fd);
+	if ((fd == -1) || !test_write_file(imported_file, imported, 1)) TEST_FAIL("can't write the fixture: %s", strerror(errno));
+	snprintf(import_line, sizeof(import_line), "import = %s", imported_file);
+	if (config_add(main_file, 2) != 0) TEST_FAIL("can't add %s", main_file);
+	// variables belong to a file, registered before it is parsed
+	for(int i = 0; i < CONF_MAX_REQUIRED; i++) {
+		snprintf(names[i], sizeof(names[i]), "r%d", i);
+		snprintf(values[i], sizeof(values[i]), "r%d = %d", i, i);
+		if (config_add_var(2, names[i], &required[i], CONF_VAR_INT, 0, 0, true) != 0) TEST_FAIL("can't register %s", names[i]);
+	}
+	config_add_var(2, "dup", &dup, CONF_VAR_INT, 0, 0, false);
+	config_add_var(2, "opt", &opt, CONF_VAR_STRING_POINTER, 1, 64, false);
+
+	// r63 only in the import, r40 missing: the parse fails
+	for(int i = 0; i < CONF_MAX_REQUIRED - 1; i++)
+		if (i != 40) lines[count++] = values[i];
+	lines[count++] = import_line;
+	bool ok = test_rewrite_file(main_file, lines, count) && !config_parse(2);
+	if (!ok) TEST_FAIL("parsed without r40");
+
+	const char *more[] = {
+		"dup = 1", "DUP = 2",
+		"opt = first", "opt = second",
+		"extra = a", "extra = b",
+		"array = list", "list = one", "list = two",
+		"r40 = 40",
+	};
+	for(size_t i = 0; i < sizeof(more) / sizeof(more[0]); i++) lines[count++] = more[i];
+	if (!test_rewrite_file(main_file, lines, count) || !config_parse(2)) TEST_FAIL("didn't parse with every required variable");
+	for(int i = 0; i < CONF_MAX_REQUIRED; i++)
+		if (required[i] != i) TEST_FAIL("%s is %d", names[i], required[i]);
+	if ((dup != 2) || (opt == NULL) || (strcmp(opt, "second") != 0)) TEST_FAIL("a variable set twice doesn't have the last value");
+	if ((config_get_value(2, "dup", buf, sizeof(buf)) != 0) || (strcmp(buf, "2") != 0)) TEST_FAIL("config_get_value(dup) gave %s", buf);
+	const char *extra = config_get_entry(2, "extra", 0);
+	if ((extra == NULL) || (strcmp(extra, "b") != 0) || (config_get_entry(2, "extra", 1) != NULL)) TEST_FAIL("unregistered extra isn't b alone");
+	const char *one = config_get_entry(2, "list", 0), *two = config_get_entry(2, "list", 1);
+	if ((one == NULL) || (two == NULL) || strcmp(one, "one") || strcmp(two, "two") || config_get_entry(2, "list", 2)) TEST_FAIL("array list isn't one, two");
+
+	// a reload drops what the file doesn't set anymore, a failed one keeps the registered values
+	count = 0;
+	for(int i = 0; i < CONF_MAX_REQUIRED - 1; i++) lines[count++] = values[i];
+	lines[count++] = "array = list";
+	lines[count++] = "list = three";
+	if (!test_rewrite_file(main_file, lines, count) || config_reload(2)) TEST_FAIL("reloaded without r63");
+	if (required[40] != 40) TEST_FAIL("a failed reload changed r40");
+	lines[count++] = import_line;
+	if (!test_rewrite_file(main_file, lines, count) || !config_reload(2)) TEST_FAIL("didn't reload");
+	const char *three = config_get_entry(2, "list", 0);
+	if ((three == NULL) || strcmp(three, "three") || config_get_entry(2, "list", 1)) TEST_FAIL("array list isn't three after the reload");
+	if (config_get_entry(2, "extra", 0) != NULL) TEST_FAIL("extra still there after the reload");
+	if (dup != 2) TEST_FAIL("registered dup lost its value in the reload");
+
+	unlink(main_file);
+	unlink(imported_file);
+	return true;
+}
+
+/* the list as a string, unregistered entries only: name=value;type */
+static void test_config_dump(int configid, char *buf, size_t size) {
+	size_t len = 0;
+
+	buf[0] = 0;
+	for(struct conf_entry *entry = config_file[configid].first; entry && (len < size); entry = entry->next) {
+		if (entry->flags & CONF_ENTRY_FLAG_REGISTERED) continue;
+		len += snprintf(buf + len, size - len, "%s=%s;%d ", entry->param_name, entry->save_pointer ? (char *)entry->save_pointer : "(null)", entry->type);
+	}
+}
+
+/* a snapshot gives the same variables and entries as the parse that wrote it,
+ * is left alone when a file, the registered variables or itself changed */
+static bool test_config_cache() {
+	static char main_file[] = "/tmp/cctest.conf.XXXXXX", imported_file[] = "/tmp/cctest.import.XXXXXX";
+	static char cache_file[64], import_line[64];
+	static int port;
+	static char *name, *late;
+	const char *imported[] = { "imported = yes" };
+	const char *changed[] = { "imported = no!" }; // same size, within the racy window
+	char parsed[1024], loaded[1024];
+
+	if (!test_write_file(imported_file, imported, 1)) TEST_FAIL("can't write the fixture: %s", strerror(errno));
+	snprintf(import_line, sizeof(import_line), "import = %s", imported_file);
+	const char *lines[] = {
+		"port = 1234", "Name = first", "name = second",
+		"extra = a", "extra = b",
+		"array = list", "list = one", "list = two",
+		"array = empty",
+		"array = cleared", "cleared = x", "cleared = clear",
+		import_line,
+	};
+	if (!test_write_file(main_file, lines, sizeof(lines) / sizeof(lines[0]))) TEST_FAIL("can't write the fixture: %s", strerror(errno));
+	snprintf(cache_file, sizeof(cache_file), "%s.cache", main_file);
+	if ((config_add(main_file, 3) != 0) || (config_add_cache(3, cache_file) != 0)) TEST_FAIL("can't add %s", main_file);
+	config_add_var(3, "port", &port, CONF_VAR_INT, 1, 65535, true);
+	config_add_var(3, "name", &name, CONF_VAR_STRING_POINTER, 1, 64, false);
+
+	bool ok = config_parse(3) && (access(cache_file, R_OK) == 0);
+	if (!ok) TEST_FAIL("parsing didn't write %s", cache_file);
+	if (config_file[3].unindexed != NULL) TEST_FAIL("the first parse came from a snapshot");
+	test_config_dump(3, parsed, sizeof(parsed));
+
+	// back from the snapshot: the values a parse gave, entries not indexed until looked up
+	config_set_value(3, "port", "1");
+	config_set_value(3, "name", "changed");
+	if (!config_reload(3)) TEST_FAIL("didn't reload from the snapshot");
+	if (config_file[3].unindexed == NULL) TEST_FAIL("reloaded without the snapshot");
+	test_config_dump(3, loaded, sizeof(loaded));
+	if (strcmp(parsed, loaded) != 0) TEST_FAIL("the snapshot gave \"%s\", the parse \"%s\"", loaded, parsed);
+	if ((port != 1234) || (name == NULL) || (strcmp(name, "second") != 0)) TEST_FAIL("registered variables are %d and %s", port, name);
+	const char *one = config_get_entry(3, "list", 0), *two = config_get_entry(3, "list", 1);
+	if ((one == NULL) || (two == NULL) || strcmp(one, "one") || strcmp(two, "two") || config_get_entry(3, "list", 2)) TEST_FAIL("array list isn't one, two");
+	if (config_file[3].unindexed != NULL) TEST_FAIL("a lookup didn't index the entries");
+	const char *extra = config_get_entry(3, "extra", 0);
+	if ((extra == NULL) || strcmp(extra, "b") || (config_get_entry(3, "cleared", 0) != NULL)) TEST_FAIL("extra isn't b alone, or cleared isn't empty");
+
+	// an import changed, with the same size and maybe the same mtime
+	if (!test_rewrite_file(imported_file, changed, 1) || !config_reload(3)) TEST_FAIL("didn't reload the changed import");
+	const char *value = config_get_entry(3, "imported", 0);
+	if ((value == NULL) || strcmp(value, "no!")) TEST_FAIL("the snapshot hid the changed import");
+	if (!config_reload(3) || (config_file[3].unindexed == NULL)) TEST_FAIL("the parse of the changed import didn't write a snapshot");
+
+	// another variable registered
+	config_add_var(3, "late", &late, CONF_VAR_STRING_POINTER, 0, 0, false);
+	if (!config_reload(3) || (config_file[3].unindexed != NULL)) TEST_FAIL("a snapshot for other variables was used");
+
+	// garbage over the table sizes, or cut short
+	FILE *fp = fopen(cache_file, "r+");
+	if ((fp == NULL) || (fseek(fp, 24, SEEK_SET) != 0) || (fputs("garbage", fp) < 0) || (fclose(fp) != 0)) TEST_FAIL("can't damage %s", cache_file);
+	if (!config_reload(3) || (config_file[3].unindexed != NULL)) TEST_FAIL("a damaged snapshot was used");
+	if (truncate(cache_file, 100) != 0) TEST_FAIL("can't truncate %s", cache_file);
+	if (!config_reload(3) || (config_file[3].unindexed != NULL)) TEST_FAIL("a truncated snapshot was used");
+	test_config_dump(3, loaded, sizeof(loaded));
+	value = config_get_entry(3, "imported", 0);
+	if ((port != 1234) || (value == NULL) || strcmp(value, "no!")) TEST_FAIL("the parse after a bad snapshot lost values");
+
+	unlink(main_file);
+	unlink(imported_file);
+	unlink(cache_file);
+	return true;
+}
+
+static uint16_t test_checksum(const uint8_t *buf, size_t len) {
+	uint32_t sum = 0;
+
+	for(size_t i = 0; i + 1 < len; i += 2) sum += (buf[i] << 8) | buf[i + 1];
+	if (len & 1) sum += buf[len - 1] << 8;
+	while(sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/* an IPv4 packet from 10.98.0.src to 10.98.0.dst, size bytes in all. TCP
+ * gets a header of tcp_hdr bytes (ACK), ICMP an echo request, with the
+ * checksums the kernel wants. tag goes in byte 27: the low byte of the TCP
+ * sequence number, the UDP checksum or the ICMP sequence number. */
+static size_t test_ip(uint8_t *buf, int src, int dst, int proto, size_t size, int tcp_hdr, uint8_t tag) {
+	memset(buf, 0, size);
+	buf[0] = 0x45;
+	buf[2] = size >> 8;
+	buf[3] = size & 0xff;
+	buf[8] = 64;
+	buf[9] = proto;
+	uint8_t addrs[8] = { 10, 98, 0, src, 10, 98, 0, dst };
+	memcpy(buf + 12, addrs, 8);
+	uint16_t sum = test_checksum(buf, 20);
+	buf[10] = sum >> 8;
+	buf[11] = sum & 0xff;
+	if (proto == IPPROTO_TCP) {
+		buf[32] = (tcp_hdr / 4) << 4;
+		buf[33] = 0x10;
+	}
+	buf[27] = tag;
+	if (proto == IPPROTO_ICMP) {
+		buf[20] = 8;
+		sum = test_checksum(buf + 20, size - 20);
+		buf[22] = sum >> 8;
+		buf[23] = sum & 0xff;
+	}
+	return size;
+}
+
+static void test_send(struct network_connection *net, uint8_t *buf, size_t len) {
+	ssl_input->packet(net, buf, len, NULL);
+}
+
+/* what a peer may send from comes from its name, and what the tunnel queues
+ * for a peer is classed by what it is: both on the forward path (peer to
+ * peer) and on the device path (the kernel's answer) */
+static bool test_tunnel() {
+	static struct network_connection a, b;
+	static struct ssl_context a_ctx = { .psk_identity = "a" }, b_ctx = { .psk_identity = "b" };
+	char peers[] = "/tmp/cctest.peers.XXXXXX";
+	struct network_connection *nets[16];
+	struct packet *pkts[16];
+	uint8_t buf[1200];
+
+	if ((geteuid() != 0) || (access("/dev/net/tun", R_OK | W_OK) != 0)) TEST_SKIP("needs root and /dev/net/tun");
+	int fd = mkstemp(peers);
+	if (fd == -1) TEST_FAIL("can't create %s: %s", peers, strerror(errno));
+	dprintf(fd, "# a name, its prefixes\na:10.98.0.2/32\nb:10.98.0.3\n");
+	close(fd);
+	bool ok = (config_set_value(CONFIG_CORE, "tunnel_device", "cctest0") == 0)
+		&& (config_set_value(CONFIG_CORE, "tunnel_address", "10.98.0.1/24") == 0)
+		&& (config_set_value(CONFIG_CORE, "tunnel_peers_file", peers) == 0);
+	if (!ok) TEST_FAIL("can't set the tunnel_* variables");
+	ok = network_loop_init() && tunnel_init();
+	unlink(peers);
+	if (!ok) TEST_FAIL("no tunnel device");
+	a.ssl_ctx = &a_ctx;
+	b.ssl_ctx = &b_ctx;
+
+	// b pings the device's address: the kernel's reply comes back for b, as control
+	uint64_t control = network_egress_stats.control;
+	test_send(&b, buf, test_ip(buf, 3, 1, IPPROTO_ICMP, 100, 0, 1));
+	for(int i = 0; (i < 20) && (tunnel_stats.out_packets == 0); i++) network_sleep();
+	if (tunnel_stats.out_packets != 1) TEST_FAIL("no echo reply from the device");
+	if (network_egress_stats.control != control + 1) TEST_FAIL("echo reply not queued as control");
+
+	// a from b's address, and from one outside of its own prefixes
+	test_send(&a, buf, test_ip(buf, 3, 1, IPPROTO_ICMP, 100, 0, 1));
+	test_send(&a, buf, test_ip(buf, 9, 1, IPPROTO_ICMP, 100, 0, 1));
+	if (tunnel_stats.spoofed != 2) TEST_FAIL("%llu packets dropped as spoofed, expected 2", (unsigned long long)tunnel_stats.spoofed);
+
+	// a to b, bulk first: control packets overtake it, each class in its order
+	static const struct {
+		int proto;
+		size_t size;
+		int tcp_hdr;
+		bool control;
+	} sent[] = {
+		{ IPPROTO_UDP, 1000, 0, false },
+		{ IPPROTO_TCP, 540, 20, false }, // 500 bytes of data
+		{ IPPROTO_TCP, 80, 60, true }, // pure ACK, with options to be over tunnel_control_size
+		{ IPPROTO_ICMP, 1000, 0, true },
+		{ IPPROTO_UDP, 48, 0, true },
+	};
+	int count = sizeof(sent) / sizeof(sent[0]);
+	for(int i = 0; i < count; i++)
+		test_send(&a, buf, test_ip(buf, 2, 3, sent[i].proto, sent[i].size, sent[i].tcp_hdr, i));
+	if (tunnel_stats.forwarded != (uint64_t)count) TEST_FAIL("%llu packets forwarded, expected %d", (unsigned long long)tunnel_stats.forwarded, count);
+
+	int n = network_egress_dequeue(nets, pkts, 16, 0);
+	if (n != count) TEST_FAIL("%d packets out, expected %d", n, count);
+	int order[16], ordered = 0;
+	for(int i = 0; i < count; i++) if (sent[i].control) order[ordered++] = i;
+	for(int i = 0; i < count; i++) if (!sent[i].control) order[ordered++] = i;
+	for(int i = 0; i < n; i++) {
+		int tag = packet_data(pkts[i])[27];
+		if (nets[i] != &b) TEST_FAIL("packet %d not for b", tag);
+		if (tag != order[i]) TEST_FAIL("packet %d out as #%d, expected %d", tag, i + 1, order[i]);
+		packet_unref(pkts[i]);
+	}
+
+	ssl_input->closed(&a);
+	ssl_input->closed(&b);
+	network_egress_free(&a);
+	network_egress_free(&b);
+	return true;
+}
+
+static const struct {
+	const char *name;
+	bool (*run)();
+} tests[] = {
+	{ "egress", test_egress },
+	{ "roam", test_roam },
+	{ "config", test_config },
+	{ "config_index", test_config_index },
+	{ "config_cache", test_config_cache },
+	{ "tunnel", test_tunnel },
+};
+
+int main(int argc, char *argv[]) {
+	int failed = 0, ran = 0;
+
+	if (gnutls_global_init() != GNUTLS_E_SUCCESS) {
+		fprintf(stderr, "Failed to initialize GnuTLS\n");
+		return 1;
+	}
+	// variables belong to a config file, this one is never parsed
+	config_add("/dev/null", CONFIG_CORE);
+	network_egress_config_init();
+	ssl_data_config_init();
+	tunnel_config_init();
+
+	for(size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		bool wanted = (argc < 2);
+		for(int j = 1; j < argc; j++)
+			if (strcmp(argv[j], tests[i].name) == 0) wanted = true;
+		if (!wanted) continue;
+		test_name = tests[i].name;
+		test_skipped = false;
+		ran++;
+		if (!tests[i].run()) failed++;
+		else if (!test_skipped) printf("ok   %s\n", test_name);
+	}
+	if (ran == 0) {
+		fprintf(stderr, "Usage: %s [egress] [roam] [config] [config_index] [config_cache] [tunnel]\n", argv[0]);
+		return 1;
+	}
+	return failed ? 1 : 0;
+}
@@ -10,6 +10,11 @@
 #include <stdlib.h>
 #include <stdio.h> /* printf */
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 /* C99 */
 #include <stdint.h>
@@ -17,31 +22,114 @@
 
 /* local includes */
 #include "cfg_files.h"
+#include "array.h"
 
 struct config_file config_file[CONF_MAX_FILES];
 
+/* entries sharing a name, indexed by name. Keys include the final NUL so no
+ * key is a prefix of another. */
+struct conf_name {
+	struct conf_entry *first,*last;
+};
+
+#define CONF_INDEX_KEY(name) strlen(name)+1, (const uint8_t *)(name)
+
+static struct conf_name *config_lookup_name(unsigned char configid, const char *name) {
+	if (!config_file[configid].index) return NULL;
+	return array_get(config_file[configid].index, CONF_INDEX_KEY(name));
+}
+
+/* config_index_entry : add a listed entry to its name's chain */
+static void config_index_entry(struct config_file *file, struct conf_entry *entry) {
+	struct conf_name *name;
+
+	if (!file->index) file->index=array_new();
+	name=array_get(file->index, CONF_INDEX_KEY(entry->param_name));
+	entry->same_next=NULL;
+	if (name) {
+		entry->same_prev=name->last;
+		name->last->same_next=entry;
+		name->last=entry;
+		return;
+	}
+	name=calloc(1, sizeof(struct conf_name));
+	name->first=name->last=entry;
+	entry->same_prev=NULL;
+	array_insert(file->index, CONF_INDEX_KEY(entry->param_name), name, false);
+}
+
+/* entries from a snapshot are listed but only indexed when a name lookup
+ * needs them, they are the tail of the list from file->unindexed on */
+static void config_index_pending(struct config_file *file) {
+	struct conf_entry *entry;
+
+	for(entry=file->unindexed; entry; entry=entry->next) config_index_entry(file, entry);
+	file->unindexed=NULL;
+}
+
+static struct conf_name *config_find_name(unsigned char configid, const char *name) {
+	if (config_file[configid].unindexed) config_index_pending(&config_file[configid]);
+	return config_lookup_name(configid, name);
+}
+
+/******
+ * config_link_entry : append an entry to the list and to its name's chain
+ ******/
+static void config_link_entry(unsigned char configid, struct conf_entry *entry) {
+	struct config_file *file=&config_file[configid];
+
+	if (file->unindexed) config_index_pending(file);
+	entry->next=NULL;
+	entry->prev=file->last;
+	if (file->last) {
+		file->last->next=entry;
+	} else {
+		file->first=entry;
+	}
+	file->last=entry;
+	config_index_entry(file, entry);
+}
+
+/******
+ * config_unlink_entry : take an entry out of the list and its name's chain,
+ * without freeing it
+ ******/
+static void config_unlink_entry(unsigned char configid, struct conf_entry *entry) {
+	struct config_file *file=&config_file[configid];
+	struct conf_name *name=config_find_name(configid, entry->param_name);
+
+	if (entry->prev) entry->prev->next=entry->next; else file->first=entry->next;
+	if (entry->next) entry->next->prev=entry->prev; else file->last=entry->prev;
+	entry->prev=entry->next=NULL;
+
+	if (!name) return;
+	if (entry->same_prev) entry->same_prev->same_next=entry->same_next; else name->first=entry->same_next;
+	if (entry->same_next) entry->same_next->same_prev=entry->same_prev; else name->last=entry->same_prev;
+	entry->same_prev=entry->same_next=NULL;
+	if (!name->first) {
+		array_remove(file->index, CONF_INDEX_KEY(entry->param_name));
+		free(name);
+	}
+}
+
 /******
  * config_get_entry : search for an entry and return its pointer
  ******/
 
 void *config_get_entry(int configid, char *entry, int index) {
-	int i=0;
 	struct conf_entry *temp_entry=NULL;
+	struct conf_name *name;
 
 #if CONF_MAX_FILES < 255
 	if (configid > CONF_MAX_FILES) return NULL;
 #endif
 	if (!config_file[configid].filename) return NULL;
 
-	temp_entry=config_file[configid].first;
-	while(temp_entry) {
-		if(strcmp(temp_entry->param_name,entry)==0) {
-			i++;
-			if (i>index) return temp_entry->save_pointer;
-		}
-		temp_entry=temp_entry->next;
-	}
-	return NULL;
+	name=config_find_name(configid, entry);
+	if (!name) return NULL;
+	temp_entry=name->first;
+	while(temp_entry && index--) temp_entry=temp_entry->same_next;
+	return temp_entry ? temp_entry->save_pointer : NULL;
 }
 
 /******
@@ -117,6 +205,115 @@ static void config_read_string2(struct conf_entry *dest, struct conf_entry *src)
 	memcpy(dest->save_pointer, &addr, sizeof(void *));
 }
 
+/* config_store : give a registered variable the value in src, within its
+ * limits. Returns false for types that hold no value. */
+static bool config_store(struct conf_entry *dest, struct conf_entry *src) {
+	void (*callback)(void *,int,int);
+
+	switch(dest->type) {
+		case CONF_VAR_CHAR:
+			*(char *)dest->save_pointer=config_read_numeric((char *)src->save_pointer,dest->min_limit,dest->max_limit);
+			return true;
+		case CONF_VAR_SHORT:
+			*(short *)dest->save_pointer=config_read_numeric((char *)src->save_pointer,dest->min_limit,dest->max_limit);
+			return true;
+		case CONF_VAR_INT:
+			*(int *)dest->save_pointer=config_read_numeric((char *)src->save_pointer,dest->min_limit,dest->max_limit);
+			return true;
+		case CONF_VAR_STRING:
+			config_read_string(dest,src);
+			return true;
+		case CONF_VAR_STRING_POINTER:
+			config_read_string2(dest,src);
+			return true;
+		case CONF_VAR_CALLBACK:
+			callback=dest->save_pointer;
+			(*callback)(src->save_pointer,dest->min_limit,dest->max_limit);
+			return true;
+		case CONF_VAR_CHARBOOL:
+			*(char *)dest->save_pointer=config_read_bool((char *)src->save_pointer);
+			return true;
+	}
+	return false;
+}
+
+/* config_format : current value of a registered variable as text, false if
+ * it has none that can be read back (callbacks) */
+static bool config_format(struct conf_entry *entry, char *buf, size_t size) {
+	const char *str;
+
+	switch(entry->type) {
+		case CONF_VAR_CHAR: snprintf(buf, size, "%d", *(char *)entry->save_pointer); return true;
+		case CONF_VAR_SHORT: snprintf(buf, size, "%d", *(short *)entry->save_pointer); return true;
+		case CONF_VAR_INT: snprintf(buf, size, "%d", *(int *)entry->save_pointer); return true;
+		case CONF_VAR_CHARBOOL: snprintf(buf, size, "%s", *(char *)entry->save_pointer?"on":"off"); return true;
+		case CONF_VAR_STRING: snprintf(buf, size, "%s", (char *)entry->save_pointer); return true;
+		case CONF_VAR_STRING_POINTER:
+			str=*(char **)entry->save_pointer;
+			snprintf(buf, size, "%s", str?str:"");
+			return true;
+	}
+	return false;
+}
+
+static struct conf_entry *config_find_registered(unsigned char configid, const char *var) {
+	struct conf_name *name;
+
+#if CONF_MAX_FILES < 255
+	if (configid > CONF_MAX_FILES) return NULL;
+#endif
+	if (!config_file[configid].filename) return NULL;
+	/* registered variables are indexed when added and come first in their
+	 * name's chain, pending snapshot entries can't change the answer */
+	name=config_lookup_name(configid, var);
+	if (!name || !(name->first->flags & CONF_ENTRY_FLAG_REGISTERED)) return NULL;
+	return name->first;
+}
+
+/******
+ * config_get_value : text value of a variable registered with config_add_var()
+ * Returns -1 if there is no such variable or it can't be read back.
+ ******/
+int config_get_value(unsigned char configid, const char *var, char *buf, size_t size) {
+	struct conf_entry *entry=config_find_registered(configid, var);
+
+	if (!entry || !config_format(entry, buf, size)) return -1;
+	return 0;
+}
+
+/******
+ * config_set_value : set a registered variable at runtime, with the limits
+ * and conversions a config file line would get. Returns -1 if there is no
+ * such variable.
+ ******/
+int config_set_value(unsigned char configid, const char *var, const char *value) {
+	struct conf_entry *entry=config_find_registered(configid, var);
+	struct conf_entry src;
+
+	if (!entry) return -1;
+	memset(&src, 0, sizeof(src));
+	src.param_name=(char *)var;
+	src.save_pointer=(char *)value;
+	return config_store(entry, &src)?0:-1;
+}
+
+/******
+ * config_foreach_var : call callback on every registered variable with its
+ * current value, NULL for those that can't be read back
+ ******/
+void config_foreach_var(unsigned char configid, void (*callback)(const char *, const char *, void *), void *arg) {
+	struct conf_entry *entry;
+	char buf[1024];
+
+#if CONF_MAX_FILES < 255
+	if (configid > CONF_MAX_FILES) return;
+#endif
+	for(entry=config_file[configid].first; entry; entry=entry->next) {
+		if (!(entry->flags & CONF_ENTRY_FLAG_REGISTERED)) continue;
+		(*callback)(entry->param_name, config_format(entry, buf, sizeof(buf))?buf:NULL, arg);
+	}
+}
+
 void config_free_conf_entry(struct conf_entry *pointer) {
 	/* check flags... */
 	if (!pointer) {
@@ -136,6 +333,7 @@ void config_free_conf_entry(struct conf_entry *pointer) {
 	} else if (pointer->prev) {
 		pointer->prev->next=NULL;
 	}
+	if (pointer->flags & CONF_ENTRY_FLAG_ARENA) return; /* freed with the arena */
 	if (pointer->flags & CONF_ENTRY_FLAG_FREEPOINTER) {
 		/* we allocated ourself the "save_pointer", unallocate it */
 		free(pointer->save_pointer);
@@ -153,7 +351,7 @@ struct conf_entry *config_make_conf_entry(char *entry_name, char dup_name, void
 	new_entry->prev=NULL;
 	new_entry->next=NULL;
 	if (dup_name) {
-		new_entry->param_name=calloc(strlen(entry_name), sizeof(char));
+		new_entry->param_name=calloc(strlen(entry_name)+1, sizeof(char));
 		strcpy(new_entry->param_name, entry_name);
 	} else {
 		new_entry->param_name=entry_name;
@@ -180,174 +378,197 @@ struct conf_entry *config_dup_conf_entry(struct conf_entry *pointer) {
 	if (!pointer) return pointer;
 	new_entry=calloc(1, sizeof(struct conf_entry));
 	if (pointer->flags & CONF_ENTRY_FLAG_FREEPOINTER) {
-		new_entry->save_pointer=calloc(strlen((char *)pointer->save_pointer), sizeof(char));
+		new_entry->save_pointer=calloc(strlen((char *)pointer->save_pointer)+1, sizeof(char));
 		strcpy((char *)new_entry->save_pointer, (char *)pointer->save_pointer);
 	} else {
 		new_entry->save_pointer = pointer->save_pointer;
 	}
-	new_entry->param_name=calloc(strlen((char *)pointer->param_name),sizeof(char));
+	new_entry->param_name=calloc(strlen((char *)pointer->param_name)+1,sizeof(char));
 	strcpy((char *)new_entry->param_name, (char *)pointer->param_name);
 	new_entry->flags=pointer->flags;
 	new_entry->type=pointer->type;
 	return new_entry;
 }
 
-void config_clean_var_name(char *str) {
-	int i,j;
+/* Parsed entries, their names and values are carved out of an arena owned by
+ * the config file, and go all at once when config_reload() drops them */
+#define CONF_ARENA_CHUNK 65536
+
+struct conf_arena {
+	struct conf_arena *next;
+	size_t used,size;
+	char data[];
+};
+
+static void *config_arena_alloc(struct conf_arena **arena, size_t size) {
+	struct conf_arena *chunk;
+	void *res;
+
+	size=(size+7) & ~(size_t)7;
+	if (!*arena || (*arena)->used+size > (*arena)->size) {
+		/* the rest of the current chunk is lost, lines are short */
+		chunk=malloc(sizeof(struct conf_arena)+(size>CONF_ARENA_CHUNK?size:CONF_ARENA_CHUNK));
+		if (!chunk) return NULL;
+		chunk->next=*arena;
+		chunk->used=0;
+		chunk->size=size>CONF_ARENA_CHUNK?size:CONF_ARENA_CHUNK;
+		*arena=chunk;
+	}
+	res=(*arena)->data+(*arena)->used;
+	(*arena)->used+=size;
+	return res;
+}
+
+static void config_arena_free(struct conf_arena **arena) {
+	struct conf_arena *chunk;
+
+	while(*arena) {
+		chunk=*arena;
+		*arena=chunk->next;
+		free(chunk);
+	}
+}
+
+/* config_token_name : variable name, lowercased, spaces turned into '_' but
+ * for the leading ones, control and 8 bit chars dropped, trailing '_' removed.
+ * out has room for end-p+1 chars. */
+static void config_token_name(const char *p, const char *end, char *out) {
+	size_t len=0;
 	char start=1;
-	for (i=0; i<CONF_LINE_MAXSIZE && str[i]; i++) {
-		if (start && str[i]==32) {
-			str[i]=1;
-		} else {
-			start=0;
-		}
-		if (str[i]<32) {
-			for (j=i;j<CONF_LINE_MAXSIZE && str[j];j++) str[j]=str[j+1];
-			i--;
-			continue;
-		} else if(str[i]==32) {
-			str[i]='_';
+	signed char c;
+
+	for(; p<end; p++) {
+		c=*p;
+		if (start && c==32) continue;
+		start=0;
+		if (c<32) continue;
+		if (c==32) {
+			out[len++]='_';
 			continue;
 		}
-		if ( (str[i]>='A') && (str[i]<='Z')) str[i]=str[i]+32;
-	}
-	for(i--; i>0; i--) {
-		if(str[i]!='_') break;
-		str[i]=0;
+		if ((c>='A') && (c<='Z')) c+=32;
+		out[len++]=c;
 	}
+	while((len>1) && (out[len-1]=='_')) len--;
+	out[len]=0;
+}
+
+static inline int config_hex_digit(signed char c) {
+	if ((c>=48) && (c<=57)) return c-48;
+	if ((c>=97) && (c<=102)) return c-87;
+	if ((c>=65) && (c<=70)) return c-55;
+	return -1;
 }
 
-void config_clean_var_value(char *str) {
-	int i=0,j=0;
+/* config_token_value : variable value. Runs of spaces and control chars
+ * outside of quotes become one space, leading and trailing ones go. Quotes are
+ * removed, in double quotes \a \b \t \n \v \f \r and \xHH are decoded, in both
+ * kinds \\ \" and \' give the char itself. out has room for end-p+1 chars. */
+static void config_token_value(const char *p, const char *end, char *out) {
+	size_t len=0;
 	int inquote=0,quoteisdouble=0,wasinquote=0;
 	int lastwasspace=1;
+	signed char c,n;
+	int hi,lo;
 
-	for(i=0;i<CONF_LINE_MAXSIZE && str[i];i++) {
-		if (str[i]<32) str[i]=32;
-		if (lastwasspace && str[i]==32) {
-			for(j=i;j<CONF_LINE_MAXSIZE && str[j];j++) str[j]=str[j+1];
-			i--;
+	while(p<end) {
+		c=*p;
+		if (c<32) c=32;
+		if (lastwasspace && c==32) {
+			p++;
 			continue;
 		}
-		lastwasspace=(str[i]==32 && !inquote);
+		lastwasspace=(c==32 && !inquote);
 		wasinquote=inquote;
-		if ((str[i]==34) || (str[i]==39)) {
-			if (!inquote || (quoteisdouble && str[i]==34) || (!quoteisdouble && str[i]==39)) {
-				inquote=1-inquote;
-				if (inquote) {
-					quoteisdouble=(str[i]==34);
-				} else {
-					lastwasspace=1;
-				}
-				for(j=i;j<CONF_LINE_MAXSIZE && str[j];j++) str[j]=str[j+1];
-				i--;
-				continue;
+		if (((c==34) || (c==39)) && (!inquote || (quoteisdouble && c==34) || (!quoteisdouble && c==39))) {
+			inquote=1-inquote;
+			if (inquote) {
+				quoteisdouble=(c==34);
+			} else {
+				lastwasspace=1;
 			}
+			p++;
+			continue;
 		}
-		if (inquote && str[i]==92) {
+		if (inquote && c==92) {
+			n=(p+1<end)?p[1]:0;
 			if (quoteisdouble) {
-				if (str[i+1]=='a') str[i+1]=7;
-				if (str[i+1]=='b') str[i+1]=8;
-				if (str[i+1]=='t') str[i+1]=9;
-				if (str[i+1]=='n') str[i+1]=10;
-				if (str[i+1]=='v') str[i+1]=11;
-				if (str[i+1]=='f') str[i+1]=12;
-				if (str[i+1]=='r') str[i+1]=13;
+				switch(n) {
+					case 'a': n=7; break;
+					case 'b': n=8; break;
+					case 't': n=9; break;
+					case 'n': n=10; break;
+					case 'v': n=11; break;
+					case 'f': n=12; break;
+					case 'r': n=13; break;
+				}
 			}
-			if ( ((str[i+1]>=7) && (str[i+1]<=13)) || str[i+1]==92 || str[i+1]==34 || str[i+1]==39) {
-				for(j=i;j<CONF_LINE_MAXSIZE && str[j];j++) str[j]=str[j+1];
+			/* the escaped char is taken as is, even a control char */
+			if (((n>=7) && (n<=13)) || n==92 || n==34 || n==39) {
+				out[len++]=n;
+				p+=2;
 				continue;
 			}
-			if (!quoteisdouble) continue;
-			if (str[i+1]=='x') {
-				/* Hexadecimal code */
-				if ( (str[i+2]>=48) && (str[i+2]<=57)) {
-					j=str[i+2]-48;
-				} else if ( (str[i+2]>=97) && (str[i+2]<=102)) {
-					j=str[i+2]-87;
-				} else if ( (str[i+2]>=65) && (str[i+2]<=70)) {
-					j=str[i+2]-55;
-				} else continue;
-				j=j*16;
-				if ((str[i+3]>=48) && (str[i+3]<=57)) {
-					j=j+(str[i+3]-48);
-				} else if ( (str[i+3]>=97) && (str[i+3]<=102)) {
-					j=j+(str[i+3]-87);
-				} else if ( (str[i+3]>=65) && (str[i+3]<=70)) {
-					j=j+(str[i+3]-55);
-				} else continue;
-				str[i]=j;
-				for(j=i+1;j<CONF_LINE_MAXSIZE && str[j];j++) str[j]=str[j+3];
+			if (quoteisdouble && n=='x' && (p+3<end) && ((hi=config_hex_digit(p[2]))>=0) && ((lo=config_hex_digit(p[3]))>=0)) {
+				/* Hexadecimal code, \x00 ends the value */
+				out[len]=hi*16+lo;
+				if (!out[len]) return;
+				len++;
+				p+=4;
+				continue;
 			}
 		}
+		out[len++]=c;
+		p++;
 	}
-	if (!wasinquote && lastwasspace) for(i--;i>0;i--) {
-		if (str[i]!=' ') break;
-		str[i]=0;
-	}
+	if (!wasinquote && lastwasspace) while((len>1) && (out[len-1]==' ')) len--;
+	out[len]=0;
 }
 
-struct conf_entry *config_parse_line(const char *line) {
+/* config_parse_line : "name = value" or "name: value", a quote also ends the
+ * name and starts the value. Comments and lines without a value give NULL. */
+static struct conf_entry *config_parse_line(struct conf_arena **arena, const char *line, const char *end) {
 	struct conf_entry *tmp_entry;
-	char w1[CONF_LINE_MAXSIZE], w2[CONF_LINE_MAXSIZE];
-	int i=0,j=0;
-	char *save_pointer;
+	const char *p,*value;
 
-	if ((line[0]=='/') && (line[1]=='/')) return NULL;
-	if (line[0]==';') return NULL;
+	if ((end-line>=2) && (line[0]=='/') && (line[1]=='/')) return NULL;
+	if ((line<end) && (line[0]==';')) return NULL;
 	/* attempt to locate ":" or "=" */
-	w1[0]=0;
-	w2[0]=0;
-	for(i=0;i<CONF_LINE_MAXSIZE;i++) {
-		if (!line[i]) break;
-		if (!j) {
-			if ((line[i]==34) || (line[i]==39)) {
-				w1[i]=0;
-				j=i;
-				i--;
-			} else if ((line[i]!=':') && (line[i]!='=')) {
-				w1[i]=line[i];
-			} else {
-				w1[i]=0;
-				j=i+1;
-			}
-		} else {
-			w2[i-j]=line[i];
-		}
+	for(p=line; p<end; p++) {
+		if ((*p==':') || (*p=='=') || (*p==34) || (*p==39)) break;
 	}
-	if (!j) return NULL;
-	w2[i-j]=0;
+	if (p==end) return NULL;
+	value=((*p==34) || (*p==39))?p:p+1;
 
-	config_clean_var_name(w1);
-	config_clean_var_value(w2);
-
-	tmp_entry=calloc(1, sizeof(struct conf_entry));
-	tmp_entry->param_name=calloc(strlen(w1)+1,sizeof(char));
-	save_pointer=calloc(strlen(w2)+1,sizeof(char));
-	strcpy(tmp_entry->param_name, w1);
-	strcpy(save_pointer, w2);
-	tmp_entry->save_pointer=save_pointer;
+	tmp_entry=config_arena_alloc(arena, sizeof(struct conf_entry));
+	if (!tmp_entry) return NULL;
+	memset(tmp_entry, 0, sizeof(struct conf_entry));
+	tmp_entry->param_name=config_arena_alloc(arena, p-line+1);
+	tmp_entry->save_pointer=config_arena_alloc(arena, end-value+1);
+	if (!tmp_entry->param_name || !tmp_entry->save_pointer) return NULL;
+	config_token_name(line, p, tmp_entry->param_name);
+	config_token_value(value, end, tmp_entry->save_pointer);
 	tmp_entry->type=CONF_VAR_STRING;
-	tmp_entry->flags=CONF_ENTRY_FLAG_FREEPOINTER;
+	tmp_entry->flags=CONF_ENTRY_FLAG_ARENA;
 	return tmp_entry;
 }
 
 int config_add_var(unsigned char configid, char *var, void *pointer, char var_type, int min_limit, int max_limit, bool required) {
 	struct conf_entry *temp_entry;
-	struct conf_entry *base_entry;
 	int i;
 
 #if CONF_MAX_FILES < 255
 	if (configid > CONF_MAX_FILES) return -1;
 #endif
 	if (!config_file[configid].filename) return -1;
-	
+
 	temp_entry=calloc(1,sizeof(struct conf_entry));
 	temp_entry->param_name=var;
 	temp_entry->save_pointer=pointer;
 	temp_entry->type=var_type;
 	temp_entry->min_limit=min_limit;
 	temp_entry->max_limit=max_limit;
+	temp_entry->flags=CONF_ENTRY_FLAG_REGISTERED;
 	if (required) {
 		for(i=0;i<CONF_MAX_REQUIRED;i++) {
 			if (config_file[configid].required[i] && strcmp(temp_entry->param_name,config_file[configid].required[i])==0) return 0;
@@ -355,26 +576,408 @@ int config_add_var(unsigned char configid, char *var, void *pointer, char var_ty
 		for(i=0;i<CONF_MAX_REQUIRED;i++) {
 			if (!config_file[configid].required[i]) {
 				config_file[configid].required[i]=temp_entry->param_name;
+				temp_entry->required=i+1;
 				break;
 			}
 		}
 	}
-	if (!config_file[configid].first) {
-		config_file[configid].first=temp_entry;
-		return 0;
+	config_link_entry(configid, temp_entry);
+	return 0;
+}
+
+/* Compiled snapshot of a parse, see config_add_cache(). It lists every file
+ * that was read, imports included, with its stat and a hash of its contents,
+ * then what config_set_var() made of them: the values given to registered
+ * variables, in file order, and the other entries as the list ended up, with
+ * repeated names replaced and arrays declared or cleared. While no source
+ * changed and the same variables are registered, config_parse() stores those
+ * values again and appends the entries as they are, their strings pointing
+ * into the mapped snapshot. Nothing is tokenized, and the entries only go
+ * into the name index once a lookup needs them. */
+#define CONF_CACHE_MAGIC "CCCONF2"
+#define CONF_CACHE_RACY 2000000000ULL /* ns, sources changed this close to the parse are hashed */
+#define CONF_CACHE_NULL UINT32_MAX /* entry without a value, an empty array */
+
+struct conf_cache_header {
+	char magic[8];
+	uint64_t started; /* ns, CLOCK_REALTIME when the sources were read */
+	uint64_t schema; /* hash of the registered variables, see config_schema() */
+	uint32_t sources,binds,entries;
+	uint32_t strings; /* size of the string blob, after the tables */
+};
+
+struct conf_cache_source {
+	uint64_t dev,ino,size,mtime; /* mtime in ns */
+	uint64_t hash;
+	uint32_t path; /* offset in the blob */
+	uint32_t missing; /* couldn't be read, an import that may show up later */
+};
+
+/* a value given to a registered variable */
+struct conf_cache_bind {
+	uint32_t name,value; /* offsets in the blob */
+};
+
+/* an entry left in the list */
+struct conf_cache_entry {
+	uint32_t name,value; /* offsets in the blob, value may be CONF_CACHE_NULL */
+	uint32_t type,pad;
+};
+
+struct conf_source {
+	const char *path;
+	struct conf_cache_source rec;
+};
+
+struct conf_cache {
+	const char *filename;
+	void *map; /* loaded snapshot, entries point into it until the next reload */
+	size_t size;
+	uint64_t started;
+	struct conf_source *sources; /* read by the current parse */
+	uint32_t count,alloc;
+	const struct conf_entry **binds; /* values config_set_var() stored, in the arena */
+	uint32_t bind_count,bind_alloc;
+	bool failed; /* parse not all recorded, don't write */
+	bool warned;
+};
+
+static uint64_t config_hash(const char *data, size_t len) {
+	uint64_t h=0xcbf29ce484222325ULL,w;
+
+	for(; len>=8; data+=8, len-=8) {
+		memcpy(&w, data, 8);
+		h=(h^w)*0x100000001b3ULL;
+		h^=h>>29;
 	}
-	base_entry=config_file[configid].first;
-	while(base_entry->next) base_entry=base_entry->next;
-	base_entry->next=temp_entry;
-	base_entry->next->prev=base_entry;
+	while(len--) h=(h^(unsigned char)*data++)*0x100000001b3ULL;
+	return h^(h>>32);
+}
+
+static uint64_t config_mtime(const struct stat *st) {
+	return (uint64_t)st->st_mtim.tv_sec*1000000000ULL+st->st_mtim.tv_nsec;
+}
+
+/* config_schema : hash of the registered variables, a snapshot only holds for
+ * the names, types, limits and required slots it was written with */
+static uint64_t config_schema(unsigned char configid) {
+	const struct conf_entry *entry;
+	uint64_t h=0;
+	int meta[4];
+
+	for(entry=config_file[configid].first; entry; entry=entry->next) {
+		if (!(entry->flags & CONF_ENTRY_FLAG_REGISTERED)) continue;
+		meta[0]=entry->type;
+		meta[1]=entry->min_limit;
+		meta[2]=entry->max_limit;
+		meta[3]=entry->required;
+		h=(h^config_hash(entry->param_name, strlen(entry->param_name)+1))*0x100000001b3ULL;
+		h=(h^config_hash((const char *)meta, sizeof(meta)))*0x100000001b3ULL;
+	}
+	return h;
+}
+
+/******
+ * config_add_cache : keep a compiled snapshot of configid in filename, used by
+ * config_parse() and config_reload() while none of the files changed
+ ******/
+int config_add_cache(unsigned char configid, const char *filename) {
+#if CONF_MAX_FILES < 255
+	if (configid > CONF_MAX_FILES) return -1;
+#endif
+	if (!config_file[configid].filename || config_file[configid].cache) return -1;
+	config_file[configid].cache=calloc(1, sizeof(struct conf_cache));
+	if (!config_file[configid].cache) return -1;
+	config_file[configid].cache->filename=filename;
 	return 0;
 }
 
+static bool config_cache_grow(void **table, uint32_t *alloc, uint32_t count, size_t size) {
+	void *res;
+
+	if (count < *alloc) return true;
+	res=realloc(*table, (*alloc?*alloc*2:8)*size);
+	if (!res) return false;
+	*table=res;
+	*alloc=*alloc?*alloc*2:8;
+	return true;
+}
+
+/* config_cache_source : note a file read by config_parse_file(), st NULL if it
+ * couldn't be */
+static void config_cache_source(unsigned char configid, const char *path, const struct stat *st, const char *data) {
+	struct conf_cache *cache=config_file[configid].cache;
+	struct conf_source *src;
+
+	if (!cache) return;
+	if (!config_cache_grow((void **)&cache->sources, &cache->alloc, cache->count, sizeof(struct conf_source))) {
+		cache->failed=true;
+		return;
+	}
+	src=&cache->sources[cache->count++];
+	memset(src, 0, sizeof(struct conf_source));
+	src->path=path;
+	if (!st) {
+		src->rec.missing=1;
+		return;
+	}
+	src->rec.dev=st->st_dev;
+	src->rec.ino=st->st_ino;
+	src->rec.size=st->st_size;
+	src->rec.mtime=config_mtime(st);
+	src->rec.hash=config_hash(data, st->st_size);
+}
+
+/* config_cache_bind : note a value config_set_var() gave a registered variable */
+static void config_cache_bind(unsigned char configid, const struct conf_entry *entry) {
+	struct conf_cache *cache=config_file[configid].cache;
+
+	if (!cache) return;
+	if (!config_cache_grow((void **)&cache->binds, &cache->bind_alloc, cache->bind_count, sizeof(struct conf_entry *))) {
+		cache->failed=true;
+		return;
+	}
+	cache->binds[cache->bind_count++]=entry;
+}
+
+/* config_cache_fresh : true if a source still holds what was parsed. Same stat
+ * is enough, unless the file changed so close to the parse that its mtime
+ * can't tell, otherwise a touched file may still have the same contents. */
+static bool config_cache_fresh(const struct conf_cache_source *src, const char *path, uint64_t started) {
+	struct stat st;
+	const char *map;
+	uint64_t hash;
+	int fd;
+
+	if (stat(path, &st) == -1) return src->missing;
+	if (src->missing) return false;
+	if ((uint64_t)st.st_size != src->size) return false;
+	if ((st.st_dev == src->dev) && (st.st_ino == src->ino) && (config_mtime(&st) == src->mtime) && (src->mtime+CONF_CACHE_RACY < started)) return true;
+
+	if (st.st_size == 0) return src->hash == config_hash(NULL, 0);
+	fd=open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+	map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+	hash=config_hash(map, st.st_size);
+	munmap((void *)map, st.st_size);
+	return hash == src->hash;
+}
+
+static void config_cache_unmap(struct conf_cache *cache) {
+	if (!cache || !cache->map) return;
+	munmap(cache->map, cache->size);
+	cache->map=NULL;
+}
+
+/* config_cache_load : apply the snapshot if it is valid and still holds for
+ * the files and the registered variables, false to parse them instead */
+static bool config_cache_load(unsigned char configid) {
+	struct config_file *file=&config_file[configid];
+	struct conf_cache *cache=file->cache;
+	const struct conf_cache_header *header;
+	const struct conf_cache_source *sources;
+	const struct conf_cache_bind *binds;
+	const struct conf_cache_entry *entries;
+	struct conf_entry *list,*dest,src;
+	struct stat st;
+	char *map,*blob;
+	uint64_t tables,found=0;
+	uint32_t i;
+	int fd;
+
+	fd=open(cache->filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+	if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(struct conf_cache_header))) {
+		close(fd);
+		return false;
+	}
+	/* private and writable, entries may be handed out as char * */
+	map=mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	/* checked for what the loader relies on: tables and strings in bounds, a
+	 * NUL ending the blob so every string ends in it. Written aside then
+	 * renamed, a snapshot is never seen half written. */
+	header=(struct conf_cache_header *)map;
+	sources=(struct conf_cache_source *)(map+sizeof(struct conf_cache_header));
+	binds=(struct conf_cache_bind *)(sources+header->sources);
+	entries=(struct conf_cache_entry *)(binds+header->binds);
+	tables=sizeof(struct conf_cache_header)+(uint64_t)header->sources*sizeof(struct conf_cache_source)+
+		(uint64_t)header->binds*sizeof(struct conf_cache_bind)+(uint64_t)header->entries*sizeof(struct conf_cache_entry);
+	blob=map+tables;
+	if ((memcmp(header->magic, CONF_CACHE_MAGIC, sizeof(header->magic)) != 0) || (tables+header->strings != (uint64_t)st.st_size) ||
+	    !header->sources || !(header->binds+header->entries) || !header->strings || blob[header->strings-1])
+		goto invalid;
+	for(i=0;i<header->sources;i++) {
+		if (sources[i].path >= header->strings) goto invalid;
+	}
+	for(i=0;i<header->binds;i++) {
+		if ((binds[i].name >= header->strings) || (binds[i].value >= header->strings)) goto invalid;
+	}
+	for(i=0;i<header->entries;i++) {
+		if ((entries[i].name >= header->strings) || ((entries[i].value >= header->strings) && (entries[i].value != CONF_CACHE_NULL))) goto invalid;
+		if ((entries[i].type != CONF_VAR_STRING) && (entries[i].type != CONF_VAR_ARRAY)) goto invalid;
+	}
+
+	if (strcmp(blob+sources[0].path, file->filename)) goto stale;
+	if (header->schema != config_schema(configid)) goto stale;
+	for(i=0;i<header->sources;i++) {
+		if (!config_cache_fresh(&sources[i], blob+sources[i].path, header->started)) goto stale;
+	}
+	for(i=0;i<header->binds;i++) {
+		dest=config_find_registered(configid, blob+binds[i].name);
+		if (!dest) goto stale;
+		if (dest->required) found|=1ULL<<(dest->required-1);
+	}
+	for(i=0;i<CONF_MAX_REQUIRED;i++) {
+		if (file->required[i] && !(found & (1ULL<<i))) goto stale; /* let the parse say which */
+	}
+
+	list=NULL;
+	if (header->entries) {
+		list=config_arena_alloc(&file->arena, header->entries*sizeof(struct conf_entry));
+		if (!list) goto stale;
+	}
+	memset(&src, 0, sizeof(src));
+	for(i=0;i<header->binds;i++) {
+		src.param_name=blob+binds[i].name;
+		src.save_pointer=blob+binds[i].value;
+		config_store(config_find_registered(configid, src.param_name), &src);
+	}
+	if (list) {
+		memset(list, 0, header->entries*sizeof(struct conf_entry));
+		for(i=0;i<header->entries;i++) {
+			list[i].param_name=blob+entries[i].name;
+			list[i].save_pointer=(entries[i].value == CONF_CACHE_NULL)?NULL:blob+entries[i].value;
+			list[i].type=entries[i].type;
+			list[i].flags=CONF_ENTRY_FLAG_ARENA;
+			list[i].prev=i?&list[i-1]:file->last;
+			if (i+1<header->entries) list[i].next=&list[i+1];
+		}
+		if (file->last) file->last->next=list; else file->first=list;
+		file->last=&list[header->entries-1];
+		if (!file->unindexed) file->unindexed=list;
+	}
+	cache->map=map;
+	cache->size=st.st_size;
+	return true;
+
+invalid:
+	fprintf(stderr, "Warning: ignoring invalid config cache `%s'!\n", cache->filename);
+stale:
+	munmap(map, st.st_size);
+	return false;
+}
+
+static bool config_cache_write_all(int fd, const char *buf, size_t len) {
+	ssize_t res;
+
+	while(len) {
+		res=write(fd, buf, len);
+		if (res == -1) return false;
+		buf+=res;
+		len-=res;
+	}
+	return true;
+}
+
+/* config_cache_string : copy a string to the blob, its offset */
+static uint32_t config_cache_string(char *blob, size_t *used, const char *str) {
+	size_t len=strlen(str)+1;
+	uint32_t res=*used;
+
+	memcpy(blob+*used, str, len);
+	*used+=len;
+	return res;
+}
+
+/* config_cache_write : snapshot of a parse once config_set_var() went through
+ * it. Written aside then renamed, workers may reload at once. */
+static void config_cache_write(unsigned char configid) {
+	struct conf_cache *cache=config_file[configid].cache;
+	struct conf_cache_header *header;
+	struct conf_cache_source *sources;
+	struct conf_cache_bind *binds;
+	struct conf_cache_entry *entries;
+	const struct conf_entry *entry;
+	uint32_t count=0,i;
+	size_t strings=0,size;
+	char *buf,*blob,*tmp;
+	int fd;
+
+	if (!cache || cache->failed || !cache->count) return;
+	for(i=0;i<cache->count;i++) strings+=strlen(cache->sources[i].path)+1;
+	for(i=0;i<cache->bind_count;i++) strings+=strlen(cache->binds[i]->param_name)+strlen((char *)cache->binds[i]->save_pointer)+2;
+	for(entry=config_file[configid].first; entry; entry=entry->next) {
+		if (entry->flags & CONF_ENTRY_FLAG_REGISTERED) continue;
+		if ((entry->type != CONF_VAR_STRING) && (entry->type != CONF_VAR_ARRAY)) return;
+		strings+=strlen(entry->param_name)+1;
+		if (entry->save_pointer) strings+=strlen((char *)entry->save_pointer)+1;
+		count++;
+	}
+	if (strings >= CONF_CACHE_NULL) return;
+	size=sizeof(struct conf_cache_header)+cache->count*sizeof(struct conf_cache_source)+
+		cache->bind_count*sizeof(struct conf_cache_bind)+count*sizeof(struct conf_cache_entry)+strings;
+	buf=malloc(size);
+	tmp=malloc(strlen(cache->filename)+16);
+	if (!buf || !tmp) {
+		free(buf);
+		free(tmp);
+		return;
+	}
+
+	header=(struct conf_cache_header *)buf;
+	sources=(struct conf_cache_source *)(buf+sizeof(struct conf_cache_header));
+	binds=(struct conf_cache_bind *)(sources+cache->count);
+	entries=(struct conf_cache_entry *)(binds+cache->bind_count);
+	blob=(char *)(entries+count);
+	memset(header, 0, sizeof(struct conf_cache_header));
+	memcpy(header->magic, CONF_CACHE_MAGIC, sizeof(header->magic));
+	header->started=cache->started;
+	header->schema=config_schema(configid);
+	header->sources=cache->count;
+	header->binds=cache->bind_count;
+	header->entries=count;
+	header->strings=strings;
+
+	strings=0;
+	for(i=0;i<cache->count;i++) {
+		sources[i]=cache->sources[i].rec;
+		sources[i].path=config_cache_string(blob, &strings, cache->sources[i].path);
+	}
+	for(i=0;i<cache->bind_count;i++) {
+		binds[i].name=config_cache_string(blob, &strings, cache->binds[i]->param_name);
+		binds[i].value=config_cache_string(blob, &strings, (char *)cache->binds[i]->save_pointer);
+	}
+	i=0;
+	for(entry=config_file[configid].first; entry; entry=entry->next) {
+		if (entry->flags & CONF_ENTRY_FLAG_REGISTERED) continue;
+		entries[i].name=config_cache_string(blob, &strings, entry->param_name);
+		entries[i].value=entry->save_pointer?config_cache_string(blob, &strings, (char *)entry->save_pointer):CONF_CACHE_NULL;
+		entries[i].type=entry->type;
+		entries[i].pad=0;
+		i++;
+	}
+
+	sprintf(tmp, "%s.%d", cache->filename, (int)getpid());
+	fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if ((fd == -1) || !config_cache_write_all(fd, buf, size) || (close(fd) == -1) || (rename(tmp, cache->filename) == -1)) {
+		if (!cache->warned) fprintf(stderr, "Warning: couldn't write config cache `%s'!\n", cache->filename);
+		cache->warned=true;
+		unlink(tmp);
+	}
+	free(tmp);
+	free(buf);
+}
+
 int config_set_var(unsigned char configid, struct conf_entry *pointer) {
 	/* return 0 if we don't want our pointer to be freed */
 	struct conf_entry *temp_entry=NULL;
 	struct conf_entry *tmp2_entry=NULL;
-	void (*callback)(void *,int,int);
+	struct conf_name *name;
 	void *temp_pointer;
 	int new_is_array=0;
 #if CONF_MAX_FILES < 255
@@ -382,17 +985,8 @@ int config_set_var(unsigned char configid, struct conf_entry *pointer) {
 #endif
 	if (!config_file[configid].filename) return 1;
 
-	temp_entry=config_file[configid].first;
-	if (temp_entry && temp_entry->prev) {
-#ifdef __DEBUG
-		printf("WARNING: config_file[x].first wasn't pointing to first entry !\n");
-#endif
-		while(temp_entry->prev) temp_entry=temp_entry->prev;
-		config_file[configid].first=temp_entry;
-	}
-
 	if (strcmp(pointer->param_name,"array")==0) {
-		free(pointer->param_name);
+		if (!(pointer->flags & CONF_ENTRY_FLAG_ARENA)) free(pointer->param_name);
 		pointer->param_name=(char *)pointer->save_pointer;
 		temp_pointer=(void *)pointer->param_name;
 		while(*(char *)temp_pointer) {
@@ -402,131 +996,118 @@ int config_set_var(unsigned char configid, struct conf_entry *pointer) {
 		pointer->save_pointer=NULL;
 		pointer->flags=pointer->flags & ~CONF_ENTRY_FLAG_FREEPOINTER;
 		pointer->type=CONF_VAR_ARRAY;
-		if (temp_entry) {
-			while(temp_entry->next) temp_entry=temp_entry->next;
-			temp_entry->next=pointer;
-			temp_entry->next->prev=temp_entry;
-			return 0;
-		}
-		config_file[configid].first=pointer;
+		config_link_entry(configid, pointer);
 		return 0;
 	}
 
 	/* try to find another entry with same name... */
-	if (temp_entry) while(temp_entry) {
-		if (strcmp(temp_entry->param_name,pointer->param_name)==0) {
-			/* found something... check type... */
-			switch(temp_entry->type) {
-				case CONF_VAR_CHAR:
-					*(char *)temp_entry->save_pointer=config_read_numeric((char *)pointer->save_pointer,temp_entry->min_limit,temp_entry->max_limit);
-					return 1;
-				case CONF_VAR_SHORT:
-					*(short *)temp_entry->save_pointer=config_read_numeric((char *)pointer->save_pointer,temp_entry->min_limit,temp_entry->max_limit);
-					return 1;
-				case CONF_VAR_INT:
-					*(int *)temp_entry->save_pointer=config_read_numeric((char *)pointer->save_pointer,temp_entry->min_limit,temp_entry->max_limit);
-					return 1;
-				case CONF_VAR_STRING:
-					config_read_string(temp_entry,pointer);
-					return 1;
-				case CONF_VAR_STRING_POINTER:
-					config_read_string2(temp_entry,pointer);
-					return 1;
-				case CONF_VAR_CALLBACK:
-					callback=temp_entry->save_pointer;
-					(*callback)(pointer->save_pointer,temp_entry->min_limit,temp_entry->max_limit);
-					return 1;
-				case CONF_VAR_CHARBOOL:
-					*(char *)temp_entry->save_pointer=config_read_bool((char *)pointer->save_pointer);
+	name=config_find_name(configid, pointer->param_name);
+	temp_entry=name ? name->first : NULL;
+	while(temp_entry) {
+		/* found something... check type... */
+		switch(temp_entry->type) {
+			case CONF_VAR_CHAR: case CONF_VAR_SHORT: case CONF_VAR_INT:
+			case CONF_VAR_STRING_POINTER: case CONF_VAR_CALLBACK: case CONF_VAR_CHARBOOL:
+				config_store(temp_entry,pointer);
+				config_cache_bind(configid, pointer);
+				return 1;
+			case CONF_VAR_STRING:
+				if (!(temp_entry->flags & CONF_ENTRY_FLAG_REGISTERED)) {
+					/* a parsed value set again, its buffer only fits the old one */
+					if (temp_entry->flags & CONF_ENTRY_FLAG_FREEPOINTER) free(temp_entry->save_pointer);
+					temp_entry->save_pointer=pointer->save_pointer;
+					pointer->save_pointer=NULL;
 					return 1;
-				case CONF_VAR_ARRAY:
-					if (temp_entry->save_pointer && (strcmp((char *)pointer->save_pointer,"clear")==0)) {
-						new_is_array=1;
-						tmp2_entry=temp_entry->prev;
-						if (!tmp2_entry) tmp2_entry=temp_entry->next;
-						config_free_conf_entry(temp_entry);
-						temp_entry=tmp2_entry;
-						break;
-					}
-					pointer->type=CONF_VAR_ARRAY;
-					if (!temp_entry->save_pointer) {
-						tmp2_entry=NULL;
-						if (temp_entry->next) tmp2_entry=temp_entry->next;
-						if (!tmp2_entry) tmp2_entry=temp_entry->prev;
-						config_free_conf_entry(temp_entry);
-						if (tmp2_entry) {
-							temp_entry=tmp2_entry;
-						} else {
-							temp_entry=pointer;
-							config_file[configid].first=temp_entry;
-							return 0;
-						}
-					}
-					while(temp_entry->next) temp_entry=temp_entry->next;
-					temp_entry->next=pointer;
-					temp_entry->next->prev=temp_entry;
-					return 0;
-				#
-			}
+				}
+				config_store(temp_entry,pointer);
+				config_cache_bind(configid, pointer);
+				return 1;
+			case CONF_VAR_ARRAY:
+				if (temp_entry->save_pointer && (strcmp((char *)pointer->save_pointer,"clear")==0)) {
+					new_is_array=1;
+					tmp2_entry=temp_entry->same_next;
+					config_unlink_entry(configid, temp_entry);
+					config_free_conf_entry(temp_entry);
+					temp_entry=tmp2_entry;
+					continue;
+				}
+				pointer->type=CONF_VAR_ARRAY;
+				if (!temp_entry->save_pointer) {
+					/* declared with array=, this is the first value */
+					config_unlink_entry(configid, temp_entry);
+					config_free_conf_entry(temp_entry);
+				}
+				config_link_entry(configid, pointer);
+				return 0;
+			#
 		}
-		if (temp_entry) temp_entry=temp_entry->next;
+		temp_entry=temp_entry->same_next;
 	}
 	if (new_is_array) {
 		/* A clear was received
 		 * config_make_conf_entry(char *entry_name, char dup_name, void *entry_pointer, char dup_pointer, int type)
 		 */
-		temp_entry=config_file[configid].first;
-		if (!temp_entry) {
-			config_file[configid].first=config_make_conf_entry(pointer->param_name, 1, NULL, 0, CONF_VAR_ARRAY);
-			return 1;
-		}
-		while(temp_entry->next) temp_entry=temp_entry->next;
-		temp_entry->next=config_make_conf_entry(pointer->param_name, 1, NULL, 0, CONF_VAR_ARRAY);
-		temp_entry->next->prev=temp_entry;
+		config_link_entry(configid, config_make_conf_entry(pointer->param_name, 1, NULL, 0, CONF_VAR_ARRAY));
 		return 1;
 	}
 	/* register var as string... */
-	temp_entry=config_file[configid].first;
-	if (!temp_entry) {
-		config_file[configid].first=pointer;
-	} else {
-		while(temp_entry->next) temp_entry=temp_entry->next;
-		temp_entry->next=pointer;
-		temp_entry->next->prev=temp_entry;
-	}
+	config_link_entry(configid, pointer);
 /*	printf("Register [%d] : \"%s\" = \"%s\"\n",configid, pointer->param_name, (char *)pointer->save_pointer); */
 	return 0;
 }
 
-struct conf_entry *config_parse_file(const char *filename, char level, char *required[]) {
-	char line[CONF_LINE_MAXSIZE];
-	FILE *fp;
+/* config_parse_file : read a file (and its imports) into a list of entries.
+ * Required variables that were seen get their bit set in found.
+ */
+struct conf_entry *config_parse_file(unsigned char configid, const char *filename, char level, uint64_t *found) {
+	struct stat st;
+	int fd;
+	const char *map,*line,*end,*eol,*nul;
 	struct conf_entry *base_entry=NULL;
 	struct conf_entry *current_entry=NULL;
 	struct conf_entry *temp_entry=NULL;
 	struct conf_entry *import_entry=NULL;
-	int i;
+	struct conf_name *name;
 
 	if (level>15) {
 		puts("WARNING: Too many levels of imported files! Aborting!!");
 		return 0;
 	}
 
-	fp=fopen(filename,"r");
-	if (fp == NULL) {
+	fd=open(filename, O_RDONLY | O_CLOEXEC);
+	if ((fd == -1) || (fstat(fd, &st) == -1)) {
+		if (fd != -1) close(fd);
+		config_cache_source(configid, filename, NULL, NULL);
 		fprintf(stderr, "Warning: couldn't open config file `%s'!\n", filename);
 		return 0;
 	}
+	if (st.st_size == 0) {
+		close(fd);
+		config_cache_source(configid, filename, &st, NULL);
+		return 0;
+	}
+	map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		config_cache_source(configid, filename, NULL, NULL);
+		fprintf(stderr, "Warning: couldn't map config file `%s'!\n", filename);
+		return 0;
+	}
+	config_cache_source(configid, filename, &st, map);
 
-	while(fgets(line, CONF_LINE_MAXSIZE - 1, fp)) {
-		temp_entry=config_parse_line(line);
+	for(line=map; line<map+st.st_size; line=eol) {
+		eol=memchr(line, '\n', map+st.st_size-line);
+		eol=eol?eol+1:map+st.st_size;
+		/* the newline is part of the value, as a space. A NUL ends the line */
+		nul=memchr(line, 0, eol-line);
+		end=nul?nul:eol;
+		temp_entry=config_parse_line(&config_file[configid].arena, line, end);
 		if (!temp_entry) continue; /* parse error or empty line */
 		if (strcmp(temp_entry->param_name,"import")==0) {
-			import_entry=config_parse_file((char*)temp_entry->save_pointer, level+1, required);
-			config_free_conf_entry(temp_entry);
+			import_entry=config_parse_file(configid, (char*)temp_entry->save_pointer, level+1, found);
 			if (!import_entry) continue;
 			if (!base_entry) {
-				base_entry=import_entry;
+				base_entry=current_entry=import_entry;
 			} else {
 				current_entry->next=import_entry;
 				current_entry->next->prev=current_entry;
@@ -534,9 +1115,9 @@ struct conf_entry *config_parse_file(const char *filename, char level, char *req
 			while(current_entry->next) current_entry=current_entry->next; /* move to the end of the list */
 			continue;
 		}
-		for(i=0;i<CONF_MAX_REQUIRED;i++) {
-			if (required[i] && strcmp(temp_entry->param_name,required[i])==0) required[i]=NULL;
-		}
+		/* registered variables come first in their name's chain */
+		name=config_find_name(configid, temp_entry->param_name);
+		if (name && name->first->required) *found|=1ULL<<(name->first->required-1);
 		if (!base_entry) {
 			base_entry=temp_entry;
 		} else {
@@ -545,7 +1126,7 @@ struct conf_entry *config_parse_file(const char *filename, char level, char *req
 		}
 		current_entry=temp_entry;
 	}
-	fclose(fp);
+	munmap((void *)map, st.st_size);
 
 	return base_entry;
 }
@@ -557,7 +1138,9 @@ bool config_parse(unsigned char configid) {
 	struct conf_entry *base_entry=NULL;
 	struct conf_entry *current_entry=NULL;
 	struct conf_entry *next_entry=NULL;
-	char *required[CONF_MAX_REQUIRED];
+	struct conf_cache *cache;
+	struct timespec now;
+	uint64_t found=0;
 	int i,j=0;
 
 #if CONF_MAX_FILES < 255
@@ -565,24 +1148,31 @@ bool config_parse(unsigned char configid) {
 #endif
 	if (!config_file[configid].filename) return false;
 
-	for(i=0;i<CONF_MAX_REQUIRED;i++) required[i]=config_file[configid].required[i];
-	base_entry=config_parse_file(config_file[configid].filename, 0, required);
-	if (!base_entry) return false; /* parsing failed : no values found */
+	cache=config_file[configid].cache;
+	if (cache) {
+		if (config_cache_load(configid)) return true;
+		clock_gettime(CLOCK_REALTIME, &now);
+		cache->started=(uint64_t)now.tv_sec*1000000000ULL+now.tv_nsec;
+		cache->count=cache->bind_count=0;
+		cache->failed=false;
+	}
+	base_entry=config_parse_file(configid, config_file[configid].filename, 0, &found);
+	if (!base_entry) {
+		/* parsing failed : no values found */
+		config_arena_free(&config_file[configid].arena);
+		return false;
+	}
 
 	for(i=0;i<CONF_MAX_REQUIRED;i++) {
-		if (required[i]) {
-			fprintf(stderr, "ERROR: Required variable %s not found!\n",required[i]);
+		if (config_file[configid].required[i] && !(found & (1ULL<<i))) {
+			fprintf(stderr, "ERROR: Required variable %s not found!\n",config_file[configid].required[i]);
 			j++;
 		}
 	}
 	if (j) {
 		fprintf(stderr, "%d error(s) found. Parsing canceled.\n",j);
-		current_entry=base_entry;
-		while(current_entry) {
-			base_entry=current_entry;
-			current_entry=current_entry->next;
-			config_free_conf_entry(base_entry);
-		}
+		/* all of them came from the arena */
+		config_arena_free(&config_file[configid].arena);
 		return false;
 	}
 
@@ -595,6 +1185,7 @@ bool config_parse(unsigned char configid) {
 		current_entry=next_entry;
 		if (i>0) config_free_conf_entry(base_entry);
 	}
+	config_cache_write(configid);
 
 #if 0
 	printf("DEBUG: Dumping configuration\n");
@@ -632,3 +1223,37 @@ bool config_parse(unsigned char configid) {
 	return true;
 }
 
+/* config_reload : parse the config file again
+ * Values parsed from the file are dropped, registered variables are kept (and
+ * keep their current value unless the file sets them again).
+ */
+bool config_reload(unsigned char configid) {
+	struct conf_entry *current_entry=NULL;
+	struct conf_entry *next_entry=NULL;
+
+#if CONF_MAX_FILES < 255
+	if (configid > CONF_MAX_FILES) return false;
+#endif
+	if (!config_file[configid].filename) return false;
+
+	/* entries from the snapshot that were never indexed go with the arena */
+	current_entry=config_file[configid].unindexed;
+	if (current_entry) {
+		if (current_entry->prev) current_entry->prev->next=NULL; else config_file[configid].first=NULL;
+		config_file[configid].last=current_entry->prev;
+		config_file[configid].unindexed=NULL;
+	}
+	current_entry=config_file[configid].first;
+	while(current_entry) {
+		next_entry=current_entry->next;
+		if (!(current_entry->flags & CONF_ENTRY_FLAG_REGISTERED)) {
+			config_unlink_entry(configid, current_entry);
+			config_free_conf_entry(current_entry);
+		}
+		current_entry=next_entry;
+	}
+	config_arena_free(&config_file[configid].arena);
+	config_cache_unmap(config_file[configid].cache);
+
+	return config_parse(configid);
+}
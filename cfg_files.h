@@ -38,34 +38,54 @@
 
 #define CONFIG_CORE 0
 
-#define CONF_LINE_MAXSIZE 1024
 /* Max number of required variables */
 #define CONF_MAX_REQUIRED 64
 
 /* FreePointer : shall we free the pointer when closing? */
 #define CONF_ENTRY_FLAG_FREEPOINTER 1
+/* Registered : entry was declared with config_add_var(), kept across reloads */
+#define CONF_ENTRY_FLAG_REGISTERED 2
+/* Arena : parsed entry lives in config_file.arena, name and value too or in the snapshot */
+#define CONF_ENTRY_FLAG_ARENA 4
 
 struct conf_entry {
 	struct conf_entry *prev,*next;
+	struct conf_entry *same_prev,*same_next; // entries with the same name, in list order
 	char *param_name; // 4 bytes + malloc'd string
 	void *save_pointer; // 4 bytes
 	int min_limit,max_limit; // 8 bytes : min. and max limit of the value (zero = not used)
 	char type; // 1 byte
 	char flags; // 1 byte
-	// 2 bytes lost
+	unsigned char required; // 1 byte : 1 + slot in config_file.required, 0 if not required
+	// 1 byte lost
 };
 
+struct array_base;
+struct conf_arena;
+struct conf_cache;
+
 struct config_file {
-	struct conf_entry *first;
+	struct conf_entry *first,*last;
+	struct conf_entry *unindexed; // first of the entries not in the index yet, NULL if none
+	struct array_base *index; // param_name => first and last entry with that name
+	struct conf_arena *arena; // parsed entries, freed on reload
+	struct conf_cache *cache; // compiled snapshot, NULL if none
 	const char *filename;
 	int loader; // source
 	char *required[CONF_MAX_REQUIRED];
 };
 
+extern struct config_file config_file[CONF_MAX_FILES];
+
 int config_add(const char *, unsigned char);
+int config_add_cache(unsigned char, const char *);
 bool config_parse(unsigned char);
+bool config_reload(unsigned char);
 int config_add_var(unsigned char, char *, void *, char, int, int, bool);
 void *config_get_entry(int, char *, int);
+int config_get_value(unsigned char, const char *, char *, size_t);
+int config_set_value(unsigned char, const char *, const char *);
+void config_foreach_var(unsigned char, void (*)(const char *, const char *, void *), void *);
 
 #endif
 
@@ -0,0 +1,45 @@
+// core_fork.c
+
+// counters of one process, all uint64_t so they can be summed as an array
+struct core_stats {
+	struct network_stats network;
+	struct network_egress_stats network_egress;
+	struct ssl_record_stats ssl_record;
+	struct ssl_session_stats ssl_session;
+	struct ssl_data_stats ssl_data;
+	struct tunnel_stats tunnel;
+	uint64_t log_dropped;
+};
+
+// sizes of one process, summed over running workers only
+struct core_gauges {
+	struct network_gauges network;
+	struct packet_gauges packet;
+	struct array_stats array;
+};
+
+extern int core_worker; // worker index, -1 when not pre-forked
+
+void core_config_init();
+bool do_fork();
+void core_stats_publish(bool force);
+void core_stats_total(struct core_stats *total);
+void core_gauges_total(struct core_gauges *total);
+
+// core_admin.c
+void core_admin_config_init();
+bool core_admin_init();
+
+// core_metrics.c
+char *core_metrics(size_t *size);
+
+// core_upgrade.c
+void core_upgrade_config_init();
+bool core_upgrade_init(char **argv);
+void core_upgrade_ready();
+void core_upgrade();
+bool core_upgrade_drained();
+
+// main.c
+bool core_reload();
+void core_apply();
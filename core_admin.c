@@ -0,0 +1,316 @@
+#define _GNU_SOURCE // accept4()
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "log.h"
+#include "ssl.h"
+#include "network.h"
+#include "cfg_files.h"
+#include "array.h"
+#include "tunnel.h"
+#include "core.h"
+
+/* Admin socket: a unix socket served by the event loop, one line per command.
+ * Replies end with "ok" or "error: <reason>". Workers each get their own
+ * socket, core_admin_socket plus ".<worker>".
+ *   help                   this list
+ *   vars                   registered variables and their values
+ *   get <var>              value of a variable, all of them for an array
+ *   set <var> <value>      set a registered variable, within its limits
+ *   conns                  established connections with their counters, time
+ *                          per event with network_event_timing = 1
+ *   close <id>             close a connection, id as listed by conns
+ *   reload                 what SIGHUP does
+ *   metrics                counters in the Prometheus text format
+ *   loop [reset]           event loop profile: time blocked and busy per
+ *                          iteration, per event (network_event_timing),
+ *                          events per wakeup
+ * A first line of "GET /metrics HTTP/1.x" gets the metrics as an HTTP response
+ * instead, for scrapers that speak HTTP over unix sockets. */
+
+#define CORE_ADMIN_LINE_MAX 1024
+
+static char *admin_socket;
+static struct network_connection *admin_listener;
+static struct network_connection *admin_client; // the one being answered
+static struct network_connection *admin_target; // close <id>
+
+void core_admin_config_init() {
+	config_add_var(CONFIG_CORE, "core_admin_socket", &admin_socket, CONF_VAR_STRING_POINTER, 1, 100, false);
+}
+
+static void core_admin_reply(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void core_admin_reply(const char *format, ...) {
+	char buf[CORE_ADMIN_LINE_MAX + 128];
+	va_list ap;
+
+	va_start(ap, format);
+	int len = vsnprintf(buf, sizeof(buf) - 1, format, ap);
+	va_end(ap);
+	if (len < 0) return;
+	if (len > (int)sizeof(buf) - 2) len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+	network_write(admin_client, buf, len);
+}
+
+static void core_admin_var(const char *name, const char *value, void *arg) {
+	core_admin_reply("%s = %s", name, value ? value : "(callback)");
+}
+
+static bool core_admin_conn(struct network_connection *net) {
+	char *ip = network_ip_string(net->remote, net->remote_len);
+	int port = 0;
+	uint64_t now = network_now();
+	struct network_egress *e = net->egress;
+
+	if (net->remote->sa_family == AF_INET) port = ntohs(((struct sockaddr_in *)net->remote)->sin_port);
+	if (net->remote->sa_family == AF_INET6) port = ntohs(((struct sockaddr_in6 *)net->remote)->sin6_port);
+	core_admin_reply("%p %s fd %d %s port %d age %llus idle %llus rx %llu tx %llu queued %zu mem %zu events %llu avg %lluus max %lluus egress %d dropped %llu",
+		net, net->stream ? "tcp" : "udp", net->fd, ip ? ip : "?", port,
+		(unsigned long long)(now - net->created) / 1000000000,
+		(unsigned long long)(net->last_event ? now - net->last_event : now - net->created) / 1000000000,
+		(unsigned long long)net->rx_bytes, (unsigned long long)net->tx_bytes, net->write_buf_pos, network_memory(net),
+		(unsigned long long)net->events,
+		(unsigned long long)(net->events ? net->event_ns / net->events / 1000 : 0),
+		(unsigned long long)net->event_ns_max / 1000,
+		e ? e->control.count + e->bulk.count : 0, (unsigned long long)(e ? e->dropped : 0));
+	free(ip);
+	return true;
+}
+
+// only compares pointers, the id may be anything
+static bool core_admin_close_one(struct network_connection *net) {
+	if (net != admin_target) return true;
+	log_printf("Admin closing %p", net);
+	admin_target = NULL;
+	return false;
+}
+
+static void core_admin_hdr(const char *name, const struct metrics_hdr *h) {
+	core_admin_reply("%-11s p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu (%llu)", name,
+		(unsigned long long)metrics_hdr_percentile(h, 50), (unsigned long long)metrics_hdr_percentile(h, 90),
+		(unsigned long long)metrics_hdr_percentile(h, 99), (unsigned long long)metrics_hdr_percentile(h, 99.9),
+		(unsigned long long)h->max, (unsigned long long)h->count);
+}
+
+static void core_admin_slowest(const char *name, const struct network_slowest *slow) {
+	if (slow->ns == 0) {
+		core_admin_reply("%s: none", name);
+		return;
+	}
+	core_admin_reply("%s: %lluus on fd %d (%p), %llus ago", name, (unsigned long long)slow->ns / 1000, slow->fd, slow->net,
+		(unsigned long long)(network_now() - slow->at) / 1000000000);
+}
+
+static void core_admin_loop() {
+	struct network_profile *p = &network_profile;
+
+	core_admin_reply("over %llus: %llu wakeups, %llu filled the batch, batch %d (grown %llu, shrunk %llu times)",
+		(unsigned long long)(network_now() - p->since) / 1000000000, (unsigned long long)p->events.count,
+		(unsigned long long)p->saturated, p->batch, (unsigned long long)p->grows, (unsigned long long)p->shrinks);
+	core_admin_hdr("blocked_us", &p->blocked_us);
+	core_admin_hdr("busy_us", &p->busy_us);
+	core_admin_hdr("event_us", &p->event_us);
+	core_admin_hdr("events", &p->events);
+	core_admin_slowest("slowest event", &p->slowest);
+	core_admin_slowest("slowest before", &p->last_slowest);
+}
+
+static void core_admin_command(char *line) {
+	char *cmd = strtok(line, " \t\r");
+	char *arg = strtok(NULL, " \t\r");
+	char *value = strtok(NULL, "\r");
+	char buf[1024];
+
+	if (cmd == NULL) return;
+
+	if (strcmp(cmd, "help") == 0) {
+		core_admin_reply("help, vars, get <var>, set <var> <value>, conns, close <id>, reload, metrics, loop [reset]");
+	} else if (strcmp(cmd, "vars") == 0) {
+		config_foreach_var(CONFIG_CORE, core_admin_var, NULL);
+	} else if ((strcmp(cmd, "get") == 0) && (arg != NULL)) {
+		if (config_get_value(CONFIG_CORE, arg, buf, sizeof(buf)) == 0) {
+			core_admin_reply("%s = %s", arg, buf);
+		} else {
+			// values set by the file only, arrays included
+			char *str;
+			int i;
+			for(i = 0; (str = config_get_entry(CONFIG_CORE, arg, i)) != NULL; i++)
+				core_admin_reply("%s = %s", arg, str);
+			if (i == 0) {
+				core_admin_reply("error: unknown variable %s", arg);
+				return;
+			}
+		}
+	} else if ((strcmp(cmd, "set") == 0) && (arg != NULL) && (value != NULL)) {
+		value += strspn(value, " \t");
+		if (config_set_value(CONFIG_CORE, arg, value) != 0) {
+			core_admin_reply("error: %s is not a registered variable", arg);
+			return;
+		}
+		log_printf("Admin set %s to %s", arg, value);
+		core_apply();
+		if (config_get_value(CONFIG_CORE, arg, buf, sizeof(buf)) == 0) core_admin_reply("%s = %s", arg, buf);
+	} else if (strcmp(cmd, "conns") == 0) {
+		network_foreach(core_admin_conn);
+	} else if ((strcmp(cmd, "close") == 0) && (arg != NULL)) {
+		admin_target = (struct network_connection *)(uintptr_t)strtoull(arg, NULL, 16);
+		network_foreach(core_admin_close_one);
+		if (admin_target != NULL) {
+			admin_target = NULL;
+			core_admin_reply("error: no connection %s", arg);
+			return;
+		}
+	} else if (strcmp(cmd, "metrics") == 0) {
+		size_t size;
+		char *metrics = core_metrics(&size);
+		if (metrics == NULL) {
+			core_admin_reply("error: out of memory");
+			return;
+		}
+		network_write(admin_client, metrics, size);
+		free(metrics);
+	} else if (strcmp(cmd, "loop") == 0) {
+		core_admin_loop();
+		if ((arg != NULL) && (strcmp(arg, "reset") == 0)) network_profile_reset();
+	} else if (strcmp(cmd, "reload") == 0) {
+		if (!core_reload()) {
+			core_admin_reply("error: failed to reload configuration");
+			return;
+		}
+	} else {
+		core_admin_reply("error: bad command, try help");
+		return;
+	}
+	core_admin_reply("ok");
+}
+
+// one request per connection, headers are not looked at
+static void core_admin_http(char *line) {
+	char header[160];
+	size_t size = 0;
+	char *body = NULL;
+	const char *status = "404 Not Found";
+
+	strtok(line, " ");
+	char *path = strtok(NULL, " \r");
+	if ((path != NULL) && (strcmp(path, "/metrics") == 0)) {
+		body = core_metrics(&size);
+		status = (body != NULL) ? "200 OK" : "500 Internal Server Error";
+	}
+	int len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, size);
+	network_write(admin_client, header, len);
+	if (body != NULL) network_write(admin_client, body, size);
+	free(body);
+	admin_client->close_on_flush = true;
+	network_want_flush(admin_client);
+}
+
+static void core_admin_read(struct network_connection *net) {
+	admin_client = net;
+	while(1) {
+		ssize_t res = read(net->fd, net->read_buf + net->read_buf_pos, CORE_ADMIN_LINE_MAX - net->read_buf_pos);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break;
+		}
+		if (res <= 0) {
+			// answer what was asked before going
+			net->close_on_flush = true;
+			network_want_flush(net);
+			break;
+		}
+		net->read_buf_pos += res;
+		net->rx_bytes += res;
+
+		char *line = net->read_buf, *eol;
+		while((eol = memchr(line, '\n', net->read_buf_pos - (line - (char *)net->read_buf))) != NULL) {
+			*eol = 0;
+			if (net->close_on_flush) {
+				// answered already, eg. the headers of an http request
+			} else if ((net->rx_bytes - net->read_buf_pos + (line - (char *)net->read_buf) == 0) && (strncmp(line, "GET ", 4) == 0)) {
+				core_admin_http(line);
+			} else {
+				core_admin_command(line);
+			}
+			line = eol + 1;
+		}
+		net->read_buf_pos -= line - (char *)net->read_buf;
+		memmove(net->read_buf, line, net->read_buf_pos);
+		if (net->read_buf_pos == CORE_ADMIN_LINE_MAX) {
+			core_admin_reply("error: line too long");
+			net->close_on_flush = true;
+			network_want_flush(net);
+			break;
+		}
+	}
+	admin_client = NULL;
+}
+
+static void core_admin_accept(struct network_connection *listener) {
+	int fd;
+
+	while((fd = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+		struct network_connection *net = network_register_fd(fd, core_admin_read);
+		if (net == NULL) {
+			close(fd);
+			continue;
+		}
+		net->stream = true;
+		net->read_buf = malloc(CORE_ADMIN_LINE_MAX);
+		if (net->read_buf == NULL) network_close(net);
+	}
+}
+
+/* core_admin_init : open the admin socket, if one is configured. Call after
+ * network_init(). */
+bool core_admin_init() {
+	struct sockaddr_un addr;
+
+	if (admin_socket == NULL) return true;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (core_worker >= 0) {
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d", admin_socket, core_worker);
+	} else {
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", admin_socket);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		log_perror();
+		return false;
+	}
+	// a process we replace may still have it, it serves its own peers only
+	unlink(addr.sun_path);
+	mode_t mask = umask(077);
+	int res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if ((res == -1) || (listen(fd, 4) == -1)) {
+		log_perror();
+		log_printf("Failed to open admin socket %s", addr.sun_path);
+		close(fd);
+		return false;
+	}
+
+	admin_listener = network_register_fd(fd, core_admin_accept);
+	if (admin_listener == NULL) {
+		close(fd);
+		return false;
+	}
+	log_printf("Admin socket on %s", addr.sun_path);
+	return true;
+}
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "log.h"
+#include "ssl.h"
+#include "network.h"
+#include "cfg_files.h"
+#include "array.h"
+#include "tunnel.h"
+#include "core.h"
+
+/* Daemon and pre-fork modes. With core_workers set, the first process becomes
+ * a supervisor: it forks the workers, each opens its own listening socket with
+ * SO_REUSEPORT so the kernel spreads peers over them, and replaces those that
+ * die. Their udp endpoints are the supervisor's, for datagrams to be steered
+ * to the worker that has their peer (network_workers_init()). Workers copy their counters in a shared segment, one slot each, that
+ * anyone can sum up with core_stats_total(). Slots are cache line aligned, a
+ * worker publishing its counters doesn't slow down its neighbours. */
+
+#define CORE_RESPAWN_DELAY 1 // s, for workers that die right after starting
+// workers failing their startup this many times in a row are not restarted, delays double in between
+#define CORE_RESPAWN_FAILURES 5
+/* loop iterations between two copies of the counters, the loop wakes up at
+ * least every 100ms so they are never more than a few seconds old */
+#define CORE_PUBLISH_EVERY 16
+
+struct core_slot {
+	pid_t pid; // 0 when not running
+	time_t started;
+	time_t respawn_at; // 0 if not waiting for a restart
+	uint32_t restarts;
+	uint32_t failures; // startups failed in a row
+	bool ready; // set by the worker once in its loop
+	struct core_stats stats; // written by the worker only
+	struct core_gauges gauges;
+} __attribute__((aligned(64)));
+
+struct core_shared {
+	struct core_stats retired; // counters of workers that exited
+	struct core_slot slots[];
+};
+
+int core_worker = -1;
+
+static int core_daemon = 0;
+static int core_workers = 0;
+static int slots; // core_workers at startup, reloads don't change it
+static struct core_shared *shared;
+static pid_t supervisor;
+
+void core_config_init() {
+	config_add_var(CONFIG_CORE, "core_daemon", &core_daemon, CONF_VAR_INT, 0, 1, false);
+	config_add_var(CONFIG_CORE, "core_workers", &core_workers, CONF_VAR_INT, 0, 256, false);
+	core_upgrade_config_init();
+	core_admin_config_init();
+}
+
+static void core_stats_add(struct core_stats *total, const struct core_stats *stats) {
+	uint64_t *t = (uint64_t *)total;
+	const uint64_t *s = (const uint64_t *)stats;
+	for(size_t i = 0; i < sizeof(struct core_stats) / sizeof(uint64_t); i++)
+		t[i] += s[i];
+}
+
+static void core_stats_self(struct core_stats *stats) {
+	stats->network = network_stats;
+	stats->network_egress = network_egress_stats;
+	stats->ssl_record = ssl_record_stats;
+	stats->ssl_session = ssl_session_stats;
+	stats->ssl_data = ssl_data_stats;
+	stats->tunnel = tunnel_stats;
+	stats->log_dropped = log_dropped();
+}
+
+static void core_gauges_self(struct core_gauges *gauges) {
+	network_gauges(&gauges->network);
+	packet_gauges(&gauges->packet);
+	gauges->array = array_stats;
+}
+
+/* core_stats_publish : worker side, call once per loop iteration, with force
+ * before exiting. */
+void core_stats_publish(bool force) {
+	static unsigned int iterations;
+
+	if (core_worker < 0) return;
+	// the first call comes from the loop, startup went well
+	shared->slots[core_worker].ready = true;
+	if (!force && (++iterations % CORE_PUBLISH_EVERY != 0)) return;
+	core_stats_self(&shared->slots[core_worker].stats);
+	core_gauges_self(&shared->slots[core_worker].gauges);
+}
+
+/* core_stats_total : counters over all workers, past and present. Workers keep
+ * running meanwhile: each counter is right, but they may be a few events
+ * apart. */
+void core_stats_total(struct core_stats *total) {
+	if (shared == NULL) {
+		core_stats_self(total);
+		return;
+	}
+	*total = shared->retired;
+	for(int i = 0; i < slots; i++) {
+		if (i == core_worker) {
+			// ours may not be published yet
+			struct core_stats self;
+			core_stats_self(&self);
+			core_stats_add(total, &self);
+			continue;
+		}
+		core_stats_add(total, &shared->slots[i].stats);
+	}
+}
+
+void core_gauges_total(struct core_gauges *total) {
+	if (shared == NULL) {
+		core_gauges_self(total);
+		return;
+	}
+	memset(total, 0, sizeof(*total));
+	for(int i = 0; i < slots; i++) {
+		struct core_gauges self;
+		const uint64_t *s = (const uint64_t *)&shared->slots[i].gauges;
+		if (i == core_worker) {
+			core_gauges_self(&self);
+			s = (const uint64_t *)&self;
+		} else if (shared->slots[i].pid == 0) {
+			continue;
+		}
+		uint64_t *t = (uint64_t *)total;
+		for(size_t j = 0; j < sizeof(struct core_gauges) / sizeof(uint64_t); j++)
+			t[j] += s[j];
+	}
+}
+
+static void core_stats_log() {
+	struct core_stats total;
+
+	for(int i = 0; i < slots; i++) {
+		struct core_slot *slot = &shared->slots[i];
+		log_printf("Worker %d: pid %d, %u restarts, %llu records sent", i, slot->pid, slot->restarts, (unsigned long long)slot->stats.ssl_record.records);
+	}
+	core_stats_total(&total);
+	log_printf("All workers: %llu records sent (%llu bytes), data channel %llu packets in, %llu out, %llu log lines dropped",
+		(unsigned long long)total.ssl_record.records, (unsigned long long)total.ssl_record.record_bytes,
+		(unsigned long long)total.ssl_data.rx_packets, (unsigned long long)total.ssl_data.tx_packets,
+		(unsigned long long)total.log_dropped);
+}
+
+/* core_spawn : fork worker i. Returns 0 in the worker, which goes on with the
+ * daemon's startup, the pid (or -1) in the supervisor. */
+static pid_t core_spawn(int i, const sigset_t *worker_mask) {
+	struct core_slot *slot = &shared->slots[i];
+
+	slot->ready = false;
+	log_close(); // the log writer thread would not survive the fork
+	pid_t pid = fork();
+	if (pid == 0) {
+		// a worker whose supervisor is gone is on its own, stop it
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() != supervisor) _exit(0);
+		sigprocmask(SIG_SETMASK, worker_mask, NULL);
+		core_worker = i;
+		memset(&slot->stats, 0, sizeof(slot->stats));
+		memset(&slot->gauges, 0, sizeof(slot->gauges));
+		log_init();
+		return 0;
+	}
+	log_init();
+
+	if (pid == -1) {
+		log_perror();
+		log_printf("Failed to start worker %d", i);
+		slot->respawn_at = time(NULL) + CORE_RESPAWN_DELAY;
+		return -1;
+	}
+	slot->pid = pid;
+	slot->started = time(NULL);
+	slot->respawn_at = 0;
+	log_printf("Started worker %d on pid %d", i, pid);
+	return pid;
+}
+
+static void core_reap(bool stopping) {
+	int status;
+	pid_t pid;
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for(int i = 0; i < slots; i++) {
+			struct core_slot *slot = &shared->slots[i];
+			if (slot->pid != pid) continue;
+
+			if (WIFSIGNALED(status)) {
+				log_printf("Worker %d (pid %d) killed by signal %d", i, pid, WTERMSIG(status));
+			} else {
+				log_printf("Worker %d (pid %d) exited with status %d", i, pid, WEXITSTATUS(status));
+			}
+			core_stats_add(&shared->retired, &slot->stats);
+			memset(&slot->stats, 0, sizeof(slot->stats));
+			memset(&slot->gauges, 0, sizeof(slot->gauges));
+			slot->pid = 0;
+			if (stopping) break;
+
+			// don't fork in a loop if it dies on startup, a bad config or a taken port won't go away
+			time_t now = time(NULL);
+			slot->failures = slot->ready ? 0 : slot->failures + 1;
+			if (slot->failures >= CORE_RESPAWN_FAILURES) {
+				log_printf("Worker %d failed to start %u times in a row, not restarting it", i, slot->failures);
+				slot->respawn_at = 0;
+				break;
+			}
+			if (slot->failures > 0)
+				slot->respawn_at = now + (CORE_RESPAWN_DELAY << (slot->failures - 1));
+			else
+				slot->respawn_at = (now - slot->started < CORE_RESPAWN_DELAY) ? now + CORE_RESPAWN_DELAY : now;
+			slot->restarts++;
+			break;
+		}
+	}
+}
+
+static void core_kill(int sig) {
+	for(int i = 0; i < slots; i++)
+		if (shared->slots[i].pid != 0) kill(shared->slots[i].pid, sig);
+}
+
+static bool core_running() {
+	for(int i = 0; i < slots; i++)
+		if (shared->slots[i].pid != 0) return true;
+	return false;
+}
+
+// running or waiting to be restarted
+static bool core_alive() {
+	for(int i = 0; i < slots; i++)
+		if ((shared->slots[i].pid != 0) || (shared->slots[i].respawn_at != 0)) return true;
+	return false;
+}
+
+/* do_fork : detach (core_daemon) and start the workers (core_workers). Returns
+ * in the process that runs the daemon, a worker or the only process. The
+ * supervisor never returns, it exits once its workers are gone. */
+bool do_fork() {
+	sigset_t mask, old;
+	bool stopping = false;
+
+	if (core_daemon) {
+		// config paths may be relative, and the log may be going to stderr
+		log_close();
+		int res = daemon(1, 1);
+		log_init();
+		if (res == -1) {
+			log_perror();
+			log_printf("Failed to detach");
+			return false;
+		}
+	}
+	if (core_workers == 0) return true;
+
+	slots = core_workers;
+	if (!network_workers_init(slots)) return false;
+	shared = mmap(NULL, sizeof(struct core_shared) + slots * sizeof(struct core_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		log_perror();
+		log_printf("Failed to map stats for %d workers", slots);
+		return false;
+	}
+	supervisor = getpid();
+
+	// signals wait for sigtimedwait() in the supervisor, workers get the old mask back
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, &old);
+
+	log_printf("Supervisor on pid %d, starting %d workers", supervisor, slots);
+	for(int i = 0; i < slots; i++)
+		if (core_spawn(i, &old) == 0) return true;
+
+	while(1) {
+		struct timespec timeout = { CORE_RESPAWN_DELAY, 0 };
+		siginfo_t info;
+
+		switch(sigtimedwait(&mask, &info, &timeout)) {
+			case SIGCHLD:
+				core_reap(stopping);
+				break;
+			case SIGHUP:
+				// workers reload on their own
+				log_printf("Reloading configuration");
+				if (config_reload(CONFIG_CORE)) log_reopen();
+				core_kill(SIGHUP);
+				break;
+			case SIGINT:
+			case SIGTERM:
+				log_printf("Got signal %d, stopping workers", info.si_signo);
+				stopping = true;
+				core_kill(SIGTERM);
+				break;
+			case SIGUSR1:
+				core_stats_log();
+				break;
+		}
+
+		if (stopping) {
+			if (!core_running()) exit(0);
+			continue;
+		}
+		if (!core_alive()) {
+			log_printf("No worker left, exiting");
+			exit(1);
+		}
+
+		time_t now = time(NULL);
+		for(int i = 0; i < slots; i++) {
+			struct core_slot *slot = &shared->slots[i];
+			if ((slot->pid != 0) || (slot->respawn_at == 0) || (slot->respawn_at > now)) continue;
+			if (core_spawn(i, &old) == 0) return true;
+		}
+	}
+}
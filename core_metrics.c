@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "ssl.h"
+#include "network.h"
+#include "cfg_files.h"
+#include "array.h"
+#include "tunnel.h"
+#include "core.h"
+
+/* Counters in the Prometheus text format (version 0.0.4), served by the admin
+ * socket. Counters are summed over all workers including those that exited, so
+ * they only go up; gauges over the running workers. */
+
+static void core_metrics_head(FILE *f, const char *name, const char *type, const char *help) {
+	fprintf(f, "# HELP cloudconnector_%s %s\n# TYPE cloudconnector_%s %s\n", name, help, name, type);
+}
+
+static void core_metrics_value(FILE *f, const char *name, const char *labels, uint64_t value) {
+	fprintf(f, "cloudconnector_%s%s%s%s %llu\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", (unsigned long long)value);
+}
+
+static void core_metrics_one(FILE *f, const char *name, const char *type, const char *help, uint64_t value) {
+	core_metrics_head(f, name, type, help);
+	core_metrics_value(f, name, NULL, value);
+}
+
+// bucket i holds values up to 2^i units, unit converts to the base unit of the metric
+static void core_metrics_histogram(FILE *f, const char *name, const char *help, const struct metrics_histogram *h, double unit) {
+	uint64_t count = 0;
+
+	core_metrics_head(f, name, "histogram", help);
+	for(int i = 0; i < METRICS_BUCKETS - 1; i++) {
+		count += h->buckets[i];
+		fprintf(f, "cloudconnector_%s_bucket{le=\"%.9g\"} %llu\n", name, unit * (double)(1ULL << i), (unsigned long long)count);
+	}
+	fprintf(f, "cloudconnector_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+	fprintf(f, "cloudconnector_%s_sum %.9g\n", name, unit * (double)h->sum);
+	fprintf(f, "cloudconnector_%s_count %llu\n", name, (unsigned long long)h->count);
+}
+
+/* core_metrics : render all metrics. Returns a malloc'd buffer, NULL if out of
+ * memory. */
+char *core_metrics(size_t *size) {
+	struct core_stats stats;
+	struct core_gauges gauges;
+	char *buf = NULL;
+
+	FILE *f = open_memstream(&buf, size);
+	if (f == NULL) return NULL;
+	core_stats_total(&stats);
+	core_gauges_total(&gauges);
+
+	// network.c
+	core_metrics_one(f, "accepts_total", "counter", "TCP connections accepted.", stats.network.accepts);
+	core_metrics_one(f, "accept_errors_total", "counter", "accept() failures other than EAGAIN.", stats.network.accept_errors);
+	core_metrics_one(f, "wakeups_total", "counter", "Event loop wakeups.", stats.network.wakeups);
+	core_metrics_one(f, "wakeups_saturated_total", "counter", "Wakeups that filled the epoll batch.", stats.network.saturated);
+	core_metrics_histogram(f, "events_per_wakeup", "Events returned by one epoll_wait().", &stats.network.events, 1);
+	core_metrics_head(f, "peers", "gauge", "Established peer connections.");
+	core_metrics_value(f, "peers", "proto=\"tcp\"", gauges.network.tcp_peers);
+	core_metrics_value(f, "peers", "proto=\"udp\"", gauges.network.udp_peers);
+	core_metrics_one(f, "buffer_bytes", "gauge", "Output buffers held by connections.", gauges.network.buffer_bytes);
+	core_metrics_one(f, "buffer_pool_bytes", "gauge", "Drained output buffers kept for reuse.", gauges.network.buffer_pool_bytes);
+	core_metrics_head(f, "packet_memory_bytes", "gauge", "Memory mapped for packet buffers, on reserved huge pages or not.");
+	core_metrics_value(f, "packet_memory_bytes", "backing=\"hugetlb\"", gauges.packet.huge_bytes);
+	core_metrics_value(f, "packet_memory_bytes", "backing=\"anonymous\"", gauges.packet.bytes - gauges.packet.huge_bytes);
+	core_metrics_one(f, "packet_free_bytes", "gauge", "Packet buffers in the shared pool.", gauges.packet.free_bytes);
+	core_metrics_one(f, "read_bytes_total", "counter", "Bytes read from TCP connections.", stats.network.read_bytes);
+	core_metrics_one(f, "write_bytes_total", "counter", "Bytes written to TCP connections.", stats.network.write_bytes);
+	core_metrics_one(f, "write_syscalls_total", "counter", "write() calls on TCP connections.", stats.network.write_syscalls);
+	core_metrics_one(f, "write_eagain_total", "counter", "Writes that found the socket buffer full.", stats.network.write_eagain);
+	core_metrics_one(f, "write_buf_full_total", "counter", "Writes refused because too much was queued.", stats.network.write_buf_full);
+	core_metrics_one(f, "udp_packets_total", "counter", "Datagrams received.", stats.network.udp_packets);
+	core_metrics_one(f, "udp_bytes_total", "counter", "Bytes received in datagrams.", stats.network.udp_bytes);
+	core_metrics_one(f, "udp_forwarded_total", "counter", "Datagrams passed to the previous process after an upgrade.", stats.network.udp_forwarded);
+	core_metrics_one(f, "worker_passed_total", "counter", "Datagrams and tunnel packets passed to the worker that has their peer.", stats.network.worker_passed);
+	core_metrics_one(f, "worker_pass_dropped_total", "counter", "Datagrams and tunnel packets dropped on the way to another worker.", stats.network.worker_pass_dropped);
+
+	// network_egress.c
+	core_metrics_head(f, "egress_packets_total", "counter", "Tunnel packets the egress scheduler let go, by class.");
+	core_metrics_value(f, "egress_packets_total", "class=\"control\"", stats.network_egress.control);
+	core_metrics_value(f, "egress_packets_total", "class=\"bulk\"", stats.network_egress.bulk);
+	core_metrics_head(f, "egress_dropped_total", "counter", "Tunnel packets the egress scheduler dropped, by reason.");
+	core_metrics_value(f, "egress_dropped_total", "reason=\"queue_full\"", stats.network_egress.queue_full);
+	core_metrics_value(f, "egress_dropped_total", "reason=\"unsent\"", stats.network_egress.unsent);
+	core_metrics_one(f, "egress_throttled_total", "counter", "Round robin turns skipped because the peer was over its rate.", stats.network_egress.throttled);
+
+	// ssl.c
+	core_metrics_head(f, "handshakes_total", "counter", "TLS and DTLS handshakes by outcome.");
+	core_metrics_value(f, "handshakes_total", "result=\"ok\"", stats.ssl_session.handshakes_ok);
+	core_metrics_value(f, "handshakes_total", "result=\"failed\"", stats.ssl_session.handshakes_failed);
+	core_metrics_value(f, "handshakes_total", "result=\"aborted\"", stats.ssl_session.handshakes_aborted);
+	core_metrics_histogram(f, "handshake_seconds", "Time from accept to handshake completion.", &stats.ssl_session.handshake_us, 1e-6);
+	core_metrics_one(f, "records_total", "counter", "Application records sent.", stats.ssl_record.records);
+	core_metrics_one(f, "record_bytes_total", "counter", "Plaintext bytes in application records.", stats.ssl_record.record_bytes);
+	core_metrics_head(f, "data_packets_total", "counter", "Data channel packets.");
+	core_metrics_value(f, "data_packets_total", "dir=\"tx\"", stats.ssl_data.tx_packets);
+	core_metrics_value(f, "data_packets_total", "dir=\"rx\"", stats.ssl_data.rx_packets);
+	core_metrics_head(f, "data_dropped_total", "counter", "Data channel packets dropped, by reason.");
+	core_metrics_value(f, "data_dropped_total", "reason=\"tx_full\"", stats.ssl_data.tx_dropped);
+	core_metrics_value(f, "data_dropped_total", "reason=\"unknown\"", stats.ssl_data.rx_unknown);
+	core_metrics_value(f, "data_dropped_total", "reason=\"replayed\"", stats.ssl_data.rx_replayed);
+	core_metrics_value(f, "data_dropped_total", "reason=\"bad\"", stats.ssl_data.rx_bad);
+
+	// tunnel.c
+	core_metrics_head(f, "tunnel_packets_total", "counter", "Tunnel packets, from peers (in), from the device to peers (out), between peers (forwarded).");
+	core_metrics_value(f, "tunnel_packets_total", "dir=\"in\"", stats.tunnel.in_packets);
+	core_metrics_value(f, "tunnel_packets_total", "dir=\"out\"", stats.tunnel.out_packets);
+	core_metrics_value(f, "tunnel_packets_total", "dir=\"forwarded\"", stats.tunnel.forwarded);
+	core_metrics_head(f, "tunnel_bytes_total", "counter", "Tunnel bytes, from peers (in) and from the device to peers (out).");
+	core_metrics_value(f, "tunnel_bytes_total", "dir=\"in\"", stats.tunnel.in_bytes);
+	core_metrics_value(f, "tunnel_bytes_total", "dir=\"out\"", stats.tunnel.out_bytes);
+	core_metrics_head(f, "tunnel_dropped_total", "counter", "Tunnel packets dropped, by reason.");
+	core_metrics_value(f, "tunnel_dropped_total", "reason=\"no_device\"", stats.tunnel.no_device);
+	core_metrics_value(f, "tunnel_dropped_total", "reason=\"no_route\"", stats.tunnel.no_route);
+	core_metrics_value(f, "tunnel_dropped_total", "reason=\"spoofed\"", stats.tunnel.spoofed);
+	core_metrics_value(f, "tunnel_dropped_total", "reason=\"bad\"", stats.tunnel.bad);
+	core_metrics_value(f, "tunnel_dropped_total", "reason=\"device_full\"", stats.tunnel.device_full);
+
+	// array.c
+	core_metrics_one(f, "array_values", "gauge", "Values stored in lookup tables.", gauges.array.values);
+	core_metrics_one(f, "array_memory_bytes", "gauge", "Memory held by lookup table nodes and keys.",
+		gauges.array.nodes * sizeof(struct array_node) + gauges.array.tables * 256 * sizeof(void *) + gauges.array.key_bytes);
+
+	core_metrics_one(f, "log_dropped_total", "counter", "Log lines dropped because the queue was full.", stats.log_dropped);
+
+	if (fclose(f) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE // close_range()
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "ssl.h"
+#include "network.h"
+#include "cfg_files.h"
+#include "array.h"
+#include "tunnel.h"
+#include "core.h"
+
+/* Hot upgrade: on SIGUSR2 the daemon starts its binary again (whatever is
+ * installed under argv[0] now) and passes it the listening socket and the udp
+ * endpoint over a unix socket (SCM_RIGHTS). Once the new process says it is
+ * running, this one leaves new peers to it and serves the established ones
+ * until they are gone, or for core_upgrade_drain seconds, then exits. The
+ * listening socket is never closed: peers connecting meanwhile wait in its
+ * backlog, whichever process accepts them.
+ *
+ * Live TLS sessions can't move, GnuTLS has no way to import the record state
+ * of one, so they stay where they are. So do DTLS peers and data channels: the
+ * new process reads the udp endpoint and passes the datagrams it has no peer
+ * for back to the old one, on a seqpacket socket that comes with the others
+ * (network_forward()). */
+
+#define CORE_UPGRADE_ENV "CC_UPGRADE_FD"
+#define CORE_UPGRADE_FD 3 // where the new process finds the unix socket
+
+static char **core_argv;
+static int upgrade_drain = 0; // s, 0 to wait for every peer
+static int upgrade_fd = -1; // new process: the old one waits for our go
+static pid_t upgrade_pid;
+static struct network_connection *upgrade_sock; // old process: waiting for the new one
+static int upgrade_forward = -1; // old process: our end of the forwarded datagrams
+static time_t draining_since; // 0 if not draining
+
+void core_upgrade_config_init() {
+	config_add_var(CONFIG_CORE, "core_upgrade_drain", &upgrade_drain, CONF_VAR_INT, 0, 86400 * 30, false);
+}
+
+static bool core_upgrade_send(int fd, int tcp, int udp, int forward) {
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctrl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+	int fds[3] = { tcp, udp, forward };
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	return sendmsg(fd, &msg, 0) == 1;
+}
+
+static bool core_upgrade_recv(int fd, int *tcp, int *udp, int *forward) {
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctrl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+	int fds[3];
+
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) return false;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if ((cmsg == NULL) || (cmsg->cmsg_type != SCM_RIGHTS) || (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))))
+		return false;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	*tcp = fds[0];
+	*udp = fds[1];
+	*forward = fds[2];
+	return true;
+}
+
+/* core_upgrade_init : remember how we were started, and if we are replacing a
+ * running process, take its sockets. Call before network_init(). */
+bool core_upgrade_init(char **argv) {
+	int tcp, udp, forward;
+
+	core_argv = argv;
+
+	const char *env = getenv(CORE_UPGRADE_ENV);
+	if (env == NULL) return true;
+	upgrade_fd = atoi(env);
+	unsetenv(CORE_UPGRADE_ENV);
+
+	if (!core_upgrade_recv(upgrade_fd, &tcp, &udp, &forward)) {
+		log_perror();
+		log_printf("Failed to get the sockets of the previous process");
+		return false;
+	}
+	network_inherit(tcp, udp, forward);
+	return true;
+}
+
+// new process: we are up, the old one can stop taking peers
+void core_upgrade_ready() {
+	char byte = 1;
+
+	if (upgrade_fd == -1) return;
+	if (write(upgrade_fd, &byte, 1) != 1) log_perror();
+	close(upgrade_fd);
+	upgrade_fd = -1;
+	log_printf("Took over from the previous process");
+}
+
+static void core_upgrade_event(struct network_connection *net) {
+	char byte;
+	int status;
+
+	ssize_t res = read(net->fd, &byte, 1);
+	if ((res == -1) && ((errno == EAGAIN) || (errno == EINTR))) return;
+
+	network_close(net);
+	upgrade_sock = NULL;
+
+	if (res != 1) {
+		close(upgrade_forward);
+		upgrade_forward = -1;
+		// the new process closes its end only by exiting
+		waitpid(upgrade_pid, &status, 0);
+		if (WIFSIGNALED(status)) {
+			log_printf("Upgrade failed, process %d killed by signal %d, keeping on", upgrade_pid, WTERMSIG(status));
+		} else {
+			log_printf("Upgrade failed, process %d exited with status %d, keeping on", upgrade_pid, WEXITSTATUS(status));
+		}
+		return;
+	}
+
+	if (!network_stop_listening(upgrade_forward)) {
+		log_printf("Failed to take datagrams back from process %d, our DTLS and data channel peers will have to come back", upgrade_pid);
+		close(upgrade_forward);
+	}
+	upgrade_forward = -1;
+	draining_since = time(NULL);
+	log_printf("Process %d took over, draining %d peers", upgrade_pid, network_peers());
+}
+
+/* core_upgrade : start the new binary (SIGUSR2). This process keeps going as
+ * before until the new one is ready. */
+void core_upgrade() {
+	int sv[2], fwd[2], tcp, udp;
+
+	if (core_worker >= 0) {
+		log_printf("Hot upgrade is not supported with core_workers");
+		return;
+	}
+	if ((upgrade_sock != NULL) || (draining_since != 0) || !network_listen_fds(&tcp, &udp)) {
+		log_printf("Upgrade already in progress");
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		log_perror();
+		return;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fwd) == -1) {
+		log_perror();
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+	// the kernel keeps the fds in the socket until the new process reads them
+	bool sent = core_upgrade_send(sv[0], tcp, udp, fwd[1]);
+	close(fwd[1]);
+	if (!sent) {
+		log_perror();
+		log_printf("Failed to pass sockets for the upgrade");
+		close(sv[0]);
+		close(sv[1]);
+		close(fwd[0]);
+		return;
+	}
+
+	log_printf("Upgrading: starting %s", core_argv[0]);
+	log_close(); // the log writer thread would not survive the fork
+	pid_t pid = fork();
+	if (pid == 0) {
+		sigset_t none;
+		char env[16];
+
+		// only the unix socket goes to the new process, every other fd is ours
+		dup2(sv[1], CORE_UPGRADE_FD);
+		close_range(CORE_UPGRADE_FD + 1, ~0U, 0);
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		snprintf(env, sizeof(env), "%d", CORE_UPGRADE_FD);
+		setenv(CORE_UPGRADE_ENV, env, 1);
+		execvp(core_argv[0], core_argv);
+		_exit(127);
+	}
+	log_init();
+	close(sv[1]);
+
+	if (pid == -1) {
+		log_perror();
+		log_printf("Failed to start the new process");
+		close(sv[0]);
+		close(fwd[0]);
+		return;
+	}
+	upgrade_pid = pid;
+	upgrade_forward = fwd[0];
+	upgrade_sock = network_register_fd(sv[0], core_upgrade_event);
+	if (upgrade_sock == NULL) {
+		close(sv[0]);
+		close(fwd[0]);
+		upgrade_forward = -1;
+	}
+}
+
+/* core_upgrade_drained : true once the old process may exit, all its peers are
+ * gone or core_upgrade_drain is over */
+bool core_upgrade_drained() {
+	if (draining_since == 0) return false;
+
+	int peers = network_peers();
+	if (peers == 0) {
+		log_printf("All peers gone, exiting");
+		return true;
+	}
+	if ((upgrade_drain > 0) && (time(NULL) - draining_since >= upgrade_drain)) {
+		log_printf("Drain time is over, closing %d peers", peers);
+		return true;
+	}
+	return false;
+}
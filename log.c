@@ -2,32 +2,365 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <syslog.h>
 
 #include "log.h"
+#include "cfg_files.h"
 
-bool log_init() {
-	return true;
+/* Lines are formatted on the calling thread into a ring owned by that thread
+ * (single producer, single consumer: no locks, no syscalls) and written out
+ * by a background thread. A full ring drops the line and counts it, callers
+ * never wait for the terminal or the disk.
+ * Before log_init() and after log_close(), lines are written directly.
+ *
+ * Each callsite also has a token bucket of log_rate_limit lines per second:
+ * past that its lines are counted instead of formatted, except one out of
+ * log_sample, and the writer reports the count once a second. GnuTLS debug
+ * output (ssl_debug) is never limited. */
+
+#define LOG_RING_SLOTS 1024 // power of 2
+#define LOG_LINE_MAX 480 // longer lines are truncated
+#define LOG_IDLE_SLEEP_MS 10
+#define LOG_SUPPRESS_REPORT_MS 1000
+
+struct log_entry {
+	struct timespec ts;
+	uint8_t level;
+	uint16_t len;
+	char text[LOG_LINE_MAX];
+};
+
+struct log_ring {
+	uint64_t head; // next slot to fill, written by the owner thread only
+	uint64_t tail; // next slot to write out, written by the writer only
+	uint64_t dropped; // owner thread only
+	uint64_t dropped_reported; // writer only
+	int used; // owned by a live thread
+	struct log_ring *next;
+	struct log_entry entries[LOG_RING_SLOTS];
+};
+
+static const char *log_level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+static const int log_syslog_priority[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+static struct log_ring *rings; // never shrinks, rings of finished threads get reused
+static __thread struct log_ring *ring_self;
+static pthread_key_t ring_key;
+static pthread_t writer;
+static bool writer_running, writer_stop, writer_reopen;
+static FILE *log_out; // writer only
+static bool log_out_syslog;
+
+// settings handed to the writer, config_reload() may free the originals any time
+static pthread_mutex_t reopen_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *reopen_file;
+static bool reopen_syslog;
+
+static char *log_file;
+static int log_syslog = 0;
+int log_level = LOG_LEVEL_DEBUG;
+static int log_rate_limit = 100; // lines per second and callsite, 0 for no limit
+static int log_sample = 0; // log 1 out of n lines over the limit, 0 for none
+
+void log_config_init() {
+	config_add_var(CONFIG_CORE, "log_file", &log_file, CONF_VAR_STRING_POINTER, 1, 255, false);
+	config_add_var(CONFIG_CORE, "log_syslog", &log_syslog, CONF_VAR_INT, 0, 1, false);
+	config_add_var(CONFIG_CORE, "log_level", &log_level, CONF_VAR_INT, LOG_LEVEL_ERROR, LOG_LEVEL_DEBUG, false);
+	config_add_var(CONFIG_CORE, "log_rate_limit", &log_rate_limit, CONF_VAR_INT, 0, 1000000, false);
+	config_add_var(CONFIG_CORE, "log_sample", &log_sample, CONF_VAR_INT, 0, 1000000, false);
+	log_trace_config_init();
+}
+
+static void log_write_line(FILE *out, bool use_syslog, const struct timespec *ts, int level, const char *text, int len) {
+	if (use_syslog) {
+		syslog(log_syslog_priority[level], "%.*s", len, text);
+		return;
+	}
+	struct tm tm;
+	char date[32];
+	localtime_r(&ts->tv_sec, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(out, "%s.%06ld %-5s %.*s\n", date, ts->tv_nsec / 1000, log_level_names[level], len, text);
+}
+
+// thread exit: the ring keeps its pending lines, the next new thread takes it over
+static void log_ring_release(void *arg) {
+	struct log_ring *ring = arg;
+	__atomic_store_n(&ring->used, 0, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *log_ring_get() {
+	struct log_ring *ring;
+
+	if (ring_self != NULL) return ring_self;
+
+	for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		int expected = 0;
+		if (__atomic_compare_exchange_n(&ring->used, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+	if (ring == NULL) {
+		ring = calloc(sizeof(struct log_ring), 1);
+		if (ring == NULL) return NULL;
+		ring->used = 1;
+		ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	ring_self = ring;
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+void log_vprintf(int level, const char *format, va_list ap) {
+	struct timespec ts;
+
+	if (level > log_level) return;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	struct log_ring *ring = __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE) ? log_ring_get() : NULL;
+	if (ring == NULL) {
+		char text[LOG_LINE_MAX];
+		int len = vsnprintf(text, sizeof(text), format, ap);
+		if (len >= (int)sizeof(text)) len = sizeof(text) - 1;
+		log_write_line(stderr, log_syslog, &ts, level, text, len);
+		return;
+	}
+
+	uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct log_entry *entry = &ring->entries[head % LOG_RING_SLOTS];
+	int len = vsnprintf(entry->text, sizeof(entry->text), format, ap);
+	if (len >= (int)sizeof(entry->text)) len = sizeof(entry->text) - 1;
+	if (len < 0) len = 0;
+	entry->ts = ts;
+	entry->level = level;
+	entry->len = len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t log_now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* log_site_allow : take a token from the callsite's bucket, which holds up to
+ * one second worth of lines. Callers on other threads may race on the refill,
+ * at worst a few extra lines get through. */
+static bool log_site_allow(struct log_callsite *site) {
+	uint32_t rate = log_rate_limit;
+
+	if (rate == 0) return true;
+
+	uint64_t now = log_now_ms();
+	uint64_t refill = __atomic_load_n(&site->refill, __ATOMIC_RELAXED);
+	uint64_t add = (now - refill) * rate / 1000;
+	if ((add > 0) && __atomic_compare_exchange_n(&site->refill, &refill, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		uint32_t tokens = __atomic_load_n(&site->tokens, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->tokens, (tokens + add > rate) ? rate : tokens + add, __ATOMIC_RELAXED);
+	}
+
+	uint32_t tokens = __atomic_load_n(&site->tokens, __ATOMIC_RELAXED);
+	while(tokens > 0) {
+		if (__atomic_compare_exchange_n(&site->tokens, &tokens, tokens - 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return true;
+	}
+
+	uint32_t over = __atomic_add_fetch(&site->over_limit, 1, __ATOMIC_RELAXED);
+	if ((log_sample > 0) && (over % log_sample == 0)) return true;
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	return false;
 }
 
-void log_perror() {
-	fprintf(stderr, "System error: %s\n", strerror(errno));
+void log_site_vprintf(struct log_callsite *site, va_list ap) {
+	if (site->level > log_level) return;
+	if (!log_site_allow(site)) return;
+	log_vprintf(site->level, site->format, ap);
 }
 
-int log_printf(const char *format, ...) {
-	int res;
+void log_site_printf(struct log_callsite *site, ...) {
 	va_list ap;
-	va_start(ap, format);
-	res = vfprintf(stderr, format, ap);
+	va_start(ap, site);
+	log_site_vprintf(site, ap);
 	va_end(ap);
+}
+
+// writer side: one line per callsite that went over its limit since last time
+static void log_report_suppressed() {
+	bool reported = false;
+
+	for(struct log_callsite *site = __start_cc_log_sites; site < __stop_cc_log_sites; site++) {
+		uint32_t suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		if (suppressed == 0) continue;
+
+		struct timespec ts;
+		char text[LOG_LINE_MAX];
+		clock_gettime(CLOCK_REALTIME, &ts);
+		int len = snprintf(text, sizeof(text), "%s:%d: suppressed %u messages like \"%s\"", site->file, site->line, suppressed, site->format);
+		if (len >= (int)sizeof(text)) len = sizeof(text) - 1;
+		log_write_line(log_out, log_out_syslog, &ts, LOG_LEVEL_WARNING, text, len);
+		reported = true;
+	}
+	if (reported && !log_out_syslog) fflush(log_out);
+}
+
+// writer side: write out everything queued so far, returns the number of lines
+static int log_drain() {
+	int lines = 0;
+
+	for(struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+
+		for(; tail != head; tail++) {
+			struct log_entry *entry = &ring->entries[tail % LOG_RING_SLOTS];
+			log_write_line(log_out, log_out_syslog, &entry->ts, entry->level, entry->text, entry->len);
+			lines++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported) {
+			struct timespec ts;
+			char text[64];
+			clock_gettime(CLOCK_REALTIME, &ts);
+			int len = snprintf(text, sizeof(text), "%llu log lines dropped", (unsigned long long)(dropped - ring->dropped_reported));
+			log_write_line(log_out, log_out_syslog, &ts, LOG_LEVEL_WARNING, text, len);
+			ring->dropped_reported = dropped;
+			lines++;
+		}
+	}
+	if ((lines > 0) && !log_out_syslog) fflush(log_out);
+	return lines;
+}
+
+// writer side: switch output to the settings given by log_reopen()
+static void log_open() {
+	pthread_mutex_lock(&reopen_lock);
+	char *file = reopen_file;
+	bool use_syslog = reopen_syslog;
+	reopen_file = NULL;
+	pthread_mutex_unlock(&reopen_lock);
+
+	if (log_out_syslog) closelog();
+	if ((log_out != NULL) && (log_out != stderr)) fclose(log_out);
+	log_out = stderr;
+	log_out_syslog = use_syslog;
+
+	if (use_syslog) {
+		openlog("cloudconnector", LOG_PID, LOG_DAEMON);
+	} else if (file != NULL) {
+		log_out = fopen(file, "a");
+		if (log_out == NULL) {
+			fprintf(stderr, "Failed to open log file %s: %s, logging to stderr\n", file, strerror(errno));
+			log_out = stderr;
+		}
+	}
+	free(file);
+}
+
+static void *log_writer(void *arg) {
+	uint64_t last_report = log_now_ms();
+
+	while(1) {
+		if (__atomic_exchange_n(&writer_reopen, false, __ATOMIC_ACQ_REL))
+			log_open();
+		if (log_now_ms() - last_report >= LOG_SUPPRESS_REPORT_MS) {
+			log_report_suppressed();
+			last_report = log_now_ms();
+		}
+		if (log_drain() > 0) continue;
+		if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) break;
 
-	fprintf(stderr, "\n");
+		struct timespec ts = { 0, LOG_IDLE_SLEEP_MS * 1000000 };
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+/* log_init : start the writer. Can be called again after log_close(), a
+ * process that forks must do so (nothing but the forking thread survives). */
+bool log_init() {
+	static bool initialized = false;
+	sigset_t all, old;
+
+	if ((!initialized) && (pthread_key_create(&ring_key, log_ring_release) != 0)) return false;
+	log_reopen(); // the writer opens the output first thing
+	__atomic_store_n(&writer_stop, false, __ATOMIC_RELEASE);
+
+	// signals are for the event loop (signalfd), never for the writer
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int res = pthread_create(&writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (res != 0) {
+		fprintf(stderr, "Failed to start log writer thread\n");
+		return false;
+	}
+
+	__atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+	if (initialized) return true;
+	initialized = true;
+	atexit(log_close);
+	return log_trace_init();
+}
+
+/* log_reopen : pick up log_* settings again and reopen the log file (after a
+ * rotation for example). Done by the writer, lines are not lost. */
+void log_reopen() {
+	pthread_mutex_lock(&reopen_lock);
+	free(reopen_file);
+	reopen_file = log_file ? strdup(log_file) : NULL;
+	reopen_syslog = log_syslog;
+	pthread_mutex_unlock(&reopen_lock);
+	__atomic_store_n(&writer_reopen, true, __ATOMIC_RELEASE);
+}
+
+// write out what is pending and go back to direct output
+void log_close() {
+	if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) return;
+
+	__atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	__atomic_store_n(&writer_running, false, __ATOMIC_RELEASE);
+	log_drain(); // lines that raced with the stop
+	log_report_suppressed();
+	if (log_out_syslog) closelog();
+	if (log_out != stderr) fclose(log_out);
+	log_out = stderr;
+	log_out_syslog = false;
+}
 
-	return res;
+static void log_unlimited_printf(int level, const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	log_vprintf(level, format, ap);
+	va_end(ap);
 }
 
+/* GnuTLS debug output, only there with ssl_debug: what was asked for isn't
+ * rate limited, and one callsite for all of GnuTLS would cut most of it */
 void log_ssl_func(int level, const char* msg) {
-	log_printf("%s", msg);
+	// GnuTLS lines come with their own newline
+	int len = strlen(msg);
+	while((len > 0) && (msg[len - 1] == '\n')) len--;
+	log_unlimited_printf(LOG_LEVEL_DEBUG, "%.*s", len, msg);
 }
 
+// lines dropped because a ring was full, over all threads
+uint64_t log_dropped() {
+	uint64_t total = 0;
+	for(struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+		total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	return total;
+}
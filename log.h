@@ -1,5 +1,112 @@
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+enum log_level {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+};
+
+extern int log_level; // lines above it are not logged
+
+void log_config_init();
 bool log_init();
-void log_perror();
-int log_printf(const char *format, ...);
+void log_reopen();
+void log_close();
 void log_ssl_func(int level, const char*);
+uint64_t log_dropped();
+void log_vprintf(int level, const char *format, va_list ap);
+
+// log_format.c
+#define LOG_ARG_INT 1
+#define LOG_ARG_LONG 2
+#define LOG_ARG_DOUBLE 3
+#define LOG_ARG_PTR 4
+#define LOG_ARG_STR 5
+
+const char *log_format_spec(const char *p, int *cls);
+int log_format_args(const char *format, uint8_t *args, int max);
+
+// log_trace.c
+#define LOG_TRACE_MAX_ARGS 8
+
+/* one per log_printf() or log_trace() call in the source, all of them end up
+ * next to each other in the cc_log_sites section: the index there is the
+ * format id for the trace, and each has its own rate limiter. The
+ * size must be a multiple of the alignment gcc may give them on its own (up to
+ * 32 bytes on x86-64), or the section gets holes. */
+struct log_callsite {
+	const char *format;
+	const char *file;
+	int line;
+	int level;
+	int nargs; // -1 until the format was parsed, -2 if it can't be traced
+	uint8_t args[LOG_TRACE_MAX_ARGS];
+	uint64_t refill; // ms, rate limiter state (log.c)
+	uint32_t tokens;
+	uint32_t suppressed; // since the last summary
+	uint32_t over_limit; // for log_sample
+} __attribute__((aligned(64)));
+
+extern struct log_callsite __start_cc_log_sites[], __stop_cc_log_sites[];
+
+#define LOG_CALLSITE(name_, level_, format_) \
+	static struct log_callsite name_ __attribute__((section("cc_log_sites"), used)) = { \
+		.format = format_, .file = __FILE__, .line = __LINE__, .level = level_, .nargs = -1 }
+
+#define log_level_printf(level_, format_, ...) do { \
+	LOG_CALLSITE(log_site_, level_, format_); \
+	log_site_printf(&log_site_, ##__VA_ARGS__); \
+} while(0)
+
+#define log_printf(format_, ...) log_level_printf(LOG_LEVEL_INFO, format_, ##__VA_ARGS__)
+
+// errno of the failed call, on the caller's callsite (and rate limit)
+#define log_perror() log_level_printf(LOG_LEVEL_ERROR, "System error: %s", strerror(errno))
+
+#define log_trace(level_, format_, ...) do { \
+	LOG_CALLSITE(log_site_, level_, format_); \
+	log_trace_call(&log_site_, ##__VA_ARGS__); \
+} while(0)
+
+void log_site_printf(struct log_callsite *site, ...);
+void log_site_vprintf(struct log_callsite *site, va_list ap);
+
+/* Trace file: header, callsite table, string blob, then a ring of fixed size
+ * records. Records are claimed with an atomic increment of head, their seq
+ * is set to 0 before they are written and to the sequence number + 1, last,
+ * when they are valid. Readers copy a record and check its seq again. */
+#define LOG_TRACE_MAGIC "CCTRACE1"
+#define LOG_TRACE_RECORD_SIZE 128
+
+struct log_trace_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t records;
+	uint32_t sites;
+	uint32_t sites_offset; // struct log_trace_site[sites]
+	uint32_t ring_offset;
+	uint32_t pad;
+	uint64_t head; // sequence number of the next record
+};
+
+struct log_trace_site {
+	uint32_t line;
+	uint32_t level;
+	uint32_t file; // offsets from the start of the file
+	uint32_t format;
+};
+
+struct log_trace_record {
+	uint64_t seq;
+	uint64_t ts; // ns, CLOCK_REALTIME
+	uint32_t site;
+	uint16_t len; // bytes used in data
+	uint8_t data[LOG_TRACE_RECORD_SIZE - 22]; // 8 bytes per number, strings as length + bytes
+};
 
+void log_trace_config_init();
+bool log_trace_init();
+void log_trace_call(struct log_callsite *site, ...);
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "log.h"
+
+/* printf format scanning for the binary trace: the daemon needs the argument
+ * types to copy them off a va_list, cclogdecode needs each conversion on its
+ * own to render them again. Only what log calls use is supported: no '*'
+ * width/precision, no %n. */
+
+/* log_format_spec : parse the conversion starting at the '%' in p. Returns the
+ * end of it and stores its argument class, 0 for "%%", -1 if unsupported. */
+const char *log_format_spec(const char *p, int *cls) {
+	bool is_long = false;
+
+	p++; // '%'
+	if (*p == '%') {
+		*cls = 0;
+		return p + 1;
+	}
+	while((*p != 0) && (strchr("-+ #0'", *p) != NULL)) p++; // flags
+	while((*p >= '0') && (*p <= '9')) p++; // width
+	if (*p == '.') {
+		p++;
+		while((*p >= '0') && (*p <= '9')) p++; // precision
+	}
+	while((*p != 0) && (strchr("hlLqjzt", *p) != NULL)) {
+		if (*p != 'h') is_long = true;
+		p++;
+	}
+
+	switch(*p) {
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+			*cls = is_long ? LOG_ARG_LONG : LOG_ARG_INT;
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			*cls = LOG_ARG_DOUBLE;
+			break;
+		case 'p':
+			*cls = LOG_ARG_PTR;
+			break;
+		case 's':
+			*cls = LOG_ARG_STR;
+			break;
+		default:
+			*cls = -1;
+			return p;
+	}
+	return p + 1;
+}
+
+/* log_format_args : argument classes of a format, in order. Returns how many
+ * there are, or -1 if the format can't be traced (unsupported, too many). */
+int log_format_args(const char *format, uint8_t *args, int max) {
+	int count = 0;
+
+	for(const char *p = strchr(format, '%'); p != NULL; p = strchr(p, '%')) {
+		int cls;
+		p = log_format_spec(p, &cls);
+		if (cls < 0) return -1;
+		if (cls == 0) continue;
+		if (count == max) return -1;
+		args[count++] = cls;
+	}
+	return count;
+}
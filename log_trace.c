@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "cfg_files.h"
+
+/* Binary trace: with log_trace_file set, log_trace() only stores the callsite
+ * index, a timestamp and the raw arguments into an mmap'd ring file, the text
+ * is rendered later by cclogdecode. Without it, log_trace() is a plain
+ * log_printf() at the callsite's level, rate limit included. */
+
+static struct log_trace_header *trace; // mapped file, NULL when off
+static struct log_trace_record *trace_ring;
+
+static char *trace_file;
+static int trace_size = 16; // MB
+
+void log_trace_config_init() {
+	config_add_var(CONFIG_CORE, "log_trace_file", &trace_file, CONF_VAR_STRING_POINTER, 1, 255, false);
+	config_add_var(CONFIG_CORE, "log_trace_size", &trace_size, CONF_VAR_INT, 1, 4096, false);
+}
+
+/* log_trace_init : create the trace file. The callsite table goes in first, so
+ * the file can be decoded without the binary that wrote it. */
+bool log_trace_init() {
+	struct log_callsite *site;
+	uint32_t sites = __stop_cc_log_sites - __start_cc_log_sites;
+	size_t strings = 0;
+
+	if (trace_file == NULL) return true;
+
+	for(site = __start_cc_log_sites; site < __stop_cc_log_sites; site++)
+		strings += strlen(site->file) + strlen(site->format) + 2;
+
+	uint32_t records = ((size_t)trace_size * 1024 * 1024) / LOG_TRACE_RECORD_SIZE;
+	size_t ring_offset = sizeof(struct log_trace_header) + sites * sizeof(struct log_trace_site) + strings;
+	ring_offset = (ring_offset + 4095) & ~4095; // keep records cache line aligned
+	size_t size = ring_offset + (size_t)records * LOG_TRACE_RECORD_SIZE;
+
+	// a new file: a process we are replacing may still have the old one mapped
+	unlink(trace_file);
+	int fd = open(trace_file, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+	if (fd == -1) {
+		log_perror();
+		log_printf("Failed to create trace file %s", trace_file);
+		return false;
+	}
+	if (ftruncate(fd, size) == -1) {
+		log_perror();
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_perror();
+		log_printf("Failed to map trace file %s", trace_file);
+		return false;
+	}
+
+	struct log_trace_header *header = map;
+	struct log_trace_site *table = map + sizeof(struct log_trace_header);
+	char *blob = (char *)(table + sites);
+
+	memcpy(header->magic, LOG_TRACE_MAGIC, sizeof(header->magic));
+	header->record_size = LOG_TRACE_RECORD_SIZE;
+	header->records = records;
+	header->sites = sites;
+	header->sites_offset = sizeof(struct log_trace_header);
+	header->ring_offset = ring_offset;
+
+	for(uint32_t i = 0; i < sites; i++) {
+		site = &__start_cc_log_sites[i];
+		table[i].line = site->line;
+		table[i].level = site->level;
+		table[i].file = blob - (char *)map;
+		blob = stpcpy(blob, site->file) + 1;
+		table[i].format = blob - (char *)map;
+		blob = stpcpy(blob, site->format) + 1;
+	}
+
+	trace_ring = map + ring_offset;
+	__atomic_store_n(&trace, header, __ATOMIC_RELEASE);
+	log_printf("Tracing %u callsites to %s (%u records)", sites, trace_file, records);
+	return true;
+}
+
+void log_trace_call(struct log_callsite *site, ...) {
+	struct log_trace_header *header = __atomic_load_n(&trace, __ATOMIC_ACQUIRE);
+	struct timespec ts;
+	va_list ap;
+
+	if (site->level > log_level) return;
+
+	// first use of this callsite, threads racing here all write the same thing
+	if (site->nargs == -1) {
+		int nargs = log_format_args(site->format, site->args, LOG_TRACE_MAX_ARGS);
+		__atomic_store_n(&site->nargs, nargs < 0 ? -2 : nargs, __ATOMIC_RELEASE);
+	}
+
+	va_start(ap, site);
+	if ((header == NULL) || (site->nargs < 0)) {
+		log_site_vprintf(site, ap);
+		va_end(ap);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t seq = __atomic_fetch_add(&header->head, 1, __ATOMIC_RELAXED);
+	struct log_trace_record *record = &trace_ring[seq % header->records];
+	// invalid while it is written, a reader that copied it in the meantime sees the change
+	__atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	uint8_t *p = record->data, *end = record->data + sizeof(record->data);
+
+	for(int i = 0; i < site->nargs; i++) {
+		uint64_t value = 0; // args[] only holds the types above, but the compiler can't know
+		double d;
+		switch(site->args[i]) {
+			case LOG_ARG_INT: value = (int64_t)va_arg(ap, int); break;
+			case LOG_ARG_LONG: value = va_arg(ap, long); break;
+			case LOG_ARG_PTR: value = (uintptr_t)va_arg(ap, void *); break;
+			case LOG_ARG_DOUBLE:
+				d = va_arg(ap, double);
+				memcpy(&value, &d, sizeof(value));
+				break;
+			case LOG_ARG_STR:
+				{
+					const char *str = va_arg(ap, const char *);
+					if (str == NULL) str = "(null)";
+					size_t len = strlen(str);
+					// keep room for the numbers that may follow, strings get cut instead
+					size_t room = end - p - 1 - (site->nargs - i - 1) * 8;
+					if (len > room) len = room;
+					if (len > 255) len = 255;
+					*p++ = len;
+					memcpy(p, str, len);
+					p += len;
+				}
+				continue;
+		}
+		memcpy(p, &value, sizeof(value));
+		p += sizeof(value);
+	}
+	va_end(ap);
+
+	record->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	record->site = site - __start_cc_log_sites;
+	record->len = p - record->data;
+	__atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
@@ -2,34 +2,122 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "log.h"
 #include "ssl.h"
 #include "network.h"
 #include "cfg_files.h"
+#include "array.h"
+#include "tunnel.h"
+#include "core.h"
 
-void do_fork() {
-	// TODO HERE: FORK (after checking for config var core_fork ?)
+bool stop;
+
+// settings changed, apply those that aren't read on the fly
+void core_apply() {
+	log_reopen();
+	ssl_reload();
+	tunnel_reload();
 }
 
-bool stop;
+bool core_reload() {
+	log_printf("Reloading configuration");
+	if (!config_reload(CONFIG_CORE)) {
+		log_printf("Failed to reload configuration, keeping current settings");
+		return false;
+	}
+	core_apply();
+	return true;
+}
+
+static void core_signal(struct network_connection *net) {
+	struct signalfd_siginfo info;
+
+	while(read(net->fd, &info, sizeof(info)) == sizeof(info)) {
+		switch(info.ssi_signo) {
+			case SIGHUP:
+				core_reload();
+				break;
+			case SIGUSR2:
+				core_upgrade();
+				break;
+			case SIGINT:
+			case SIGTERM:
+				// leave the loop, pending log lines get written on exit
+				log_printf("Got signal %d, exiting", info.ssi_signo);
+				stop = true;
+				break;
+		}
+	}
+}
+
+/* signals are received through the event loop, never asynchronously */
+static bool core_signal_init() {
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		log_perror();
+		return false;
+	}
+
+	int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd == -1) {
+		log_perror();
+		log_printf("Failed to create signalfd");
+		return false;
+	}
+
+	return network_register_fd(fd, core_signal) != NULL;
+}
 
 int main(int argc, char *argv[]) {
+	int opt;
+
 	stop = false;
 	config_add("cloudconnector.conf", CONFIG_CORE);
+	// -c snapshot : keep the parsed config there, reloads and upgrades skip the parse while it holds
+	while((opt = getopt(argc, argv, "c:")) != -1) {
+		switch(opt) {
+			case 'c': config_add_cache(CONFIG_CORE, optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-c config_snapshot]\n", argv[0]);
+				return 1;
+		}
+	}
 	ssl_config_init();
 	network_config_init();
+	packet_config_init();
+	tunnel_config_init();
+	log_config_init();
+	core_config_init();
 	if (!config_parse(CONFIG_CORE)) return 1;
 	if (!log_init()) return 1;
-	do_fork();
+	if (!do_fork()) return 1;
 	log_printf("CloudConnector initializing on pid %d", getpid());
 	if (!ssl_init()) return 1;
+	if (!core_upgrade_init(argv)) return 1;
 	if (!network_init()) return 1;
+	if (!ssl_verify_watch()) return 1;
+	if (!tunnel_init()) return 1;
+	if (!core_admin_init()) return 1;
+	if (!core_signal_init()) return 1;
+	core_upgrade_ready();
 
 	while(!stop) {
 		network_sleep();
+		core_stats_publish(false);
+		if (core_upgrade_drained()) break;
 	}
+	core_stats_publish(true);
 
 	return 0;
 }
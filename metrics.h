@@ -0,0 +1,63 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+
+/* log2 histogram, all uint64_t so it sums like the other counters. Bucket i
+ * counts values up to 2^i units, the last one everything above. */
+#define METRICS_BUCKETS 24
+
+struct metrics_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+static inline void metrics_observe(struct metrics_histogram *h, uint64_t value) {
+	int i = (value <= 1) ? 0 : 64 - __builtin_clzll(value - 1);
+	if (i >= METRICS_BUCKETS) i = METRICS_BUCKETS - 1;
+	h->buckets[i]++;
+	h->count++;
+	h->sum += value;
+}
+
+/* log-linear (HDR style) histogram for percentiles: exact below 16, then 8
+ * buckets per power of two, so within 12.5%. Values up to 2^36. */
+#define METRICS_HDR_BUCKETS (16 + (36 - 4) * 8)
+
+struct metrics_hdr {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[METRICS_HDR_BUCKETS];
+};
+
+static inline void metrics_hdr_record(struct metrics_hdr *h, uint64_t value) {
+	int i = value;
+	if (value >= 16) {
+		int major = 63 - __builtin_clzll(value);
+		i = (major >= 36) ? METRICS_HDR_BUCKETS - 1 : 16 + (major - 4) * 8 + ((value >> (major - 3)) & 7);
+	}
+	h->buckets[i]++;
+	h->count++;
+	if (value > h->max) h->max = value;
+}
+
+// highest value bucket i can hold
+static inline uint64_t metrics_hdr_upper(int i) {
+	if (i < 16) return i;
+	int major = 4 + (i - 16) / 8;
+	return ((uint64_t)(9 + (i - 16) % 8) << (major - 3)) - 1;
+}
+
+// value at percentile p (0-100), never above the largest one seen
+static inline uint64_t metrics_hdr_percentile(const struct metrics_hdr *h, double p) {
+	uint64_t rank = p / 100 * h->count, seen = 0;
+
+	for(int i = 0; i < METRICS_HDR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) return metrics_hdr_upper(i) < h->max ? metrics_hdr_upper(i) : h->max;
+	}
+	return h->max;
+}
+
+#endif
@@ -3,28 +3,119 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include "network.h"
 #include "log.h"
 #include "cfg_files.h"
 #include "array.h"
 #include "ssl.h"
+#include "tunnel.h"
+#include "probes.h"
+#include "core.h"
 
-#define EPOLL_MAX_EVENTS 16
+#define NETWORK_DGRAM_MAXSIZE 65536
+#define NETWORK_EGRESS_BATCH 64 // packets per ssl_data_send_batch()
 
-static array_t *sockets;
+/* connections by fd. The kernel hands out the lowest free fd, so a flat
+ * table stays dense: 8 bytes a connection where a trie node and its key
+ * took over 250. */
+static struct network_connection **sockets;
+static int sockets_size, sockets_count;
+static array_t *udp_peers; // DTLS sessions, keyed by network_addr_key()
 
 static int epoll_handle;
-static struct epoll_event ev, epoll_events[EPOLL_MAX_EVENTS];
+static struct epoll_event ev, epoll_events[NETWORK_BATCH_MAX];
 
 static char *listen_addr = NULL;
 static int port = 65534;
+static int udp_timeout = 60;
+static int listen_backlog = SOMAXCONN; // the kernel caps it at net.core.somaxconn
+static time_t udp_last_expire = 0;
+
+static struct network_connection *flush_list;
+static struct network_connection *tcp_listener, *udp_listener;
+static int inherited_tcp = -1, inherited_udp = -1;
+static int udp_forward = -1; // new process: datagrams we have no peer for go to the previous one
+static int workers; // core_workers, 0 when not pre-forked
+static int *worker_udp; // udp endpoint of each worker, one SO_REUSEPORT group
+static int (*worker_pipes)[2]; // worker i reads [i][0], the others write [i][1]
+static uint64_t tcp_peers;
+static int buffer_budget = 5120; // KB per connection, write_buf and ssl output together
+static int buffer_pool_max = 256; // idle buffers kept for reuse, in NETWORK_BUF_SIZE units
+static int event_timing = 0; // two clock reads per event, ~4% on small records (ccbench metrics)
+
+/* Output buffers are only held while there is something in them: once
+ * drained they go back to a pool shared by all connections, most of which
+ * are idle at any time. There is a free list per size, NETWORK_BUF_SIZE and
+ * its first doublings; larger buffers go back to malloc. */
+static void *buffer_pool[NETWORK_BUF_CLASSES]; // free lists, linked through the first word
+static uint64_t buffer_pool_bytes;
+static uint64_t buffer_bytes; // held by connections
+struct network_stats network_stats;
+bool network_reuse_port = false; // pre-forked workers each bind the same address
+
+static bool network_socket_add(int fd, struct network_connection *net) {
+	if (fd >= sockets_size) {
+		int new_size = sockets_size ? sockets_size * 2 : 64;
+		while (new_size <= fd) new_size *= 2;
+		struct network_connection **new_sockets = realloc(sockets, sizeof(*sockets) * new_size);
+		if (new_sockets == NULL) return false;
+		memset(new_sockets + sockets_size, 0, sizeof(*sockets) * (new_size - sockets_size));
+		sockets = new_sockets;
+		sockets_size = new_size;
+	}
+	sockets[fd] = net;
+	sockets_count++;
+	return true;
+}
+
+static void network_socket_remove(int fd) {
+	if ((fd < 0) || (fd >= sockets_size) || (sockets[fd] == NULL)) return;
+	sockets[fd] = NULL;
+	sockets_count--;
+}
+
+// CLOCK_MONOTONIC in ns, for connection counters
+uint64_t network_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Events are counted per connection, and stamped with the wakeup they came
+ * with. With network_event_timing, each one is also timed around its own
+ * handler, for event_ns, the profile and the event probe (0 otherwise). */
+static uint64_t loop_clock; // when epoll_wait() returned
+static uint64_t event_start;
+
+void network_event_begin() {
+	if (event_timing) event_start = network_now();
+}
+
+void network_event_done(struct network_connection *net) {
+	net->events++;
+	if (!event_timing) {
+		net->last_event = loop_clock;
+		cc_probe(event, net, net->fd, 0);
+		return;
+	}
+	uint64_t now = network_now(), ns = now - event_start;
+	net->event_ns += ns;
+	if (ns > net->event_ns_max) net->event_ns_max = ns;
+	net->last_event = now;
+	cc_probe(event, net, net->fd, ns);
+	network_profile_event(net, ns, now);
+}
 
 char *network_ip_string(struct sockaddr *addr, int addr_len) {
 	char buf[64];
@@ -32,172 +123,824 @@ char *network_ip_string(struct sockaddr *addr, int addr_len) {
 		case AF_INET:
 			{
 				struct sockaddr_in *addr4 = (struct sockaddr_in*)addr;
-				return strdup(inet_ntop(addr4->sin_family, &addr4->sin_addr, (char*)&buf, addr_len));
+				return strdup(inet_ntop(addr4->sin_family, &addr4->sin_addr, (char*)&buf, sizeof(buf)));
 			}
 			break;
 		case AF_INET6:
 			{
 				struct sockaddr_in6 *addr6 = (struct sockaddr_in6*)addr;
-				return strdup(inet_ntop(addr6->sin6_family, &addr6->sin6_addr, (char*)&buf, addr_len));
+				return strdup(inet_ntop(addr6->sin6_family, &addr6->sin6_addr, (char*)&buf, sizeof(buf)));
 			}
 			break;
 	}
 	return NULL;
 }
 
+/* build a lookup key (family, port, address) for a remote address. Unlike the
+ * raw sockaddr this has no padding, so two identical peers always give the
+ * same key. Returns the key length, or 0 for unknown families. */
+int network_addr_key(struct sockaddr *addr, uint8_t *key) {
+	switch(addr->sa_family) {
+		case AF_INET:
+			{
+				struct sockaddr_in *addr4 = (struct sockaddr_in*)addr;
+				key[0] = AF_INET;
+				memcpy(key+1, &addr4->sin_port, 2);
+				memcpy(key+3, &addr4->sin_addr, 4);
+				return 7;
+			}
+		case AF_INET6:
+			{
+				struct sockaddr_in6 *addr6 = (struct sockaddr_in6*)addr;
+				key[0] = AF_INET6;
+				memcpy(key+1, &addr6->sin6_port, 2);
+				memcpy(key+3, &addr6->sin6_addr, 16);
+				return 19;
+			}
+	}
+	return 0;
+}
+
 void network_config_init() {
 	config_add_var(CONFIG_CORE, "network_bind_ip", &listen_addr, CONF_VAR_STRING_POINTER, 2, 39, true);
 	config_add_var(CONFIG_CORE, "network_bind_port", &port, CONF_VAR_INT, 1, 65535, false);
+	config_add_var(CONFIG_CORE, "network_udp_timeout", &udp_timeout, CONF_VAR_INT, 1, 86400, false);
+	config_add_var(CONFIG_CORE, "network_listen_backlog", &listen_backlog, CONF_VAR_INT, 1, 65535, false);
+	config_add_var(CONFIG_CORE, "network_buffer_budget", &buffer_budget, CONF_VAR_INT, 64, 1048576, false);
+	config_add_var(CONFIG_CORE, "network_buffer_pool", &buffer_pool_max, CONF_VAR_INT, 0, 1048576, false);
+	config_add_var(CONFIG_CORE, "network_event_timing", &event_timing, CONF_VAR_INT, 0, 1, false);
+	network_egress_config_init();
 }
 
-void network_sleep() {
-	int nfds = epoll_wait(epoll_handle, epoll_events, EPOLL_MAX_EVENTS, 100); // 100ms timeout
-	for(int i = 0; i < nfds; i++) {
-		struct network_connection *net = array_get_int(sockets, epoll_events[i].data.fd);
-		if (net == NULL) continue;
-		if (!net->stream) {
-			log_printf("client not stream, ignoring fd %d %p", epoll_events[i].data.fd, net);
-			continue; // TODO: handle udp traffic
+ssize_t network_read(struct network_connection *net, void *buf, size_t size) {
+	if (net->stream) {
+		ssize_t res = read(net->fd, buf, size);
+		if (res > 0) {
+			net->rx_bytes += res;
+			network_stats.read_bytes += res;
 		}
+		return res;
+	}
 
-		if (net->server) {
-			char addr[128];
-			char *ipstr;
-			socklen_t addr_len = sizeof(addr);
-			int fd = accept(net->fd, (struct sockaddr*)&addr, &addr_len);
-			if (fd == -1) continue; // no client for us?
-			fcntl(fd, F_SETFL, O_NONBLOCK); /* stupid linux does not inherit this via accept() as bsd does */
+	// datagram: hand out whatever is pending from the udp endpoint, one datagram per call
+	if (net->read_buf == NULL) {
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t len = net->read_buf_size - net->read_buf_pos;
+	if (len > size) len = size; // datagram truncated, as recv() would do
+	memcpy(buf, net->read_buf + net->read_buf_pos, len);
+	net->rx_bytes += len;
+	net->read_buf = NULL;
+	net->read_buf_size = net->read_buf_pos = 0;
+	return len;
+}
 
-			ipstr = network_ip_string((struct sockaddr*)&addr, addr_len);
+// index of the free list for size, -1 if it isn't pooled
+static int network_buf_class(size_t size) {
+	for (int i = 0; i < NETWORK_BUF_CLASSES; i++)
+		if (size == (size_t)NETWORK_BUF_SIZE << i) return i;
+	return -1;
+}
 
-			net = calloc(sizeof(struct network_connection), 1);
-			net->fd = fd;
-			net->remote = malloc(addr_len);
-			memcpy(net->remote, &addr, addr_len);
-			net->remote_len = addr_len;
-			net->stream = true;
-			net->server = false;
+/* network_buf_realloc : realloc() for connection buffers, taken from the pool
+ * when it has one of new_size. The old buffer then goes back to it. */
+void *network_buf_realloc(void *buf, size_t size, size_t new_size) {
+	int class = network_buf_class(new_size);
+	void *res;
+
+	if ((class >= 0) && (buffer_pool[class] != NULL)) {
+		res = buffer_pool[class];
+		buffer_pool[class] = *(void **)res;
+		buffer_pool_bytes -= new_size;
+		if (buf != NULL) memcpy(res, buf, size < new_size ? size : new_size);
+		network_buf_free(buf, size);
+		buffer_bytes += new_size;
+		return res;
+	}
+	res = realloc(buf, new_size);
+	if (res == NULL) return NULL;
+	buffer_bytes += new_size - size;
+	return res;
+}
 
-			log_printf("new client on fd %d %p from %s", fd, net, ipstr);
+void network_buf_free(void *buf, size_t size) {
+	if (buf == NULL) return;
+	buffer_bytes -= size;
+	int class = network_buf_class(size);
+	if ((class >= 0) && (buffer_pool_bytes + size <= (uint64_t)buffer_pool_max * NETWORK_BUF_SIZE)) {
+		*(void **)buf = buffer_pool[class];
+		buffer_pool[class] = buf;
+		buffer_pool_bytes += size;
+		return;
+	}
+	free(buf);
+}
 
-			array_insert_int(sockets, fd, net);
+/* network_buf_budget : may net grow its buffers by size bytes? All of its
+ * output buffers count, ours and the record layer's. */
+bool network_buf_budget(struct network_connection *net, size_t size) {
+	size_t held = net->write_buf_size + (net->ssl_ctx ? net->ssl_ctx->out_size : 0);
+	return held + size <= (size_t)buffer_budget * 1024;
+}
 
-			ssl_session_init(net);
+/* network_memory : what a connection holds, GnuTLS's own state excluded (its
+ * session is about 10 KB) */
+size_t network_memory(struct network_connection *net) {
+	size_t size = sizeof(*net) + net->remote_len + net->write_buf_size;
+	if (net->handler) size += net->read_buf_size;
+	if (net->ssl_ctx) size += sizeof(*net->ssl_ctx) + net->ssl_ctx->out_size;
+	return size;
+}
 
-			ev.events = EPOLLIN | EPOLLET;
-			ev.data.fd = fd;
-			if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, fd, &ev) == -1) {
-				log_perror();
-				log_printf("Failed to add new peer to poll");
-				close(fd);
-				free(net->remote);
-				free(net);
-				continue;
-			}
-			continue;
+/* stream writes are only buffered here, everything written during a loop
+ * iteration goes out in a single write() from network_flush() */
+ssize_t network_write(struct network_connection *net, const void *buf, size_t size) {
+	if (!net->stream) {
+		ssize_t res = sendto(net->fd, buf, size, 0, net->remote, net->remote_len);
+		if (res > 0) net->tx_bytes += res;
+		return res;
+	}
+
+	if (net->write_buf_pos + size > net->write_buf_size) {
+		size_t new_size = net->write_buf_size ? net->write_buf_size * 2 : NETWORK_BUF_SIZE;
+		while (new_size < net->write_buf_pos + size) new_size *= 2;
+		if (!network_buf_budget(net, new_size - net->write_buf_size)) {
+			network_stats.write_buf_full++;
+			errno = EAGAIN;
+			return -1;
 		}
-		log_printf("event on %d (p=%p)", epoll_events[i].data.fd, net);
+		void *new_buf = network_buf_realloc(net->write_buf, net->write_buf_size, new_size);
+		if (new_buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		net->write_buf = new_buf;
+		net->write_buf_size = new_size;
 	}
+	memcpy(net->write_buf + net->write_buf_pos, buf, size);
+	net->write_buf_pos += size;
+	network_stats.writes++;
+	network_want_flush(net);
+	return size;
 }
 
-bool network_init() {
-	struct sockaddr_in addr;
-	struct sockaddr_in6 addr6;
-	int tcp_server;
-	int udp_endpoint;
+void network_want_flush(struct network_connection *net) {
+	if (net->flush_pending) return;
+	net->flush_pending = true;
+	net->flush_next = flush_list;
+	flush_list = net;
+}
 
-	sockets = array_new();
+static bool network_flush(struct network_connection *net) {
+	while(1) {
+		// let the record layer turn pending application data into records first
+		if ((net->ssl_ctx != NULL) && (!ssl_flush(net))) return false;
+		if (net->write_buf_pos == 0) return !net->close_on_flush;
+
+		ssize_t res = write(net->fd, net->write_buf, net->write_buf_pos);
+		cc_probe(flush, net, net->fd, net->write_buf_pos, res);
+		network_stats.write_syscalls++;
+		if (res == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) network_stats.write_eagain++;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return true; // EPOLLOUT will call us back
+			log_perror();
+			return false;
+		}
+		network_stats.write_bytes += res;
+		net->tx_bytes += res;
+		if ((size_t)res < net->write_buf_pos) {
+			memmove(net->write_buf, net->write_buf + res, net->write_buf_pos - res);
+			net->write_buf_pos -= res;
+			return true;
+		}
+		net->write_buf_pos = 0;
+		network_buf_free(net->write_buf, net->write_buf_size);
+		net->write_buf = NULL;
+		net->write_buf_size = 0;
+		// buffer drained, go on only if the record layer was held back by it
+		if ((net->ssl_ctx == NULL) || (!ssl_pending(net))) return !net->close_on_flush;
+	}
+}
 
-//	const char *listen_addr = "0.0.0.0";
-//	uint16_t port = 65534;
+// called once per loop iteration, after all events have been handled
+static void network_flush_all() {
+	while(flush_list != NULL) {
+		struct network_connection *net = flush_list;
+		flush_list = net->flush_next;
+		net->flush_pending = false;
+		net->flush_next = NULL;
+		if (!network_flush(net)) network_close(net);
+	}
+}
 
-	epoll_handle = epoll_create(64);
-	if (epoll_handle == -1) {
-		log_perror();
-		log_printf("Could not create epoll struct");
-		return false;
+/* the tunnel packets the egress scheduler lets go, over the data channel or
+ * as TLS (or DTLS) records when the peer has none */
+static void network_egress_send() {
+	struct network_connection *nets[NETWORK_EGRESS_BATCH];
+	struct packet *pkts[NETWORK_EGRESS_BATCH];
+	bool sent[NETWORK_EGRESS_BATCH];
+	uint64_t now = network_now();
+	int n;
+
+	while((n = network_egress_dequeue(nets, pkts, NETWORK_EGRESS_BATCH, now)) > 0) {
+		ssl_data_send_batch(nets, pkts, n, sent);
+		for(int i = 0; i < n; i++) {
+			if (!sent[i] && !ssl_write(nets[i], packet_data(pkts[i]), pkts[i]->len)) network_egress_stats.unsent++;
+			packet_unref(pkts[i]);
+		}
 	}
+}
 
-	log_printf("Creating sockets on tcp/udp %s/%d", listen_addr, port);
+void network_close(struct network_connection *net) {
+	cc_probe(close, net, net->fd, net->rx_bytes, net->tx_bytes);
+	if (net->ssl_ctx != NULL) ssl_session_close(net);
+	network_egress_free(net);
 
-	int af_family = -1;
-	// don't know yet which one we will use
-	addr.sin_family = AF_INET;
-	addr6.sin6_family = AF_INET6;
-	addr.sin_port = htons(port);
-	addr6.sin6_port = htons(port);
+	if (net->flush_pending) {
+		struct network_connection **prev = &flush_list;
+		while(*prev != net) prev = &(*prev)->flush_next;
+		*prev = net->flush_next;
+	}
 
-	// parse addr
-	if (inet_pton(AF_INET6, listen_addr, &addr6.sin6_addr) == 0) { // failed
-		if (inet_pton(AF_INET, listen_addr, &addr.sin_addr) == 0) {
-			log_printf("Failed to parse listen address");
-			return false;
-		} else {
-			af_family = AF_INET;
-		}
+	if (net->stream && !net->server && !net->handler) tcp_peers--;
+	if (net->stream || net->handler) {
+		epoll_ctl(epoll_handle, EPOLL_CTL_DEL, net->fd, NULL);
+		network_socket_remove(net->fd);
+		close(net->fd);
 	} else {
-		af_family = AF_INET6;
+		// fd is the shared udp endpoint, only drop the peer
+		uint8_t key[32];
+		int key_len = network_addr_key(net->remote, key);
+		array_remove(udp_peers, key_len, key);
 	}
 
-	tcp_server = socket(af_family, SOCK_STREAM, 0);
+	if (net->handler) free(net->read_buf);
+	if (net->closed) net->closed(net);
+	network_buf_free(net->write_buf, net->write_buf_size);
+	free(net);
+}
 
-	if (tcp_server == -1) {
+/* network_register_fd : have the event loop call handler when fd becomes
+ * readable. Events are edge triggered, the handler must drain the fd. Set
+ * stream for network_write() to buffer on it, like on a peer, and closed to
+ * hear about it when a failed flush closes it. */
+struct network_connection *network_register_fd(int fd, void (*handler)(struct network_connection *)) {
+	struct network_connection *net = calloc(sizeof(struct network_connection), 1);
+	net->fd = fd;
+	net->handler = handler;
+	net->created = network_now();
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, fd, &ev) == -1) {
 		log_perror();
-		log_printf("Failed to create socket for TCP server");
-		return false;
+		log_printf("Failed to add fd %d to poll", fd);
+		free(net);
+		return NULL;
+	}
+	if (!network_socket_add(fd, net)) {
+		epoll_ctl(epoll_handle, EPOLL_CTL_DEL, fd, NULL);
+		free(net);
+		return NULL;
 	}
+	return net;
+}
 
-	udp_endpoint = socket(af_family, SOCK_DGRAM, 0);
+/* network_foreach : run callback on every established peer connection (tcp
+ * and udp). Connections for which it returns false get closed. */
+void network_foreach(bool (*callback)(struct network_connection *)) {
+	struct network_connection **close_list = malloc(sizeof(void*) * (sockets_count + udp_peers->count + 1));
+	int close_count = 0;
+	array_iterator_t *it;
+
+	for(int fd = 0; fd < sockets_size; fd++) {
+		struct network_connection *net = sockets[fd];
+		if ((net == NULL) || net->server || net->handler) continue;
+		if (!callback(net)) close_list[close_count++] = net;
+	}
 
-	if (udp_endpoint == -1) {
-		log_perror();
-		log_printf("Failed to create socket for UDP endpoint");
+	it = array_iterator(udp_peers);
+	while(array_next(it)) {
+		struct network_connection *net = it->value;
+		if (!callback(net)) close_list[close_count++] = net;
+	}
+	array_iterator_free(it);
+
+	for(int i = 0; i < close_count; i++)
+		network_close(close_list[i]);
+	free(close_list);
+}
+
+// a peer's connection, its address in the same allocation
+static struct network_connection *network_connection_new(int fd, struct sockaddr *addr, socklen_t addr_len) {
+	struct network_connection *net = calloc(sizeof(struct network_connection) + addr_len, 1);
+	net->fd = fd;
+	net->remote = (struct sockaddr *)(net + 1);
+	memcpy(net->remote, addr, addr_len);
+	net->remote_len = addr_len;
+	return net;
+}
+
+static void network_udp_peer_new(struct network_connection *endpoint, struct sockaddr *addr, socklen_t addr_len, int key_len, const uint8_t *key, void *buf, size_t len) {
+	gnutls_dtls_prestate_st prestate;
+
+	// stateless until the peer proves it can receive at its claimed address
+	if (!ssl_dtls_cookie_verify(endpoint, addr, addr_len, buf, len, &prestate))
+		return;
+
+	struct network_connection *net = network_connection_new(endpoint->fd, addr, addr_len);
+	net->stream = false;
+	net->server = false;
+	net->last_activity = time(NULL);
+	net->created = network_now();
+
+	char *ipstr = network_ip_string(addr, addr_len);
+	log_trace(LOG_LEVEL_DEBUG, "new udp client %p from %s", net, ipstr);
+	free(ipstr);
+
+	array_insert(udp_peers, key_len, key, net, false);
+
+	net->read_buf = buf;
+	net->read_buf_size = len;
+	net->read_buf_pos = 0;
+	bool ok = ssl_dtls_session_init(net, &prestate);
+	net->read_buf = NULL;
+	network_event_done(net);
+	if (!ok) network_close(net);
+}
+
+/* After a hot upgrade the previous process keeps its DTLS and data channel
+ * peers until they are gone, but their datagrams arrive here: those we have
+ * no peer for are passed to it, with their source address, on a seqpacket
+ * socket it gave us (network_inherit()). It replies on its copy of the
+ * endpoint. So do packets from the tunnel device, which both processes read
+ * while the old one drains.
+ *
+ * Pre-forked workers pass each other datagrams and tunnel packets the same
+ * way, along with the data channel ids and tunnel addresses they claim (see
+ * network_workers_init()). */
+struct network_forward {
+	uint8_t type; // enum network_forward_type
+	bool release; // CHANNEL and ROUTE: the claim is dropped
+	int16_t worker; // sender, -1 for the previous process
+	socklen_t addr_len; // DATAGRAM only
+	struct sockaddr_storage addr;
+};
+
+static bool network_forward_send(int fd, struct network_forward *hdr, const void *buf, size_t len) {
+	struct iovec iov[2] = { { hdr, sizeof(*hdr) }, { (void *)buf, len } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != -1;
+}
+
+/* network_forward : pass a datagram (or with addr NULL a tunnel packet) we
+ * have no peer for to the previous process, false if there is none (anymore) */
+bool network_forward(struct sockaddr *addr, socklen_t addr_len, const uint8_t *buf, size_t len) {
+	if (udp_forward == -1) return false;
+
+	struct network_forward hdr = { .type = addr ? NETWORK_FORWARD_DATAGRAM : NETWORK_FORWARD_TUNNEL, .worker = -1, .addr_len = addr ? addr_len : 0 };
+	if (addr != NULL) memcpy(&hdr.addr, addr, addr_len);
+	if (network_forward_send(udp_forward, &hdr, buf, len)) {
+		network_stats.udp_forwarded++;
+		return true;
+	}
+	// a full socket drops it, as a full endpoint would
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) return true;
+	log_printf("Previous process is gone, not forwarding datagrams anymore");
+	close(udp_forward);
+	udp_forward = -1;
+	return false;
+}
+
+// pre-forked workers, 0 if not
+int network_workers() {
+	return workers;
+}
+
+/* network_worker_pass : have worker handle a datagram from addr (or with addr
+ * NULL a tunnel packet), false if it was dropped. The supervisor holds the
+ * other end, only a full socket refuses it. */
+bool network_worker_pass(int worker, struct sockaddr *addr, socklen_t addr_len, const uint8_t *buf, size_t len) {
+	struct network_forward hdr = { .type = addr ? NETWORK_FORWARD_DATAGRAM : NETWORK_FORWARD_TUNNEL, .worker = core_worker, .addr_len = addr ? addr_len : 0 };
+	if (addr != NULL) memcpy(&hdr.addr, addr, addr_len);
+	if (!network_forward_send(worker_pipes[worker][1], &hdr, buf, len)) {
+		network_stats.worker_pass_dropped++;
 		return false;
 	}
+	network_stats.worker_passed++;
+	return true;
+}
+
+/* network_worker_claim : tell worker, the home of key, that this one has (or
+ * with release, no longer has) the data channel or tunnel address key */
+bool network_worker_claim(int worker, enum network_forward_type type, bool release, const uint8_t *key, size_t key_len) {
+	struct network_forward hdr = { .type = type, .release = release, .worker = core_worker };
+	return network_forward_send(worker_pipes[worker][1], &hdr, key, key_len);
+}
 
-	{
-		int ok = 1;
-		setsockopt(tcp_server, SOL_SOCKET, SO_REUSEADDR, &ok, sizeof(ok));
-		setsockopt(udp_endpoint, SOL_SOCKET, SO_REUSEADDR, &ok, sizeof(ok));
-//		setsockopt(tcp_server, IPPROTO_TCP, TCP_NODELAY, &ok, sizeof(ok));
+/* the start of a DTLS handshake: a handshake record of epoch 0 holding a
+ * ClientHello. A new peer, anything else from an unknown address may belong
+ * to the previous process. */
+static bool network_dtls_hello(const uint8_t *buf, size_t len) {
+	return (len > 13) && (buf[0] == 22) && (buf[3] == 0) && (buf[4] == 0) && (buf[13] == 1);
+}
+
+// one datagram from the udp endpoint, pkt is the packet buf is in, if any
+static void network_udp_datagram(struct network_connection *endpoint, struct sockaddr *addr, socklen_t addr_len, uint8_t *buf, size_t len, struct packet *pkt) {
+	// data channel datagrams are events of their TLS connection, ssl_data_input() ends them
+	network_event_begin();
+	if (ssl_data_input(endpoint, addr, addr_len, buf, len, pkt)) return;
+
+	uint8_t key[32];
+	int key_len = network_addr_key(addr, key);
+	if (key_len == 0) return;
+
+	struct network_connection *net = array_get(udp_peers, key_len, key);
+	if (net == NULL) {
+		if (!network_dtls_hello(buf, len) && network_forward(addr, addr_len, buf, len)) return;
+		// draining after an upgrade, new peers go to the other process
+		if (tcp_listener == NULL) return;
+		network_udp_peer_new(endpoint, addr, addr_len, key_len, key, buf, len);
+		return;
 	}
 
-	// bind stuff
-	switch(af_family) {
-		case AF_INET:
-			if (bind(tcp_server, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-				log_perror();
-				log_printf("Failed to bind TCP server");
-				return false;
-			}
-			if (bind(udp_endpoint, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-				log_perror();
-				log_printf("Failed to bind UDP endpoint");
-				return false;
-			}
-			break;
-		case AF_INET6:
-			if (bind(tcp_server, (struct sockaddr *)&addr6, sizeof(addr6)) == -1) {
-				log_perror();
-				log_printf("Failed to bind TCP server");
-				return false;
-			}
-			if (bind(udp_endpoint, (struct sockaddr *)&addr6, sizeof(addr6)) == -1) {
+	net->last_activity = time(NULL);
+	net->read_buf = buf;
+	net->read_buf_size = len;
+	net->read_buf_pos = 0;
+	bool ok = ssl_session_event(net);
+	net->read_buf = NULL;
+	network_event_done(net);
+	if (!ok) network_close(net);
+}
+
+// datagrams passed back by the new process, or by the other workers, see network_forward()
+static void network_forwarded(struct network_connection *net) {
+	static uint8_t buf[NETWORK_DGRAM_MAXSIZE];
+	struct network_forward hdr;
+
+	while(1) {
+		struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { buf, sizeof(buf) } };
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+		ssize_t len = recvmsg(net->fd, &msg, 0);
+		if ((len == -1) && (errno == EINTR)) continue;
+		if ((len == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return;
+		if (len <= 0) {
+			// the new process exited, nobody reads the endpoint for our peers anymore
+			network_close(net);
+			return;
+		}
+		if (((size_t)len < sizeof(hdr)) || (hdr.addr_len > sizeof(hdr.addr)) || (hdr.worker >= workers)) continue;
+		len -= sizeof(hdr);
+		switch(hdr.type) {
+			case NETWORK_FORWARD_DATAGRAM:
+				if (hdr.addr_len == 0) break;
+				network_udp_datagram(udp_listener, (struct sockaddr *)&hdr.addr, hdr.addr_len, buf, len, NULL);
+				break;
+			case NETWORK_FORWARD_TUNNEL:
+				tunnel_forwarded(buf, len);
+				break;
+			case NETWORK_FORWARD_STARTED:
+				if (hdr.worker < 0) break;
+				ssl_data_worker_started(hdr.worker);
+				tunnel_worker_started(hdr.worker);
+				break;
+			case NETWORK_FORWARD_CHANNEL:
+				if ((hdr.worker < 0) || (len != SSL_DATA_ID_SIZE)) break;
+				ssl_data_claim(buf, hdr.worker, hdr.release);
+				break;
+			case NETWORK_FORWARD_ROUTE:
+				if (hdr.worker < 0) break;
+				tunnel_claim(buf, len, hdr.worker, hdr.release);
+				break;
+		}
+	}
+}
+
+/* datagrams land in packet buffers, so data channel packets can be opened,
+ * queued and sealed again without a copy. The few that don't fit one (big
+ * data channel packets, or no buffer left) go through a static buffer. */
+static void network_udp_read(struct network_connection *endpoint) {
+	static uint8_t big[NETWORK_DGRAM_MAXSIZE];
+	struct packet *pkt = NULL;
+
+	// edge triggered: drain everything
+	while(1) {
+		struct sockaddr_storage addr;
+		if (pkt == NULL) pkt = packet_alloc();
+		uint8_t *buf = pkt ? packet_data(pkt) : big;
+		size_t room = pkt ? packet_tailroom(pkt) : 0;
+		struct iovec iov[2] = { { buf, room }, { big + room, sizeof(big) - room } };
+		struct msghdr msg = { .msg_name = &addr, .msg_namelen = sizeof(addr), .msg_iov = iov, .msg_iovlen = 2 };
+		ssize_t len = recvmsg(endpoint->fd, &msg, 0);
+		if (len == -1) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
 				log_perror();
-				log_printf("Failed to bind UDP endpoint");
-				return false;
+				log_printf("Failed to read from UDP endpoint");
 			}
-			break;
-		default:
-			log_printf("Unknown address family");
-			return false;
+			if (errno == EINTR) continue;
+			packet_unref(pkt);
+			return;
+		}
+		socklen_t addr_len = msg.msg_namelen;
+
+		network_stats.udp_packets++;
+		network_stats.udp_bytes += len;
+		struct packet *in = pkt;
+		if ((size_t)len > room) {
+			memcpy(big, buf, room);
+			buf = big;
+			in = NULL;
+		} else {
+			pkt->len = len;
+		}
+		network_udp_datagram(endpoint, (struct sockaddr*)&addr, addr_len, buf, len, in);
+
+		// whoever kept a reference owns it now, otherwise it is reused as is
+		if ((pkt != NULL) && packet_shared(pkt)) {
+			packet_unref(pkt);
+			pkt = NULL;
+		} else if (pkt != NULL) {
+			pkt->head = PACKET_HEADROOM;
+			pkt->len = 0;
+		}
+	}
+}
+
+// drop udp peers we haven't heard from in a while, there is no FIN to tell us
+static void network_udp_expire() {
+	time_t now = time(NULL);
+	if (now == udp_last_expire) return;
+	udp_last_expire = now;
+
+	struct network_connection **expired = NULL;
+	int count = 0;
+	array_iterator_t *it = array_iterator(udp_peers);
+	while(array_next(it)) {
+		struct network_connection *net = it->value;
+		if (now - net->last_activity < udp_timeout) continue;
+		// closing removes it from udp_peers, not while iterating over them
+		if ((count & 63) == 0) expired = realloc(expired, sizeof(void *) * (count + 64));
+		expired[count++] = net;
+	}
+	array_iterator_free(it);
+
+	for(int i = 0; i < count; i++) {
+		log_printf("udp client %p timed out", expired[i]);
+		network_close(expired[i]);
+	}
+	free(expired);
+}
+
+// edge triggered: accept everything in the backlog
+static void network_accept(struct network_connection *server) {
+	while(1) {
+		char addr[128];
+		char *ipstr;
+		socklen_t addr_len = sizeof(addr);
+		int fd = accept(server->fd, (struct sockaddr*)&addr, &addr_len);
+		if (fd == -1) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) network_stats.accept_errors++;
+			return; // no client for us?
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK); /* stupid linux does not inherit this via accept() as bsd does */
+
+		ipstr = network_ip_string((struct sockaddr*)&addr, addr_len);
+
+		struct network_connection *net = network_connection_new(fd, (struct sockaddr *)&addr, addr_len);
+		net->stream = true;
+		net->server = false;
+		net->created = network_now();
+
+		log_trace(LOG_LEVEL_DEBUG, "new client on fd %d %p from %s", fd, net, ipstr);
+
+		free(ipstr);
+
+		if (!network_socket_add(fd, net)) {
+			log_printf("Failed to add new peer");
+			close(fd);
+			free(net);
+			continue;
+		}
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			log_perror();
+			log_printf("Failed to add new peer to poll");
+			network_socket_remove(fd);
+			close(fd);
+			free(net);
+			continue;
+		}
+		network_stats.accepts++;
+		tcp_peers++;
+		cc_probe(accept, net, fd);
+
+		network_event_begin();
+		bool ok = ssl_session_init(net);
+		network_event_done(net);
+		if (!ok) network_close(net);
+	}
+}
+
+void network_sleep() {
+	cc_probe(epoll_enter);
+	// 100ms timeout, less when queued packets wait for their rate or a DTLS flight for its retransmit
+	uint64_t now = network_now();
+	int nfds = epoll_wait(epoll_handle, epoll_events, network_profile.batch, network_egress_timeout(ssl_dtls_timeout(100, now), now));
+	cc_probe(epoll_return, nfds);
+	loop_clock = network_now();
+	network_stats.wakeups++;
+	if (nfds >= 0) metrics_observe(&network_stats.events, nfds);
+	network_profile_wakeup(nfds, loop_clock);
+	for(int i = 0; i < nfds; i++) {
+		struct network_connection *net = sockets[epoll_events[i].data.fd];
+		if (net == NULL) continue;
+		if (net->handler) {
+			if (epoll_events[i].events & EPOLLOUT) network_want_flush(net);
+			if (epoll_events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) net->handler(net);
+			continue;
+		}
+		if (!net->stream) {
+			network_udp_read(net);
+			continue;
+		}
+
+		if (net->server) {
+			network_accept(net);
+			continue;
+		}
+		log_trace(LOG_LEVEL_DEBUG, "event on %d (p=%p)", epoll_events[i].data.fd, net);
+		if (epoll_events[i].events & EPOLLOUT) network_want_flush(net);
+		if (!(epoll_events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) continue;
+		network_event_begin();
+		bool ok = ssl_session_event(net);
+		network_event_done(net);
+		if (!ok) network_close(net);
+	}
+
+	ssl_dtls_timers(network_now());
+	network_egress_send();
+	network_flush_all();
+	network_udp_expire();
+	network_profile_done(nfds, network_now());
+	cc_probe(loop_done, nfds);
+}
+
+// listen_addr and port as a socket address, its length or 0
+static socklen_t network_listen_addr(struct sockaddr_storage *addr) {
+	struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+	memset(addr, 0, sizeof(*addr));
+	if (inet_pton(AF_INET6, listen_addr, &addr6->sin6_addr) == 1) {
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = htons(port);
+		return sizeof(*addr6);
+	}
+	if (inet_pton(AF_INET, listen_addr, &addr4->sin_addr) == 1) {
+		addr4->sin_family = AF_INET;
+		addr4->sin_port = htons(port);
+		return sizeof(*addr4);
+	}
+	log_printf("Failed to parse listen address");
+	return 0;
+}
+
+// the TCP server (SOCK_STREAM) or the UDP endpoint (SOCK_DGRAM), -1 on failure
+static int network_bind(int type) {
+	const char *what = (type == SOCK_STREAM) ? "TCP server" : "UDP endpoint";
+	struct sockaddr_storage addr;
+	socklen_t addr_len = network_listen_addr(&addr);
+
+	if (addr_len == 0) return -1;
+	int fd = socket(addr.ss_family, type, 0);
+	if (fd == -1) {
+		log_perror();
+		log_printf("Failed to create socket for %s", what);
+		return -1;
 	}
 
-	if (listen(tcp_server, 5) == -1) {
+	int ok = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &ok, sizeof(ok));
+	if (network_reuse_port) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &ok, sizeof(ok));
+	// tunnel packets can't wait for an ACK, records are already coalesced per loop iteration (ssl_flush)
+	if (type == SOCK_STREAM) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &ok, sizeof(ok));
+
+	if (bind(fd, (struct sockaddr *)&addr, addr_len) == -1) {
+		log_perror();
+		log_printf("Failed to bind %s", what);
+		close(fd);
+		return -1;
+	}
+	// handshakes burst on reconnects, a short queue drops SYNs and peers wait for their 1s retransmit
+	if ((type == SOCK_STREAM) && (listen(fd, listen_backlog) == -1)) {
 		log_perror();
 		log_printf("Failed to put tcp server in listen mode!");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* network_workers_init : supervisor, before forking count workers.
+ *
+ * Each worker has its own TCP server, the kernel spreads connections over
+ * them. A data channel's datagrams have to reach the worker its connection
+ * is on, but neither their source address nor the channel id (both ends
+ * derive it from the session) say which one that is. So the udp endpoints
+ * are bound here, in worker order, and stay open in the supervisor for the
+ * SO_REUSEPORT group never to change: a classic BPF program sends data
+ * channel datagrams to the worker the first byte of their id points at, the
+ * channel's home, DTLS by the usual address hash. The worker that has the
+ * channel claims it at its home, which passes it the datagrams on a seqpacket
+ * socket (network_worker_pass()). Tunnel addresses are claimed at a home
+ * too, for the device packets a worker has no peer for (tunnel.c). */
+bool network_workers_init(int count) {
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SSL_DATA_MAGIC, 0, 3),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1), // the id's first byte, ssl_data_home()
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff), // not in the group: hashed
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	log_printf("Creating udp endpoints on %s/%d for %d workers", listen_addr, port, count);
+	network_reuse_port = true;
+	worker_udp = calloc(count, sizeof(*worker_udp));
+	worker_pipes = calloc(count, sizeof(*worker_pipes));
+	if ((worker_udp == NULL) || (worker_pipes == NULL)) return false;
+	for(int i = 0; i < count; i++) {
+		if ((worker_udp[i] = network_bind(SOCK_DGRAM)) == -1) return false;
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, worker_pipes[i]) == -1) {
+			log_perror();
+			log_printf("Failed to create the socket of worker %d", i);
+			return false;
+		}
+	}
+	if (setsockopt(worker_udp[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+		log_perror();
+		log_printf("Failed to attach the data channel steering program");
 		return false;
 	}
+	workers = count;
+	return true;
+}
+
+/* a worker keeps its own endpoint and socket, and the others' sockets to
+ * write to, then tells them it is there: what a previous instance of it had
+ * claimed is gone, and claims homed here are sent again */
+static bool network_worker_start() {
+	for(int i = 0; i < workers; i++) {
+		if (i == core_worker) continue;
+		close(worker_udp[i]);
+		close(worker_pipes[i][0]);
+	}
+	close(worker_pipes[core_worker][1]);
+	if (network_register_fd(worker_pipes[core_worker][0], network_forwarded) == NULL) return false;
+
+	struct network_forward hdr = { .type = NETWORK_FORWARD_STARTED, .worker = core_worker };
+	for(int i = 0; i < workers; i++)
+		if (i != core_worker) network_forward_send(worker_pipes[i][1], &hdr, NULL, 0);
+	return true;
+}
+
+/* network_loop_init : the event loop alone, without listening sockets, for
+ * tools that only have fds of their own (network_register_fd()) */
+bool network_loop_init() {
+	udp_peers = array_new();
+
+	epoll_handle = epoll_create(64);
+	if (epoll_handle == -1) {
+		log_perror();
+		log_printf("Could not create epoll struct");
+		return false;
+	}
+	return true;
+}
+
+bool network_init() {
+	int tcp_server;
+	int udp_endpoint;
+
+	if (!network_loop_init()) return false;
+
+	if (inherited_tcp != -1) {
+		tcp_server = inherited_tcp;
+		udp_endpoint = inherited_udp;
+		log_printf("Using the tcp/udp sockets of the previous process");
+	} else {
+		log_printf("Creating sockets on tcp/udp %s/%d", listen_addr, port);
+		if ((tcp_server = network_bind(SOCK_STREAM)) == -1) return false;
+		// a worker's comes from the supervisor, network_workers_init()
+		udp_endpoint = (workers > 0) ? worker_udp[core_worker] : network_bind(SOCK_DGRAM);
+		if (udp_endpoint == -1) return false;
+	}
 
 	fcntl(tcp_server, F_SETFL, O_NONBLOCK);
 	fcntl(udp_endpoint, F_SETFL, O_NONBLOCK);
@@ -220,15 +963,59 @@ bool network_init() {
 	net->fd = tcp_server;
 	net->stream = true;
 	net->server = true;
-	array_insert_int(sockets, tcp_server, net);
+	network_socket_add(tcp_server, net);
+	tcp_listener = net;
 	net = calloc(sizeof(struct network_connection), 1);
 	net->fd = udp_endpoint;
 	net->stream = false;
 	net->server = true;
-	array_insert_int(sockets, udp_endpoint, net);
+	network_socket_add(udp_endpoint, net);
+	udp_listener = net;
+
+	if ((workers > 0) && !network_worker_start()) return false;
 
 //	log_printf("Network initialization complete");
 
 	return true;
 }
 
+/* network_inherit : use these sockets instead of creating new ones, they come
+ * from the process being replaced, along with where its datagrams go back
+ * (network_forward()). Call before network_init(). */
+void network_inherit(int tcp, int udp, int forward) {
+	inherited_tcp = tcp;
+	inherited_udp = udp;
+	udp_forward = forward;
+}
+
+// the listening socket and the udp endpoint, false once network_stop_listening() was called
+bool network_listen_fds(int *tcp, int *udp) {
+	if (tcp_listener == NULL) return false;
+	*tcp = tcp_listener->fd;
+	*udp = udp_listener->fd;
+	return true;
+}
+
+/* network_stop_listening : another process has the sockets now, leave new
+ * peers and datagrams to it. The udp endpoint stays open, we reply to our
+ * established peers on it, their datagrams come back on forwarded. */
+bool network_stop_listening(int forwarded) {
+	if (tcp_listener == NULL) return false;
+	network_close(tcp_listener); // the socket lives on in the other process
+	epoll_ctl(epoll_handle, EPOLL_CTL_DEL, udp_listener->fd, NULL);
+	network_socket_remove(udp_listener->fd);
+	tcp_listener = NULL;
+	return network_register_fd(forwarded, network_forwarded) != NULL;
+}
+
+// established peer connections, tcp and udp
+int network_peers() {
+	return tcp_peers + udp_peers->count;
+}
+
+void network_gauges(struct network_gauges *gauges) {
+	gauges->tcp_peers = tcp_peers;
+	gauges->udp_peers = udp_peers ? udp_peers->count : 0;
+	gauges->buffer_bytes = buffer_bytes;
+	gauges->buffer_pool_bytes = buffer_pool_bytes;
+}
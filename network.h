@@ -1,4 +1,7 @@
 
+#include "metrics.h"
+#include "packet.h"
+
 struct network_connection {
 	int fd;
 	struct ssl_context *ssl_ctx;
@@ -6,19 +9,170 @@ struct network_connection {
 	int remote_len;
 	bool stream; // false=udp true=tcp
 	bool server;
+	time_t last_activity;
+	void (*handler)(struct network_connection *); // non-network fd (signalfd, pipe...)
+	void (*closed)(struct network_connection *); // optional for handler fds, from network_close()
 
-	// read buffer
+	// read buffer: the pending datagram of a udp peer, or owned by a handler fd
 	void *read_buf;
 	size_t read_buf_size, read_buf_pos;
 	// write buffer
 	void *write_buf;
 	size_t write_buf_size, write_buf_pos;
+	struct network_connection *flush_next; // pending write_buf flush (or ssl records)
+	bool flush_pending;
+	bool close_on_flush; // close once write_buf is out
+	struct network_egress *egress; // tunnel packets waiting to be sent, NULL until the first
+	struct tunnel_peer *tunnel; // its addresses in the tunnel, NULL until it sent something
+
+	// per connection counters, for the admin socket
+	uint64_t created; // CLOCK_MONOTONIC ns
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t events; // handled read events
+	uint64_t event_ns, event_ns_max; // time spent handling them
+	uint64_t last_event; // CLOCK_MONOTONIC ns
+};
+
+struct network_stats {
+	uint64_t writes; // buffered network_write() calls on streams
+	uint64_t write_syscalls; // write() calls they turned into
+	uint64_t write_bytes;
+	uint64_t write_eagain; // socket full, waiting for EPOLLOUT
+	uint64_t write_buf_full; // network_write() refused, NETWORK_WRITE_BUF_MAX
+	uint64_t read_bytes; // on streams
+	uint64_t udp_packets, udp_bytes; // datagrams in, data channel included
+	uint64_t udp_forwarded; // passed to the previous process after an upgrade
+	uint64_t worker_passed; // datagrams and tunnel packets passed to another worker
+	uint64_t worker_pass_dropped; // its socket was full
+	uint64_t accepts, accept_errors;
+	uint64_t wakeups; // epoll_wait() returns
+	uint64_t saturated; // wakeups that filled every slot of the batch
+	struct metrics_histogram events; // per wakeup
 };
 
+// current sizes, not summed over time
+struct network_gauges {
+	uint64_t tcp_peers, udp_peers;
+	uint64_t buffer_bytes; // output buffers held by connections
+	uint64_t buffer_pool_bytes; // drained ones kept for reuse
+};
+
+// what the previous process and pre-forked workers pass each other (network_forwarded())
+enum network_forward_type {
+	NETWORK_FORWARD_DATAGRAM, // from a peer, with its address
+	NETWORK_FORWARD_TUNNEL, // read from the tunnel device
+	NETWORK_FORWARD_STARTED, // a worker (re)started, whatever it claimed is gone
+	NETWORK_FORWARD_CHANNEL, // a data channel id, claimed or released
+	NETWORK_FORWARD_ROUTE, // a tunnel address, claimed or released
+};
+
+extern struct network_stats network_stats;
+extern bool network_reuse_port;
+
 void network_config_init();
 bool network_init();
+bool network_loop_init();
 void network_sleep();
+void network_close(struct network_connection *net);
+void network_want_flush(struct network_connection *net);
+char *network_ip_string(struct sockaddr *addr, int addr_len);
+int network_addr_key(struct sockaddr *addr, uint8_t *key);
+struct network_connection *network_register_fd(int fd, void (*handler)(struct network_connection *));
+void network_foreach(bool (*callback)(struct network_connection *));
+void network_gauges(struct network_gauges *gauges);
+uint64_t network_now();
+void network_event_begin();
+void network_event_done(struct network_connection *net);
+void network_inherit(int tcp, int udp, int forward);
+bool network_listen_fds(int *tcp, int *udp);
+bool network_stop_listening(int forwarded);
+bool network_forward(struct sockaddr *addr, socklen_t addr_len, const uint8_t *buf, size_t len);
+bool network_workers_init(int count);
+int network_workers();
+bool network_worker_pass(int worker, struct sockaddr *addr, socklen_t addr_len, const uint8_t *buf, size_t len);
+bool network_worker_claim(int worker, enum network_forward_type type, bool release, const uint8_t *key, size_t key_len);
+int network_peers();
 
 ssize_t network_read(struct network_connection *net, void*buf, size_t size);
 ssize_t network_write(struct network_connection *net, const void*buf, size_t size);
 
+/* smallest output buffer: a full TLS record (2^14 bytes of data) with its 5
+ * byte header and the 256 bytes of expansion the RFCs allow a cipher. Buffers
+ * only grow by doubling, NETWORK_BUF_CLASSES sizes from this one are pooled. */
+#define NETWORK_BUF_SIZE (16384 + 5 + 256)
+#define NETWORK_BUF_CLASSES 4
+
+void *network_buf_realloc(void *buf, size_t size, size_t new_size);
+void network_buf_free(void *buf, size_t size);
+bool network_buf_budget(struct network_connection *net, size_t size);
+size_t network_memory(struct network_connection *net);
+
+// network_profile.c
+#define NETWORK_BATCH_MIN 16 // events one epoll_wait() may return
+#define NETWORK_BATCH_MAX 256
+
+struct network_slowest {
+	uint64_t ns; // 0 if no event yet
+	uint64_t at; // when it ended, network_now()
+	int fd;
+	struct network_connection *net; // may be closed by now, only an id
+};
+
+// this process's loop, since start or the last reset
+struct network_profile {
+	uint64_t since; // network_now()
+	struct metrics_hdr blocked_us; // in epoll_wait()
+	struct metrics_hdr busy_us; // from its return to the end of the iteration
+	struct metrics_hdr event_us; // one peer's event
+	struct metrics_hdr events; // per wakeup
+	uint64_t saturated; // wakeups that filled the batch
+	int batch; // current batch size, NETWORK_BATCH_MIN to NETWORK_BATCH_MAX
+	uint64_t grows, shrinks;
+	struct network_slowest slowest, last_slowest; // this interval and the one before
+};
+
+extern struct network_profile network_profile;
+
+void network_profile_reset();
+void network_profile_wakeup(int nfds, uint64_t now);
+void network_profile_event(struct network_connection *net, uint64_t ns, uint64_t now);
+void network_profile_done(int nfds, uint64_t now);
+
+// network_egress.c
+/* a ring of references, not a list through packet->next: the same packet
+ * may be queued for several peers */
+struct network_egress_queue {
+	struct packet **ring;
+	int first, count, size;
+};
+
+// one peer's place in the egress scheduler
+struct network_egress {
+	struct network_connection *net;
+	struct network_egress_queue control; // strict priority: control and keepalives
+	struct network_egress_queue bulk; // everything else, deficit round robin
+	struct network_egress *control_next, *bulk_next; // in the lists of peers with something queued
+	bool on_control, on_bulk;
+	bool in_turn; // got its quantum this round, may send while the deficit allows
+	int deficit; // bytes
+	uint64_t rate; // bytes per second, 0 for no limit of its own
+	int64_t tokens; // bytes, the bucket
+	uint64_t refilled; // when, network_now()
+	uint64_t sent, dropped; // packets, for the admin socket
+};
+
+struct network_egress_stats {
+	uint64_t control, bulk; // packets sent by class
+	uint64_t queue_full; // dropped, the peer's queue was at network_egress_queue_max
+	uint64_t unsent; // dropped, neither the data channel nor the TLS session took it
+	uint64_t throttled; // turns skipped because the peer was over its rate
+};
+
+extern struct network_egress_stats network_egress_stats;
+
+void network_egress_config_init();
+bool network_egress_queue(struct network_connection *net, struct packet *pkt, bool control);
+void network_egress_limit(struct network_connection *net, uint64_t rate);
+int network_egress_dequeue(struct network_connection **nets, struct packet **pkts, int max, uint64_t now);
+int network_egress_timeout(int timeout, uint64_t now);
+void network_egress_free(struct network_connection *net);
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ssl.h"
+#include "cfg_files.h"
+#include "network.h"
+
+/* Egress scheduler: tunnel packets for peers wait here until the loop sends
+ * them (network_egress_dequeue() once per iteration), so one peer with a bulk
+ * transfer can't make everyone else's packets wait behind its own.
+ *
+ * Each peer has two queues. Control packets (keepalives, anything small that
+ * a tunnel waits on) go out first, one per peer in turn. Bulk packets are
+ * served by deficit round robin: on its turn a peer gets network_egress_quantum
+ * more bytes of credit and sends while its next packet fits, so peers share
+ * the link by bytes whatever their packet sizes, and a peer with a few small
+ * packets never waits for more than a turn of each of the others.
+ *
+ * Fairness only helps if the queue builds up here and not in the socket
+ * buffer or the modem after it: network_egress_link shapes everything to a
+ * rate a bit under the uplink. A peer may also be held to a rate of its own,
+ * network_egress_peer_rate or network_egress_limit(). Both are token buckets
+ * of NETWORK_EGRESS_BURST_MS worth of bytes; a packet may go as long as the
+ * bucket isn't empty and takes it below zero, so packets bigger than the
+ * bucket still pass. Control packets skip the peer's bucket but not the link.
+ *
+ * A queue holds at most network_egress_queue_max packets, more are dropped,
+ * like a full socket buffer would. */
+
+#define NETWORK_EGRESS_BURST_MS 2
+// what the link carries on top of a payload: data channel header and tag, UDP and IPv4 headers
+#define NETWORK_EGRESS_OVERHEAD (SSL_DATA_OVERHEAD + 28)
+
+static int quantum = 1500; // bytes
+static int queue_max = 256; // packets per queue
+static int link_rate = 0; // kB/s, 0 for no shaping
+static int peer_rate = 0; // kB/s
+
+// peers with control packets, and with bulk packets: the round robin order
+static struct network_egress *control_head, *control_tail;
+static struct network_egress *bulk_head, *bulk_tail;
+static int bulk_peers;
+
+static int64_t link_tokens;
+static uint64_t link_refilled;
+
+struct network_egress_stats network_egress_stats;
+
+void network_egress_config_init() {
+	config_add_var(CONFIG_CORE, "network_egress_quantum", &quantum, CONF_VAR_INT, 64, 65536, false);
+	config_add_var(CONFIG_CORE, "network_egress_queue_max", &queue_max, CONF_VAR_INT, 1, 65536, false);
+	config_add_var(CONFIG_CORE, "network_egress_link", &link_rate, CONF_VAR_INT, 0, 100000000, false);
+	config_add_var(CONFIG_CORE, "network_egress_peer_rate", &peer_rate, CONF_VAR_INT, 0, 100000000, false);
+}
+
+static int64_t network_egress_burst(uint64_t rate) {
+	int64_t burst = rate * NETWORK_EGRESS_BURST_MS / 1000;
+	return burst < 2 * PACKET_SIZE ? 2 * PACKET_SIZE : burst;
+}
+
+static void network_egress_refill(int64_t *tokens, uint64_t *refilled, uint64_t rate, uint64_t now) {
+	uint64_t elapsed = now - *refilled;
+
+	// a full bucket takes far less than a second, and rate * ns would overflow past that
+	if (elapsed > 1000000000) elapsed = 1000000000;
+	*tokens += elapsed * rate / 1000000000;
+	*refilled = now;
+	int64_t burst = network_egress_burst(rate);
+	if (*tokens > burst) *tokens = burst;
+}
+
+static size_t network_egress_size(struct packet *pkt) {
+	return pkt->len + NETWORK_EGRESS_OVERHEAD;
+}
+
+// the ring grows by doubling up to network_egress_queue_max, the caller checked count is below that
+static bool network_egress_push(struct network_egress_queue *q, struct packet *pkt) {
+	if (q->count == q->size) {
+		int size = q->size ? q->size * 2 : 16;
+		if (size > queue_max) size = queue_max;
+		struct packet **ring = malloc(sizeof(struct packet *) * size);
+		if (ring == NULL) return false;
+		for(int i = 0; i < q->count; i++) ring[i] = q->ring[(q->first + i) % q->size];
+		free(q->ring);
+		q->ring = ring;
+		q->first = 0;
+		q->size = size;
+	}
+	q->ring[(q->first + q->count) % q->size] = pkt;
+	q->count++;
+	return true;
+}
+
+static struct packet *network_egress_peek(struct network_egress_queue *q) {
+	return q->count ? q->ring[q->first] : NULL;
+}
+
+static struct packet *network_egress_pop(struct network_egress_queue *q) {
+	struct packet *pkt = q->ring[q->first];
+	q->first = (q->first + 1) % q->size;
+	q->count--;
+	return pkt;
+}
+
+static void network_egress_flush_queue(struct network_egress_queue *q) {
+	while(q->count > 0) packet_unref(network_egress_pop(q));
+	free(q->ring);
+	q->ring = NULL;
+	q->size = 0;
+}
+
+static struct network_egress *network_egress_get(struct network_connection *net) {
+	if (net->egress != NULL) return net->egress;
+
+	struct network_egress *e = calloc(sizeof(struct network_egress), 1);
+	if (e == NULL) return NULL;
+	e->net = net;
+	e->rate = (uint64_t)peer_rate * 1000;
+	e->tokens = network_egress_burst(e->rate); // and refilled = 0, the first refill tops it up anyway
+	net->egress = e;
+	return e;
+}
+
+/* network_egress_queue : queue a tunnel packet for a peer, taking over the
+ * caller's reference. Returns false if it was dropped instead. */
+bool network_egress_queue(struct network_connection *net, struct packet *pkt, bool control) {
+	struct network_egress *e = network_egress_get(net);
+
+	if (e == NULL) {
+		packet_unref(pkt);
+		return false;
+	}
+	struct network_egress_queue *q = control ? &e->control : &e->bulk;
+	if ((q->count >= queue_max) || !network_egress_push(q, pkt)) {
+		network_egress_stats.queue_full++;
+		e->dropped++;
+		packet_unref(pkt);
+		return false;
+	}
+
+	if (control && !e->on_control) {
+		e->on_control = true;
+		e->control_next = NULL;
+		if (control_tail != NULL) control_tail->control_next = e;
+		else control_head = e;
+		control_tail = e;
+	}
+	if (!control && !e->on_bulk) {
+		e->on_bulk = true;
+		e->bulk_next = NULL;
+		if (bulk_tail != NULL) bulk_tail->bulk_next = e;
+		else bulk_head = e;
+		bulk_tail = e;
+		bulk_peers++;
+	}
+	return true;
+}
+
+// give a peer a rate of its own, bytes per second, 0 for none
+void network_egress_limit(struct network_connection *net, uint64_t rate) {
+	struct network_egress *e = network_egress_get(net);
+
+	if (e == NULL) return;
+	e->rate = rate;
+	int64_t burst = network_egress_burst(rate);
+	if (e->tokens > burst) e->tokens = burst;
+}
+
+static void network_egress_control_rotate() {
+	struct network_egress *e = control_head;
+
+	control_head = e->control_next;
+	e->control_next = NULL;
+	if (e->control.count > 0) {
+		if (control_head != NULL) control_tail->control_next = e;
+		else control_head = e;
+		control_tail = e;
+	} else {
+		e->on_control = false;
+		if (control_head == NULL) control_tail = NULL;
+	}
+}
+
+// the peer at the head of the round is done for now, to the back or out if it has nothing left
+static void network_egress_bulk_rotate() {
+	struct network_egress *e = bulk_head;
+
+	e->in_turn = false;
+	if (e->bulk.count == 0) {
+		e->deficit = 0; // credit doesn't carry over idle time
+		e->on_bulk = false;
+		bulk_peers--;
+	}
+	if (e->bulk_next == NULL) {
+		if (e->on_bulk) return; // alone in the round
+		bulk_head = bulk_tail = NULL;
+		return;
+	}
+	bulk_head = e->bulk_next;
+	e->bulk_next = NULL;
+	if (e->on_bulk) {
+		bulk_tail->bulk_next = e;
+		bulk_tail = e;
+	}
+}
+
+/* network_egress_dequeue : up to max packets that may go now, in order, with
+ * the peer each is for. The caller owns them. Returns 0 when nothing is queued
+ * or everything left has to wait for its rate. */
+int network_egress_dequeue(struct network_connection **nets, struct packet **pkts, int max, uint64_t now) {
+	uint64_t link = (uint64_t)link_rate * 1000;
+	int n = 0;
+
+	if (link) network_egress_refill(&link_tokens, &link_refilled, link, now);
+	else link_tokens = 0;
+
+	while((n < max) && (control_head != NULL) && (link_tokens >= 0)) {
+		struct network_egress *e = control_head;
+		struct packet *pkt = network_egress_pop(&e->control);
+		if (link) link_tokens -= network_egress_size(pkt);
+		e->sent++;
+		network_egress_stats.control++;
+		nets[n] = e->net;
+		pkts[n++] = pkt;
+		network_egress_control_rotate();
+	}
+
+	// a full round of peers that are all over their rate ends it
+	int waiting = 0;
+	while((n < max) && (bulk_head != NULL) && (link_tokens >= 0) && (waiting < bulk_peers)) {
+		struct network_egress *e = bulk_head;
+
+		if (e->rate && !e->in_turn) {
+			network_egress_refill(&e->tokens, &e->refilled, e->rate, now);
+			if (e->tokens < 0) {
+				network_egress_stats.throttled++;
+				waiting++;
+				network_egress_bulk_rotate();
+				continue;
+			}
+		}
+		if (!e->in_turn) {
+			e->deficit += quantum;
+			e->in_turn = true;
+		}
+		size_t size = network_egress_size(network_egress_peek(&e->bulk));
+		if (size > (size_t)e->deficit) {
+			// more credit next round
+			waiting = 0;
+			network_egress_bulk_rotate();
+			continue;
+		}
+
+		struct packet *pkt = network_egress_pop(&e->bulk);
+		e->deficit -= size;
+		if (e->rate) e->tokens -= size;
+		if (link) link_tokens -= size;
+		e->sent++;
+		network_egress_stats.bulk++;
+		nets[n] = e->net;
+		pkts[n++] = pkt;
+		waiting = 0;
+		if ((e->bulk.count == 0) || (e->rate && (e->tokens < 0))) network_egress_bulk_rotate();
+	}
+	return n;
+}
+
+/* network_egress_timeout : how long the loop may sleep, at most timeout ms,
+ * for packets held back by a rate to go when their tokens are there */
+int network_egress_timeout(int timeout, uint64_t now) {
+	uint64_t link = (uint64_t)link_rate * 1000;
+	int wait = timeout;
+
+	if ((control_head == NULL) && (bulk_head == NULL)) return timeout;
+	if (link && (link_tokens < 0)) {
+		// tokens as of the last dequeue, they kept coming since
+		uint64_t ns = (uint64_t)-link_tokens * 1000000000 / link;
+		uint64_t elapsed = now - link_refilled;
+		wait = (ns > elapsed) ? (ns - elapsed + 999999) / 1000000 : 0;
+	} else if (bulk_head != NULL) {
+		// a peer over its own rate, try again on the next tick
+		wait = 1;
+	}
+	return wait < timeout ? wait : timeout;
+}
+
+// drop what a closing peer had queued
+void network_egress_free(struct network_connection *net) {
+	struct network_egress *e = net->egress;
+	struct network_egress *prev = NULL;
+
+	if (e == NULL) return;
+	if (e->on_control) {
+		for(struct network_egress *p = control_head; p != e; p = p->control_next) prev = p;
+		if (prev != NULL) prev->control_next = e->control_next;
+		else control_head = e->control_next;
+		if (control_tail == e) control_tail = prev;
+	}
+	prev = NULL;
+	if (e->on_bulk) {
+		for(struct network_egress *p = bulk_head; p != e; p = p->bulk_next) prev = p;
+		if (prev != NULL) prev->bulk_next = e->bulk_next;
+		else bulk_head = e->bulk_next;
+		if (bulk_tail == e) bulk_tail = prev;
+		bulk_peers--;
+	}
+	network_egress_flush_queue(&e->control);
+	network_egress_flush_queue(&e->bulk);
+	free(e);
+	net->egress = NULL;
+}
@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "network.h"
+
+/* Loop profile: where network_sleep() spends its time, and how many events
+ * each wakeup brings. The admin socket shows it ("loop").
+ *
+ * It also sizes the epoll batch. Everything the handlers of one batch write is
+ * flushed after the last of them, so a batch is a latency budget as much as a
+ * syscall saving: grow it while wakeups fill it and iterations stay short,
+ * shrink it when an iteration runs long or the load is gone. */
+
+#define NETWORK_PROFILE_INTERVAL 10000000000ULL // ns, slowest event kept per interval
+#define NETWORK_BATCH_BUSY_US 2000 // iterations longer than this shrink the batch
+#define NETWORK_BATCH_IDLE 64 // wakeups under a quarter of the batch before it shrinks
+
+struct network_profile network_profile = { .batch = NETWORK_BATCH_MIN };
+
+static uint64_t iteration_start, iteration_end;
+static uint64_t interval_start;
+static int underused; // wakeups in a row
+
+void network_profile_reset() {
+	int batch = network_profile.batch;
+
+	memset(&network_profile, 0, sizeof(network_profile));
+	network_profile.batch = batch;
+	network_profile.since = network_now();
+}
+
+void network_profile_wakeup(int nfds, uint64_t now) {
+	struct network_profile *p = &network_profile;
+
+	if (p->since == 0) p->since = now;
+	if (iteration_end != 0) metrics_hdr_record(&p->blocked_us, (now - iteration_end) / 1000);
+	iteration_start = now;
+	if (nfds < 0) return;
+	metrics_hdr_record(&p->events, nfds);
+	if (nfds == p->batch) {
+		// more may be waiting in the ready list
+		p->saturated++;
+		network_stats.saturated++;
+	}
+}
+
+void network_profile_event(struct network_connection *net, uint64_t ns, uint64_t now) {
+	metrics_hdr_record(&network_profile.event_us, ns / 1000);
+	if (ns > network_profile.slowest.ns)
+		network_profile.slowest = (struct network_slowest){ ns, now, net->fd, net };
+}
+
+void network_profile_done(int nfds, uint64_t now) {
+	struct network_profile *p = &network_profile;
+	uint64_t busy_us = (now - iteration_start) / 1000;
+
+	metrics_hdr_record(&p->busy_us, busy_us);
+	iteration_end = now;
+
+	if ((busy_us > NETWORK_BATCH_BUSY_US) && (p->batch > NETWORK_BATCH_MIN)) {
+		p->batch /= 2;
+		p->shrinks++;
+		underused = 0;
+	} else if ((nfds == p->batch) && (p->batch < NETWORK_BATCH_MAX)) {
+		p->batch *= 2;
+		p->grows++;
+		underused = 0;
+	} else if ((nfds < p->batch / 4) && (p->batch > NETWORK_BATCH_MIN)) {
+		if (++underused >= NETWORK_BATCH_IDLE) {
+			p->batch /= 2;
+			p->shrinks++;
+			underused = 0;
+		}
+	} else {
+		underused = 0;
+	}
+
+	if (now - interval_start >= NETWORK_PROFILE_INTERVAL) {
+		p->last_slowest = p->slowest;
+		memset(&p->slowest, 0, sizeof(p->slowest));
+		interval_start = now;
+	}
+}
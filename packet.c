@@ -0,0 +1,201 @@
+#define _GNU_SOURCE // MAP_HUGETLB
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "cfg_files.h"
+#include "packet.h"
+
+/* Packet buffers for tunnel traffic: a packet is received, opened, queued and
+ * sealed again for another peer in the same buffer, references instead of
+ * copies when it goes to several places. Whoever writes to a packet it
+ * doesn't hold alone (packet_shared()) works on a packet_copy().
+ *
+ * Buffers are carved from 2 MB chunks, on explicit huge pages when there are
+ * some reserved (vm.nr_hugepages), else on a 2 MB aligned mapping the kernel
+ * may back with a transparent huge page. Chunks are never given back.
+ *
+ * Each thread allocates from and frees to its own cache without locking, and
+ * trades PACKET_BATCH buffers at a time with the shared pool when it runs
+ * empty or grows past twice that. A packet may be freed by another thread
+ * than the one that allocated it. */
+
+#define PACKET_CHUNK_SIZE (2 * 1024 * 1024)
+#define PACKET_BATCH 64
+#define PACKET_CACHE_MAX (2 * PACKET_BATCH)
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+_Static_assert(sizeof(struct packet) == PACKET_SIZE, "struct packet header is not 16 bytes");
+
+struct packet_cache {
+	struct packet *head;
+	int count;
+};
+
+static int pool_max = 256; // MB
+static int use_hugetlb = 1;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct packet *pool; // shared free list
+static int pool_count;
+static struct packet_gauges gauges;
+static bool hugetlb_failed;
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key; // gives the cache back when its thread exits
+static __thread struct packet_cache cache;
+static __thread bool cache_registered;
+
+void packet_config_init() {
+	config_add_var(CONFIG_CORE, "packet_pool_max", &pool_max, CONF_VAR_INT, 2, 1048576, false);
+	config_add_var(CONFIG_CORE, "packet_hugetlb", &use_hugetlb, CONF_VAR_INT, 0, 1, false);
+}
+
+static void *packet_chunk_map(bool *huge) {
+	void *chunk = MAP_FAILED;
+
+	if (use_hugetlb && !hugetlb_failed) {
+		chunk = mmap(NULL, PACKET_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		if (chunk == MAP_FAILED) {
+			// don't retry for every chunk, the reserve doesn't refill by itself
+			log_printf("No 2 MB huge pages for packet buffers, using transparent huge pages");
+			hugetlb_failed = true;
+		}
+	}
+	*huge = (chunk != MAP_FAILED);
+	if (*huge) return chunk;
+
+	// over-map to find a 2 MB boundary, a huge page can only back an aligned range
+	uint8_t *map = mmap(NULL, 2 * PACKET_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return NULL;
+	uint8_t *aligned = (uint8_t *)(((uintptr_t)map + PACKET_CHUNK_SIZE - 1) & ~(uintptr_t)(PACKET_CHUNK_SIZE - 1));
+	if (aligned > map) munmap(map, aligned - map);
+	munmap(aligned + PACKET_CHUNK_SIZE, map + PACKET_CHUNK_SIZE - aligned);
+	madvise(aligned, PACKET_CHUNK_SIZE, MADV_HUGEPAGE);
+	return aligned;
+}
+
+// add a chunk to the shared pool, with pool_lock held
+static bool packet_pool_grow() {
+	bool huge;
+
+	if (gauges.bytes + PACKET_CHUNK_SIZE > (uint64_t)pool_max * 1024 * 1024) return false;
+	uint8_t *chunk = packet_chunk_map(&huge);
+	if (chunk == NULL) {
+		log_perror();
+		return false;
+	}
+	for(int i = PACKET_CHUNK_SIZE / PACKET_SIZE - 1; i >= 0; i--) {
+		struct packet *p = (struct packet *)(chunk + i * PACKET_SIZE);
+		p->next = pool;
+		pool = p;
+	}
+	pool_count += PACKET_CHUNK_SIZE / PACKET_SIZE;
+	gauges.bytes += PACKET_CHUNK_SIZE;
+	if (huge) gauges.huge_bytes += PACKET_CHUNK_SIZE;
+	return true;
+}
+
+// give count buffers (all if count < 0) of this thread's cache to the pool
+static void packet_cache_flush(int count) {
+	struct packet *first = cache.head, *last = NULL;
+	int n = 0;
+
+	if (first == NULL) return;
+	for(struct packet *p = first; (p != NULL) && ((count < 0) || (n < count)); p = p->next) {
+		last = p;
+		n++;
+	}
+	cache.head = last->next;
+	cache.count -= n;
+
+	pthread_mutex_lock(&pool_lock);
+	last->next = pool;
+	pool = first;
+	pool_count += n;
+	gauges.free_bytes = (uint64_t)pool_count * PACKET_SIZE;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void packet_cache_release(void *arg) {
+	packet_cache_flush(-1);
+}
+
+static void packet_cache_key() {
+	pthread_key_create(&cache_key, packet_cache_release);
+}
+
+static void packet_cache_register() {
+	pthread_once(&cache_once, packet_cache_key);
+	pthread_setspecific(cache_key, &cache);
+	cache_registered = true;
+}
+
+// take a batch from the pool, growing it if needed
+static bool packet_cache_fill() {
+	if (!cache_registered) packet_cache_register();
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < PACKET_BATCH) packet_pool_grow();
+	while((pool != NULL) && (cache.count < PACKET_BATCH)) {
+		struct packet *p = pool;
+		pool = p->next;
+		pool_count--;
+		p->next = cache.head;
+		cache.head = p;
+		cache.count++;
+	}
+	gauges.free_bytes = (uint64_t)pool_count * PACKET_SIZE;
+	pthread_mutex_unlock(&pool_lock);
+	return cache.head != NULL;
+}
+
+/* packet_alloc : a packet with no data and PACKET_HEADROOM in front of it,
+ * held once. NULL when packet_pool_max is reached. */
+struct packet *packet_alloc() {
+	if ((cache.head == NULL) && !packet_cache_fill()) return NULL;
+
+	struct packet *p = cache.head;
+	cache.head = p->next;
+	cache.count--;
+	p->next = NULL;
+	p->refcount = 1;
+	p->head = PACKET_HEADROOM;
+	p->len = 0;
+	return p;
+}
+
+void packet_unref(struct packet *p) {
+	if (p == NULL) return;
+	if (__atomic_sub_fetch(&p->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+	if (!cache_registered) packet_cache_register();
+	p->next = cache.head;
+	cache.head = p;
+	if (++cache.count >= PACKET_CACHE_MAX) packet_cache_flush(PACKET_BATCH);
+}
+
+// a packet of our own with the same data at the same place, NULL if out of buffers
+struct packet *packet_copy(struct packet *p) {
+	struct packet *copy = packet_alloc();
+
+	if (copy == NULL) return NULL;
+	copy->head = p->head;
+	copy->len = p->len;
+	memcpy(packet_data(copy), packet_data(p), p->len);
+	return copy;
+}
+
+void packet_gauges(struct packet_gauges *res) {
+	pthread_mutex_lock(&pool_lock);
+	*res = gauges;
+	pthread_mutex_unlock(&pool_lock);
+}
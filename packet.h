@@ -0,0 +1,80 @@
+#ifndef _PACKET_H
+#define _PACKET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Packet buffers, see packet.c. A packet is one fixed size buffer: this
+ * header, then the data somewhere inside buf with free space on both sides,
+ * so headers can be prepended and tags appended where the data already is. */
+#define PACKET_SIZE 2048 // whole buffer, header included
+#define PACKET_BUF_SIZE (PACKET_SIZE - 16)
+#define PACKET_HEADROOM 64 // in front of the data of a new packet
+#define PACKET_TAILROOM 32 // to keep free after data written into a new packet
+#define PACKET_DATA_MAX (PACKET_BUF_SIZE - PACKET_HEADROOM - PACKET_TAILROOM)
+
+struct packet {
+	struct packet *next; // free lists, or any queue its owner puts it on
+	uint32_t refcount;
+	uint16_t head; // data starts at buf + head
+	uint16_t len;
+	uint8_t buf[PACKET_BUF_SIZE];
+};
+
+// current sizes, not summed over time
+struct packet_gauges {
+	uint64_t bytes; // mapped for buffers
+	uint64_t huge_bytes; // of which on explicit 2 MB pages
+	uint64_t free_bytes; // in the shared pool, thread caches not included
+};
+
+static inline uint8_t *packet_data(struct packet *p) {
+	return p->buf + p->head;
+}
+
+static inline size_t packet_headroom(const struct packet *p) {
+	return p->head;
+}
+
+static inline size_t packet_tailroom(const struct packet *p) {
+	return PACKET_BUF_SIZE - p->head - p->len;
+}
+
+// make room for size bytes in front of the data, the caller checked packet_headroom()
+static inline uint8_t *packet_push(struct packet *p, size_t size) {
+	p->head -= size;
+	p->len += size;
+	return p->buf + p->head;
+}
+
+// drop size bytes from the front
+static inline void packet_pull(struct packet *p, size_t size) {
+	p->head += size;
+	p->len -= size;
+}
+
+// make room for size bytes after the data, the caller checked packet_tailroom()
+static inline uint8_t *packet_put(struct packet *p, size_t size) {
+	uint8_t *tail = p->buf + p->head + p->len;
+	p->len += size;
+	return tail;
+}
+
+static inline struct packet *packet_ref(struct packet *p) {
+	__atomic_add_fetch(&p->refcount, 1, __ATOMIC_RELAXED);
+	return p;
+}
+
+// someone else holds it too, writing to it needs a copy
+static inline bool packet_shared(struct packet *p) {
+	return __atomic_load_n(&p->refcount, __ATOMIC_ACQUIRE) > 1;
+}
+
+void packet_config_init();
+struct packet *packet_alloc();
+void packet_unref(struct packet *p);
+struct packet *packet_copy(struct packet *p);
+void packet_gauges(struct packet_gauges *gauges);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/* USDT probes, provider "cloudconnector". Each one is a nop in the code and a
+ * note in the binary, bpftrace and perf find them without a rebuild:
+ *   bpftrace -l 'usdt:./cloudconnector:*'
+ * Built in when <sys/sdt.h> (systemtap-sdt-dev) is there, nothing otherwise:
+ * make says so. Scripts using them are in trace/. */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CC_HAVE_PROBES
+#endif
+#endif
+
+#ifdef CC_HAVE_PROBES
+#define cc_probe(name, ...) STAP_PROBEV(cloudconnector, name, ##__VA_ARGS__)
+#else
+#define cc_probe(name, ...) do { } while(0)
+#endif
+
+#endif
@@ -2,60 +2,565 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <gcrypt.h>
 
 #include "ssl.h"
 #include "log.h"
 #include "cfg_files.h"
 #include "network.h"
+#include "probes.h"
 
-static gnutls_certificate_credentials_t x509_cred;
 static gnutls_dh_params_t dh_params;
-static gnutls_priority_t prio_cache;
+static gnutls_datum_t cookie_key;
+
+static struct ssl_credentials *ssl_creds; // given to new sessions
+static int reload_pipe[2];
+static struct network_connection *reload_net;
+static bool reload_running, reload_again;
+static struct network_connection *dtls_handshakes; // waiting for a retransmit timer
+
+// record payload limit from the TLS spec
+#define SSL_RECORD_MAX 16384
+
+struct ssl_record_stats ssl_record_stats;
+struct ssl_session_stats ssl_session_stats;
+const struct ssl_input *ssl_input; // NULL: application data is dropped
+
+// copy of the ssl_* settings credentials get built from
+struct ssl_reload_job {
+	char *cert, *key, *ca_cert, *ca_crl, *priority, *psk_file;
+};
 
 static char *ssl_ca_cert;
 static char *ssl_ca_crl;
 static char *ssl_cert;
 static char *ssl_key;
+static char *ssl_priority;
+static char *ssl_psk_file;
 static int ssl_debug = 0;
+static char auto_priority[512]; // built once by the AEAD benchmark
+static int record_min = 1400; // fits in a single TCP segment with the record overhead
+static int record_ramp = 1024*1024; // 0: full size records from the start
+static int record_idle = 1000;
 
 void ssl_config_init() {
 	config_add_var(CONFIG_CORE, "ssl_ca_cert", &ssl_ca_cert, CONF_VAR_STRING_POINTER, 1, 255, true);
 	config_add_var(CONFIG_CORE, "ssl_ca_crl", &ssl_ca_crl, CONF_VAR_STRING_POINTER, 1, 255, true);
 	config_add_var(CONFIG_CORE, "ssl_cert", &ssl_cert, CONF_VAR_STRING_POINTER, 1, 255, true);
 	config_add_var(CONFIG_CORE, "ssl_key", &ssl_key, CONF_VAR_STRING_POINTER, 1, 255, true);
+	config_add_var(CONFIG_CORE, "ssl_priority", &ssl_priority, CONF_VAR_STRING_POINTER, 1, 1023, false);
+	config_add_var(CONFIG_CORE, "ssl_psk_file", &ssl_psk_file, CONF_VAR_STRING_POINTER, 1, 255, false);
 	config_add_var(CONFIG_CORE, "ssl_debug", &ssl_debug, CONF_VAR_INT, 0, 10, false);
+	config_add_var(CONFIG_CORE, "ssl_record_min", &record_min, CONF_VAR_INT, 256, SSL_RECORD_MAX, false);
+	config_add_var(CONFIG_CORE, "ssl_record_ramp", &record_ramp, CONF_VAR_INT, 0, 1024*1024*1024, false);
+	config_add_var(CONFIG_CORE, "ssl_record_idle", &record_idle, CONF_VAR_INT, 1, 3600000, false);
+	ssl_verify_config_init();
+	ssl_data_config_init();
+}
+
+static uint64_t ssl_now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 static ssize_t ssl_gnutls_push(gnutls_transport_ptr_t ptr, const void *buf, size_t size) {
 	struct network_connection *net = (struct network_connection *)ptr;
-	return network_write(net, buf, size);
+	ssl_record_stats.pushes++;
+	ssize_t res = network_write(net, buf, size);
+	cc_probe(gnutls_push, net, net->fd, size, res);
+	return res;
 }
 
 static ssize_t ssl_gnutls_pull(gnutls_transport_ptr_t ptr, void *buf, size_t size) {
 	struct network_connection *net = (struct network_connection *)ptr;
-	return network_read(net, buf, size);
+	ssize_t res = network_read(net, buf, size);
+	cc_probe(gnutls_pull, net, net->fd, size, res);
+	return res;
 }
 
-bool ssl_session_init(struct network_connection *net) {
+static int ssl_gnutls_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+	struct network_connection *net = (struct network_connection *)ptr;
+	// we never block here, the event loop calls us again when a datagram arrives
+	if (net->read_buf != NULL) return 1;
+	errno = EAGAIN;
+	return 0;
+}
+
+static void ssl_session_setup(struct network_connection *net, unsigned int flags) {
 	net->ssl_ctx = calloc(sizeof(struct ssl_context), 1);
-	gnutls_init(&net->ssl_ctx->session, GNUTLS_SERVER);
-	gnutls_priority_set(net->ssl_ctx->session, prio_cache);
-	gnutls_credentials_set(net->ssl_ctx->session, GNUTLS_CRD_CERTIFICATE, x509_cred);
+	net->ssl_ctx->datagram = (flags & GNUTLS_DATAGRAM) != 0;
+	net->ssl_ctx->record_size = record_min;
+	gnutls_init(&net->ssl_ctx->session, GNUTLS_SERVER | flags);
+	gnutls_priority_set(net->ssl_ctx->session, ssl_creds->prio);
+	// the session keeps the credentials it started with, even if a reload swaps them
+	net->ssl_ctx->creds = ssl_creds;
+	ssl_creds->refcount++;
+	gnutls_credentials_set(net->ssl_ctx->session, GNUTLS_CRD_CERTIFICATE, ssl_creds->x509_cred);
+	if (ssl_creds->psk_cred != NULL) ssl_psk_session_init(net->ssl_ctx);
 	gnutls_certificate_server_set_request(net->ssl_ctx->session, GNUTLS_CERT_REQUEST);
 
 	gnutls_transport_set_ptr(net->ssl_ctx->session, (gnutls_transport_ptr_t)net);
 	gnutls_transport_set_push_function(net->ssl_ctx->session, ssl_gnutls_push);
 	gnutls_transport_set_pull_function(net->ssl_ctx->session, ssl_gnutls_pull);
+	if (net->ssl_ctx->datagram)
+		gnutls_transport_set_pull_timeout_function(net->ssl_ctx->session, ssl_gnutls_pull_timeout);
+	cc_probe(handshake_start, net, net->fd, net->ssl_ctx->datagram);
+}
+
+bool ssl_session_init(struct network_connection *net) {
+	ssl_session_setup(net, 0);
+	return ssl_session_event(net);
+}
+
+/* ssl_dtls_cookie_verify : check the cookie in a datagram from an unknown peer.
+ * If there is no valid cookie, a HelloVerifyRequest is sent back and false
+ * returned; nothing gets allocated for the peer until it echoes our cookie. */
+bool ssl_dtls_cookie_verify(struct network_connection *endpoint, struct sockaddr *addr, socklen_t addr_len, void *buf, size_t len, gnutls_dtls_prestate_st *prestate) {
+	memset(prestate, 0, sizeof(*prestate));
+	int ret = gnutls_dtls_cookie_verify(&cookie_key, addr, addr_len, buf, len, prestate);
+	if (ret == 0) return true;
+	if (ret != GNUTLS_E_BAD_COOKIE) return false; // not a ClientHello, ignore
+
+	// reply through a throwaway connection so the push function knows where to send
+	struct network_connection tmp = {
+		.fd = endpoint->fd,
+		.remote = addr,
+		.remote_len = addr_len,
+		.stream = false,
+	};
+	gnutls_dtls_cookie_send(&cookie_key, addr, addr_len, prestate, (gnutls_transport_ptr_t)&tmp, ssl_gnutls_push);
+	return false;
+}
+
+bool ssl_dtls_session_init(struct network_connection *net, gnutls_dtls_prestate_st *prestate) {
+	ssl_session_setup(net, GNUTLS_DATAGRAM | GNUTLS_NONBLOCK);
+	gnutls_dtls_prestate_set(net->ssl_ctx->session, prestate);
+	return ssl_session_event(net);
+}
+
+/* a DTLS handshake only moves when a datagram comes, a flight that got lost
+ * has to be sent again when GnuTLS' timer says so */
+static void ssl_dtls_timer_set(struct network_connection *net) {
+	struct ssl_context *ctx = net->ssl_ctx;
+
+	if (ctx->dtls_timer == 0) {
+		ctx->dtls_next = dtls_handshakes;
+		dtls_handshakes = net;
+	}
+	ctx->dtls_timer = network_now() + (uint64_t)gnutls_dtls_get_timeout(ctx->session) * 1000000;
+}
+
+static void ssl_dtls_timer_clear(struct network_connection *net) {
+	struct ssl_context *ctx = net->ssl_ctx;
+	struct network_connection **prev = &dtls_handshakes;
+
+	if (ctx->dtls_timer == 0) return;
+	while(*prev != net) prev = &(*prev)->ssl_ctx->dtls_next;
+	*prev = ctx->dtls_next;
+	ctx->dtls_next = NULL;
+	ctx->dtls_timer = 0;
+}
+
+// how long the loop may sleep, at most timeout ms, before a retransmit is due
+int ssl_dtls_timeout(int timeout, uint64_t now) {
+	for(struct network_connection *net = dtls_handshakes; net != NULL; net = net->ssl_ctx->dtls_next) {
+		uint64_t timer = net->ssl_ctx->dtls_timer;
+		int wait = (timer > now) ? (timer - now + 999999) / 1000000 : 0;
+		if (wait < timeout) timeout = wait;
+	}
+	return timeout;
+}
+
+// move the handshakes whose timer expired, GnuTLS sends their last flight again
+void ssl_dtls_timers(uint64_t now) {
+	struct network_connection *net = dtls_handshakes, *next;
+
+	for(; net != NULL; net = next) {
+		next = net->ssl_ctx->dtls_next;
+		if (net->ssl_ctx->dtls_timer > now) continue;
+		// closing it only takes it off the list, next stays valid
+		if (!ssl_session_event(net)) network_close(net);
+	}
+}
+
+/* ssl_session_event : something happened on the connection, move the handshake
+ * forward or read pending records. Returns false if the connection should be
+ * closed. */
+bool ssl_session_event(struct network_connection *net) {
+	struct ssl_context *ctx = net->ssl_ctx;
+	int ret;
+
+	if (ctx == NULL) return false;
+
+	if (!ctx->handshake_done) {
+		ret = gnutls_handshake(ctx->session);
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+			if (ctx->datagram) ssl_dtls_timer_set(net);
+			return true;
+		}
+		if (ctx->datagram) ssl_dtls_timer_clear(net);
+		if (ret < 0) {
+			if (gnutls_error_is_fatal(ret) || ctx->datagram) {
+				log_printf("gnutls handshake error: %s", gnutls_strerror(ret));
+				cc_probe(handshake_done, net, net->fd, ret);
+				ctx->handshake_failed = true;
+				ssl_session_stats.handshakes_failed++;
+				return false;
+			}
+			return true;
+		}
+		ctx->handshake_done = true;
+		cc_probe(handshake_done, net, net->fd, 0);
+		if (!ssl_data_setup(net)) {
+			ctx->handshake_failed = true;
+			ssl_session_stats.handshakes_failed++;
+			return false;
+		}
+		ssl_session_stats.handshakes_ok++;
+		metrics_observe(&ssl_session_stats.handshake_us, (network_now() - net->created) / 1000);
+		if (ssl_debug > 0)
+			log_trace(LOG_LEVEL_DEBUG, "handshake complete on %p (%s%s%s)", net, ctx->datagram ? "dtls" : "tls", ctx->psk_identity ? ", psk " : "", ctx->psk_identity ? ctx->psk_identity : "");
+	}
+
+	while(1) {
+		char buf[16384];
+		ret = gnutls_record_recv(ctx->session, buf, sizeof(buf));
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) return true;
+		if (ret == 0) return false; // peer closed
+		if (ret < 0) {
+			if (!gnutls_error_is_fatal(ret)) continue; // eg. bad mac on a dtls record, just drop it
+			log_printf("gnutls read error: %s", gnutls_strerror(ret));
+			return false;
+		}
+		if (ssl_debug > 0)
+			log_trace(LOG_LEVEL_DEBUG, "got %d bytes from %p", ret, net);
+		// a DTLS record is one packet, a TLS stream a run of them
+		if (ssl_input == NULL) continue;
+		if (ctx->datagram) {
+			ssl_input->packet(net, (uint8_t *)buf, ret, NULL);
+		} else if (!ssl_input->stream(net, (uint8_t *)buf, ret)) {
+			log_printf("Closing %p: application stream out of sync", net);
+			return false;
+		}
+	}
+}
+
+/* ssl_write : queue application data. On streams, everything written during
+ * a loop iteration is coalesced into full records by ssl_flush(). Datagram
+ * sessions keep message boundaries and send one record per call. */
+bool ssl_write(struct network_connection *net, const void *buf, size_t size) {
+	struct ssl_context *ctx = net->ssl_ctx;
+
+	if ((ctx == NULL) || (!ctx->handshake_done)) return false;
+
+	if (ctx->datagram) {
+		ssize_t ret = gnutls_record_send(ctx->session, buf, size);
+		if (ret < 0) return false;
+		ssl_record_stats.records++;
+		ssl_record_stats.record_bytes += ret;
+		return true;
+	}
+
+	if (ctx->out_len + size > ctx->out_size) {
+		// reclaim space already sent before growing
+		if (ctx->out_pos > 0) {
+			memmove(ctx->out_buf, ctx->out_buf + ctx->out_pos, ctx->out_len - ctx->out_pos);
+			ctx->out_len -= ctx->out_pos;
+			ctx->out_pos = 0;
+		}
+		if (ctx->out_len + size > ctx->out_size) {
+			size_t new_size = ctx->out_size ? ctx->out_size * 2 : NETWORK_BUF_SIZE;
+			while (new_size < ctx->out_len + size) new_size *= 2;
+			if (!network_buf_budget(net, new_size - ctx->out_size)) return false;
+			uint8_t *new_buf = network_buf_realloc(ctx->out_buf, ctx->out_size, new_size);
+			if (new_buf == NULL) return false;
+			ctx->out_buf = new_buf;
+			ctx->out_size = new_size;
+		}
+	}
+
+	memcpy(ctx->out_buf + ctx->out_len, buf, size);
+	ctx->out_len += size;
+	network_want_flush(net);
+	return true;
+}
+
+bool ssl_pending(struct network_connection *net) {
+	struct ssl_context *ctx = net->ssl_ctx;
+	return (ctx != NULL) && (ctx->send_pending || (ctx->out_pos < ctx->out_len));
+}
+
+/* ssl_flush : cut queued data into records. A connection starts with small
+ * records so the first bytes can be decrypted as soon as one segment arrives,
+ * and switches to full size records once record_ramp bytes went through
+ * without an idle period of record_idle ms. */
+bool ssl_flush(struct network_connection *net) {
+	struct ssl_context *ctx = net->ssl_ctx;
+
+	if (!ssl_pending(net)) return true;
+
+	uint64_t now = ssl_now_ms();
+	if (now - ctx->last_send >= (uint64_t)record_idle) {
+		ctx->record_size = record_min;
+		ctx->burst_bytes = 0;
+	}
+	ctx->last_send = now;
+
+	while (ssl_pending(net)) {
+		ssize_t ret;
+		if (ctx->send_pending) {
+			// GnuTLS kept the record, finish sending it
+			ret = gnutls_record_send(ctx->session, NULL, 0);
+		} else {
+			size_t len = ctx->out_len - ctx->out_pos;
+			if (len > ctx->record_size) len = ctx->record_size;
+			ret = gnutls_record_send(ctx->session, ctx->out_buf + ctx->out_pos, len);
+		}
+		if ((ret == GNUTLS_E_AGAIN) || (ret == GNUTLS_E_INTERRUPTED)) {
+			ctx->send_pending = true;
+			return true;
+		}
+		if (ret < 0) {
+			log_printf("gnutls write error: %s", gnutls_strerror(ret));
+			return false;
+		}
+		ctx->send_pending = false;
+		ctx->out_pos += ret;
+		ssl_record_stats.records++;
+		ssl_record_stats.record_bytes += ret;
+
+		ctx->burst_bytes += ret;
+		if (ctx->burst_bytes >= (size_t)record_ramp) ctx->record_size = SSL_RECORD_MAX;
+	}
+
+	// all cut into records, an idle connection doesn't need the buffer
+	ctx->out_pos = ctx->out_len = 0;
+	network_buf_free(ctx->out_buf, ctx->out_size);
+	ctx->out_buf = NULL;
+	ctx->out_size = 0;
+	return true;
+}
+
+void ssl_session_close(struct network_connection *net) {
+	if (net->ssl_ctx == NULL) return;
+	if (!net->ssl_ctx->handshake_done && !net->ssl_ctx->handshake_failed) ssl_session_stats.handshakes_aborted++;
+	if (ssl_input != NULL) ssl_input->closed(net);
+	ssl_dtls_timer_clear(net);
+	ssl_verify_release(net->ssl_ctx);
+	ssl_data_close(net->ssl_ctx);
+	gnutls_deinit(net->ssl_ctx->session);
+	ssl_credentials_release(net->ssl_ctx->creds);
+	free(net->ssl_ctx->psk_identity);
+	network_buf_free(net->ssl_ctx->out_buf, net->ssl_ctx->out_size);
+	free(net->ssl_ctx);
+	net->ssl_ctx = NULL;
+}
+
+/* ssl_priority_string : priorities from ssl_priority. "auto" benchmarks the
+ * AEADs (once, on first use) and prefers the fastest one on this machine. */
+static const char *ssl_priority_string() {
+	if (ssl_priority == NULL) return "NORMAL";
+	if (strcmp(ssl_priority, "auto") != 0) return ssl_priority;
+	if (auto_priority[0] != 0) return auto_priority;
+
+	struct ssl_bench_result results[8];
+	int count = ssl_bench_aead(results, 8, 50, 16384);
+	if (!ssl_bench_priority(auto_priority, sizeof(auto_priority), results, count)) {
+		log_printf("Failed to build priority string from AEAD benchmark, using NORMAL");
+		strcpy(auto_priority, "NORMAL");
+		return auto_priority;
+	}
+	for(int i = 0; i < count; i++)
+		log_printf("AEAD benchmark: %s %.1f MB/s", gnutls_cipher_get_name(results[i].cipher), results[i].mbps);
+	log_printf("Using SSL priority %s", auto_priority);
+	return auto_priority;
+}
 
-	int ret = gnutls_handshake(net->ssl_ctx->session);
-	if (ret < 0) {
-		gnutls_deinit (net->ssl_ctx->session);
-		log_printf("gnutls handshake error: %s", gnutls_strerror (ret));
+/* ssl_credentials_new : load keypair, CA, CRL and PSK keys into a new
+ * credentials object. Only touches its arguments and dh_params, so it can run
+ * outside of the event loop thread. */
+static struct ssl_credentials *ssl_credentials_new(const struct ssl_reload_job *job) {
+	struct ssl_credentials *creds = calloc(sizeof(struct ssl_credentials), 1);
+	char priority[1100];
+	creds->refcount = 1;
+
+	// known peers may skip certificates, but only with a forward secret key exchange
+	snprintf(priority, sizeof(priority), "%s%s", job->priority, job->psk_file ? ":+ECDHE-PSK:+DHE-PSK" : "");
+
+	if (gnutls_priority_init(&creds->prio, priority, NULL) < 0) {
+		log_printf("Failed to initialize gnutls priority cache from \"%s\"", priority);
+		free(creds);
+		return NULL;
+	}
+
+	if (gnutls_certificate_allocate_credentials(&creds->x509_cred) != 0) {
+		log_printf("Can't allocate creditentials");
+		gnutls_priority_deinit(creds->prio);
+		free(creds);
+		return NULL;
+	}
+
+	if (gnutls_certificate_set_x509_key_file(creds->x509_cred, job->cert, job->key, GNUTLS_X509_FMT_PEM) != 0) {
+		log_printf("Can't load keypair!");
+		ssl_credentials_release(creds);
+		return NULL;
+	}
+
+	gnutls_certificate_set_dh_params(creds->x509_cred, dh_params);
+
+	if (ssl_debug > 0)
+		log_printf("Initializing CA...");
+
+	if (gnutls_certificate_set_x509_trust_file(creds->x509_cred, job->ca_cert, GNUTLS_X509_FMT_PEM) < 0) {
+		log_printf("Failed to load CA certificate");
+		ssl_credentials_release(creds);
+		return NULL;
+	}
+
+	if (!ssl_verify_load(creds, job->ca_cert, job->ca_crl)) {
+		log_printf("Failed to load CA CRL list");
+		ssl_credentials_release(creds);
+		return NULL;
+	}
+
+	gnutls_certificate_set_verify_limits(creds->x509_cred, 32768, 8);
+
+	if (job->psk_file != NULL) {
+		if (!ssl_psk_load(creds, job->psk_file)) {
+			ssl_credentials_release(creds);
+			return NULL;
+		}
+		gnutls_psk_set_server_dh_params(creds->psk_cred, dh_params);
+	}
+
+	return creds;
+}
+
+void ssl_credentials_release(struct ssl_credentials *creds) {
+	if (creds == NULL) return;
+	if (--creds->refcount > 0) return;
+	gnutls_certificate_free_credentials(creds->x509_cred);
+	gnutls_priority_deinit(creds->prio);
+	ssl_verify_free(creds);
+	ssl_psk_free(creds);
+	free(creds);
+}
+
+static void ssl_set_debug() {
+	gnutls_global_set_log_function(log_ssl_func);
+	gnutls_global_set_log_level(ssl_debug);
+}
+
+static void ssl_reload_job_free(struct ssl_reload_job *job) {
+	free(job->cert);
+	free(job->key);
+	free(job->ca_cert);
+	free(job->ca_crl);
+	free(job->priority);
+	free(job->psk_file);
+	free(job);
+}
+
+static struct ssl_reload_job *ssl_reload_job_new() {
+	struct ssl_reload_job *job = calloc(sizeof(struct ssl_reload_job), 1);
+	job->cert = strdup(ssl_cert);
+	job->key = strdup(ssl_key);
+	job->ca_cert = strdup(ssl_ca_cert);
+	job->ca_crl = strdup(ssl_ca_crl);
+	job->priority = strdup(ssl_priority_string());
+	if (ssl_psk_file != NULL) job->psk_file = strdup(ssl_psk_file);
+	return job;
+}
+
+static void *ssl_reload_thread(void *arg) {
+	struct ssl_reload_job *job = arg;
+	struct ssl_credentials *creds = ssl_credentials_new(job);
+
+	ssl_reload_job_free(job);
+
+	// a pointer is well below PIPE_BUF, this write is atomic
+	if (write(reload_pipe[1], &creds, sizeof(creds)) != sizeof(creds)) {
+		log_perror();
+		log_printf("Failed to notify SSL reload completion");
+	}
+	return NULL;
+}
+
+// network_foreach() callback: false for sessions whose PSK or certificate was revoked
+bool ssl_session_check_revoked(struct network_connection *net) {
+	if (net->ssl_ctx == NULL) return true;
+	if (ssl_psk_revoked(net->ssl_ctx, ssl_creds)) {
+		log_printf("Closing %p: PSK identity %s is gone", net, net->ssl_ctx->psk_identity);
+		return false;
 	}
+	if (net->ssl_ctx->peer == NULL) return true;
+	if (!ssl_verify_revoked(net->ssl_ctx->peer)) return true;
+	log_printf("Closing %p: peer certificate has been revoked", net);
 	return false;
 }
 
+// event loop side: swap in the credentials built by ssl_reload_thread()
+static void ssl_reload_done(struct network_connection *net) {
+	struct ssl_credentials *creds;
+
+	while(read(net->fd, &creds, sizeof(creds)) == sizeof(creds)) {
+		reload_running = false;
+		if (creds == NULL) {
+			log_printf("SSL reload failed, keeping current credentials");
+		} else {
+			ssl_credentials_release(ssl_creds);
+			ssl_creds = creds;
+			ssl_verify_activate(creds);
+			log_printf("SSL credentials reloaded");
+			network_foreach(ssl_session_check_revoked);
+		}
+		if (reload_again) {
+			reload_again = false;
+			ssl_reload();
+		}
+	}
+}
+
+/* ssl_reload : build new credentials from the current config in a separate
+ * thread. Handshakes keep using the old ones until the new set is ready, and
+ * established sessions keep theirs until they close. */
+void ssl_reload() {
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	ssl_set_debug();
+
+	if (reload_running) {
+		reload_again = true;
+		return;
+	}
+
+	if (reload_net == NULL) {
+		reload_net = network_register_fd(reload_pipe[0], ssl_reload_done);
+		if (reload_net == NULL) return;
+	}
+
+	struct ssl_reload_job *job = ssl_reload_job_new();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, ssl_reload_thread, job) != 0) {
+		log_printf("Failed to start SSL reload thread");
+		ssl_reload_job_free(job);
+	} else {
+		reload_running = true;
+	}
+	pthread_attr_destroy(&attr);
+}
+
 bool ssl_init() {
 	const char *gnutls_version = gnutls_check_version("2.8.0");
 	if (gnutls_version == NULL) {
@@ -77,43 +582,30 @@ bool ssl_init() {
 
 	if (ssl_debug > 0) {
 		log_printf("Enabling SSL debugging (ssl_debug=%d)", ssl_debug);
-		gnutls_global_set_log_function(log_ssl_func);
-		gnutls_global_set_log_level(ssl_debug);
+		ssl_set_debug();
 	}
 
-	if (gnutls_certificate_allocate_credentials(&x509_cred) != 0) {
-		log_printf("Can't allocate creditentials");
-		return false;
-	}
-
-	if (gnutls_certificate_set_x509_key_file(x509_cred, ssl_cert, ssl_key, GNUTLS_X509_FMT_PEM) != 0) {
-		log_printf("Can't load keypair!");
-		return false;
-	}
+	if (!ssl_data_init()) return false;
 
 	gnutls_dh_params_init(&dh_params);
 	if (ssl_debug > 0)
 		log_printf("Generating new pair of prime for Diffie-Hellman key exchange...");
 	gnutls_dh_params_generate2(dh_params, 1024);
-	gnutls_certificate_set_dh_params(x509_cred, dh_params);
 
-	if (ssl_debug > 0)
-		log_printf("Initializing CA...");
-
-	if (gnutls_certificate_set_x509_trust_file(x509_cred, ssl_ca_cert, GNUTLS_X509_FMT_PEM) < 0) {
-		log_printf("Failed to load CA certificate");
-		return false;
-	}
+	struct ssl_reload_job *job = ssl_reload_job_new();
+	ssl_creds = ssl_credentials_new(job);
+	ssl_reload_job_free(job);
+	if (ssl_creds == NULL) return false;
+	ssl_verify_activate(ssl_creds);
 
-	if (gnutls_certificate_set_x509_crl_file(x509_cred, ssl_ca_crl, GNUTLS_X509_FMT_PEM) < 0) {
-		log_printf("Failed to load CA CRL list");
+	if (pipe(reload_pipe) == -1) {
+		log_perror();
+		log_printf("Failed to create SSL reload pipe");
 		return false;
 	}
 
-	gnutls_certificate_set_verify_limits(x509_cred, 32768, 8);
-
-	if (gnutls_priority_init(&prio_cache, "NORMAL", NULL) < 0) {
-		log_printf("Failed to initialize gnutls priority cache");
+	if (gnutls_key_generate(&cookie_key, GNUTLS_COOKIE_KEY_SIZE) < 0) {
+		log_printf("Failed to generate DTLS cookie key");
 		return false;
 	}
 
@@ -124,9 +616,9 @@ bool ssl_init() {
 }
 
 void ssl_close() {
-	gnutls_certificate_free_credentials(x509_cred);
-	gnutls_priority_deinit(prio_cache);
+	ssl_credentials_release(ssl_creds);
 	gnutls_dh_params_deinit(dh_params);
+	gnutls_free(cookie_key.data);
 	gnutls_global_deinit();
 }
 
@@ -1,13 +1,192 @@
+
 #include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <gnutls/dtls.h>
+#include <gnutls/x509.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+struct ssl_verify_entry;
+struct ssl_data_channel;
+struct array_base;
+struct packet;
+struct network_connection;
+
+/* everything loaded from the ssl_* settings, replaced as a whole on reload.
+ * Sessions hold a reference until they close. */
+struct ssl_credentials {
+	int refcount;
+	gnutls_certificate_credentials_t x509_cred;
+	gnutls_priority_t prio;
+
+	// ssl_verify.c
+	gnutls_x509_trust_list_t trust_list;
+	gnutls_x509_crt_t *ca_list;
+	unsigned int ca_list_size;
+	struct array_base *revoked;
+	char *crl_file;
+	struct stat crl_stat;
+
+	// ssl_psk.c, only with ssl_psk_file
+	gnutls_psk_server_credentials_t psk_cred;
+	struct array_base *psk_keys;
+};
 
 struct ssl_context {
 	gnutls_session_t session;
+	bool handshake_done;
+	bool handshake_failed;
+	bool datagram;
+	struct ssl_credentials *creds;
+	struct ssl_verify_entry *peer; // verified peer chain
+	char *psk_identity; // peer authenticated with a pre-shared key instead
+	struct ssl_data_channel *data; // with ssl_data_channel, tunnel packets go over udp
+	struct network_connection *dtls_next; // in the list of DTLS handshakes waiting for their timer
+	uint64_t dtls_timer; // network_now() when GnuTLS wants to retransmit, 0 when not listed
+
+	// record layer: application data waiting to be cut into records
+	uint8_t *out_buf;
+	size_t out_size, out_len, out_pos;
+	bool send_pending; // a record is stuck in gnutls_record_send() (EAGAIN)
+	size_t record_size; // current record payload size
+	size_t burst_bytes; // sent since the connection was last idle
+	uint64_t last_send; // ms, monotonic
+};
+
+struct ssl_record_stats {
+	uint64_t records; // application records sent
+	uint64_t record_bytes; // plaintext bytes in these records
+	uint64_t pushes; // records (including handshake) handed to the transport
+};
+
+extern struct ssl_record_stats ssl_record_stats;
+
+struct ssl_session_stats {
+	uint64_t handshakes_ok;
+	uint64_t handshakes_failed; // gnutls error, or no data channel
+	uint64_t handshakes_aborted; // closed before either, eg. peer gone or reaped
+	struct metrics_histogram handshake_us; // from accept to completion
+};
+
+extern struct ssl_session_stats ssl_session_stats;
+
+/* ssl_input : where decrypted application data goes, set by tunnel.c. A DTLS
+ * record or a data channel datagram is one packet (pkt its buffer, or NULL),
+ * a TLS stream is bytes: false from stream() closes the connection. closed()
+ * hears about every session that goes away. */
+struct ssl_input {
+	void (*packet)(struct network_connection *net, uint8_t *buf, size_t len, struct packet *pkt);
+	bool (*stream)(struct network_connection *net, const uint8_t *buf, size_t len);
+	void (*closed)(struct network_connection *net);
 };
 
+extern const struct ssl_input *ssl_input;
+
 bool ssl_init();
 void ssl_config_init();
+void ssl_reload();
+void ssl_credentials_release(struct ssl_credentials *);
 
 struct network_connection;
 
 bool ssl_session_init(struct network_connection *);
+bool ssl_session_event(struct network_connection *);
+void ssl_session_close(struct network_connection *);
+bool ssl_session_check_revoked(struct network_connection *);
+bool ssl_write(struct network_connection *, const void *buf, size_t size);
+bool ssl_flush(struct network_connection *);
+bool ssl_pending(struct network_connection *);
+
+bool ssl_dtls_cookie_verify(struct network_connection *endpoint, struct sockaddr *addr, socklen_t addr_len, void *buf, size_t len, gnutls_dtls_prestate_st *prestate);
+bool ssl_dtls_session_init(struct network_connection *, gnutls_dtls_prestate_st *prestate);
+int ssl_dtls_timeout(int timeout, uint64_t now);
+void ssl_dtls_timers(uint64_t now);
+
+// ssl_bench.c
+struct ssl_bench_result {
+	gnutls_cipher_algorithm_t cipher;
+	double mbps;
+};
+
+int ssl_bench_aead(struct ssl_bench_result *results, int max, int duration_ms, size_t size);
+bool ssl_bench_priority(char *buf, size_t size, struct ssl_bench_result *results, int count);
+
+// ssl_data.c
+#define SSL_DATA_MAGIC 0xcc // DTLS records start with 20-63 (RFC 7983), no confusion possible
+#define SSL_DATA_ID_SIZE 8
+#define SSL_DATA_HEADER_SIZE (1 + SSL_DATA_ID_SIZE + 8)
+#define SSL_DATA_TAG_SIZE 16
+#define SSL_DATA_OVERHEAD (SSL_DATA_HEADER_SIZE + SSL_DATA_TAG_SIZE)
+#define SSL_DATA_WINDOW 1024 // replay window, in packets
+
+struct ssl_data_channel {
+	uint8_t id[SSL_DATA_ID_SIZE];
+	gnutls_aead_cipher_hd_t tx, rx;
+	uint8_t tx_iv[12], rx_iv[12];
+	uint64_t tx_counter;
+	uint64_t rx_max; // highest counter received
+	uint64_t rx_window[SSL_DATA_WINDOW / 64];
+	struct network_connection *net; // TLS connection the keys come from
+	struct network_connection *endpoint; // UDP endpoint the peer talks to, NULL until it did
+	struct sockaddr_storage remote;
+	socklen_t remote_len;
+};
+
+struct ssl_data_stats {
+	uint64_t tx_packets;
+	uint64_t tx_dropped; // sendto() failed, socket buffer full
+	uint64_t rx_packets;
+	uint64_t rx_unknown; // no channel with this id
+	uint64_t rx_replayed; // counter already seen or left the window
+	uint64_t rx_bad; // failed authentication
+	uint64_t roams; // peer moved to a new address
+};
+
+// one packet of a batch, sealed or opened in place
+struct ssl_data_packet {
+	struct ssl_data_channel *ch;
+	uint8_t *buf; // datagram: header, payload, tag
+	size_t len; // seal: payload in, datagram out. open: datagram in, payload out
+	bool ok;
+};
+
+extern struct ssl_data_stats ssl_data_stats;
+
+void ssl_data_config_init();
+bool ssl_data_init();
+bool ssl_data_setup(struct network_connection *);
+void ssl_data_close(struct ssl_context *);
+bool ssl_data_send(struct network_connection *, const void *buf, size_t size);
+int ssl_data_send_batch(struct network_connection **nets, struct packet **pkts, int count, bool *sent);
+bool ssl_data_input(struct network_connection *endpoint, struct sockaddr *addr, socklen_t addr_len, uint8_t *buf, size_t len, struct packet *pkt);
+void ssl_data_claim(const uint8_t *id, int owner, bool release);
+void ssl_data_worker_started(int worker);
+
+// ssl_data_aead.c
+bool ssl_data_keys(struct ssl_data_channel *, gnutls_cipher_algorithm_t cipher, const uint8_t *id,
+		const uint8_t *tx_key, const uint8_t *tx_iv, const uint8_t *rx_key, const uint8_t *rx_iv);
+bool ssl_data_derive(struct ssl_data_channel *, gnutls_session_t session, bool server);
+void ssl_data_free(struct ssl_data_channel *);
+int ssl_data_seal_batch(struct ssl_data_packet *pkts, int count);
+int ssl_data_open_batch(struct ssl_data_packet *pkts, int count);
+size_t ssl_data_seal(struct ssl_data_channel *, const void *buf, size_t size, uint8_t *out);
+ssize_t ssl_data_open(struct ssl_data_channel *, uint8_t *buf, size_t len);
+bool ssl_data_selftest(char *err, size_t err_size);
+
+// ssl_psk.c
+bool ssl_psk_load(struct ssl_credentials *, const char *psk_file);
+void ssl_psk_free(struct ssl_credentials *);
+void ssl_psk_session_init(struct ssl_context *);
+bool ssl_psk_revoked(struct ssl_context *, struct ssl_credentials *);
 
+// ssl_verify.c
+void ssl_verify_config_init();
+bool ssl_verify_load(struct ssl_credentials *, const char *ca_file, const char *crl_file);
+void ssl_verify_free(struct ssl_credentials *);
+void ssl_verify_activate(struct ssl_credentials *);
+bool ssl_verify_revoked(struct ssl_verify_entry *);
+void ssl_verify_release(struct ssl_context *);
+const char *ssl_peer_name(struct ssl_context *);
+bool ssl_verify_watch();
@@ -0,0 +1,90 @@
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ssl.h"
+
+// AEADs that TLS can negotiate with NORMAL, in the order NORMAL uses
+static const gnutls_cipher_algorithm_t ssl_bench_ciphers[] = {
+	GNUTLS_CIPHER_AES_256_GCM,
+	GNUTLS_CIPHER_CHACHA20_POLY1305,
+	GNUTLS_CIPHER_AES_128_GCM,
+};
+
+#define SSL_BENCH_CIPHERS (sizeof(ssl_bench_ciphers) / sizeof(ssl_bench_ciphers[0]))
+
+static double ssl_bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ssl_bench_aead : encrypt size byte buffers with each AEAD for about
+ * duration_ms, store throughput in MB/s. Returns the number of results. */
+int ssl_bench_aead(struct ssl_bench_result *results, int max, int duration_ms, size_t size) {
+	uint8_t key_data[32], nonce[12], aad[13];
+	uint8_t *ptext = malloc(size), *ctext = malloc(size + 16);
+	int count = 0;
+
+	gnutls_rnd(GNUTLS_RND_NONCE, key_data, sizeof(key_data));
+	memset(nonce, 0, sizeof(nonce));
+	memset(aad, 0, sizeof(aad));
+	memset(ptext, 0x5a, size);
+
+	for(unsigned int i = 0; (i < SSL_BENCH_CIPHERS) && (count < max); i++) {
+		gnutls_aead_cipher_hd_t handle;
+		gnutls_datum_t key = { key_data, gnutls_cipher_get_key_size(ssl_bench_ciphers[i]) };
+
+		if (gnutls_aead_cipher_init(&handle, ssl_bench_ciphers[i], &key) < 0) continue; // not available
+
+		double start = ssl_bench_now(), elapsed;
+		uint64_t bytes = 0;
+		do {
+			// check the clock every few rounds only
+			for(int j = 0; j < 16; j++) {
+				size_t ctext_len = size + 16;
+				nonce[0]++;
+				gnutls_aead_cipher_encrypt(handle, nonce, sizeof(nonce), aad, sizeof(aad), 16, ptext, size, ctext, &ctext_len);
+				bytes += size;
+			}
+			elapsed = ssl_bench_now() - start;
+		} while (elapsed * 1000 < duration_ms);
+
+		gnutls_aead_cipher_deinit(handle);
+
+		results[count].cipher = ssl_bench_ciphers[i];
+		results[count].mbps = bytes / elapsed / 1e6;
+		count++;
+	}
+
+	free(ptext);
+	free(ctext);
+	return count;
+}
+
+static int ssl_bench_cmp(const void *a, const void *b) {
+	const struct ssl_bench_result *ra = a, *rb = b;
+	if (ra->mbps > rb->mbps) return -1;
+	if (ra->mbps < rb->mbps) return 1;
+	return 0;
+}
+
+/* ssl_bench_priority : build a priority string preferring the fastest AEAD.
+ * results get sorted by speed. Non AEAD ciphers of NORMAL come last. */
+bool ssl_bench_priority(char *buf, size_t size, struct ssl_bench_result *results, int count) {
+	size_t len;
+
+	qsort(results, count, sizeof(struct ssl_bench_result), ssl_bench_cmp);
+
+	len = snprintf(buf, size, "NORMAL:%%SERVER_PRECEDENCE:-CIPHER-ALL");
+	for(int i = 0; i < count && len < size; i++)
+		len += snprintf(buf + len, size - len, ":+%s", gnutls_cipher_get_name(results[i].cipher));
+	if (len < size)
+		len += snprintf(buf + len, size - len, ":+AES-256-CCM:+AES-128-CCM:+AES-256-CBC:+AES-128-CBC");
+	return len < size;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE // sendmmsg()
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ssl.h"
+#include "log.h"
+#include "cfg_files.h"
+#include "network.h"
+#include "array.h"
+#include "tunnel.h"
+#include "core.h"
+
+/* Data channel: tunnel packets travel as individually sealed datagrams on the
+ * UDP endpoint, the TLS connection they are keyed from only carries control.
+ *
+ * Both ends export keying material from the TLS session (RFC 5705) with the
+ * label "EXPORTER-cloudconnector-data" and no context:
+ *   channel id (8) | client key | server key | client iv (12) | server iv (12)
+ * using the AEAD negotiated for TLS, or AES-256-GCM if that is not an AEAD.
+ *
+ * Datagram: SSL_DATA_MAGIC (1) | channel id (8) | counter (8, big endian) |
+ * ciphertext | tag (16). The nonce is the direction's iv xored with the
+ * counter (as TLS 1.3 does), the 17 header bytes are the additional data.
+ * Counters start at 0 and must never repeat for a key. With TLS 1.3 a client
+ * may send before the server has processed its Finished, such datagrams are
+ * dropped like any lost packet. */
+
+// on the wire it is at most what fits in a UDP datagram
+#define SSL_DATA_MAX_PAYLOAD (65507 - SSL_DATA_OVERHEAD)
+// burst size for ssl_data_send_batch(), packets bigger than a packet buffer go through ssl_data_send()
+#define SSL_DATA_BATCH_MAX 64
+
+static int data_channel = 0;
+static array_t *channels; // channel id => struct ssl_data_channel
+static array_t *foreign; // pre-forked: channel id homed here => worker that has it, plus one
+
+void ssl_data_config_init() {
+	config_add_var(CONFIG_CORE, "ssl_data_channel", &data_channel, CONF_VAR_INT, 0, 1, false);
+}
+
+bool ssl_data_init() {
+	char err[128];
+
+	if (!ssl_data_selftest(err, sizeof(err))) {
+		log_printf("Data channel AEAD self-test failed: %s", err);
+		return false;
+	}
+	return true;
+}
+
+/* the worker a channel's datagrams arrive at, -1 if not pre-forked. The
+ * steering program of network_workers_init() does the same. */
+static int ssl_data_home(const uint8_t *id) {
+	int workers = network_workers();
+	return (workers > 1) ? id[0] % workers : -1;
+}
+
+// pre-forked, a channel on another worker than its home is claimed there
+static bool ssl_data_claim_home(struct ssl_data_channel *ch, bool release) {
+	int home = ssl_data_home(ch->id);
+	if ((home < 0) || (home == core_worker)) return true;
+	return network_worker_claim(home, NETWORK_FORWARD_CHANNEL, release, ch->id, SSL_DATA_ID_SIZE);
+}
+
+/* ssl_data_claim : home worker, owner has (or with release, no longer has)
+ * the channel id */
+void ssl_data_claim(const uint8_t *id, int owner, bool release) {
+	if (foreign == NULL) foreign = array_new();
+	intptr_t current = (intptr_t)array_get(foreign, SSL_DATA_ID_SIZE, id) - 1;
+	if (!release) {
+		if (current < 0) array_insert(foreign, SSL_DATA_ID_SIZE, id, (void *)(intptr_t)(owner + 1), false);
+		else array_update(foreign, SSL_DATA_ID_SIZE, id, (void *)(intptr_t)(owner + 1), false);
+	} else if (current == owner) {
+		array_remove(foreign, SSL_DATA_ID_SIZE, id);
+	}
+}
+
+/* ssl_data_worker_started : worker (re)started, its claims went with the
+ * previous instance, ours homed there are sent again */
+void ssl_data_worker_started(int worker) {
+	if (foreign != NULL) {
+		array_iterator_t *it = array_iterator(foreign);
+		while(array_next(it))
+			if ((intptr_t)it->value - 1 == worker) array_remove_iterator(it);
+		array_iterator_free(it);
+	}
+	if (channels == NULL) return;
+	array_iterator_t *it = array_iterator(channels);
+	while(array_next(it)) {
+		struct ssl_data_channel *ch = it->value;
+		if (ssl_data_home(ch->id) == worker) ssl_data_claim_home(ch, false);
+	}
+	array_iterator_free(it);
+}
+
+/* ssl_data_setup : open the data channel of a TLS connection once its
+ * handshake is done. Nothing is sent until the peer's first datagram tells us
+ * where it is. */
+bool ssl_data_setup(struct network_connection *net) {
+	struct ssl_context *ctx = net->ssl_ctx;
+
+	if ((!data_channel) || ctx->datagram) return true;
+	if (channels == NULL) channels = array_new();
+
+	struct ssl_data_channel *ch = calloc(sizeof(struct ssl_data_channel), 1);
+	if (!ssl_data_derive(ch, ctx->session, true)) {
+		log_printf("Failed to derive data channel keys for %p", net);
+		free(ch);
+		return false;
+	}
+	if (array_get(channels, SSL_DATA_ID_SIZE, ch->id) != NULL) {
+		// 2^-64 odds, don't let the second session hijack the first
+		log_printf("Data channel id collision on %p, staying on TLS", net);
+		ssl_data_free(ch);
+		free(ch);
+		return true;
+	}
+	if (!ssl_data_claim_home(ch, false)) {
+		// its datagrams would be dropped, the peer can connect again
+		log_printf("Failed to claim the data channel of %p at worker %d", net, ssl_data_home(ch->id));
+		ssl_data_free(ch);
+		free(ch);
+		return false;
+	}
+	ch->net = net;
+	array_insert(channels, SSL_DATA_ID_SIZE, ch->id, ch, false);
+	ctx->data = ch;
+	return true;
+}
+
+void ssl_data_close(struct ssl_context *ctx) {
+	struct ssl_data_channel *ch = ctx->data;
+	if (ch == NULL) return;
+	// a lost release is made up for by the next datagram, ssl_data_pass()
+	ssl_data_claim_home(ch, true);
+	array_remove(channels, SSL_DATA_ID_SIZE, ch->id);
+	ssl_data_free(ch);
+	free(ch);
+	ctx->data = NULL;
+}
+
+static struct ssl_data_channel *ssl_data_channel_ready(struct network_connection *net) {
+	struct ssl_data_channel *ch = net->ssl_ctx ? net->ssl_ctx->data : NULL;
+	if ((ch == NULL) || (ch->endpoint == NULL)) return NULL;
+	return ch;
+}
+
+/* ssl_data_send : send a tunnel packet over the data channel. Returns false if
+ * the connection has no usable channel (yet), the caller then uses ssl_write. */
+bool ssl_data_send(struct network_connection *net, const void *buf, size_t size) {
+	static uint8_t out[SSL_DATA_MAX_PAYLOAD + SSL_DATA_OVERHEAD];
+	struct ssl_data_channel *ch = ssl_data_channel_ready(net);
+
+	if ((ch == NULL) || (size > SSL_DATA_MAX_PAYLOAD)) return false;
+
+	size_t len = ssl_data_seal(ch, buf, size, out);
+	if (len == 0) return false;
+	// datagrams may be dropped anyway, a full socket buffer is just another loss
+	if (sendto(ch->endpoint->fd, out, len, 0, (struct sockaddr *)&ch->remote, ch->remote_len) == -1) {
+		ssl_data_stats.tx_dropped++;
+		return true;
+	}
+	ssl_data_stats.tx_packets++;
+	return true;
+}
+
+/* ssl_data_send_batch : send a burst of tunnel packets, sealed in one pass
+ * and handed to the kernel with one sendmmsg() per endpoint. Each packet is
+ * sealed where it is, in its headroom and tailroom, and holds the datagram
+ * afterwards; shared ones are copied first. sent[i] is set for the packets
+ * that went over the data channel, the others (no usable channel, or no room
+ * around the payload) are left to the caller. */
+int ssl_data_send_batch(struct network_connection **nets, struct packet **pkts, int count, bool *sent) {
+	struct ssl_data_packet batch[SSL_DATA_BATCH_MAX];
+	struct packet *copies[SSL_DATA_BATCH_MAX];
+	struct mmsghdr msgs[SSL_DATA_BATCH_MAX];
+	struct iovec iovs[SSL_DATA_BATCH_MAX];
+	int total = 0;
+
+	for(int start = 0; start < count; start += SSL_DATA_BATCH_MAX) {
+		int n = 0, c = 0;
+		int end = (count - start > SSL_DATA_BATCH_MAX) ? start + SSL_DATA_BATCH_MAX : count;
+
+		for(int i = start; i < end; i++) {
+			struct ssl_data_channel *ch = ssl_data_channel_ready(nets[i]);
+			struct packet *pkt = pkts[i];
+			sent[i] = false;
+			if ((ch == NULL) || (packet_headroom(pkt) < SSL_DATA_HEADER_SIZE) || (packet_tailroom(pkt) < SSL_DATA_TAG_SIZE)) continue;
+			if (packet_shared(pkt)) {
+				pkt = copies[c] = packet_copy(pkt);
+				if (pkt == NULL) continue;
+				c++;
+			}
+			size_t payload_len = pkt->len;
+			batch[n] = (struct ssl_data_packet){ ch, packet_push(pkt, SSL_DATA_HEADER_SIZE), payload_len, false };
+			packet_put(pkt, SSL_DATA_TAG_SIZE);
+			sent[i] = true;
+			n++;
+		}
+		ssl_data_seal_batch(batch, n);
+
+		int m = 0;
+		for(int i = 0; i < n; i++) {
+			struct ssl_data_channel *ch = batch[i].ch;
+			if (!batch[i].ok) continue;
+			iovs[m] = (struct iovec){ batch[i].buf, batch[i].len };
+			msgs[m].msg_hdr = (struct msghdr){
+				.msg_name = &ch->remote,
+				.msg_namelen = ch->remote_len,
+				.msg_iov = &iovs[m],
+				.msg_iovlen = 1,
+			};
+			m++;
+		}
+
+		// runs of packets for the same endpoint go out together
+		for(int i = 0; i < m; ) {
+			int fd = batch[i].ch->endpoint->fd, run = 1;
+			while((i + run < m) && (batch[i + run].ch->endpoint->fd == fd)) run++;
+			int done = sendmmsg(fd, &msgs[i], run, 0);
+			if (done < 0) done = 0;
+			// datagrams may be dropped anyway, a full socket buffer is just another loss
+			ssl_data_stats.tx_packets += done;
+			ssl_data_stats.tx_dropped += run - done;
+			i += run;
+		}
+		for(int i = 0; i < c; i++)
+			packet_unref(copies[i]);
+		total += m;
+	}
+	return total;
+}
+
+/* the channel id identifies the peer, not its address: when an authenticated
+ * packet comes from somewhere else (NAT rebinding, network change) replies
+ * follow it right away. Only the newest packet may move the peer, so a
+ * delayed or replayed copy of an older one can't drag it back. */
+static void ssl_data_roam(struct ssl_data_channel *ch, struct network_connection *endpoint, struct sockaddr *addr, socklen_t addr_len) {
+	uint8_t old_key[32], new_key[32];
+	int old_len = network_addr_key((struct sockaddr *)&ch->remote, old_key);
+	int new_len = network_addr_key(addr, new_key);
+
+	if ((old_len == new_len) && (memcmp(old_key, new_key, new_len) == 0) && (ch->endpoint == endpoint)) return;
+
+	char *ipstr = network_ip_string(addr, addr_len);
+	// sin_port and sin6_port are at the same place
+	log_printf("Data channel of %p moved to %s port %d", ch->net, ipstr, ntohs(((struct sockaddr_in *)addr)->sin_port));
+	free(ipstr);
+
+	ch->endpoint = endpoint;
+	memcpy(&ch->remote, addr, addr_len);
+	ch->remote_len = addr_len;
+	ssl_data_stats.roams++;
+}
+
+/* a datagram for a channel we don't have: maybe the previous process' after
+ * an upgrade, or another worker's if we are its home. A non-home worker only
+ * gets those its home passed it, the claim is out of date there. Returns
+ * false if nobody has it. */
+static bool ssl_data_pass(struct sockaddr *addr, socklen_t addr_len, const uint8_t *buf, size_t len) {
+	const uint8_t *id = buf + 1;
+
+	if (network_forward(addr, addr_len, buf, len)) return true;
+	int home = ssl_data_home(id);
+	if (home < 0) return false;
+	if (home != core_worker) {
+		network_worker_claim(home, NETWORK_FORWARD_CHANNEL, true, id, SSL_DATA_ID_SIZE);
+		return false;
+	}
+	intptr_t owner = foreign ? (intptr_t)array_get(foreign, SSL_DATA_ID_SIZE, id) - 1 : -1;
+	if (owner < 0) return false;
+	// a full socket drops it, as a full endpoint would
+	network_worker_pass(owner, addr, addr_len, buf, len);
+	return true;
+}
+
+/* ssl_data_input : called for every datagram on the UDP endpoint, pkt is the
+ * packet buf is in (NULL if it is too big for one). Returns false if it isn't
+ * data channel traffic (DTLS handles it), true otherwise, even if it had to be
+ * dropped. An opened packet only holds the payload, header and tag space
+ * around it ready to seal it again for another peer. */
+bool ssl_data_input(struct network_connection *endpoint, struct sockaddr *addr, socklen_t addr_len, uint8_t *buf, size_t len, struct packet *pkt) {
+	if ((len < 1) || (buf[0] != SSL_DATA_MAGIC)) return false;
+	if (len < SSL_DATA_HEADER_SIZE) return true;
+
+	struct ssl_data_channel *ch = channels ? array_get(channels, SSL_DATA_ID_SIZE, buf + 1) : NULL;
+	if (ch == NULL) {
+		if (!ssl_data_pass(addr, addr_len, buf, len)) ssl_data_stats.rx_unknown++;
+		return true;
+	}
+
+	uint64_t rx_max = ch->rx_max;
+	ssize_t plain_len = ssl_data_open(ch, buf, len);
+	if (plain_len < 0) return true;
+
+	if (ch->endpoint == NULL) {
+		// first authenticated datagram, this is where we send from now on
+		ch->endpoint = endpoint;
+		memcpy(&ch->remote, addr, addr_len);
+		ch->remote_len = addr_len;
+		log_printf("Data channel up for %p", ch->net);
+	} else if (ch->rx_max > rx_max) {
+		ssl_data_roam(ch, endpoint, addr, addr_len);
+	}
+	ch->net->last_activity = time(NULL);
+	ssl_data_stats.rx_packets++;
+	if (pkt != NULL) {
+		packet_pull(pkt, SSL_DATA_HEADER_SIZE);
+		pkt->len = plain_len;
+	}
+
+	// forwarded to another peer, the packet is queued with a reference: no copy on the way through
+	if (ssl_input != NULL) ssl_input->packet(ch->net, buf + SSL_DATA_HEADER_SIZE, plain_len, pkt);
+	network_event_done(ch->net);
+	return true;
+}
@@ -0,0 +1,287 @@
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "ssl.h"
+
+/* Data channel packet protection, see ssl_data.c for the protocol. Nothing
+ * here depends on the daemon, so tools can talk to a data channel too.
+ *
+ * Packets are sealed and opened in place with the v2 (scatter/gather) AEAD
+ * calls: the payload sits right after the header in the datagram buffer and
+ * the tag is written after it, so a batch is one pass over the packets with
+ * no copies and no per-packet allocation. */
+
+#define SSL_DATA_LABEL "EXPORTER-cloudconnector-data"
+#define SSL_DATA_IV_SIZE 12
+
+struct ssl_data_stats ssl_data_stats;
+
+static void ssl_data_nonce(uint8_t *nonce, const uint8_t *iv, uint64_t counter) {
+	memcpy(nonce, iv, SSL_DATA_IV_SIZE);
+	for(int i = 0; i < 8; i++)
+		nonce[SSL_DATA_IV_SIZE - 1 - i] ^= (counter >> (i * 8)) & 0xff;
+}
+
+/* replay window over the last SSL_DATA_WINDOW counters: a bit per counter,
+ * indexed modulo the window size, rx_max is the highest counter accepted */
+static bool ssl_data_replay_check(struct ssl_data_channel *ch, uint64_t counter) {
+	if (counter > ch->rx_max) return true;
+	if (ch->rx_max - counter >= SSL_DATA_WINDOW) return false; // too old to tell
+	uint64_t bit = counter % SSL_DATA_WINDOW;
+	return (ch->rx_window[bit / 64] & (1ULL << (bit % 64))) == 0;
+}
+
+static void ssl_data_replay_update(struct ssl_data_channel *ch, uint64_t counter) {
+	if (counter > ch->rx_max) {
+		if (counter - ch->rx_max >= SSL_DATA_WINDOW) {
+			memset(ch->rx_window, 0, sizeof(ch->rx_window));
+		} else {
+			// forget counters that slid out of the window
+			for(uint64_t c = ch->rx_max + 1; c < counter; c++) {
+				uint64_t bit = c % SSL_DATA_WINDOW;
+				ch->rx_window[bit / 64] &= ~(1ULL << (bit % 64));
+			}
+		}
+		ch->rx_max = counter;
+	}
+	uint64_t bit = counter % SSL_DATA_WINDOW;
+	ch->rx_window[bit / 64] |= 1ULL << (bit % 64);
+}
+
+/* ssl_data_keys : set up a channel from raw keys and ivs */
+bool ssl_data_keys(struct ssl_data_channel *ch, gnutls_cipher_algorithm_t cipher, const uint8_t *id,
+		const uint8_t *tx_key, const uint8_t *tx_iv, const uint8_t *rx_key, const uint8_t *rx_iv) {
+	size_t key_size = gnutls_cipher_get_key_size(cipher);
+	gnutls_datum_t tx = { (unsigned char *)tx_key, key_size };
+	gnutls_datum_t rx = { (unsigned char *)rx_key, key_size };
+
+	memcpy(ch->id, id, SSL_DATA_ID_SIZE);
+	memcpy(ch->tx_iv, tx_iv, SSL_DATA_IV_SIZE);
+	memcpy(ch->rx_iv, rx_iv, SSL_DATA_IV_SIZE);
+	if (gnutls_aead_cipher_init(&ch->tx, cipher, &tx) < 0) return false;
+	if (gnutls_aead_cipher_init(&ch->rx, cipher, &rx) < 0) {
+		gnutls_aead_cipher_deinit(ch->tx);
+		return false;
+	}
+	return true;
+}
+
+/* ssl_data_derive : export data channel keys from an established TLS session.
+ * Works for both ends, server selects which direction is tx. */
+bool ssl_data_derive(struct ssl_data_channel *ch, gnutls_session_t session, bool server) {
+	gnutls_cipher_algorithm_t cipher = gnutls_cipher_get(session);
+	uint8_t material[SSL_DATA_ID_SIZE + 2 * 32 + 2 * SSL_DATA_IV_SIZE];
+
+	switch(cipher) {
+		case GNUTLS_CIPHER_AES_128_GCM:
+		case GNUTLS_CIPHER_AES_256_GCM:
+		case GNUTLS_CIPHER_CHACHA20_POLY1305:
+			break;
+		default:
+			cipher = GNUTLS_CIPHER_AES_256_GCM;
+	}
+	size_t key_size = gnutls_cipher_get_key_size(cipher);
+	size_t len = SSL_DATA_ID_SIZE + 2 * key_size + 2 * SSL_DATA_IV_SIZE;
+
+	if (gnutls_prf_rfc5705(session, sizeof(SSL_DATA_LABEL) - 1, SSL_DATA_LABEL, 0, NULL, len, (char *)material) < 0)
+		return false;
+
+	uint8_t *client_key = material + SSL_DATA_ID_SIZE;
+	uint8_t *server_key = client_key + key_size;
+	uint8_t *client_iv = server_key + key_size;
+	uint8_t *server_iv = client_iv + SSL_DATA_IV_SIZE;
+	bool ok;
+	if (server)
+		ok = ssl_data_keys(ch, cipher, material, server_key, server_iv, client_key, client_iv);
+	else
+		ok = ssl_data_keys(ch, cipher, material, client_key, client_iv, server_key, server_iv);
+	gnutls_memset(material, 0, sizeof(material));
+	return ok;
+}
+
+/* ssl_data_seal_batch : seal packets in place. Each buf holds the payload at
+ * SSL_DATA_HEADER_SIZE with SSL_DATA_TAG_SIZE bytes of room after it; len is
+ * the payload length on input and the datagram length on output. Packets may
+ * belong to different channels. Returns how many were sealed (ok set). */
+int ssl_data_seal_batch(struct ssl_data_packet *pkts, int count) {
+	int sealed = 0;
+
+	for(int i = 0; i < count; i++) {
+		struct ssl_data_packet *pkt = &pkts[i];
+		struct ssl_data_channel *ch = pkt->ch;
+		uint8_t nonce[SSL_DATA_IV_SIZE];
+		uint64_t counter = ch->tx_counter++;
+		size_t tag_size = SSL_DATA_TAG_SIZE;
+
+		pkt->buf[0] = SSL_DATA_MAGIC;
+		memcpy(pkt->buf + 1, ch->id, SSL_DATA_ID_SIZE);
+		for(int j = 0; j < 8; j++)
+			pkt->buf[1 + SSL_DATA_ID_SIZE + j] = (counter >> (56 - j * 8)) & 0xff;
+		ssl_data_nonce(nonce, ch->tx_iv, counter);
+
+		giovec_t auth = { pkt->buf, SSL_DATA_HEADER_SIZE };
+		giovec_t data = { pkt->buf + SSL_DATA_HEADER_SIZE, pkt->len };
+		pkt->ok = gnutls_aead_cipher_encryptv2(ch->tx, nonce, sizeof(nonce), &auth, 1, &data, 1,
+				pkt->buf + SSL_DATA_HEADER_SIZE + pkt->len, &tag_size) >= 0;
+		if (!pkt->ok) continue;
+		pkt->len += SSL_DATA_HEADER_SIZE + SSL_DATA_TAG_SIZE;
+		sealed++;
+	}
+	return sealed;
+}
+
+/* ssl_data_open_batch : authenticate and decrypt datagrams in place. len is
+ * the datagram length on input, the payload (at SSL_DATA_HEADER_SIZE) length
+ * on output. Forged, corrupted and replayed packets get ok = false. */
+int ssl_data_open_batch(struct ssl_data_packet *pkts, int count) {
+	int opened = 0;
+
+	for(int i = 0; i < count; i++) {
+		struct ssl_data_packet *pkt = &pkts[i];
+		struct ssl_data_channel *ch = pkt->ch;
+		uint8_t nonce[SSL_DATA_IV_SIZE];
+		uint64_t counter = 0;
+
+		pkt->ok = false;
+		if (pkt->len < SSL_DATA_OVERHEAD) continue;
+		for(int j = 0; j < 8; j++)
+			counter = (counter << 8) | pkt->buf[1 + SSL_DATA_ID_SIZE + j];
+
+		if (!ssl_data_replay_check(ch, counter)) {
+			ssl_data_stats.rx_replayed++;
+			continue;
+		}
+
+		size_t payload_len = pkt->len - SSL_DATA_OVERHEAD;
+		ssl_data_nonce(nonce, ch->rx_iv, counter);
+		giovec_t auth = { pkt->buf, SSL_DATA_HEADER_SIZE };
+		giovec_t data = { pkt->buf + SSL_DATA_HEADER_SIZE, payload_len };
+		if (gnutls_aead_cipher_decryptv2(ch->rx, nonce, sizeof(nonce), &auth, 1, &data, 1,
+				pkt->buf + SSL_DATA_HEADER_SIZE + payload_len, SSL_DATA_TAG_SIZE) < 0) {
+			ssl_data_stats.rx_bad++;
+			continue;
+		}
+
+		// only authenticated packets may move the window
+		ssl_data_replay_update(ch, counter);
+		pkt->len = payload_len;
+		pkt->ok = true;
+		opened++;
+	}
+	return opened;
+}
+
+/* ssl_data_seal : build the datagram for one packet into out, which must have
+ * room for size + SSL_DATA_OVERHEAD. Returns the datagram length, 0 on error. */
+size_t ssl_data_seal(struct ssl_data_channel *ch, const void *buf, size_t size, uint8_t *out) {
+	struct ssl_data_packet pkt = { ch, out, size, false };
+
+	memmove(out + SSL_DATA_HEADER_SIZE, buf, size);
+	if (ssl_data_seal_batch(&pkt, 1) != 1) return 0;
+	return pkt.len;
+}
+
+/* ssl_data_open : authenticate and decrypt a datagram in place. Returns the
+ * payload (after the header) length, or -1 if forged, corrupted or replayed. */
+ssize_t ssl_data_open(struct ssl_data_channel *ch, uint8_t *buf, size_t len) {
+	struct ssl_data_packet pkt = { ch, buf, len, false };
+
+	if (ssl_data_open_batch(&pkt, 1) != 1) return -1;
+	return pkt.len;
+}
+
+void ssl_data_free(struct ssl_data_channel *ch) {
+	gnutls_aead_cipher_deinit(ch->tx);
+	gnutls_aead_cipher_deinit(ch->rx);
+}
+
+/* known answers, computed independently (Python cryptography): key bytes
+ * 0, 1, 2..., iv bytes a0, a1..., id 10..17, counter 0102030405060708,
+ * payload (i * 7) & 0xff for i in 0..31. Ciphertext and tag follow. */
+static const struct {
+	gnutls_cipher_algorithm_t cipher;
+	const char *sealed;
+} ssl_data_kat[] = {
+	{ GNUTLS_CIPHER_AES_128_GCM, "687296a75f1908f31f9c8dff836b0654ef0565aaa7504854ff073a2f2cced80f4ee2cf5ba46d6c25580718d0cafaf5d0" },
+	{ GNUTLS_CIPHER_AES_256_GCM, "f1d1a752650e274f192b7fb4750730e3244f0d9063ba6f9362383de7c3688c5ca87d47a9abf17454c89bfa2be57f414b" },
+	{ GNUTLS_CIPHER_CHACHA20_POLY1305, "a6f84a43cfa814a78dc3aa1707bc260f0567f5dce5e3ed27bd826cff21d28f19e8b779997056101ac11556ac6cde5bcb" },
+};
+
+#define SSL_DATA_KAT_PAYLOAD 32
+#define SSL_DATA_KAT_BATCH 4
+
+static bool ssl_data_selftest_run(char *err, size_t err_size) {
+	uint8_t key[32], iv[SSL_DATA_IV_SIZE], id[SSL_DATA_ID_SIZE];
+	uint8_t bufs[SSL_DATA_KAT_BATCH][SSL_DATA_KAT_PAYLOAD + SSL_DATA_OVERHEAD];
+	uint8_t expected[SSL_DATA_KAT_PAYLOAD + SSL_DATA_TAG_SIZE];
+
+	for(int i = 0; i < 32; i++) key[i] = i;
+	for(int i = 0; i < SSL_DATA_IV_SIZE; i++) iv[i] = 0xa0 + i;
+	for(int i = 0; i < SSL_DATA_ID_SIZE; i++) id[i] = 0x10 + i;
+
+	for(unsigned int k = 0; k < sizeof(ssl_data_kat) / sizeof(ssl_data_kat[0]); k++) {
+		const char *name = gnutls_cipher_get_name(ssl_data_kat[k].cipher);
+		struct ssl_data_channel ch;
+		struct ssl_data_packet pkts[SSL_DATA_KAT_BATCH];
+
+		memset(&ch, 0, sizeof(ch));
+		// same keys both ways, so the channel can open what it sealed
+		if (!ssl_data_keys(&ch, ssl_data_kat[k].cipher, id, key, iv, key, iv)) {
+			snprintf(err, err_size, "%s: not available", name);
+			return false;
+		}
+		for(size_t i = 0; i < sizeof(expected); i++)
+			sscanf(ssl_data_kat[k].sealed + i * 2, "%2hhx", &expected[i]);
+
+		ch.tx_counter = 0x0102030405060708ULL;
+		for(int p = 0; p < SSL_DATA_KAT_BATCH; p++) {
+			for(int i = 0; i < SSL_DATA_KAT_PAYLOAD; i++)
+				bufs[p][SSL_DATA_HEADER_SIZE + i] = (i * 7) & 0xff;
+			pkts[p] = (struct ssl_data_packet){ &ch, bufs[p], SSL_DATA_KAT_PAYLOAD, false };
+		}
+
+		bool ok = (ssl_data_seal_batch(pkts, SSL_DATA_KAT_BATCH) == SSL_DATA_KAT_BATCH)
+			&& (pkts[0].len == sizeof(bufs[0]))
+			&& (memcmp(bufs[0] + SSL_DATA_HEADER_SIZE, expected, sizeof(expected)) == 0);
+		if (!ok) {
+			snprintf(err, err_size, "%s: sealed packet does not match the known answer", name);
+			ssl_data_free(&ch);
+			return false;
+		}
+
+		// packet 1 replays packet 0, packet 3 gets a flipped bit
+		memcpy(bufs[1], bufs[0], sizeof(bufs[0]));
+		bufs[3][SSL_DATA_HEADER_SIZE] ^= 1;
+		ch.rx_max = 0;
+		memset(ch.rx_window, 0, sizeof(ch.rx_window));
+
+		int opened = ssl_data_open_batch(pkts, SSL_DATA_KAT_BATCH);
+		ok = (opened == 2) && pkts[0].ok && !pkts[1].ok && pkts[2].ok && !pkts[3].ok;
+		for(int p = 0; ok && (p < SSL_DATA_KAT_BATCH); p += 2) {
+			for(int i = 0; i < SSL_DATA_KAT_PAYLOAD; i++)
+				if (bufs[p][SSL_DATA_HEADER_SIZE + i] != ((i * 7) & 0xff)) ok = false;
+		}
+		ssl_data_free(&ch);
+		if (!ok) {
+			snprintf(err, err_size, "%s: batch open gave wrong results", name);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* ssl_data_selftest : check every data channel AEAD against the known answers
+ * through the batch path, then open a batch (with a replay and a corrupted
+ * packet in it) back. Returns false and fills err on the first mismatch. */
+bool ssl_data_selftest(char *err, size_t err_size) {
+	struct ssl_data_stats stats = ssl_data_stats;
+	bool ok = ssl_data_selftest_run(err, err_size);
+	ssl_data_stats = stats; // the rejects above were on purpose
+	return ok;
+}
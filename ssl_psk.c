@@ -0,0 +1,194 @@
+#include <gnutls/gnutls.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssl.h"
+#include "log.h"
+#include "network.h"
+#include "array.h"
+
+// identities are at most 2^16-1 bytes on the wire, ours come from a text file
+#define SSL_PSK_LINE_MAXSIZE 1024
+#define SSL_PSK_EXT_PRE_SHARED_KEY 41
+
+struct ssl_psk_key {
+	size_t len;
+	uint8_t data[];
+};
+
+// keys don't stay behind in freed memory
+static void ssl_psk_key_free(struct ssl_psk_key *psk) {
+	gnutls_memset(psk->data, 0, psk->len);
+	free(psk);
+}
+
+struct ssl_psk_hello {
+	struct ssl_credentials *creds;
+	enum { SSL_PSK_NONE, SSL_PSK_KNOWN, SSL_PSK_UNKNOWN } identity;
+};
+
+/* pre_shared_key extension of a TLS 1.3 ClientHello (RFC 8446 4.2.11):
+ * identities<2> { identity<2>, obfuscated_ticket_age<4> }, binders. GnuTLS
+ * looks up the first identity with a zero ticket age (not a resumption
+ * ticket), and aborts the handshake if it is unknown. */
+static int ssl_psk_hello_ext(void *ptr, unsigned tls_id, const unsigned char *data, unsigned size) {
+	struct ssl_psk_hello *hello = ptr;
+
+	if ((tls_id != SSL_PSK_EXT_PRE_SHARED_KEY) || (size < 2)) return 0;
+	unsigned end = 2 + ((data[0] << 8) | data[1]);
+	if (end > size) return 0;
+	for(unsigned pos = 2; pos + 2 <= end;) {
+		unsigned len = (data[pos] << 8) | data[pos + 1];
+		const unsigned char *identity = data + pos + 2;
+		pos += 2 + len + 4;
+		if (pos > end) return 0;
+		if ((len == 0) || (identity[len] | identity[len + 1] | identity[len + 2] | identity[len + 3])) continue;
+		hello->identity = (array_get(hello->creds->psk_keys, len, identity) != NULL) ? SSL_PSK_KNOWN : SSL_PSK_UNKNOWN;
+		return 0;
+	}
+	return 0;
+}
+
+/* called before GnuTLS parses a ClientHello: a peer offering only identities
+ * we don't know gets the session without PSK credentials, the extension is
+ * ignored and the handshake goes on with the peer's certificate. */
+static int ssl_psk_hello_hook(gnutls_session_t session, unsigned int htype, unsigned when, unsigned int incoming, const gnutls_datum_t *msg) {
+	struct network_connection *net = gnutls_transport_get_ptr(session);
+	struct ssl_psk_hello hello = { net->ssl_ctx->creds, SSL_PSK_NONE };
+	unsigned int flags = net->ssl_ctx->datagram ? GNUTLS_EXT_RAW_FLAG_DTLS_CLIENT_HELLO : GNUTLS_EXT_RAW_FLAG_TLS_CLIENT_HELLO;
+
+	if (!incoming || (gnutls_ext_raw_parse(&hello, ssl_psk_hello_ext, msg, flags) < 0)) return 0;
+	if (hello.identity != SSL_PSK_UNKNOWN) return 0;
+
+	log_printf("Peer %p offered unknown PSK identity, falling back to its certificate", net);
+	gnutls_credentials_clear(session);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, net->ssl_ctx->creds->x509_cred);
+	return 0;
+}
+
+/* ssl_psk_session_init : PSK on a new session. Under TLS 1.3 an unknown
+ * identity falls back to X.509 (ssl_psk_hello_hook). Under TLS 1.2 the
+ * identity only comes with the ClientKeyExchange, after a PSK cipher suite
+ * was agreed on: the handshake fails. */
+void ssl_psk_session_init(struct ssl_context *ctx) {
+	gnutls_credentials_set(ctx->session, GNUTLS_CRD_PSK, ctx->creds->psk_cred);
+	gnutls_handshake_set_hook_function(ctx->session, GNUTLS_HANDSHAKE_CLIENT_HELLO, GNUTLS_HOOK_PRE, ssl_psk_hello_hook);
+}
+
+/* called by GnuTLS when a client offers a PSK identity. Keys come from the
+ * credentials the session started with, so a reload can't pull them away
+ * during a handshake. An unknown identity only gets here under TLS 1.2,
+ * where it ends the handshake. */
+static int ssl_psk_callback(gnutls_session_t session, const gnutls_datum_t *username, gnutls_datum_t *key) {
+	struct network_connection *net = gnutls_transport_get_ptr(session);
+	struct ssl_context *ctx = net->ssl_ctx;
+	struct ssl_psk_key *psk = NULL;
+
+	if (username->size > 0)
+		psk = array_get(ctx->creds->psk_keys, username->size, username->data);
+	if (psk == NULL) {
+		log_printf("Peer %p offered unknown PSK identity with a PSK cipher suite, refused", net);
+		return -1;
+	}
+
+	key->data = gnutls_malloc(psk->len);
+	if (key->data == NULL) return -1;
+	memcpy(key->data, psk->data, psk->len);
+	key->size = psk->len;
+
+	free(ctx->psk_identity);
+	ctx->psk_identity = strndup((const char *)username->data, username->size);
+	return 0;
+}
+
+/* ssl_psk_load : read "identity:hexkey" lines (psktool format) into the
+ * credentials' key table. May run outside of the event loop thread. */
+bool ssl_psk_load(struct ssl_credentials *creds, const char *psk_file) {
+	char line[SSL_PSK_LINE_MAXSIZE];
+	char file_buf[BUFSIZ]; // stdio's own buffer would be freed with the keys in it
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(psk_file, "r");
+	if (fp == NULL) {
+		log_printf("Failed to open PSK file %s", psk_file);
+		return false;
+	}
+	setvbuf(fp, file_buf, _IOFBF, sizeof(file_buf));
+
+	creds->psk_keys = array_new();
+
+	while(fgets(line, sizeof(line), fp)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = 0;
+		if ((line[0] == '#') || (line[0] == 0)) continue;
+
+		char *sep = strchr(line, ':');
+		if ((sep == NULL) || (sep == line)) {
+			log_printf("%s:%d: expected identity:hexkey", psk_file, lineno);
+			continue;
+		}
+		*sep = 0;
+
+		gnutls_datum_t hex = { (unsigned char *)sep + 1, strlen(sep + 1) };
+		gnutls_datum_t raw;
+		if ((hex.size == 0) || (gnutls_hex_decode2(&hex, &raw) < 0)) {
+			log_printf("%s:%d: invalid key for %s", psk_file, lineno, line);
+			continue;
+		}
+
+		struct ssl_psk_key *psk = malloc(sizeof(struct ssl_psk_key) + raw.size);
+		psk->len = raw.size;
+		memcpy(psk->data, raw.data, raw.size);
+		gnutls_memset(raw.data, 0, raw.size);
+		gnutls_free(raw.data);
+
+		struct ssl_psk_key *old = array_get(creds->psk_keys, sep - line, (uint8_t *)line);
+		if (old != NULL) {
+			log_printf("%s:%d: duplicate identity %s, using the last one", psk_file, lineno, line);
+			array_update(creds->psk_keys, sep - line, (uint8_t *)line, psk, false);
+			ssl_psk_key_free(old);
+		} else {
+			array_insert(creds->psk_keys, sep - line, (uint8_t *)line, psk, false);
+		}
+	}
+	fclose(fp);
+	gnutls_memset(line, 0, sizeof(line));
+	gnutls_memset(file_buf, 0, sizeof(file_buf));
+
+	if (gnutls_psk_allocate_server_credentials(&creds->psk_cred) < 0) {
+		log_printf("Can't allocate PSK credentials");
+		return false;
+	}
+	gnutls_psk_set_server_credentials_function2(creds->psk_cred, ssl_psk_callback);
+
+	log_printf("Loaded %u PSK identities", creds->psk_keys->count);
+	return true;
+}
+
+void ssl_psk_free(struct ssl_credentials *creds) {
+	if (creds->psk_cred != NULL) gnutls_psk_free_server_credentials(creds->psk_cred);
+	if (creds->psk_keys == NULL) return;
+
+	array_iterator_t *it = array_iterator(creds->psk_keys);
+	while(array_next(it))
+		ssl_psk_key_free(it->value);
+	array_iterator_free(it);
+	array_free(creds->psk_keys);
+}
+
+/* ssl_psk_revoked : true if the identity this session authenticated with is
+ * not in creds anymore (removed from the keyfile or key changed) */
+bool ssl_psk_revoked(struct ssl_context *ctx, struct ssl_credentials *creds) {
+	if (ctx->psk_identity == NULL) return false;
+	if (creds->psk_keys == NULL) return true;
+
+	size_t len = strlen(ctx->psk_identity);
+	struct ssl_psk_key *now = array_get(creds->psk_keys, len, (uint8_t *)ctx->psk_identity);
+	struct ssl_psk_key *then = array_get(ctx->creds->psk_keys, len, (uint8_t *)ctx->psk_identity);
+	if ((now == NULL) || (then == NULL)) return true;
+	return (now->len != then->len) || (memcmp(now->data, then->data, now->len) != 0);
+}
@@ -0,0 +1,401 @@
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <gnutls/crypto.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "ssl.h"
+#include "log.h"
+#include "cfg_files.h"
+#include "network.h"
+#include "array.h"
+
+#define SSL_VERIFY_MAX_DEPTH 8
+#define SSL_VERIFY_FPR_SIZE 32
+// 8 bytes of issuer DN hash + up to 20 bytes of serial (RFC 5280 4.1.2.2)
+#define SSL_SERIAL_KEY_MAXSIZE 28
+#define SSL_VERIFY_CRL_CHECK_S 1 // how often the CRL file is looked at
+#define SSL_VERIFY_NAME_MAXSIZE 65 // ub-common-name (RFC 5280 A.1), and the NUL
+
+struct ssl_serial_key {
+	uint8_t len;
+	uint8_t data[SSL_SERIAL_KEY_MAXSIZE];
+};
+
+/* result of a successful chain verification, shared between the cache and
+ * the sessions that were authenticated with it */
+struct ssl_verify_entry {
+	time_t expires;
+	unsigned int generation; // crl_generation at verification time
+	int refcount;
+	int chain_len;
+	struct ssl_serial_key chain[SSL_VERIFY_MAX_DEPTH];
+	char name[SSL_VERIFY_NAME_MAXSIZE]; // leaf CN, empty if it has none
+};
+
+static struct ssl_credentials *active; // newest credentials, the cache holds results obtained with them
+static char revoked_marker; // value for creds->revoked: issuer hash + serial => &revoked_marker
+static array_t *verify_cache; // leaf sha256 => struct ssl_verify_entry
+static unsigned int crl_generation;
+
+static int verify_cache_ttl = 3600;
+static int verify_cache_size = 16384;
+
+void ssl_verify_config_init() {
+	config_add_var(CONFIG_CORE, "ssl_verify_cache_ttl", &verify_cache_ttl, CONF_VAR_INT, 0, 604800, false);
+	config_add_var(CONFIG_CORE, "ssl_verify_cache_size", &verify_cache_size, CONF_VAR_INT, 1, 16777216, false);
+}
+
+static void ssl_verify_entry_release(struct ssl_verify_entry *entry) {
+	if (entry == NULL) return;
+	if (--entry->refcount > 0) return;
+	free(entry);
+}
+
+void ssl_verify_release(struct ssl_context *ctx) {
+	ssl_verify_entry_release(ctx->peer);
+	ctx->peer = NULL;
+}
+
+static void ssl_serial_key_make(struct ssl_serial_key *key, const gnutls_datum_t *issuer_dn, const void *serial, size_t serial_len) {
+	uint8_t hash[32];
+	gnutls_hash_fast(GNUTLS_DIG_SHA256, issuer_dn->data, issuer_dn->size, hash);
+	memcpy(key->data, hash, 8);
+	if (serial_len > SSL_SERIAL_KEY_MAXSIZE - 8) serial_len = SSL_SERIAL_KEY_MAXSIZE - 8;
+	memcpy(key->data + 8, serial, serial_len);
+	key->len = 8 + serial_len;
+}
+
+static bool ssl_serial_key_crt(struct ssl_serial_key *key, gnutls_x509_crt_t crt) {
+	gnutls_datum_t dn;
+	uint8_t serial[SSL_SERIAL_KEY_MAXSIZE];
+	size_t serial_len = sizeof(serial);
+
+	if (gnutls_x509_crt_get_serial(crt, serial, &serial_len) < 0) return false;
+	if (gnutls_x509_crt_get_raw_issuer_dn(crt, &dn) < 0) return false;
+	ssl_serial_key_make(key, &dn, serial, serial_len);
+	gnutls_free(dn.data);
+	return true;
+}
+
+static bool ssl_serial_key_revoked(struct ssl_credentials *creds, const struct ssl_serial_key *key) {
+	return array_get(creds->revoked, key->len, key->data) != NULL;
+}
+
+// true if any certificate of an already verified chain appears in the active CRL
+bool ssl_verify_revoked(struct ssl_verify_entry *entry) {
+	for(int i = 0; i < entry->chain_len; i++) {
+		if (ssl_serial_key_revoked(active, &entry->chain[i])) return true;
+	}
+	return false;
+}
+
+static void ssl_verify_cache_clear() {
+	if (verify_cache == NULL) return;
+	array_iterator_t *it = array_iterator(verify_cache);
+	while(array_next(it))
+		ssl_verify_entry_release(it->value);
+	array_iterator_free(it);
+	array_truncate(verify_cache);
+}
+
+/* ssl_verify_load_crl : build the revoked serials index from the CRL file.
+ * Each CRL must be signed by one of our CAs. Serials are walked with the CRL
+ * iterator, indexed access is quadratic on large lists. */
+static bool ssl_verify_load_crl(struct ssl_credentials *creds, const char *crl_file) {
+	gnutls_datum_t data;
+	gnutls_x509_crl_t *crls;
+	unsigned int crls_size;
+	int ret;
+
+	stat(crl_file, &creds->crl_stat);
+	if (gnutls_load_file(crl_file, &data) < 0) {
+		log_printf("Failed to read CA CRL list %s", crl_file);
+		return false;
+	}
+	ret = gnutls_x509_crl_list_import2(&crls, &crls_size, &data, GNUTLS_X509_FMT_PEM, 0);
+	gnutls_free(data.data);
+	if (ret < 0) {
+		log_printf("Failed to parse CA CRL list: %s", gnutls_strerror(ret));
+		return false;
+	}
+
+	array_t *revoked = array_new();
+	bool ok = true;
+
+	for(unsigned int i = 0; i < crls_size && ok; i++) {
+		unsigned int status;
+		gnutls_datum_t dn;
+		gnutls_x509_crl_iter_t iter = NULL;
+
+		if ((gnutls_x509_crl_verify(crls[i], creds->ca_list, creds->ca_list_size, 0, &status) < 0) || (status != 0)) {
+			log_printf("CRL #%d is not signed by a trusted CA", i);
+			ok = false;
+			break;
+		}
+		if (gnutls_x509_crl_get_raw_issuer_dn(crls[i], &dn) < 0) {
+			ok = false;
+			break;
+		}
+
+		while(1) {
+			uint8_t serial[SSL_SERIAL_KEY_MAXSIZE];
+			size_t serial_len = sizeof(serial);
+			struct ssl_serial_key key;
+
+			ret = gnutls_x509_crl_iter_crt_serial(crls[i], &iter, serial, &serial_len, NULL);
+			if (ret == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE) break;
+			if (ret < 0) {
+				log_printf("Failed to read CRL entry: %s", gnutls_strerror(ret));
+				ok = false;
+				break;
+			}
+			ssl_serial_key_make(&key, &dn, serial, serial_len);
+			array_insert(revoked, key.len, key.data, &revoked_marker, false);
+		}
+		gnutls_x509_crl_iter_deinit(iter);
+		gnutls_free(dn.data);
+	}
+
+	for(unsigned int i = 0; i < crls_size; i++)
+		gnutls_x509_crl_deinit(crls[i]);
+	gnutls_free(crls);
+
+	if (!ok) {
+		array_free(revoked);
+		return false;
+	}
+
+	creds->revoked = revoked;
+	log_printf("Loaded CRL with %d revoked certificate(s)", revoked->count);
+	return true;
+}
+
+/* timer on the event loop: pick up a modified CRL file. Only the revoked
+ * index of the active credentials is rebuilt, verifications cached with the
+ * previous one are dropped and peers now on it are closed. */
+static void ssl_verify_crl_timer(struct network_connection *net) {
+	uint64_t expirations;
+	struct stat st;
+
+	if (read(net->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+	if ((active == NULL) || (stat(active->crl_file, &st) == -1)) return;
+	if ((st.st_mtime == active->crl_stat.st_mtime) && (st.st_size == active->crl_stat.st_size) && (st.st_ino == active->crl_stat.st_ino)) return;
+
+	log_printf("CRL file %s changed, reloading", active->crl_file);
+	array_t *revoked = active->revoked;
+	if (!ssl_verify_load_crl(active, active->crl_file)) {
+		// crl_stat is the new one, no retry until the file changes again
+		log_printf("Keeping the current CRL");
+		return;
+	}
+	array_free(revoked);
+	crl_generation++;
+	ssl_verify_cache_clear();
+	network_foreach(ssl_session_check_revoked);
+}
+
+/* ssl_verify_watch : start looking at the CRL file for changes, once the
+ * event loop is up */
+bool ssl_verify_watch() {
+	struct itimerspec tick = { { SSL_VERIFY_CRL_CHECK_S, 0 }, { SSL_VERIFY_CRL_CHECK_S, 0 } };
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if ((fd == -1) || (timerfd_settime(fd, 0, &tick, NULL) == -1)) {
+		log_perror();
+		log_printf("Failed to create the CRL timer");
+		if (fd != -1) close(fd);
+		return false;
+	}
+	if (network_register_fd(fd, ssl_verify_crl_timer) == NULL) {
+		close(fd);
+		return false;
+	}
+	return true;
+}
+
+static struct ssl_verify_entry *ssl_verify_chain(struct ssl_credentials *creds, const gnutls_datum_t *certs, unsigned int count, time_t now) {
+	gnutls_x509_crt_t chain[SSL_VERIFY_MAX_DEPTH];
+	struct ssl_verify_entry *entry = NULL;
+	unsigned int imported = 0;
+	unsigned int status;
+	gnutls_typed_vdata_st vdata = {
+		.type = GNUTLS_DT_KEY_PURPOSE_OID,
+		.data = (void*)GNUTLS_KP_TLS_WWW_CLIENT,
+	};
+
+	if (count > SSL_VERIFY_MAX_DEPTH) {
+		log_printf("Peer certificate chain too long (%d)", count);
+		return NULL;
+	}
+
+	for(; imported < count; imported++) {
+		gnutls_x509_crt_init(&chain[imported]);
+		if (gnutls_x509_crt_import(chain[imported], &certs[imported], GNUTLS_X509_FMT_DER) < 0) {
+			gnutls_x509_crt_deinit(chain[imported]);
+			log_printf("Failed to parse peer certificate");
+			goto out;
+		}
+	}
+
+	if ((gnutls_x509_trust_list_verify_crt2(creds->trust_list, chain, count, &vdata, 1, 0, &status, NULL) < 0) || (status != 0)) {
+		gnutls_datum_t out;
+		if (gnutls_certificate_verification_status_print(status, GNUTLS_CRT_X509, &out, 0) == 0) {
+			log_printf("Peer certificate rejected: %s", out.data);
+			gnutls_free(out.data);
+		}
+		goto out;
+	}
+
+	entry = calloc(sizeof(struct ssl_verify_entry), 1);
+	entry->refcount = 1;
+	entry->generation = crl_generation;
+	entry->expires = now + verify_cache_ttl;
+	entry->chain_len = count;
+	size_t name_size = sizeof(entry->name);
+	if (gnutls_x509_crt_get_dn_by_oid(chain[0], GNUTLS_OID_X520_COMMON_NAME, 0, 0, entry->name, &name_size) < 0)
+		entry->name[0] = 0;
+
+	for(unsigned int i = 0; i < count; i++) {
+		time_t expiration = gnutls_x509_crt_get_expiration_time(chain[i]);
+		if (expiration < entry->expires) entry->expires = expiration;
+
+		if ((!ssl_serial_key_crt(&entry->chain[i], chain[i])) || ssl_serial_key_revoked(creds, &entry->chain[i])) {
+			log_printf("Peer certificate chain contains a revoked certificate");
+			free(entry);
+			entry = NULL;
+			goto out;
+		}
+	}
+
+out:
+	for(unsigned int i = 0; i < imported; i++)
+		gnutls_x509_crt_deinit(chain[i]);
+	return entry;
+}
+
+static void ssl_verify_cache_insert(const uint8_t *fpr, struct ssl_verify_entry *entry, time_t now) {
+	if (verify_cache->count >= verify_cache_size) {
+		// drop stale entries first, and everything if that is not enough
+		array_iterator_t *it = array_iterator(verify_cache);
+		while(array_next(it)) {
+			struct ssl_verify_entry *old = it->value;
+			if ((old->expires > now) && (old->generation == crl_generation)) continue;
+			array_remove_iterator(it);
+			ssl_verify_entry_release(old);
+		}
+		array_iterator_free(it);
+		if (verify_cache->count >= verify_cache_size) ssl_verify_cache_clear();
+	}
+
+	entry->refcount++;
+	array_insert(verify_cache, SSL_VERIFY_FPR_SIZE, fpr, entry, false);
+}
+
+/* called by GnuTLS once the peer certificate has been received. Known peers
+ * are looked up by leaf fingerprint and skip chain validation entirely.
+ * The chain is checked against the CA/CRL of the credentials the session was
+ * set up with: a handshake started before a reload ends with them, and skips
+ * the cache, which only holds results for the newest ones. */
+static int ssl_verify_callback(gnutls_session_t session) {
+	struct network_connection *net = gnutls_transport_get_ptr(session);
+	struct ssl_credentials *creds = net->ssl_ctx->creds;
+	const gnutls_datum_t *certs;
+	unsigned int count = 0;
+	uint8_t fpr[SSL_VERIFY_FPR_SIZE];
+	time_t now = time(NULL);
+
+	certs = gnutls_certificate_get_peers(session, &count);
+	if ((certs == NULL) || (count == 0)) {
+		log_printf("Peer %p did not send a certificate", net);
+		return GNUTLS_E_NO_CERTIFICATE_FOUND;
+	}
+
+	gnutls_hash_fast(GNUTLS_DIG_SHA256, certs[0].data, certs[0].size, fpr);
+	struct ssl_verify_entry *entry = (creds == active) ? array_get(verify_cache, SSL_VERIFY_FPR_SIZE, fpr) : NULL;
+
+	if ((entry != NULL) && ((entry->expires <= now) || (entry->generation != crl_generation))) {
+		array_remove(verify_cache, SSL_VERIFY_FPR_SIZE, fpr);
+		ssl_verify_entry_release(entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL) {
+		entry->refcount++;
+	} else {
+		entry = ssl_verify_chain(creds, certs, count, now);
+		if (entry == NULL) return GNUTLS_E_CERTIFICATE_ERROR;
+		if ((verify_cache_ttl > 0) && (creds == active)) ssl_verify_cache_insert(fpr, entry, now);
+	}
+
+	ssl_verify_release(net->ssl_ctx);
+	net->ssl_ctx->peer = entry;
+	return 0;
+}
+
+/* ssl_peer_name : who the peer authenticated as, its PSK identity or the CN
+ * of its certificate. NULL before that, or if the certificate has no CN. */
+const char *ssl_peer_name(struct ssl_context *ctx) {
+	if (ctx->psk_identity != NULL) return ctx->psk_identity;
+	if ((ctx->peer == NULL) || (ctx->peer->name[0] == 0)) return NULL;
+	return ctx->peer->name;
+}
+
+/* ssl_verify_load : load CA and CRL for verification into a new set of
+ * credentials. May run outside of the event loop thread. */
+bool ssl_verify_load(struct ssl_credentials *creds, const char *ca_file, const char *crl_file) {
+	gnutls_datum_t data;
+
+	creds->crl_file = strdup(crl_file);
+
+	if (gnutls_load_file(ca_file, &data) < 0) {
+		log_printf("Failed to read CA certificate %s", ca_file);
+		return false;
+	}
+	int ret = gnutls_x509_crt_list_import2(&creds->ca_list, &creds->ca_list_size, &data, GNUTLS_X509_FMT_PEM, 0);
+	gnutls_free(data.data);
+	if (ret < 0) {
+		log_printf("Failed to parse CA certificate: %s", gnutls_strerror(ret));
+		return false;
+	}
+
+	// CRLs are not given to the trust list, we check revocation ourselves with the index
+	gnutls_x509_trust_list_init(&creds->trust_list, 0);
+	if (gnutls_x509_trust_list_add_trust_file(creds->trust_list, ca_file, NULL, GNUTLS_X509_FMT_PEM, 0, 0) <= 0) {
+		log_printf("Failed to load CA certificate");
+		return false;
+	}
+
+	if (!ssl_verify_load_crl(creds, crl_file)) return false;
+
+	gnutls_certificate_set_verify_function(creds->x509_cred, ssl_verify_callback);
+	return true;
+}
+
+void ssl_verify_free(struct ssl_credentials *creds) {
+	if (creds->trust_list != NULL) gnutls_x509_trust_list_deinit(creds->trust_list, 1);
+	for(unsigned int i = 0; i < creds->ca_list_size; i++)
+		gnutls_x509_crt_deinit(creds->ca_list[i]);
+	gnutls_free(creds->ca_list);
+	if (creds->revoked != NULL) array_free(creds->revoked);
+	free(creds->crl_file);
+}
+
+/* ssl_verify_activate : verify new handshakes against these credentials. The
+ * cache is dropped, results obtained with the previous CA/CRL are stale. */
+void ssl_verify_activate(struct ssl_credentials *creds) {
+	if (verify_cache == NULL) verify_cache = array_new();
+
+	creds->refcount++;
+	ssl_credentials_release(active);
+	active = creds;
+	crl_generation++;
+	ssl_verify_cache_clear();
+}
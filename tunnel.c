@@ -0,0 +1,678 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+
+#include "log.h"
+#include "ssl.h"
+#include "cfg_files.h"
+#include "network.h"
+#include "array.h"
+#include "tunnel.h"
+#include "core.h"
+
+/* Tunnel: IP packets between the peers and a TUN device. A peer sends whole
+ * IP packets, one per DTLS record or data channel datagram, back to back on
+ * a TLS stream (the IP header has the length). Whatever the device gives us
+ * goes to the peer its destination address is behind.
+ *
+ * Which addresses a peer may use comes from tunnel_peers_file, by the name
+ * it authenticated with (PSK identity or certificate CN). Those it sends
+ * from are learned, up to tunnel_routes_max, and forgotten when it goes
+ * away. An address another peer has is only taken over by a connection with
+ * the same name (a reconnect), anything else is dropped as spoofed. Packets
+ * from a peer for another peer's address go straight to that one, the rest
+ * to the device, and the kernel routes them from there.
+ *
+ * Without tunnel_device everything peers send is dropped, and counted. */
+
+#define TUNNEL_KEY_SIZE 17 // version, then the address
+
+struct tunnel_route {
+	uint8_t key[TUNNEL_KEY_SIZE];
+	int key_len;
+	struct network_connection *net;
+	struct tunnel_route *next; // the peer's other addresses
+};
+
+struct tunnel_prefix {
+	uint8_t key[TUNNEL_KEY_SIZE]; // like a route's
+	int bits;
+};
+
+// what a name may use, from tunnel_peers_file
+struct tunnel_allowed {
+	int count;
+	struct tunnel_prefix prefix[];
+};
+
+static char *device_name;
+static char *device_address; // a.b.c.d/len
+static int mtu = 1400;
+static int routes_max = 64; // per peer
+static char *peers_file;
+static int control_size = 64; // bytes, packets up to this size skip the bulk queue
+
+static struct network_connection *device;
+static array_t *routes; // tunnel_key() => struct tunnel_route
+static array_t *allowed; // peer name => struct tunnel_allowed
+static array_t *foreign; // pre-forked: tunnel_key() homed here => worker that has it, plus one
+
+struct tunnel_stats tunnel_stats;
+
+void tunnel_config_init() {
+	config_add_var(CONFIG_CORE, "tunnel_device", &device_name, CONF_VAR_STRING_POINTER, 1, IFNAMSIZ - 1, false);
+	config_add_var(CONFIG_CORE, "tunnel_address", &device_address, CONF_VAR_STRING_POINTER, 9, 18, false);
+	config_add_var(CONFIG_CORE, "tunnel_mtu", &mtu, CONF_VAR_INT, 576, PACKET_DATA_MAX, false);
+	config_add_var(CONFIG_CORE, "tunnel_routes_max", &routes_max, CONF_VAR_INT, 1, 65536, false);
+	config_add_var(CONFIG_CORE, "tunnel_peers_file", &peers_file, CONF_VAR_STRING_POINTER, 1, 4096, false);
+	config_add_var(CONFIG_CORE, "tunnel_control_size", &control_size, CONF_VAR_INT, 0, PACKET_DATA_MAX, false);
+}
+
+// "address/bits", IPv4 or IPv6, into a prefix
+static bool tunnel_prefix_parse(char *str, struct tunnel_prefix *prefix) {
+	char *slash = strchr(str, '/');
+	int max;
+
+	if (slash != NULL) *slash = 0;
+	memset(prefix, 0, sizeof(*prefix));
+	if (inet_pton(AF_INET, str, prefix->key + 1) == 1) {
+		prefix->key[0] = 4;
+		max = 32;
+	} else if (inet_pton(AF_INET6, str, prefix->key + 1) == 1) {
+		prefix->key[0] = 6;
+		max = 128;
+	} else {
+		return false;
+	}
+	prefix->bits = max;
+	if (slash != NULL) {
+		char *end;
+		prefix->bits = strtol(slash + 1, &end, 10);
+		if ((end == slash + 1) || (*end != 0) || (prefix->bits < 0) || (prefix->bits > max)) return false;
+	}
+	return true;
+}
+
+static bool tunnel_prefix_match(const struct tunnel_prefix *prefix, const uint8_t *key) {
+	if (prefix->key[0] != key[0]) return false;
+	int bytes = prefix->bits / 8, bits = prefix->bits % 8;
+	if (memcmp(prefix->key + 1, key + 1, bytes) != 0) return false;
+	if (bits == 0) return true;
+	uint8_t mask = 0xff << (8 - bits);
+	return ((prefix->key[1 + bytes] ^ key[1 + bytes]) & mask) == 0;
+}
+
+static void tunnel_allowed_free(array_t *table) {
+	if (table == NULL) return;
+	array_iterator_t *it = array_iterator(table);
+	while(array_next(it))
+		free(it->value);
+	array_iterator_free(it);
+	array_free(table);
+}
+
+#define TUNNEL_PEERS_LINE_MAXSIZE 4096
+#define TUNNEL_PEERS_PREFIX_MAX 256
+
+/* tunnel_peers_load : read "name:prefix[,prefix...]" lines (name as in
+ * ssl_peer_name, so without a ':'). NULL if the file can't be read. */
+static array_t *tunnel_peers_load(const char *file) {
+	char line[TUNNEL_PEERS_LINE_MAXSIZE];
+	struct tunnel_prefix prefix[TUNNEL_PEERS_PREFIX_MAX];
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		log_printf("Failed to open tunnel peers file %s", file);
+		return NULL;
+	}
+
+	array_t *table = array_new();
+	while(fgets(line, sizeof(line), fp)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = 0;
+		if ((line[0] == '#') || (line[0] == 0)) continue;
+
+		char *sep = strchr(line, ':');
+		if ((sep == NULL) || (sep == line)) {
+			log_printf("%s:%d: expected name:prefix[,prefix...]", file, lineno);
+			continue;
+		}
+		*sep = 0;
+
+		int count = 0;
+		bool ok = true;
+		for(char *save, *str = strtok_r(sep + 1, ", \t", &save); ok && (str != NULL); str = strtok_r(NULL, ", \t", &save)) {
+			if (count == TUNNEL_PEERS_PREFIX_MAX) {
+				log_printf("%s:%d: more than %d prefixes for %s", file, lineno, TUNNEL_PEERS_PREFIX_MAX, line);
+				ok = false;
+			} else if (!tunnel_prefix_parse(str, &prefix[count++])) {
+				log_printf("%s:%d: invalid prefix %s for %s", file, lineno, str, line);
+				ok = false;
+			}
+		}
+		if (!ok) continue;
+
+		struct tunnel_allowed *entry = malloc(sizeof(struct tunnel_allowed) + count * sizeof(struct tunnel_prefix));
+		if (entry == NULL) continue;
+		entry->count = count;
+		memcpy(entry->prefix, prefix, count * sizeof(struct tunnel_prefix));
+
+		struct tunnel_allowed *old = array_get(table, sep - line, (uint8_t *)line);
+		if (old != NULL) {
+			log_printf("%s:%d: duplicate name %s, using the last one", file, lineno, line);
+			array_update(table, sep - line, (uint8_t *)line, entry, false);
+			free(old);
+		} else {
+			array_insert(table, sep - line, (uint8_t *)line, entry, false);
+		}
+	}
+	fclose(fp);
+
+	log_printf("Loaded %u tunnel peers", table->count);
+	return table;
+}
+
+/* size of the IP packet buf starts with, 0 if len is too short to tell, -1 if
+ * it isn't one or is bigger than what a packet buffer holds */
+static ssize_t tunnel_packet_size(const uint8_t *buf, size_t len) {
+	size_t size;
+
+	if (len < 1) return 0;
+	switch(buf[0] >> 4) {
+		case 4:
+			if (len < 4) return 0;
+			size = (buf[2] << 8) | buf[3];
+			if (size < 20) return -1;
+			break;
+		case 6:
+			if (len < 6) return 0;
+			size = 40 + ((buf[4] << 8) | buf[5]);
+			break;
+		default:
+			return -1;
+	}
+	return size > PACKET_DATA_MAX ? -1 : (ssize_t)size;
+}
+
+// the source (or destination) address of a whole packet, as a routes key
+static int tunnel_key(const uint8_t *buf, bool dst, uint8_t *key) {
+	key[0] = buf[0] >> 4;
+	if (key[0] == 4) {
+		memcpy(key + 1, buf + (dst ? 16 : 12), 4);
+		return 5;
+	}
+	memcpy(key + 1, buf + (dst ? 24 : 8), 16);
+	return 17;
+}
+
+/* Pre-forked, each worker only has the routes of its own peers, and reads
+ * from its own queue of the device. The worker that learns an address claims
+ * it at the address' home, which passes it the device packets the others
+ * have no route for. */
+static int tunnel_home(const uint8_t *key, int key_len) {
+	int workers = network_workers();
+	uint32_t hash = 0;
+
+	if (workers <= 1) return -1;
+	for(int i = 0; i < key_len; i++)
+		hash = hash * 31 + key[i];
+	return hash % workers;
+}
+
+// a lost claim costs the packets the device gives the others, a lost release is made up for by tunnel_pass()
+static void tunnel_claim_home(struct tunnel_route *route, bool release) {
+	int home = tunnel_home(route->key, route->key_len);
+	if ((home < 0) || (home == core_worker)) return;
+	network_worker_claim(home, NETWORK_FORWARD_ROUTE, release, route->key, route->key_len);
+}
+
+/* tunnel_claim : home worker, owner has (or with release, no longer has) the
+ * address key */
+void tunnel_claim(const uint8_t *key, size_t key_len, int owner, bool release) {
+	if ((key_len != 5) && (key_len != TUNNEL_KEY_SIZE)) return;
+	if (foreign == NULL) foreign = array_new();
+	intptr_t current = (intptr_t)array_get(foreign, key_len, key) - 1;
+	if (!release) {
+		// the newest connection has it, as with tunnel_same_peer()
+		if (current < 0) array_insert(foreign, key_len, key, (void *)(intptr_t)(owner + 1), false);
+		else array_update(foreign, key_len, key, (void *)(intptr_t)(owner + 1), false);
+	} else if (current == owner) {
+		array_remove(foreign, key_len, key);
+	}
+}
+
+/* tunnel_worker_started : worker (re)started, its claims went with the
+ * previous instance, ours homed there are sent again */
+void tunnel_worker_started(int worker) {
+	if (foreign != NULL) {
+		array_iterator_t *it = array_iterator(foreign);
+		while(array_next(it))
+			if ((intptr_t)it->value - 1 == worker) array_remove_iterator(it);
+		array_iterator_free(it);
+	}
+	if (routes == NULL) return;
+	array_iterator_t *it = array_iterator(routes);
+	while(array_next(it)) {
+		struct tunnel_route *route = it->value;
+		if (tunnel_home(route->key, route->key_len) == worker) tunnel_claim_home(route, false);
+	}
+	array_iterator_free(it);
+}
+
+/* tunnel_control : whether a whole packet goes to the control queue of the
+ * egress scheduler: small ones (tunnel_control_size), ICMP, and TCP segments
+ * without payload (pure ACKs, SYN, FIN, RST), which the other side's
+ * throughput waits on. IPv6 extension headers aren't followed. */
+static bool tunnel_control(const uint8_t *buf, size_t size) {
+	size_t hdr;
+	int proto;
+
+	if (size <= (size_t)control_size) return true;
+	if ((buf[0] >> 4) == 4) {
+		hdr = (buf[0] & 0x0f) * 4;
+		proto = buf[9];
+		// only the first fragment has the TCP header
+		if ((proto == IPPROTO_TCP) && ((((buf[6] & 0x1f) << 8) | buf[7]) != 0)) return false;
+	} else {
+		hdr = 40;
+		proto = buf[6];
+	}
+	if ((proto == IPPROTO_ICMP) || (proto == IPPROTO_ICMPV6)) return true;
+	if ((proto != IPPROTO_TCP) || (size < hdr + 20)) return false;
+	return size == hdr + (buf[hdr + 12] >> 4) * 4;
+}
+
+static struct tunnel_peer *tunnel_peer(struct network_connection *net) {
+	if (net->tunnel == NULL) net->tunnel = calloc(sizeof(struct tunnel_peer), 1);
+	return net->tunnel;
+}
+
+// the address key is one the name net authenticated with may use
+static bool tunnel_allowed(struct network_connection *net, const uint8_t *key) {
+	const char *name = ssl_peer_name(net->ssl_ctx);
+	if (name == NULL) return false;
+
+	struct tunnel_allowed *entry = array_get_string(allowed, name);
+	if (entry == NULL) return false;
+	for(int i = 0; i < entry->count; i++)
+		if (tunnel_prefix_match(&entry->prefix[i], key)) return true;
+	return false;
+}
+
+// both connections authenticated with the same name
+static bool tunnel_same_peer(struct network_connection *a, struct network_connection *b) {
+	const char *name_a = ssl_peer_name(a->ssl_ctx);
+	const char *name_b = ssl_peer_name(b->ssl_ctx);
+	return (name_a != NULL) && (name_b != NULL) && (strcmp(name_a, name_b) == 0);
+}
+
+// take route out of its peer's list, it stays in routes
+static void tunnel_unlink(struct tunnel_route *route) {
+	struct tunnel_peer *tp = route->net->tunnel;
+
+	for(struct tunnel_route **r = &tp->routes; *r != NULL; r = &(*r)->next) {
+		if (*r == route) {
+			*r = route->next;
+			tp->route_count--;
+			return;
+		}
+	}
+}
+
+/* the source address is the peer's: learned if its name may use it and
+ * nobody has it, or taken from an older connection with the same name */
+static bool tunnel_learn(struct network_connection *net, const uint8_t *buf) {
+	uint8_t key[TUNNEL_KEY_SIZE];
+	int key_len = tunnel_key(buf, false, key);
+	struct tunnel_route *route = array_get(routes, key_len, key);
+
+	if ((route != NULL) && (route->net == net)) return true;
+	if ((route != NULL) && !tunnel_same_peer(route->net, net)) return false;
+	if ((route == NULL) && !tunnel_allowed(net, key)) return false;
+
+	struct tunnel_peer *tp = tunnel_peer(net);
+	if ((tp == NULL) || (tp->route_count >= routes_max)) return false;
+	if (route != NULL) {
+		tunnel_unlink(route);
+	} else {
+		route = calloc(sizeof(struct tunnel_route), 1);
+		if (route == NULL) return false;
+		memcpy(route->key, key, key_len);
+		route->key_len = key_len;
+		array_insert(routes, key_len, key, route, false);
+		tunnel_claim_home(route, false);
+	}
+	route->net = net;
+	route->next = tp->routes;
+	tp->routes = route;
+	tp->route_count++;
+	return true;
+}
+
+static struct network_connection *tunnel_route(const uint8_t *buf) {
+	uint8_t key[TUNNEL_KEY_SIZE];
+	int key_len = tunnel_key(buf, true, key);
+	struct tunnel_route *route = array_get(routes, key_len, key);
+	return route ? route->net : NULL;
+}
+
+/* tunnel_input : an IP packet from a peer, pkt the packet buffer whose data
+ * buf is, or NULL. A reference is taken if the packet is kept. */
+static void tunnel_input(struct network_connection *net, uint8_t *buf, size_t len, struct packet *pkt) {
+	static bool warned;
+
+	if ((pkt != NULL) && (packet_data(pkt) != buf)) pkt = NULL;
+
+	if (device == NULL) {
+		tunnel_stats.no_device++;
+		if (!warned) log_printf("No tunnel_device, dropping tunnel data (this from %p), counted in tunnel_dropped_total", net);
+		warned = true;
+		return;
+	}
+	ssize_t size = tunnel_packet_size(buf, len);
+	if ((size <= 0) || ((size_t)size > len)) {
+		tunnel_stats.bad++;
+		return;
+	}
+	tunnel_stats.in_packets++;
+	tunnel_stats.in_bytes += size;
+	if (!tunnel_learn(net, buf)) {
+		tunnel_stats.spoofed++;
+		return;
+	}
+
+	struct network_connection *to = tunnel_route(buf);
+	if (to == net) {
+		tunnel_stats.no_route++;
+		return;
+	}
+	if (to != NULL) {
+		if (pkt != NULL) {
+			packet_ref(pkt);
+			pkt->len = size; // anything after the IP packet isn't part of it
+		} else {
+			pkt = packet_alloc();
+			if (pkt == NULL) return;
+			memcpy(packet_put(pkt, size), buf, size);
+		}
+		tunnel_stats.forwarded++;
+		network_egress_queue(to, pkt, tunnel_control(buf, size));
+		return;
+	}
+
+	if (write(device->fd, buf, size) != size) {
+		// a tun device drops when its queue is full, so do we
+		tunnel_stats.device_full++;
+	}
+}
+
+/* tunnel_stream_input : bytes from a TLS stream, cut into IP packets. Returns
+ * false if they aren't, the stream can't be trusted past that point. */
+static bool tunnel_stream_input(struct network_connection *net, const uint8_t *buf, size_t len) {
+	struct tunnel_peer *tp = tunnel_peer(net);
+
+	if (tp == NULL) return false;
+	while(len > 0) {
+		struct packet *p = tp->partial;
+		if (p == NULL) {
+			ssize_t size = tunnel_packet_size(buf, len);
+			if (size < 0) return false;
+			if ((size > 0) && ((size_t)size <= len)) {
+				// whole, no need to copy it
+				tunnel_input(net, (uint8_t *)buf, size, NULL);
+				buf += size;
+				len -= size;
+				continue;
+			}
+			p = tp->partial = packet_alloc();
+			if (p == NULL) return false;
+		}
+
+		// the header first, to know how much more makes a packet
+		ssize_t size = tunnel_packet_size(packet_data(p), p->len);
+		size_t want = (size > 0) ? size - p->len : 6 - p->len;
+		if (want > len) want = len;
+		memcpy(packet_put(p, want), buf, want);
+		buf += want;
+		len -= want;
+
+		size = tunnel_packet_size(packet_data(p), p->len);
+		if (size < 0) return false;
+		if ((size > 0) && (p->len == size)) {
+			tp->partial = NULL;
+			tunnel_input(net, packet_data(p), p->len, p);
+			packet_unref(p);
+		}
+	}
+	return true;
+}
+
+static void tunnel_forget(struct tunnel_peer *tp) {
+	while(tp->routes != NULL) {
+		struct tunnel_route *route = tp->routes;
+		tp->routes = route->next;
+		tunnel_claim_home(route, true);
+		array_remove(routes, route->key_len, route->key);
+		free(route);
+	}
+	tp->route_count = 0;
+}
+
+static void tunnel_peer_closed(struct network_connection *net) {
+	struct tunnel_peer *tp = net->tunnel;
+
+	if (tp == NULL) return;
+	tunnel_forget(tp);
+	packet_unref(tp->partial);
+	free(tp);
+	net->tunnel = NULL;
+}
+
+/* a device packet we have no route for: after a hot upgrade maybe for the
+ * previous process' peers, pre-forked for another worker's, which the home
+ * of its destination knows. Packets passed to us go no further, unless we
+ * are that home; if we aren't, the home's claim is out of date. */
+static bool tunnel_pass(struct packet *pkt, bool passed) {
+	uint8_t key[TUNNEL_KEY_SIZE];
+	const uint8_t *buf = packet_data(pkt);
+
+	if (!passed && network_forward(NULL, 0, buf, pkt->len)) return true;
+	int key_len = tunnel_key(buf, true, key);
+	int home = tunnel_home(key, key_len);
+	if (home < 0) return false;
+	if (home != core_worker) {
+		if (passed) {
+			network_worker_claim(home, NETWORK_FORWARD_ROUTE, true, key, key_len);
+			return false;
+		}
+		network_worker_pass(home, NULL, 0, buf, pkt->len);
+		return true;
+	}
+	intptr_t owner = foreign ? (intptr_t)array_get(foreign, key_len, key) - 1 : -1;
+	if (owner < 0) return false;
+	network_worker_pass(owner, NULL, 0, buf, pkt->len);
+	return true;
+}
+
+/* tunnel_out : a packet from the device to the peer its destination is
+ * behind, true if it was queued and the packet is the peer's now. passed if
+ * it came from another process or worker. */
+static bool tunnel_out(struct packet *pkt, bool passed) {
+	struct network_connection *to = tunnel_route(packet_data(pkt));
+	if (to == NULL) {
+		if (!tunnel_pass(pkt, passed)) tunnel_stats.no_route++;
+		return false;
+	}
+	tunnel_stats.out_packets++;
+	tunnel_stats.out_bytes += pkt->len;
+	network_egress_queue(to, pkt, tunnel_control(packet_data(pkt), pkt->len));
+	return true;
+}
+
+/* tunnel_forwarded : a packet the new process, or another worker, read from
+ * the device and had no peer for */
+void tunnel_forwarded(const uint8_t *buf, size_t len) {
+	struct packet *pkt;
+
+	if ((device == NULL) || (len > PACKET_DATA_MAX) || (tunnel_packet_size(buf, len) <= 0)) return;
+	if ((pkt = packet_alloc()) == NULL) return;
+	memcpy(packet_data(pkt), buf, len);
+	pkt->len = len;
+	if (!tunnel_out(pkt, true)) packet_unref(pkt);
+}
+
+// edge triggered: drain the device, each packet to the peer its destination is behind
+static void tunnel_read(struct network_connection *dev) {
+	struct packet *pkt = NULL;
+
+	while(1) {
+		if ((pkt == NULL) && ((pkt = packet_alloc()) == NULL)) {
+			// out of buffers, the device keeps them until some come back
+			return;
+		}
+		ssize_t len = read(dev->fd, packet_data(pkt), PACKET_DATA_MAX);
+		if (len <= 0) {
+			if ((len == -1) && (errno == EINTR)) continue;
+			if ((len == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) log_perror();
+			packet_unref(pkt);
+			return;
+		}
+		pkt->len = len;
+		if (tunnel_packet_size(packet_data(pkt), len) <= 0) {
+			tunnel_stats.bad++;
+			continue;
+		}
+		if (tunnel_out(pkt, false)) pkt = NULL;
+	}
+}
+
+// tunnel_address: address and prefix length of the device
+static bool tunnel_set_address(int s, struct ifreq *ifr) {
+	char addr[19];
+	int prefix = 32;
+
+	snprintf(addr, sizeof(addr), "%s", device_address);
+	char *slash = strchr(addr, '/');
+	if (slash != NULL) {
+		*slash = 0;
+		prefix = atoi(slash + 1);
+	}
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ifr->ifr_addr;
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	if ((prefix < 1) || (prefix > 32) || (inet_pton(AF_INET, addr, &sin->sin_addr) != 1)) {
+		log_printf("Bad tunnel_address %s, expected a.b.c.d/prefix", device_address);
+		return false;
+	}
+	if (ioctl(s, SIOCSIFADDR, ifr) == -1) return false;
+	sin->sin_addr.s_addr = htonl(0xffffffffU << (32 - prefix));
+	return ioctl(s, SIOCSIFNETMASK, ifr) != -1;
+}
+
+/* tunnel_reload : tunnel_peers_file again, on SIGHUP. Peers with an address
+ * they may not use anymore lose all of theirs, and learn the others again
+ * from their next packets. */
+void tunnel_reload() {
+	if (device == NULL) return;
+
+	array_t *table = tunnel_peers_load(peers_file);
+	if (table == NULL) {
+		log_printf("Keeping the current tunnel peers");
+		return;
+	}
+	tunnel_allowed_free(allowed);
+	allowed = table;
+
+	struct tunnel_peer **revoked = NULL;
+	size_t count = 0;
+	array_iterator_t *it = array_iterator(routes);
+	while(array_next(it)) {
+		struct tunnel_route *route = it->value;
+		if (tunnel_allowed(route->net, route->key)) continue;
+		struct tunnel_peer **grown = realloc(revoked, (count + 1) * sizeof(*revoked));
+		if (grown == NULL) break;
+		revoked = grown;
+		revoked[count++] = route->net->tunnel;
+	}
+	array_iterator_free(it);
+	for(size_t i = 0; i < count; i++)
+		tunnel_forget(revoked[i]);
+	free(revoked);
+	if (count > 0) log_printf("Tunnel peers reloaded, %zu addresses not allowed anymore", count);
+}
+
+// what the TLS, DTLS and data channel sessions decrypt
+static const struct ssl_input tunnel_ssl_input = {
+	.packet = tunnel_input,
+	.stream = tunnel_stream_input,
+	.closed = tunnel_peer_closed,
+};
+
+bool tunnel_init() {
+	struct ifreq ifr;
+
+	ssl_input = &tunnel_ssl_input;
+	if (device_name == NULL) {
+		log_printf("Warning: no tunnel_device, tunnel data from peers will be dropped");
+		return true;
+	}
+	if (peers_file == NULL) {
+		log_printf("tunnel_device needs tunnel_peers_file, the addresses each peer may use");
+		return false;
+	}
+	allowed = tunnel_peers_load(peers_file);
+	if (allowed == NULL) return false;
+	routes = array_new();
+
+	int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		log_perror();
+		log_printf("Failed to open /dev/net/tun");
+		return false;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	// multi queue: a hot upgrade's new process attaches while the old one drains
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", device_name);
+	if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+		log_perror();
+		log_printf("Failed to attach to tunnel device %s", device_name);
+		close(fd);
+		return false;
+	}
+
+	int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	bool ok = (s != -1);
+	ifr.ifr_mtu = mtu;
+	if (ok) ok = ioctl(s, SIOCSIFMTU, &ifr) != -1;
+	if (ok && (device_address != NULL)) ok = tunnel_set_address(s, &ifr);
+	if (ok) ok = ioctl(s, SIOCGIFFLAGS, &ifr) != -1;
+	ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+	if (ok) ok = ioctl(s, SIOCSIFFLAGS, &ifr) != -1;
+	if (!ok) {
+		log_perror();
+		log_printf("Failed to set up tunnel device %s", device_name);
+	}
+	if (s != -1) close(s);
+
+	if (ok) device = network_register_fd(fd, tunnel_read);
+	if (device == NULL) {
+		close(fd);
+		return false;
+	}
+	log_printf("Tunnel on %s, mtu %d", device_name, mtu);
+	return true;
+}
@@ -0,0 +1,38 @@
+#ifndef _TUNNEL_H
+#define _TUNNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct network_connection;
+struct packet;
+
+// what a peer has in the tunnel, allocated with its first packet
+struct tunnel_peer {
+	struct tunnel_route *routes; // addresses learned behind it
+	int route_count;
+	struct packet *partial; // stream peers: a packet cut between two records
+};
+
+struct tunnel_stats {
+	uint64_t in_packets, in_bytes; // from peers
+	uint64_t out_packets, out_bytes; // read from the device, queued for a peer
+	uint64_t forwarded; // from a peer straight to another one
+	uint64_t no_device; // dropped, there is no tunnel_device
+	uint64_t no_route; // dropped, no peer has the destination
+	uint64_t spoofed; // dropped, the source isn't the peer's (tunnel_peers_file), is another's or over tunnel_routes_max
+	uint64_t bad; // dropped, not an IP packet
+	uint64_t device_full; // dropped, the device didn't take it
+};
+
+extern struct tunnel_stats tunnel_stats;
+
+void tunnel_config_init();
+bool tunnel_init();
+void tunnel_reload();
+void tunnel_forwarded(const uint8_t *buf, size_t len);
+void tunnel_claim(const uint8_t *key, size_t key_len, int owner, bool release);
+void tunnel_worker_started(int worker);
+
+#endif